@@ -8,6 +8,8 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <limits.h>
+#include <math.h>
 #ifndef WIN32
 #include <arpa/inet.h>
 #else
@@ -28,32 +30,6 @@
 static rel_time_t (*get_current_time)(void);
 static EXTENSION_LOGGER_DESCRIPTOR *logger;
 
-#if defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
-#include <atomic.h>
-static inline int ATOMIC_ADD(volatile int *dest, int value) {
-    return atomic_add_int_nv((volatile unsigned int *)dest, value);
-}
-
-static inline int ATOMIC_INCR(volatile int *dest) {
-    return atomic_inc_32_nv((volatile unsigned int *)dest);
-}
-
-static inline int ATOMIC_DECR(volatile int *dest) {
-    return atomic_dec_32_nv((volatile unsigned int *)dest);
-}
-
-static inline int ATOMIC_CAS(volatile bucket_state_t *dest, int prev, int next) {
-    return (prev == atomic_cas_uint((volatile uint_t*)dest, (uint_t)prev,
-                                    (uint_t)next));
-}
-#else
-#define ATOMIC_ADD(i, by) __sync_add_and_fetch(i, by)
-#define ATOMIC_INCR(i) ATOMIC_ADD(i, 1)
-#define ATOMIC_DECR(i) ATOMIC_ADD(i, -1)
-#define ATOMIC_CAS(ptr, oldval, newval) \
-            __sync_bool_compare_and_swap(ptr, oldval, newval)
-#endif
-
 static ENGINE_ERROR_CODE (*upstream_reserve_cookie)(const void *cookie);
 static ENGINE_ERROR_CODE (*upstream_release_cookie)(const void *cookie);
 static ENGINE_ERROR_CODE bucket_engine_reserve_cookie(const void *cookie);
@@ -176,7 +152,11 @@ static ENGINE_ERROR_CODE bucket_get_engine_vb_map(ENGINE_HANDLE* handle,
                                                   const void * cookie,
                                                   engine_get_vb_map_cb callback);
 
-static ENGINE_HANDLE *load_engine(void **dlhandle, const char *soname);
+static ENGINE_HANDLE *load_engine(engine_module_t **module, const char *soname);
+static void release_engine_module(engine_module_t *m);
+static bool claim_spare_engine(struct bucket_engine *e,
+                               proxied_engine_handle_t *peh,
+                               const char *path, const char *config);
 
 static bool is_authorized(ENGINE_HANDLE* handle, const void* cookie);
 
@@ -185,6 +165,8 @@ static void free_engine_handle(proxied_engine_handle_t *);
 static bool list_buckets(struct bucket_engine *e, struct bucket_list **blist);
 static void bucket_list_free(struct bucket_list *blist);
 static void maybe_start_engine_shutdown(proxied_engine_handle_t *e);
+static void maybe_start_hibernation(proxied_engine_handle_t *peh);
+static void schedule_shutdown_job_UNLOCKED(proxied_engine_handle_t *peh);
 
 
 /**
@@ -218,12 +200,37 @@ struct bucket_engine bucket_engine = {
         .get_engine_vb_map = bucket_get_engine_vb_map
     },
     .initialized = false,
+    .modules = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .list = NULL
+    },
+    .spares = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER
+    },
+    .hibernation = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER
+    },
+    .negative = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER
+    },
+    .throttle = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER
+    },
+    .fair = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER
+    },
+    .es_depot = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER
+    },
     .shutdown = {
         .in_progress = false,
         .bucket_counter = 0,
         .mutex = PTHREAD_MUTEX_INITIALIZER,
         .cond = PTHREAD_COND_INITIALIZER,
-        .refcount_cond = PTHREAD_COND_INITIALIZER
+        .work_cond = PTHREAD_COND_INITIALIZER
     },
     .info.engine_info = {
         .description = "Bucket engine v0.2",
@@ -246,6 +253,25 @@ static void release_memory(void *ptr, size_t size)
     free(ptr);
 }
 
+/**
+ * Allocate zeroed memory starting on a cache line boundary (for
+ * structures with CACHE_ALIGNED members). Release it with free (or
+ * release_memory).
+ */
+static void *calloc_cache_aligned(size_t size)
+{
+#ifdef HAVE_POSIX_MEMALIGN
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, CACHE_LINE_SIZE, size) != 0) {
+        return NULL;
+    }
+    memset(ptr, 0, size);
+    return ptr;
+#else
+    return calloc(size, 1);
+#endif
+}
+
 
 /* Internal utility functions */
 
@@ -308,6 +334,10 @@ static const char * bucket_state_name(bucket_state_t s) {
     case STATE_RUNNING: rv = "running"; break;
     case STATE_STOPPING: rv = "stopping"; break;
     case STATE_STOPPED: rv = "stopped"; break;
+    case STATE_CREATING: rv = "creating"; break;
+    case STATE_HIBERNATING: rv = "hibernating"; break;
+    case STATE_HIBERNATED: rv = "hibernated"; break;
+    case STATE_WAKING: rv = "waking"; break;
     }
     assert(rv);
     return rv;
@@ -360,6 +390,13 @@ static void find_bucket_by_engine(const void* key, size_t nkey,
     }
 }
 
+/**
+ * The spare this thread is initializing. The engine registers its
+ * callbacks from initialize, before there is a bucket to attach them
+ * to (see bucket_register_callback).
+ */
+static __thread spare_engine_t *initializing_spare;
+
 /**
  * bucket_engine intercepts the calls from the underlying engine to
  * register callbacks. During startup bucket engine registers a callback
@@ -368,10 +405,10 @@ static void find_bucket_by_engine(const void* key, size_t nkey,
  * want this notification, so we intercept their attemt to register
  * callbacks and forward the callback to the correct engine.
  *
- * This function will _always_ be called while we're holding the global
- * lock for the hash table (during the call to "initialize" in the
- * underlying engine. It is therefore safe to try to traverse the
- * engines list.
+ * This function will _always_ be called during the call to
+ * "initialize" in the underlying engine, which happens without
+ * holding the engines lock (see create_bucket). The bucket is already
+ * in the engines list by then, as a placeholder.
  */
 static void bucket_register_callback(ENGINE_HANDLE *eh,
                                      ENGINE_EVENT_TYPE type,
@@ -381,13 +418,20 @@ static void bucket_register_callback(ENGINE_HANDLE *eh,
        we need them. */
     assert(type == ON_DISCONNECT);
 
-    /* Assume this always happens while holding the hash table lock. */
-    /* This is called from underlying engine 'initialize' handler
-     * which we invoke with engines_mutex held */
+    spare_engine_t *spare = initializing_spare;
+    if (spare != NULL && eh == spare->pe.v0) {
+        spare->cb = cb;
+        spare->cb_data = cb_data;
+        spare->wants_disconnects = true;
+        return;
+    }
+
     struct bucket_find_by_handle_data find_data = { .needle = eh,
                                                     .peh = NULL };
 
+    lock_engines();
     genhash_iter(bucket_engine.engines, find_bucket_by_engine, &find_data);
+    unlock_engines();
 
     if (find_data.peh) {
         find_data.peh->cb = cb;
@@ -519,21 +563,42 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
 }
 
 /**
- * Grab the engine handle mutex and release the proxied engine handle.
- * The function currently allows you to call it with a NULL pointer,
- * but that should be replaced (we should have better control of if we
- * have an engine handle or not....)
+ * Record that a client used the bucket. The clock only moves once a
+ * second, so we don't dirty the cache line more often than that.
+ */
+static inline void touch_bucket(proxied_engine_handle_t *peh) {
+    rel_time_t now = get_current_time();
+    if (peh->last_active != now) {
+        peh->last_active = now;
+    }
+}
+
+/**
+ * Release the proxied engine handle. If this was the last reference
+ * to a deleted bucket, hand the handle to the shutdown workers to be
+ * freed. The function currently allows you to call it with a NULL
+ * pointer, but that should be replaced (we should have better control
+ * of if we have an engine handle or not....)
  */
 static void release_handle(proxied_engine_handle_t *peh) {
     if (!peh) {
         return;
     }
 
+    if (bucket_engine.hibernate_after != 0) {
+        touch_bucket(peh);
+    }
     int count = ATOMIC_DECR(&peh->refcount);
     assert(count >= 0);
     if (count == 0) {
+        /* The engines table holds a reference until the bucket is
+         * unlinked, so nobody else can reach it anymore. During the
+         * global shutdown we leave it be, just like the buckets
+         * still in the table. */
         must_lock(&bucket_engine.shutdown.mutex);
-        pthread_cond_broadcast(&bucket_engine.shutdown.refcount_cond);
+        if (!bucket_engine.shutdown.in_progress) {
+            schedule_shutdown_job_UNLOCKED(peh);
+        }
         must_unlock(&bucket_engine.shutdown.mutex);
     }
 }
@@ -565,19 +630,156 @@ static proxied_engine_handle_t* retain_handle(proxied_engine_handle_t *peh) {
     return rv;
 }
 
+/**
+ * A callback function used by genhash_iter to insert the engine handle
+ * into a registry snapshot being built by publish_registry_UNLOCKED.
+ * The snapshot borrows the name from the handle, since the handle
+ * outlives its presence in any snapshot.
+ */
+static void registry_insert(const void *key, size_t nkey,
+                            const void *val, size_t nval,
+                            void *arg) {
+    (void)key;
+    (void)nkey;
+    (void)nval;
+    bucket_registry_t *reg = arg;
+    proxied_engine_handle_t *peh = (proxied_engine_handle_t *)val;
+    if (peh->state == STATE_CREATING) {
+        /* create_bucket publishes it once it's running */
+        return;
+    }
+    size_t mask = reg->size - 1;
+    size_t n = (unsigned int)genhash_seeded_hash(peh->name,
+                                                 peh->name_len) & mask;
+    while (reg->slots[n].peh != NULL) {
+        n = (n + 1) & mask;
+    }
+    reg->slots[n].name = peh->name;
+    reg->slots[n].name_len = peh->name_len;
+    reg->slots[n].peh = peh;
+}
+
+/**
+ * Rebuild the registry snapshot from the engines table and publish
+ * it for the lock-free readers. The old snapshot is released when
+ * no reader may reference it anymore. Unlinking a bucket from the
+ * engines table followed by a call to this function also guarantees
+ * that no reader in find_bucket still holds a pointer to the bucket
+ * when it returns.
+ *
+ * Must be called with the engines lock held. That's fine since we only
+ * wait for the registry readers, which never block (the clients inside
+ * the engines are in a domain of their own, see epoch.h).
+ */
+static void publish_registry_UNLOCKED(struct bucket_engine *e) {
+    size_t count = (size_t)genhash_size(e->engines);
+    size_t size = 8;
+    while (size < count * 2) {
+        size <<= 1;
+    }
+
+    bucket_registry_t *reg = calloc(1, sizeof(*reg) +
+                                    size * sizeof(reg->slots[0]));
+    assert(reg);
+    reg->size = size;
+    genhash_iter(e->engines, registry_insert, reg);
+
+    bucket_registry_t *old = e->registry;
+    /* make sure the content is visible before the pointer is */
+    MEMORY_BARRIER();
+    e->registry = reg;
+    epoch_synchronize(EPOCH_REGISTRY);
+    free(old);
+}
+
+/**
+ * Look up a named bucket in the registry snapshot. Must be called
+ * from within an epoch read-side critical section.
+ */
+static proxied_engine_handle_t *registry_find(bucket_registry_t *reg,
+                                              const char *name) {
+    if (reg == NULL) {
+        return NULL;
+    }
+    size_t nkey = strlen(name);
+    size_t mask = reg->size - 1;
+    size_t n = (unsigned int)genhash_seeded_hash(name, nkey) & mask;
+    while (reg->slots[n].peh != NULL) {
+        if (reg->slots[n].name_len == nkey &&
+            memcmp(reg->slots[n].name, name, nkey) == 0) {
+            return reg->slots[n].peh;
+        }
+        n = (n + 1) & mask;
+    }
+    return NULL;
+}
+
 /**
  * Search the list of buckets for a named bucket. If the bucket
  * exists and is in a runnable state, it's reference count is
  * incremented and returned. The caller is responsible for
  * releasing the handle with release_handle.
+ *
+ * This is on the path of every SASL auth and doesn't take the engines
+ * lock. The registry snapshot (and the handles it points to) can't be
+ * released while we're inside the epoch critical section, and once
+ * we've bumped the refcount the handle stays alive on its own.
 */
 static proxied_engine_handle_t *find_bucket(const char *name) {
-    lock_engines();
-    proxied_engine_handle_t *rv = retain_handle(find_bucket_inner(name));
-    unlock_engines();
+    epoch_enter(EPOCH_REGISTRY);
+    proxied_engine_handle_t *rv;
+    rv = retain_handle(registry_find(bucket_engine.registry, name));
+    epoch_exit(EPOCH_REGISTRY);
     return rv;
 }
 
+/**
+ * Wait for a bucket to leave STATE_CREATING, STATE_HIBERNATING or
+ * STATE_WAKING. We sleep on a condition of our own, on the bucket's
+ * list of waiters, so only that bucket's transition wakes us. The
+ * caller must look the bucket up again afterwards; it may have been
+ * freed while we slept, which is also why the one waking us (see
+ * wake_bucket_waiters_UNLOCKED) takes us off the list rather than us.
+ *
+ * Must be called with the engines lock held.
+ */
+static void wait_for_bucket_UNLOCKED(struct bucket_engine *e,
+                                     proxied_engine_handle_t *peh) {
+    bucket_waiter_t me = { .woken = false, .next = peh->waiters };
+    int r = pthread_cond_init(&me.cond, NULL);
+    assert(r == 0);
+    peh->waiters = &me;
+    while (!me.woken) {
+        pthread_cond_wait(&me.cond, &e->engines_mutex);
+    }
+    pthread_cond_destroy(&me.cond);
+}
+
+/**
+ * A bucket left STATE_CREATING, STATE_HIBERNATING or STATE_WAKING.
+ * Wake up the threads waiting for it, if there are any.
+ *
+ * Must be called with the engines lock held.
+ */
+static void wake_bucket_waiters_UNLOCKED(struct bucket_engine *e,
+                                         proxied_engine_handle_t *peh) {
+    bucket_waiter_t *w = peh->waiters;
+    if (w == NULL) {
+        ++e->wakeups_avoided;
+        return;
+    }
+    peh->waiters = NULL;
+    while (w != NULL) {
+        /* It can't return (and take its entry off the stack) before
+         * we drop the engines lock */
+        bucket_waiter_t *next = w->next;
+        w->woken = true;
+        pthread_cond_signal(&w->cond);
+        ++e->waiter_wakeups;
+        w = next;
+    }
+}
+
 /**
  * Validate that the bucket name only consists of legal characters
  */
@@ -589,6 +791,16 @@ static bool has_valid_bucket_name(const char *n) {
     return rv;
 }
 
+/**
+ * Get the current time in usec (for timing the shutdowns and for the
+ * ops limits)
+ */
+static uint64_t now_usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+}
+
 /**
  * Initialize a proxied engine handle. (Assumes that it's zeroed already
 */
@@ -608,7 +820,31 @@ static ENGINE_ERROR_CODE init_engine_handle(proxied_engine_handle_t *peh, const
             return ENGINE_ENOMEM;
         }
     }
+#ifndef ENABLE_EPOCH_HANDLES
+    /* Over-allocate so the slots can start on a cache line */
+    peh->clients_mem = calloc(CLIENT_SLOTS + 1, sizeof(client_slot_t));
+    if (peh->clients_mem == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    peh->clients = (client_slot_t *)(((uintptr_t)peh->clients_mem +
+                                      CACHE_LINE_SIZE - 1) &
+                                     ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+#endif
+    peh->counters = calloc_cache_aligned(STATS_SLOTS *
+                                         sizeof(op_counter_slot_t));
+    if (peh->counters == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    if (bucket_engine.op_timings) {
+        peh->timings = calloc(1, sizeof(bucket_timings_t));
+        if (peh->timings == NULL) {
+            return ENGINE_ENOMEM;
+        }
+    }
     peh->refcount = 1;
+    peh->last_active = get_current_time();
+    peh->rates.updated = now_usec();
+    peh->fair.weight = 1;
     peh->name = strdup(name);
     if (peh->name == NULL) {
         return ENGINE_ENOMEM;
@@ -636,19 +872,39 @@ static void uninit_engine_handle(proxied_engine_handle_t *peh) {
         }
         free(peh->topkeys);
     }
+#ifndef ENABLE_EPOCH_HANDLES
+    free(peh->clients_mem);
+#endif
     release_memory((void*)peh->name, peh->name_len);
+    free(peh->config);
+    free(peh->counters);
+    if (peh->timings != NULL) {
+        for (int i = 0; i < STATS_SLOTS; i++) {
+            free(peh->timings->slots[i]);
+        }
+        free(peh->timings);
+    }
+    if (peh->limit != NULL) {
+        while (peh->limit->parked_head != NULL) {
+            parked_op_t *op = peh->limit->parked_head;
+            peh->limit->parked_head = op->next;
+            free(op);
+        }
+        pthread_mutex_destroy(&peh->limit->mutex);
+        free(peh->limit);
+    }
     /* Note: looks like current engine API allows engine to keep some
      * connections reserved past destroy call return. This implies
-     * that doing dlclose is raceful and thus we should not do it.
+     * that doing dlclose is raceful and thus we should not do it,
+     * even when this was the module's last instance.
      *
      * Currently we also have issue with tcmalloc integration on
      * windows where apparently unloading ep.so is causing some
      * troubles in tcmalloc. */
-    /*
-     * if (peh->dlhandle) {
-     *     dlclose(peh->dlhandle);
-     * }
-     */
+    if (peh->module) {
+        release_engine_module(peh->module);
+        peh->module = NULL;
+    }
 }
 
 /**
@@ -661,1038 +917,4585 @@ static void free_engine_handle(proxied_engine_handle_t *peh) {
 }
 
 /**
- * Creates bucket and places it's handle into *e_out. NOTE: that
- * caller is responsible for calling release_handle on that handle
+ * A monotonic clock in ns, for timing the ops.
  */
-static ENGINE_ERROR_CODE create_bucket_UNLOCKED(struct bucket_engine *e,
-                                                const char *bucket_name,
-                                                const char *path,
-                                                const char *config,
-                                                proxied_engine_handle_t **e_out,
-                                                char *msg, size_t msglen) {
+static inline uint64_t now_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
 
-    ENGINE_ERROR_CODE rv;
+/**
+ * The clock the ops are timed with. The time stamp counter is about
+ * twice as cheap to read as the monotonic clock, which matters at two
+ * reads per op. The ticks are only converted to ns for the stats (see
+ * timing_ticks_per_nsec).
+ */
+static inline uint64_t timing_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return now_nsec();
+#endif
+}
 
-    if (!has_valid_bucket_name(bucket_name)) {
-        return ENGINE_EINVAL;
+/**
+ * How many timing_ticks there are to a ns, going by how many of both
+ * there were since initialization.
+ */
+static double timing_ticks_per_nsec(void) {
+    uint64_t ticks = timing_ticks() - bucket_engine.timing_base_ticks;
+    uint64_t nsec = now_nsec() - bucket_engine.timing_base_nsec;
+    if (ticks == 0 || nsec == 0) {
+        return 1.0;
     }
+    return (double)ticks / (double)nsec;
+}
 
-    proxied_engine_handle_t *peh = calloc(sizeof(proxied_engine_handle_t), 1);
-    if (peh == NULL) {
-        return ENGINE_ENOMEM;
+/**
+ * The CPU time the calling thread has used (ns), or 0 if we can't
+ * tell.
+ */
+static uint64_t thread_cpu_nsec(void) {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+        return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
     }
-    rv = init_engine_handle(peh, bucket_name, path);
-    if (rv != ENGINE_SUCCESS) {
-        release_memory(peh, sizeof(*peh));
-        return rv;
+#endif
+    return 0;
+}
+
+/** The ops the calling thread lets go by before it samples one */
+static __thread size_t cpu_sample_countdown;
+/** The state of the thread's generator of gaps between samples */
+static __thread uint32_t cpu_sample_seed;
+
+/**
+ * Start measuring the CPU time of an op, if it's one of the sampled
+ * ones. Reading the thread's CPU clock costs about as much as a whole
+ * op in a fast engine, so only 1 in cpu_sample_rate ops (on average)
+ * is measured. The gaps between the samples are random, so a client
+ * taking turns between buckets can't line up with them.
+ *
+ * @return the thread's CPU time, or 0 if the op isn't sampled
+ */
+static inline uint64_t cpu_sample_start(void) {
+    size_t rate = bucket_engine.cpu_sample_rate;
+    if (rate == 0) {
+        return 0;
+    }
+    if (cpu_sample_countdown > 0) {
+        --cpu_sample_countdown;
+        return 0;
     }
+    /* xorshift32; any seed but 0 will do */
+    uint32_t x = cpu_sample_seed;
+    if (x == 0) {
+        x = (uint32_t)(uintptr_t)&cpu_sample_seed | 1;
+    }
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    cpu_sample_seed = x;
+    /* 0 to 2 * (rate - 1) ops, rate - 1 on average */
+    cpu_sample_countdown = x % (2 * rate - 1);
+    return thread_cpu_nsec();
+}
 
-    rv = ENGINE_FAILED;
+/**
+ * When an op started, for record_op_timing.
+ */
+typedef struct op_start {
+    /* timing_ticks, or 0 if op_timings is off */
+    uint64_t ticks;
+    /* thread_cpu_nsec, or 0 if the op isn't sampled */
+    uint64_t cpu;
+} op_start_t;
 
-    peh->pe.v0 = load_engine(&peh->dlhandle, path);
+/**
+ * Start timing an op (see record_op_timing).
+ */
+static inline op_start_t timing_start(void) {
+    op_start_t start;
+    start.ticks = bucket_engine.op_timings ? timing_ticks() : 0;
+    start.cpu = cpu_sample_start();
+    return start;
+}
 
-    if (!peh->pe.v0) {
-        free_engine_handle(peh);
-        if (msg) {
-            snprintf(msg, msglen, "Failed to load engine.");
-        }
-        return rv;
+/**
+ * The bucket of the timing histograms a time (ticks) goes in: the times
+ * below 1 << TIMING_SUB_BITS get one each, every power of two above
+ * is split into 1 << TIMING_SUB_BITS.
+ */
+static inline int timing_bucket(uint64_t ticks) {
+    if (ticks < (1 << TIMING_SUB_BITS)) {
+        return (int)ticks;
+    }
+    if (ticks >= (1ULL << TIMING_MAX_BITS)) {
+        return TIMING_BUCKETS - 1;
     }
+    int msb = 63 - __builtin_clzll(ticks);
+    return ((msb - TIMING_SUB_BITS + 1) << TIMING_SUB_BITS) +
+        (int)((ticks >> (msb - TIMING_SUB_BITS)) & ((1 << TIMING_SUB_BITS) - 1));
+}
 
-    proxied_engine_handle_t *tmppeh = find_bucket_inner(bucket_name);
-    if (tmppeh == NULL) {
-        genhash_update(e->engines, bucket_name, strlen(bucket_name), peh, 0);
+/**
+ * The lowest time (ticks) that goes in a bucket of the timing
+ * histograms.
+ */
+static uint64_t timing_bucket_low(int b) {
+    if (b < (1 << TIMING_SUB_BITS)) {
+        return b;
+    }
+    int msb = (b >> TIMING_SUB_BITS) + TIMING_SUB_BITS - 1;
+    uint64_t sub = b & ((1 << TIMING_SUB_BITS) - 1);
+    return ((1ULL << TIMING_SUB_BITS) + sub) << (msb - TIMING_SUB_BITS);
+}
 
-        // This was already verified, but we'll check it anyway
-        assert(peh->pe.v0->interface == 1);
+/** The slot the calling thread keeps its per-bucket op stats in */
+static __thread int my_stats_slot = -1;
+/** Bit n is set while a thread has slot n to itself */
+static volatile int stats_slots_owned;
+/** Set for good once a thread found no slot free and shares one */
+static volatile bool stats_slots_shared;
+/** Used to hand out the slots to the threads sharing them */
+static volatile int next_stats_slot;
+/** Gives a thread's slot back when it exits */
+static pthread_key_t stats_slot_key;
+static pthread_once_t stats_slot_once = PTHREAD_ONCE_INIT;
+
+static void stats_slot_thread_exit(void *arg) {
+    int bit = 1 << ((int)(intptr_t)arg - 1);
+    int owned;
+    do {
+        owned = stats_slots_owned;
+    } while (!ATOMIC_CAS(&stats_slots_owned, owned, owned & ~bit));
+}
 
-        rv = ENGINE_SUCCESS;
+static void stats_slot_init_key(void) {
+    int r = pthread_key_create(&stats_slot_key, stats_slot_thread_exit);
+    assert(r == 0);
+}
 
-        if (peh->pe.v1->initialize(peh->pe.v0, config) != ENGINE_SUCCESS) {
-            peh->pe.v1->destroy(peh->pe.v0, false);
-            genhash_delete_all(e->engines, bucket_name, strlen(bucket_name));
-            if (msg) {
-                snprintf(msg, msglen,
-                         "Failed to initialize instance. Error code: %d\n", rv);
-            }
-            rv = ENGINE_FAILED;
-        }
-    } else {
-        if (msg) {
-            snprintf(msg, msglen,
-                     "Bucket exists: %s", bucket_state_name(tmppeh->state));
+/**
+ * Find the calling thread a stats slot: a free one if there is one,
+ * which is given back when the thread exits. Past STATS_SLOTS threads
+ * they share the slots round robin, and stats_add goes atomic.
+ */
+static int claim_stats_slot(void) {
+    pthread_once(&stats_slot_once, stats_slot_init_key);
+    int owned;
+    while ((owned = stats_slots_owned) != (1 << STATS_SLOTS) - 1) {
+        int slot = 0;
+        while (owned & (1 << slot)) {
+            ++slot;
         }
-        peh->pe.v1->destroy(peh->pe.v0, true);
-        rv = ENGINE_KEY_EEXISTS;
-    }
-
-    if (rv == ENGINE_SUCCESS) {
-        if (e_out) {
-            *e_out = peh;
-        } else {
-            release_handle(peh);
+        if (ATOMIC_CAS(&stats_slots_owned, owned, owned | (1 << slot))) {
+            pthread_setspecific(stats_slot_key, (void *)(intptr_t)(slot + 1));
+            return slot;
         }
-    } else {
-        free_engine_handle(peh);
     }
-
-    return rv;
+    stats_slots_shared = true;
+    return (ATOMIC_INCR(&next_stats_slot) - 1) & (STATS_SLOTS - 1);
 }
 
 /**
- * The client returned from the call inside the engine. If this was the
- * last client inside the engine, and the engine is scheduled for removal
- * it should be safe to nuke the engine :)
- *
- * @param engine the proxied engine
+ * The slot of the per-bucket op stats (the op counters and timings)
+ * the calling thread uses; the stats add the slots up.
  */
-static void release_engine_handle(proxied_engine_handle_t *engine) {
-    assert(engine->clients > 0);
-    int count = ATOMIC_DECR(&engine->clients);
-    assert(count >= 0);
-    if (count == 0 && engine->state == STATE_STOPPING) {
-        maybe_start_engine_shutdown(engine);
+static inline int stats_slot(void) {
+    int slot = my_stats_slot;
+    if (slot < 0) {
+        slot = claim_stats_slot();
+        my_stats_slot = slot;
     }
+    return slot;
 }
 
 /**
- * Returns engine handle for this connection.
- * All access to underlying engine must go through this function, because
- * we keep a counter of how many cookies that are currently calling into
- * the engine..
- *
- * NOTE: this cannot ever return engine handle that's in STATE_STOPPED
- * and if returns non-null it also prevents STATE_STOPPED to be
- * reached until release_engine_handle is called that'll decrement
- * clients counter. Here's why:
- *
- * Assume it returned non-null but engine's state is
- * STATE_STOPPED. But that means state was changed after it was
- * observed to be STATE_RUNNING in this function. And because we never
- * change from running to stopped it changed twice. Because STATE_RUNNING was seen after incrementing clients count here's sequence of inter-dependendent events:
- *
- * - we bump clients count
- *
- * - we observe STATE_RUNNING (and that also implies didn't
-     have STATE_STOPPED & STATE_STOPPING in past because we don't
-     change from STOPPING/STOPPED back to RUNNING)
- *
- * - some other thread changes STATE_RUNNING to STATE_STOPPING
- *
- * - somebody sets STATE_STOPPED (see
-     maybe_start_engine_shutdown). But that implies that somebody
-     first observed STATE_STOPPING and _then_ observed clients ==
-     0. Which assuming nobody decrements it without first incrementing
-     it cannot happen because our bumped clients count prevents that.
- *
- * Q.E.D.
+ * Add to a counter in the calling thread's stats slot. While every
+ * thread has its slot to itself a plain add will do; once some share
+ * them it has to be atomic. (The adds of the owners racing with the
+ * first thread to share may still get lost.)
  */
-static proxied_engine_handle_t *get_engine_handle(ENGINE_HANDLE *h,
-                                                  const void *cookie) {
-    struct bucket_engine *e = (struct bucket_engine*)h;
-    engine_specific_t *es;
-    es = e->upstream_server->cookie->get_engine_specific(cookie);
-    assert(es);
-
-    proxied_engine_handle_t *peh = es->peh;
-    if (!peh) {
-        if (e->default_engine.pe.v0) {
-            peh = &e->default_engine;
-        } else {
-            return NULL;
-        }
+static inline void stats_add(uint64_t *counter, uint64_t by) {
+    if (stats_slots_shared) {
+        ATOMIC_ADD64(counter, by);
+    } else {
+        *counter += by;
     }
+}
 
-    int count = ATOMIC_INCR(&peh->clients);
-    assert(count > 0);
+/**
+ * The op counters of a bucket for the calling thread.
+ */
+static inline op_counters_t *op_counters(proxied_engine_handle_t *peh) {
+    return &peh->counters[stats_slot()].counters;
+}
 
-    if (peh->state != STATE_RUNNING) {
-        release_engine_handle(peh);
-        peh = NULL;
+/**
+ * The size of an item's value, for the byte counters. It takes a call
+ * into the engine, so the bytes are only counted with op_timings.
+ */
+static size_t item_nbytes(proxied_engine_handle_t *peh, const void *cookie,
+                          const item *itm) {
+    item_info info = { .nvalue = 1 };
+    if (!peh->pe.v1->get_item_info(peh->pe.v0, cookie, itm, &info)) {
+        return 0;
     }
+    return info.nbytes;
+}
 
-    return peh;
+/**
+ * Does the bucket trace its slow ops (see record_slow_op)?
+ */
+static inline bool traces_slow_ops(proxied_engine_handle_t *peh) {
+    return peh->timings != NULL && peh->timings->slow_ticks != 0;
 }
 
 /**
- * Returns engine handle for this connection.
- * All access to underlying engine must go through this function, because
- * we keep a counter of how many cookies that are currently calling into
- * the engine..
+ * The number of timing_ticks from which record_op_timing looks at an
+ * op for the slow op tracer. It's half the threshold, in case the
+ * ticks per ns aren't known that well yet (shortly after
+ * initialization); record_slow_op checks the time in ns.
  */
-static proxied_engine_handle_t *try_get_engine_handle(ENGINE_HANDLE *h,
-                                                      const void *cookie) {
-    struct bucket_engine *e = (struct bucket_engine*)h;
-    engine_specific_t *es;
-    es = e->upstream_server->cookie->get_engine_specific(cookie);
-    if (es == NULL || es->peh == NULL) {
-        return NULL;
-    }
-    proxied_engine_handle_t *peh = es->peh;
-    proxied_engine_handle_t *ret = peh;
-
-    int count = ATOMIC_INCR(&peh->clients);
-    assert(count > 0);
-    if (peh->state != STATE_RUNNING) {
-        release_engine_handle(peh);
-        ret = NULL;
+static uint64_t slow_op_ticks(size_t usec) {
+    if (usec == 0) {
+        return 0;
     }
-
-    return ret;
+    uint64_t ticks = (uint64_t)((double)usec * 500 * timing_ticks_per_nsec());
+    return ticks > 0 ? ticks : 1;
 }
 
 /**
- * Create an engine specific section for the cookie
+ * Record an op that took longer than the slow_usec of its bucket in
+ * the slow op tracer's ring. The writers take the records round robin
+ * and never wait: if the record is still being written by somebody a
+ * lap ahead (or behind), the op is dropped.
+ *
+ * @param ticks how long it took
+ * @param key the key (a prefix of it is kept), or NULL
  */
-static void create_engine_specific(struct bucket_engine *e,
-                                   const void *cookie) {
-    engine_specific_t *es;
-    es = e->upstream_server->cookie->get_engine_specific(cookie);
-    assert(es == NULL);
-    es = calloc(1, sizeof(engine_specific_t));
-    assert(es);
-    es->reserved = ES_CONNECTED_FLAG;
-    e->upstream_server->cookie->store_engine_specific(cookie, es);
+static void record_slow_op(proxied_engine_handle_t *peh, timing_op_t op,
+                           uint64_t ticks, ENGINE_ERROR_CODE rc,
+                           const void *key, size_t nkey) {
+    struct bucket_engine *e = &bucket_engine;
+    uint64_t nsec = (uint64_t)(ticks / timing_ticks_per_nsec());
+    if (e->slow_ops.size == 0 ||
+        nsec < (uint64_t)peh->timings->slow_usec * 1000) {
+        return;
+    }
+
+    unsigned int pos = (unsigned int)ATOMIC_INCR(&e->slow_ops.next) - 1;
+    slow_op_t *rec = &e->slow_ops.ring[pos & (e->slow_ops.size - 1)];
+    int seq = rec->seq;
+    if (seq == SLOW_OP_BUSY || !ATOMIC_CAS(&rec->seq, seq, SLOW_OP_BUSY)) {
+        ATOMIC_INCR(&e->slow_ops.dropped);
+        return;
+    }
+
+    rec->op = op;
+    rec->rc = rc;
+    rec->when = now_usec();
+    rec->nsec = nsec;
+    rec->name_len = (uint16_t)peh->name_len;
+    size_t len = peh->name_len < SLOW_OP_NAME_LEN ?
+        peh->name_len : SLOW_OP_NAME_LEN - 1;
+    memcpy(rec->name, peh->name, len);
+    rec->name[len] = 0x00;
+    if (key == NULL) {
+        nkey = 0;
+    }
+    rec->nkey = (uint16_t)nkey;
+    len = nkey < SLOW_OP_NAME_LEN ? nkey : SLOW_OP_NAME_LEN - 1;
+    if (len > 0) {
+        memcpy(rec->key, key, len);
+    }
+    rec->key[len] = 0x00;
+    /* The record must be complete before the readers see the seq; it
+     * wraps around past INT_MAX without hitting 0 or SLOW_OP_BUSY */
+    MEMORY_BARRIER();
+    rec->seq = (int)((pos & INT_MAX) + 1);
 }
 
 /**
- * Set the engine handle for a cookie (create if it doesn't exist)
+ * Record the time an op spent in the engine of a bucket, and the CPU
+ * time if it was sampled, in the calling thread's slot (see
+ * stats_slot). A sample stands for all the ops that weren't, so it's
+ * counted cpu_sample_rate times. Ops slower than the bucket's
+ * slow_usec also go to the slow op tracer.
+ *
+ * @param start what timing_start returned before calling the engine
+ * @param rc what the engine returned
+ * @param key the op's key for the slow op tracer, or NULL
  */
-static proxied_engine_handle_t* set_engine_handle(ENGINE_HANDLE *h,
-                                                  const void *cookie,
-                                                  proxied_engine_handle_t *peh) {
-    (void)h;
-    engine_specific_t *es;
-    es = bucket_engine.upstream_server->cookie->get_engine_specific(cookie);
-    assert(es);
+static inline void record_op_timing(proxied_engine_handle_t *peh,
+                                    timing_op_t op, op_start_t start,
+                                    ENGINE_ERROR_CODE rc,
+                                    const void *key, size_t nkey) {
+    if (start.cpu != 0) {
+        uint64_t cpu = thread_cpu_nsec();
+        if (cpu > start.cpu) {
+            op_counters_t *c = op_counters(peh);
+            stats_add(&c->cpu_nsec,
+                      (cpu - start.cpu) * bucket_engine.cpu_sample_rate);
+            stats_add(&c->cpu_samples, 1);
+        }
+    }
+    if (start.ticks == 0) {
+        return;
+    }
+    uint64_t elapsed = timing_ticks() - start.ticks;
+
+    int s = stats_slot();
+    timing_slot_t *slot = peh->timings->slots[s];
+    if (slot == NULL) {
+        /* We're still inside the engine (an epoch read section with
+         * ENABLE_EPOCH_HANDLES), so we must not take the engines lock
+         * here. Two threads sharing the slot may both allocate it;
+         * the one losing the race uses the other's. The CAS is a full
+         * barrier, so the zeroes are visible before the pointer is */
+        timing_slot_t *mine = calloc_cache_aligned(sizeof(*slot));
+        assert(mine);
+        if (ATOMIC_CAS(&peh->timings->slots[s], NULL, mine)) {
+            slot = mine;
+        } else {
+            free(mine);
+            slot = peh->timings->slots[s];
+        }
+    }
+    stats_add(&slot->hist[op][timing_bucket(elapsed)], 1);
 
-    /* we cannot switch bucket for connection that's reserved. With
-     * current code at least. */
-    assert((es->reserved & ~ES_CONNECTED_FLAG) == 0);
+    uint64_t slow_ticks = peh->timings->slow_ticks;
+    if (slow_ticks != 0 && elapsed >= slow_ticks) {
+        record_slow_op(peh, op, elapsed, rc, key, nkey);
+    }
+}
 
-    proxied_engine_handle_t *old = es->peh;
-    // In with the new
-    es->peh = retain_handle(peh);
+/** The slot the calling thread uses in every ops limit */
+static __thread int my_limit_slot = -1;
+/** Used to hand out the limit slots to threads round robin */
+static volatile int next_limit_slot;
 
-    // out with the old (this may be NULL if we did't have an associated
-    // strucure...
-    release_handle(old);
-    return es->peh;
+static inline limit_slot_t *limit_slot(bucket_limit_t *limit) {
+    int slot = my_limit_slot;
+    if (slot < 0) {
+        slot = (ATOMIC_INCR(&next_limit_slot) - 1) & (LIMIT_SLOTS - 1);
+        my_limit_slot = slot;
+    }
+    return &limit->slots[slot];
 }
 
+/** The upper bounds of the parked ops' wait histogram buckets (usec) */
+static const uint64_t inflight_wait_bounds[INFLIGHT_WAIT_BUCKETS] = {
+    100, 1000, 10000, 100000, 1000000, UINT64_MAX
+};
+
 /**
- * Helper function to convert an ENGINE_HANDLE* to a bucket engine pointer
- * without a cast
+ * Count a wait that started at since in a wait histogram.
  */
-static inline struct bucket_engine* get_handle(ENGINE_HANDLE* handle) {
-    return (struct bucket_engine*)handle;
+static void record_wait(uint64_t *waits, uint64_t since, uint64_t now) {
+    uint64_t waited = now > since ? now - since : 0;
+    int b = 0;
+    while (waited > inflight_wait_bounds[b]) {
+        ++b;
+    }
+    ++waits[b];
 }
 
 /**
- * Implementation of the the get_info function in the engine interface
+ * Hand the slots that are free under max_inflight to the queued ops,
+ * oldest first (or all the queued ops, whether there's room or not).
+ * The ops are returned for notify_granted.
+ *
+ * Must be called with the limit's lock held.
  */
-static const engine_info* bucket_get_info(ENGINE_HANDLE* handle) {
-    return &(get_handle(handle)->info.engine_info);
+static parked_op_t *grant_parked_UNLOCKED(bucket_limit_t *limit, bool all) {
+    parked_op_t *granted = NULL;
+    parked_op_t **tail = &granted;
+    uint64_t now = now_usec();
+
+    while (limit->parked_head != NULL) {
+        if (ATOMIC_INCR(&limit->inflight) > limit->max_inflight && !all) {
+            /* Whoever took it since will look at the queue again
+             * when they give it back */
+            ATOMIC_DECR(&limit->inflight);
+            break;
+        }
+        parked_op_t *op = limit->parked_head;
+        limit->parked_head = op->next;
+        if (limit->parked_head == NULL) {
+            limit->parked_tail = NULL;
+        }
+        --limit->queued;
+        record_wait(limit->waits, op->since, now);
+        op->es->parked = false;
+        op->es->granted = true;
+
+        op->next = NULL;
+        *tail = op;
+        tail = &op->next;
+    }
+    return granted;
 }
 
-/***********************************************************
- **       Implementation of functions used by genhash     **
- **********************************************************/
-
 /**
- * Function used by genhash to check if two keys differ
+ * Tell the clients of the ops grant_parked_UNLOCKED handed a slot to
+ * retry them.
  */
-static int my_hash_eq(const void *k1, size_t nkey1,
-                      const void *k2, size_t nkey2) {
-    return nkey1 == nkey2 && memcmp(k1, k2, nkey1) == 0;
+static void notify_granted(parked_op_t *granted) {
+    while (granted != NULL) {
+        parked_op_t *next = granted->next;
+        bucket_engine.upstream_server->cookie->notify_io_complete(granted->cookie,
+                                                                  ENGINE_SUCCESS);
+        free(granted);
+        granted = next;
+    }
 }
 
 /**
- * Function used by genhash to create a copy of a key
+ * Set the limits of a bucket. The ops see the new settings right
+ * away. If max_inflight is raised (or removed) the ops queued that now
+ * fit in go ahead.
  */
-static void* hash_strdup(const void *k, size_t nkey) {
-    void *rv = calloc(nkey, 1);
-    assert(rv);
-    memcpy(rv, k, nkey);
-    return rv;
+static void set_bucket_limit(proxied_engine_handle_t *peh,
+                             const limit_config_t *lc) {
+    peh->fair.weight = lc->weight;
+    if (peh->timings != NULL) {
+        peh->timings->slow_usec = lc->slow_usec;
+        peh->timings->slow_ticks = slow_op_ticks(lc->slow_usec);
+    }
+    if (peh->limit == NULL && lc->rate == 0 && lc->max_inflight == 0) {
+        /* Nothing to limit */
+        return;
+    }
+
+    /* The engines lock keeps two of us from allocating the limit */
+    lock_engines();
+    bucket_limit_t *limit = peh->limit;
+    if (limit == NULL) {
+        limit = calloc_cache_aligned(sizeof(*limit));
+        assert(limit);
+        int r = pthread_mutex_init(&limit->mutex, NULL);
+        assert(r == 0);
+        limit->tokens = lc->rate;
+        limit->refilled = now_usec();
+        limit->rate = lc->rate;
+        limit->delay = lc->delay;
+        limit->max_inflight = (int)lc->max_inflight;
+        /* make the content visible before the pointer is */
+        MEMORY_BARRIER();
+        peh->limit = limit;
+    }
+    unlock_engines();
+
+    must_lock(&limit->mutex);
+    limit->rate = lc->rate;
+    limit->delay = lc->delay;
+    if (limit->tokens > lc->rate) {
+        limit->tokens = lc->rate;
+    }
+    limit->max_inflight = (int)lc->max_inflight;
+    parked_op_t *granted = grant_parked_UNLOCKED(limit,
+                                                 lc->max_inflight == 0);
+    must_unlock(&limit->mutex);
+    notify_granted(granted);
 }
 
 /**
- * Function used by genhash to create a copy of the value (this is
- * the proxied engine handle). We don't copy that value, instead
- * we increase the reference count.
+ * Parse the limit settings: "ops_limit" (ops per second, 0 for no
+ * limit), "ops_limit_policy" ("delay" or "reject"), "max_inflight"
+ * (0 for no cap), "weight" (the bucket's share of an overloaded
+ * node, see fair_enter) and "slow_op_usec" (the time over which the
+ * ops are traced, see record_slow_op; 0 for none). The settings that aren't given keep the
+ * values in lc.
+ *
+ * @return false if the config has anything else in it, or it isn't
+ *         valid
  */
-static void* refcount_dup(const void* ob, size_t vlen) {
-    (void)vlen;
-    proxied_engine_handle_t *peh = (proxied_engine_handle_t *)ob;
-    assert(peh);
-    int count = ATOMIC_INCR(&peh->refcount);
-    assert(count > 0);
-    return (void*)ob;
+static bool parse_limit_config(const char *config, limit_config_t *lc) {
+    char *policy = NULL;
+    struct config_item items[] = {
+        { .key = "ops_limit",
+          .datatype = DT_SIZE,
+          .value.dt_size = &lc->rate },
+        { .key = "ops_limit_policy",
+          .datatype = DT_STRING,
+          .value.dt_string = &policy },
+        { .key = "max_inflight",
+          .datatype = DT_SIZE,
+          .value.dt_size = &lc->max_inflight },
+        { .key = "weight",
+          .datatype = DT_SIZE,
+          .value.dt_size = &lc->weight },
+        { .key = "slow_op_usec",
+          .datatype = DT_SIZE,
+          .value.dt_size = &lc->slow_usec },
+        { .key = NULL }
+    };
+
+    bool rv = bucket_get_server_api()->core->parse_config(config, items,
+                                                          stderr) == 0;
+    if (policy != NULL) {
+        if (strcmp(policy, "delay") == 0) {
+            lc->delay = true;
+        } else if (strcmp(policy, "reject") == 0) {
+            lc->delay = false;
+        } else {
+            rv = false;
+        }
+        free(policy);
+    }
+    return rv && lc->max_inflight <= INT_MAX &&
+        lc->weight >= 1 && lc->weight <= FAIR_MAX_WEIGHT &&
+        lc->slow_usec <= SLOW_OP_MAX_USEC;
 }
 
 /**
- * Function used by genhash to release an object.
+ * Is the "key=value" setting one of parse_limit_config's?
  */
-static void engine_hash_free(void* ob) {
-    proxied_engine_handle_t *peh = (proxied_engine_handle_t *)ob;
-    assert(peh);
-    release_handle(peh);
-    peh->state = STATE_NULL;
+static bool is_limit_setting(const char *p, size_t len) {
+    static const char *keys[] = {
+        "ops_limit", "ops_limit_policy", "max_inflight", "weight",
+        "slow_op_usec", NULL
+    };
+    while (len > 0 && isspace(*p)) {
+        ++p;
+        --len;
+    }
+    const char *eq = memchr(p, '=', len);
+    if (eq == NULL) {
+        return false;
+    }
+    size_t klen = eq - p;
+    while (klen > 0 && isspace(p[klen - 1])) {
+        --klen;
+    }
+    for (int i = 0; keys[i] != NULL; i++) {
+        if (klen == strlen(keys[i]) && memcmp(p, keys[i], klen) == 0) {
+            return true;
+        }
+    }
+    return false;
 }
 
 /**
- * Try to load a shared object and create an engine.
+ * Move the limit settings out of the config of a new bucket, so the
+ * engine only gets its own.
  *
- * @param dlhandle The pointer to the loaded object (OUT). The caller is
- *                 responsible for calling dlcose() to release the resources
- *                 if the function succeeds.
- * @param soname The name of the shared object to load
- * @return A pointer to the created instance, or NULL if anything
- *         failed.
+ * @param config the config, edited in place
+ * @param ours where to put the limit settings (must be as large as
+ *             config)
  */
-static ENGINE_HANDLE *load_engine(void **dlhandle, const char *soname) {
-    ENGINE_HANDLE *engine = NULL;
-    /* Hack to remove the warning from C99 */
-    union my_hack {
-        CREATE_INSTANCE create;
-        void* voidptr;
-    } my_create = {.create = NULL };
-
-    void *handle = dlopen(soname, RTLD_NOW | RTLD_LOCAL);
-    if (handle == NULL) {
-        const char *msg = dlerror();
-        logger->log(EXTENSION_LOG_WARNING, NULL,
-                    "Failed to open library \"%s\": %s\n",
-                    soname ? soname : "self",
-                    msg ? msg : "unknown error");
-        return NULL;
+static void split_bucket_config(char *config, char *ours) {
+    char *theirs = config;
+    char *o = ours;
+    const char *p = config;
+    ours[0] = '\0';
+    if (strstr(config, "ops_limit") == NULL &&
+        strstr(config, "max_inflight") == NULL &&
+        strstr(config, "weight") == NULL &&
+        strstr(config, "slow_op_usec") == NULL) {
+        return;
     }
 
-    void *symbol = dlsym(handle, "create_instance");
-    if (symbol == NULL) {
-        logger->log(EXTENSION_LOG_WARNING, NULL,
-                "Could not find symbol \"create_instance\" in %s: %s\n",
-                soname ? soname : "self",
-                dlerror());
-        return NULL;
+    while (*p != '\0') {
+        const char *end = p;
+        while (*end != '\0' && *end != ';') {
+            if (*end == '\\' && end[1] != '\0') {
+                ++end;
+            }
+            ++end;
+        }
+        size_t len = end - p;
+        if (is_limit_setting(p, len)) {
+            if (o != ours) {
+                *o++ = ';';
+            }
+            memcpy(o, p, len);
+            o += len;
+        } else {
+            /* we never write past what we've read */
+            if (theirs != config) {
+                *theirs++ = ';';
+            }
+            memmove(theirs, p, len);
+            theirs += len;
+        }
+        p = *end == ';' ? end + 1 : end;
     }
-    my_create.voidptr = symbol;
-
-    /* request a instance with protocol version 1 */
-    ENGINE_ERROR_CODE error = (*my_create.create)(1,
-                                                  bucket_engine.get_server_api,
-                                                  &engine);
+    *theirs = '\0';
+    *o = '\0';
+}
 
-    if (error != ENGINE_SUCCESS || engine == NULL) {
-        logger->log(EXTENSION_LOG_WARNING, NULL,
-                    "Failed to create instance. Error code: %d\n", error);
-        dlclose(handle);
-        return NULL;
+/**
+ * Move the op at n up the throttle heap to where it belongs.
+ *
+ * Must be called with the throttle lock held.
+ */
+static void throttle_sift_up_UNLOCKED(struct bucket_engine *e, size_t n) {
+    throttled_op_t *heap = e->throttle.heap;
+    throttled_op_t op = heap[n];
+    while (n > 0 && heap[(n - 1) / 2].due > op.due) {
+        heap[n] = heap[(n - 1) / 2];
+        n = (n - 1) / 2;
     }
-
-    *dlhandle = handle;
-    return engine;
+    heap[n] = op;
 }
 
-/***********************************************************
- **  Implementation of callbacks from the memcached core  **
- **********************************************************/
-
 /**
- * Handle the situation when a connection is disconnected
- * from the upstream. Propagate the command downstream and
- * release the allocated resources for the connection
- * unless it is reserved.
+ * Remove the op due first from the throttle heap.
  *
- * @param cookie the cookie representing the connection that was closed
- * @param type The kind of event (should be ON_DISCONNECT)
- * @param event_data not used
- * @param cb_data The bucket instance in use
+ * Must be called with the throttle lock held.
  */
-static void handle_disconnect(const void *cookie,
-                              ENGINE_EVENT_TYPE type,
-                              const void *event_data,
-                              const void *cb_data)
-{
-    assert(type == ON_DISCONNECT);
-    struct bucket_engine *e = (struct bucket_engine*)cb_data;
-    engine_specific_t *es;
-
-    logger->log(EXTENSION_LOG_DETAIL, cookie,
-                "Handle disconnect for: %p", cookie);
-    es = e->upstream_server->cookie->get_engine_specific(cookie);
-    if (es == NULL) {
-        logger->log(EXTENSION_LOG_DETAIL, cookie,
-                    "The connection is no longer known to bucket_engine: %p",
-                    cookie);
-        return;
+static const void *throttle_pop_UNLOCKED(struct bucket_engine *e) {
+    throttled_op_t *heap = e->throttle.heap;
+    const void *cookie = heap[0].cookie;
+    throttled_op_t last = heap[--e->throttle.count];
+    size_t n = 0;
+    for (;;) {
+        size_t child = 2 * n + 1;
+        if (child >= e->throttle.count) {
+            break;
+        }
+        if (child + 1 < e->throttle.count &&
+            heap[child + 1].due < heap[child].due) {
+            ++child;
+        }
+        if (heap[child].due >= last.due) {
+            break;
+        }
+        heap[n] = heap[child];
+        n = child;
     }
-    assert(es);
+    heap[n] = last;
+    return cookie;
+}
 
-    proxied_engine_handle_t *peh = es->peh;
-    if (peh == NULL) {
-        logger->log(EXTENSION_LOG_DETAIL, cookie,
-                    "The connection is not connected to an engine %p", cookie);
-        // Not attached to an engine!
-        // Release the allocated memory, and clear the cookie data
-        // upstream
-        assert(es->reserved == ES_CONNECTED_FLAG);
-        release_memory(es, sizeof(*es));
-        e->upstream_server->cookie->store_engine_specific(cookie, NULL);
-        return;
+/**
+ * Tell the clients of the delayed ops to retry them when they're
+ * due. When the thread is told to stop, the ops still waiting are
+ * let go right away.
+ */
+static void *throttle_thread(void *arg) {
+    struct bucket_engine *e = arg;
+
+    must_lock(&e->throttle.mutex);
+    while (e->throttle.running || e->throttle.count > 0) {
+        if (e->throttle.count == 0) {
+            pthread_cond_wait(&e->throttle.cond, &e->throttle.mutex);
+            continue;
+        }
+        uint64_t due = e->throttle.heap[0].due;
+        if (e->throttle.running && due > now_usec()) {
+            struct timespec ts = { .tv_sec = due / 1000000,
+                                   .tv_nsec = (due % 1000000) * 1000 };
+            pthread_cond_timedwait(&e->throttle.cond, &e->throttle.mutex,
+                                   &ts);
+            continue;
+        }
+        const void *cookie = throttle_pop_UNLOCKED(e);
+        must_unlock(&e->throttle.mutex);
+        e->upstream_server->cookie->notify_io_complete(cookie,
+                                                       ENGINE_SUCCESS);
+        must_lock(&e->throttle.mutex);
     }
+    must_unlock(&e->throttle.mutex);
+    return NULL;
+}
 
-    proxied_engine_handle_t *cb_peh;
-    cb_peh = try_get_engine_handle((ENGINE_HANDLE *)e, cookie);
-
-    bool do_callback = cb_peh != NULL && peh->wants_disconnects;
-    if (do_callback) {
-        logger->log(EXTENSION_LOG_DETAIL, NULL,
-                    "Send disconnect call to engine %p cookie %p",
-                    peh, cookie);
-        peh->cb(cookie, type, event_data, peh->cb_data);
+/**
+ * Have the client retry the op when it's due. The throttle thread is
+ * started by the first op delayed.
+ *
+ * @return false if the thread couldn't be started
+ */
+static bool delay_op(const void *cookie, uint64_t due) {
+    struct bucket_engine *e = &bucket_engine;
+
+    must_lock(&e->throttle.mutex);
+    if (!e->throttle.running) {
+        if (pthread_create(&e->throttle.thread, NULL,
+                           throttle_thread, e) != 0) {
+            must_unlock(&e->throttle.mutex);
+            logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Failed to start the throttle thread\n");
+            return false;
+        }
+        e->throttle.running = true;
+    }
+    if (e->throttle.count == e->throttle.size) {
+        e->throttle.size = e->throttle.size ? e->throttle.size * 2 : 64;
+        e->throttle.heap = realloc(e->throttle.heap,
+                                   e->throttle.size * sizeof(throttled_op_t));
+        assert(e->throttle.heap);
     }
+    size_t n = e->throttle.count++;
+    e->throttle.heap[n].due = due;
+    e->throttle.heap[n].cookie = cookie;
+    throttle_sift_up_UNLOCKED(e, n);
+    if (e->throttle.heap[0].cookie == cookie) {
+        pthread_cond_signal(&e->throttle.cond);
+    }
+    must_unlock(&e->throttle.mutex);
+    return true;
+}
 
-    if (cb_peh != NULL) {
-        release_engine_handle(cb_peh);
+/**
+ * Let the delayed ops go, and stop the throttle thread.
+ */
+static void stop_throttle(struct bucket_engine *e) {
+    must_lock(&e->throttle.mutex);
+    bool running = e->throttle.running;
+    e->throttle.running = false;
+    pthread_cond_signal(&e->throttle.cond);
+    must_unlock(&e->throttle.mutex);
+
+    if (running) {
+        pthread_join(e->throttle.thread, NULL);
     }
+    free(e->throttle.heap);
+    e->throttle.heap = NULL;
+    e->throttle.size = 0;
+}
 
-    /*
-     * We can't release the bucket engine yet, because the connection is
-     * still reserved
-     */
-    if (es->reserved != ES_CONNECTED_FLAG) {
-        logger->log(EXTENSION_LOG_DETAIL, cookie,
-                    "We can't complete the shutdown due to reservations %p",
-                    cookie);
-        return;
+/**
+ * The slot of this thread ran out of tokens: take a batch from the
+ * shared bucket, after adding the tokens for the time since it was
+ * last done. The bucket holds at most a second's worth of tokens.
+ */
+static ENGINE_ERROR_CODE throttle_op_slow(bucket_limit_t *limit,
+                                          limit_slot_t *slot,
+                                          engine_specific_t *es,
+                                          const void *cookie,
+                                          size_t rate) {
+    /* Keep the tokens stuck in the slots to about a thousandth of
+     * the rate */
+    int batch = rate / 1000 > 64 ? 64 : (int)(rate / 1000);
+    if (batch == 0) {
+        batch = 1;
     }
 
-    logger->log(EXTENSION_LOG_DETAIL, cookie, "Complete the shutdown of %p",
-                cookie);
-
-    /* We don't expect concurrent calls to reserve because of
-     * restriction that reserve can be only called from upcall. And
-     * memcached will not upcall this while doing upcall for something
-     * else (e.g. tap_notify or tap_itertator). */
-    /* NOTE: that concurrent release is ok */
-    int count = ATOMIC_ADD(&es->reserved, -ES_CONNECTED_FLAG);
-    if (count == 0) {
-        /* if we're last just clear this thing */
-        // Release all the memory and clear the cookie data upstream.
-        release_memory(es, sizeof(*es));
-        e->upstream_server->cookie->store_engine_specific(cookie, NULL);
+    must_lock(&limit->mutex);
+    uint64_t now = now_usec();
+    if (now > limit->refilled) {
+        limit->tokens += (double)(now - limit->refilled) * rate / 1000000.0;
+        if (limit->tokens > rate) {
+            limit->tokens = rate;
+        }
+        limit->refilled = now;
     }
-    /* we now have one less connection holding reference to this peh.
-     *
-     * NOTE: we have es->peh still has this peh, and es->reserved now
-     * guards peh 'alive'-dness so connection's engine-specific will
-     * still not outlive peh. */
-    release_handle(peh);
+    if (limit->tokens >= 1) {
+        int grab = limit->tokens < batch ? (int)limit->tokens : batch;
+        limit->tokens -= grab;
+        must_unlock(&limit->mutex);
+        /* one of them is ours */
+        if (grab > 1) {
+            ATOMIC_ADD(&slot->tokens, grab - 1);
+        }
+        return ENGINE_SUCCESS;
+    }
+    if (!limit->delay) {
+        ++limit->rejected;
+        must_unlock(&limit->mutex);
+        return ENGINE_TMPFAIL;
+    }
+    /* Pay now, so the ops after this one wait for it */
+    limit->tokens -= 1;
+    uint64_t due = now + (uint64_t)(-limit->tokens * 1000000.0 / rate);
+    ++limit->delayed;
+    must_unlock(&limit->mutex);
+
+    es->throttled = true;
+    if (!delay_op(cookie, due)) {
+        es->throttled = false;
+        return ENGINE_TMPFAIL;
+    }
+    return ENGINE_EWOULDBLOCK;
 }
 
 /**
- * Callback from the memcached core for a new connection. Associate
- * it with the default bucket (if it exists) and create an engine
- * specific structure.
+ * Take a token for an op on a bucket with an ops limit. Each thread
+ * takes the tokens from its own slot, so unless the slot is empty we
+ * don't write to memory shared with the other threads.
  *
- * @param cookie the cookie representing the connection
- * @param type The kind of event (should be ON_CONNECT)
- * @param event_data not used
- * @param cb_data The bucket instance in use
+ * @return ENGINE_SUCCESS if the op may go ahead, ENGINE_EWOULDBLOCK
+ *         if it's delayed (the client is told when to retry it) or
+ *         ENGINE_TMPFAIL if it's rejected
  */
-static void handle_connect(const void *cookie,
-                           ENGINE_EVENT_TYPE type,
-                           const void *event_data,
-                           const void *cb_data) {
-    assert(type == ON_CONNECT);
-    (void)event_data;
-    struct bucket_engine *e = (struct bucket_engine*)cb_data;
+static ENGINE_ERROR_CODE throttle_op(bucket_limit_t *limit,
+                                     engine_specific_t *es,
+                                     const void *cookie) {
+    if (es->throttled) {
+        /* The retry of a delayed op */
+        es->throttled = false;
+        return ENGINE_SUCCESS;
+    }
 
-    proxied_engine_handle_t *peh = NULL;
-    if (e->default_bucket_name != NULL) {
-        // Assign a default named bucket (if there is one).
-        peh = find_bucket(e->default_bucket_name);
-        if (!peh && e->auto_create) {
-            lock_engines();
-            create_bucket_UNLOCKED(e, e->default_bucket_name,
-                                   e->default_engine_path,
-                                   e->default_bucket_config, &peh, NULL, 0);
-            unlock_engines();
+    size_t rate = limit->rate;
+    if (rate == 0) {
+        return ENGINE_SUCCESS;
+    }
+    limit_slot_t *slot = limit_slot(limit);
+    if (ATOMIC_DECR(&slot->tokens) >= 0) {
+        return ENGINE_SUCCESS;
+    }
+    ATOMIC_INCR(&slot->tokens);
+    return throttle_op_slow(limit, slot, es, cookie, rate);
+}
+
+/**
+ * Take one of the max_inflight slots of the bucket for an op. If
+ * they're all taken (or others are queued for them already) the op is
+ * queued, and the client is told to retry it once an op leaving the
+ * engine hands it a slot (see leave_inflight).
+ *
+ * @return ENGINE_SUCCESS if the op may go ahead, ENGINE_EWOULDBLOCK
+ *         if it's queued
+ */
+static ENGINE_ERROR_CODE enter_inflight(bucket_limit_t *limit,
+                                        engine_specific_t *es,
+                                        const void *cookie) {
+    if (es->inflight) {
+        /* Kept while the op was queued by fair_enter */
+        return ENGINE_SUCCESS;
+    }
+    if (es->granted) {
+        /* The slot was taken for us */
+        es->granted = false;
+        es->inflight = true;
+        return ENGINE_SUCCESS;
+    }
+    int max = limit->max_inflight;
+    if (max == 0) {
+        return ENGINE_SUCCESS;
+    }
+    if (limit->queued == 0) {
+        if (ATOMIC_INCR(&limit->inflight) <= max) {
+            es->inflight = true;
+            return ENGINE_SUCCESS;
         }
+        ATOMIC_DECR(&limit->inflight);
+    }
+
+    parked_op_t *op = malloc(sizeof(*op));
+    assert(op);
+    op->cookie = cookie;
+    op->es = es;
+    op->since = now_usec();
+    op->next = NULL;
+    /* The ops limit was already paid for */
+    es->throttled = true;
+
+    must_lock(&limit->mutex);
+    es->parked = true;
+    if (limit->parked_tail != NULL) {
+        limit->parked_tail->next = op;
     } else {
-        // Assign the default bucket (if there is one).
-        peh = e->default_engine.pe.v0 ? &e->default_engine : NULL;
-        if (peh != NULL) {
-            /* increment refcount because final release_handle will
-             * decrement it */
-            proxied_engine_handle_t *t = retain_handle(peh);
-            assert(t == peh);
+        limit->parked_head = op;
+    }
+    limit->parked_tail = op;
+    ++limit->queued;
+    ++limit->parked;
+    /* An op may have left the engine before it could see us queued */
+    MEMORY_BARRIER();
+    parked_op_t *granted = grant_parked_UNLOCKED(limit, false);
+    must_unlock(&limit->mutex);
+    notify_granted(granted);
+
+    return ENGINE_EWOULDBLOCK;
+}
+
+/**
+ * Give back the max_inflight slot of an op leaving the engine, to one
+ * of the queued ops if there are any.
+ */
+static void leave_inflight(bucket_limit_t *limit, engine_specific_t *es) {
+    es->inflight = false;
+    ATOMIC_DECR(&limit->inflight);
+    if (limit->queued == 0) {
+        return;
+    }
+    must_lock(&limit->mutex);
+    parked_op_t *granted = grant_parked_UNLOCKED(limit, false);
+    must_unlock(&limit->mutex);
+    notify_granted(granted);
+}
+
+/**
+ * Take the op of a connection that's going away out of its bucket's
+ * max_inflight queue, and give back the slot it holds (or was handed
+ * but won't come back for).
+ */
+static void inflight_abandon(engine_specific_t *es) {
+    proxied_engine_handle_t *peh = es->peh;
+    bucket_limit_t *limit = peh != NULL ? peh->limit : NULL;
+    if (limit == NULL || !(es->parked || es->granted || es->inflight)) {
+        return;
+    }
+
+    must_lock(&limit->mutex);
+    if (es->parked) {
+        parked_op_t *prev = NULL;
+        parked_op_t *op = limit->parked_head;
+        while (op->es != es) {
+            prev = op;
+            op = op->next;
+        }
+        if (prev != NULL) {
+            prev->next = op->next;
+        } else {
+            limit->parked_head = op->next;
         }
+        if (limit->parked_tail == op) {
+            limit->parked_tail = prev;
+        }
+        --limit->queued;
+        es->parked = false;
+        free(op);
     }
+    bool held = es->granted || es->inflight;
+    es->granted = false;
+    must_unlock(&limit->mutex);
 
-    create_engine_specific(e, cookie);
-    set_engine_handle((ENGINE_HANDLE*)e, cookie, peh);
-    release_handle(peh);
+    if (held) {
+        leave_inflight(limit, es);
+    }
 }
 
 /**
- * Callback from the memcached core that a cookie succesfully
- * authenticated itself. Associate the cookie with the bucket it is
- * authenticated to.
+ * Hand the slots that are free under overload_inflight to the queued
+ * ops. The bucket at the head of the ring gets up to its weight of
+ * them in before it goes to the back of the ring (or leaves it, once
+ * it has no more ops queued). The ops are returned for
+ * notify_granted.
  *
- * @param cookie the cookie representing the connection
- * @param type The kind of event (should be ON_AUTH)
- * @param event_data The authentication data
- * @param cb_data The bucket instance in use
+ * Must be called with fair.mutex held.
  */
-static void handle_auth(const void *cookie,
-                        ENGINE_EVENT_TYPE type,
-                        const void *event_data,
-                        const void *cb_data) {
-    assert(type == ON_AUTH);
-    struct bucket_engine *e = (struct bucket_engine*)cb_data;
+static parked_op_t *grant_fair_UNLOCKED(struct bucket_engine *e) {
+    parked_op_t *granted = NULL;
+    parked_op_t **tail = &granted;
+    uint64_t now = now_usec();
+
+    while (e->fair.tail != NULL) {
+        if (ATOMIC_INCR(&e->fair.inflight) > (int)e->fair.threshold) {
+            ATOMIC_DECR(&e->fair.inflight);
+            break;
+        }
+        proxied_engine_handle_t *peh = e->fair.tail->fair.next;
+        fair_queue_t *q = &peh->fair;
+        if (q->deficit == 0) {
+            q->deficit = q->weight;
+        }
+        parked_op_t *op = q->head;
+        q->head = op->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+        --q->queued;
+        --q->deficit;
+        --e->fair.queued;
+        record_wait(q->waits, op->since, now);
+        op->es->fair_parked = false;
+        op->es->fair_granted = true;
+
+        if (q->queued == 0) {
+            /* Off the ring */
+            if (e->fair.tail == peh) {
+                e->fair.tail = NULL;
+            } else {
+                e->fair.tail->fair.next = q->next;
+            }
+            q->next = NULL;
+            q->deficit = 0;
+        } else if (q->deficit == 0) {
+            /* To the back of the ring */
+            e->fair.tail = peh;
+        }
 
-    const auth_data_t *auth_data = (const auth_data_t*)event_data;
-    proxied_engine_handle_t *peh = find_bucket(auth_data->username);
-    if (!peh && e->auto_create) {
-        lock_engines();
-        create_bucket_UNLOCKED(e, auth_data->username, e->default_engine_path,
-                               auth_data->config ? auth_data->config : "", &peh, NULL, 0);
-        unlock_engines();
+        op->next = NULL;
+        *tail = op;
+        tail = &op->next;
     }
-    set_engine_handle((ENGINE_HANDLE*)e, cookie, peh);
-    release_handle(peh);
+    return granted;
 }
 
 /**
- * Initialize the default bucket.
+ * Take one of the overload_inflight slots for an op. While there are
+ * free slots (and nobody's queued for them) the ops go right in. Past
+ * that the engines are overloaded, and the op is queued in its
+ * bucket's fair queue until grant_fair_UNLOCKED hands it a slot, so the
+ * buckets share the engines by weight instead of by how many ops they
+ * send.
+ *
+ * @return ENGINE_SUCCESS if the op may go ahead, ENGINE_EWOULDBLOCK
+ *         if it's queued
  */
-static ENGINE_ERROR_CODE init_default_bucket(struct bucket_engine* se)
-{
-    ENGINE_ERROR_CODE ret;
-    memset(&se->default_engine, 0, sizeof(se->default_engine));
-    if ((ret = init_engine_handle(&se->default_engine, "",
-                                  se->default_engine_path)) != ENGINE_SUCCESS) {
-        return ret;
+static ENGINE_ERROR_CODE fair_enter(proxied_engine_handle_t *peh,
+                                    engine_specific_t *es,
+                                    const void *cookie) {
+    struct bucket_engine *e = &bucket_engine;
+    if (es->fair_granted) {
+        es->fair_granted = false;
+        es->fair = true;
+        return ENGINE_SUCCESS;
     }
-    se->default_engine.pe.v0 = load_engine(&se->default_engine.dlhandle,
-                                           se->default_engine_path);
-    ENGINE_HANDLE_V1 *dv1 = (ENGINE_HANDLE_V1*)se->default_engine.pe.v0;
-    if (!dv1) {
-        return ENGINE_FAILED;
+    if (e->fair.queued == 0) {
+        if (ATOMIC_INCR(&e->fair.inflight) <= (int)e->fair.threshold) {
+            es->fair = true;
+            return ENGINE_SUCCESS;
+        }
+        ATOMIC_DECR(&e->fair.inflight);
     }
 
-    ret = dv1->initialize(se->default_engine.pe.v0, se->default_bucket_config);
-    if (ret != ENGINE_SUCCESS) {
-        dv1->destroy(se->default_engine.pe.v0, false);
+    parked_op_t *op = malloc(sizeof(*op));
+    assert(op);
+    op->cookie = cookie;
+    op->es = es;
+    op->since = now_usec();
+    op->next = NULL;
+
+    must_lock(&e->fair.mutex);
+    es->fair_parked = true;
+    fair_queue_t *q = &peh->fair;
+    if (q->tail != NULL) {
+        q->tail->next = op;
+    } else {
+        q->head = op;
+    }
+    q->tail = op;
+    if (q->queued++ == 0) {
+        /* On to the back of the ring */
+        if (e->fair.tail == NULL) {
+            q->next = peh;
+        } else {
+            q->next = e->fair.tail->fair.next;
+            e->fair.tail->fair.next = peh;
+        }
+        e->fair.tail = peh;
     }
+    ++q->parked;
+    ++e->fair.queued;
+    ++e->fair.parked;
+    /* An op may have left before it could see us queued */
+    MEMORY_BARRIER();
+    parked_op_t *granted = grant_fair_UNLOCKED(e);
+    must_unlock(&e->fair.mutex);
+    notify_granted(granted);
+
+    return ENGINE_EWOULDBLOCK;
+}
 
-    return ret;
+/**
+ * Give back the overload_inflight slot of an op leaving the engine,
+ * to one of the queued ops if there are any.
+ */
+static void fair_leave(engine_specific_t *es) {
+    struct bucket_engine *e = &bucket_engine;
+    es->fair = false;
+    ATOMIC_DECR(&e->fair.inflight);
+    if (e->fair.queued == 0) {
+        return;
+    }
+    must_lock(&e->fair.mutex);
+    parked_op_t *granted = grant_fair_UNLOCKED(e);
+    must_unlock(&e->fair.mutex);
+    notify_granted(granted);
 }
 
 /**
- * This is the implementation of the "initialize" function in the engine
- * interface. It is called right after create_instance if memcached liked
- * the interface we returned. Perform all initialization and load the
- * default bucket (if specified in the config string).
+ * Take a bucket off the ring of the buckets with ops queued.
+ *
+ * Must be called with fair.mutex held.
  */
-static ENGINE_ERROR_CODE bucket_initialize(ENGINE_HANDLE* handle,
-                                           const char* config_str) {
-    struct bucket_engine* se = get_handle(handle);
-    assert(!se->initialized);
+static void fair_unlink_bucket_UNLOCKED(struct bucket_engine *e,
+                                        proxied_engine_handle_t *peh) {
+    fair_queue_t *q = &peh->fair;
+    proxied_engine_handle_t *prev = e->fair.tail;
+    while (prev->fair.next != peh) {
+        prev = prev->fair.next;
+    }
+    if (prev == peh) {
+        e->fair.tail = NULL;
+    } else {
+        prev->fair.next = q->next;
+        if (e->fair.tail == peh) {
+            e->fair.tail = prev;
+        }
+    }
+    q->next = NULL;
+    q->deficit = 0;
+}
 
-    char *tenv = getenv("MEMCACHED_TOP_KEYS");
-    if (tenv != NULL) {
-        se->topkeys = atoi(tenv);
-        if (se->topkeys < 0) {
-            se->topkeys = 0;
+/**
+ * Take the op of a connection that's going away (or whose bucket is)
+ * out of its bucket's fair queue, and give back the slot it was
+ * handed if it never comes back to use it. A queued op holds no slot,
+ * so there's nothing to give back for it.
+ */
+static void fair_abandon(engine_specific_t *es) {
+    struct bucket_engine *e = &bucket_engine;
+    if (es == NULL || !(es->fair_parked || es->fair_granted)) {
+        return;
+    }
+
+    must_lock(&e->fair.mutex);
+    if (es->fair_parked) {
+        fair_queue_t *q = &es->peh->fair;
+        parked_op_t *prev = NULL;
+        parked_op_t *op = q->head;
+        while (op->es != es) {
+            prev = op;
+            op = op->next;
+        }
+        if (prev != NULL) {
+            prev->next = op->next;
+        } else {
+            q->head = op->next;
+        }
+        if (q->tail == op) {
+            q->tail = prev;
+        }
+        --e->fair.queued;
+        if (--q->queued == 0) {
+            fair_unlink_bucket_UNLOCKED(e, es->peh);
         }
+        es->fair_parked = false;
+        free(op);
     }
+    bool granted = es->fair_granted;
+    es->fair_granted = false;
+    must_unlock(&e->fair.mutex);
 
-    get_current_time = bucket_engine.upstream_server->core->get_current_time;
+    if (granted) {
+        es->fair = true;
+        fair_leave(es);
+    }
+}
 
+/**
+ * Take the ops of a bucket being deleted out of the fair queues, and
+ * tell them to retry (they'll find the bucket gone).
+ */
+static void fair_forget_bucket(proxied_engine_handle_t *peh) {
+    struct bucket_engine *e = &bucket_engine;
+    if (e->fair.threshold == 0) {
+        return;
+    }
 
-#ifdef HAVE_PTHREAD_MUTEX_ERRORCHECK
-    bucket_engine.mutexattr = &bucket_engine.mutexattr_storage;
+    must_lock(&e->fair.mutex);
+    fair_queue_t *q = &peh->fair;
+    parked_op_t *ops = q->head;
+    if (q->queued > 0) {
+        fair_unlink_bucket_UNLOCKED(e, peh);
+        e->fair.queued -= q->queued;
+    }
+    for (parked_op_t *op = ops; op != NULL; op = op->next) {
+        op->es->fair_parked = false;
+    }
+    q->head = q->tail = NULL;
+    q->next = NULL;
+    q->queued = 0;
+    q->deficit = 0;
+    must_unlock(&e->fair.mutex);
+
+    while (ops != NULL) {
+        parked_op_t *next = ops->next;
+        e->upstream_server->cookie->notify_io_complete(ops->cookie,
+                                                       ENGINE_SUCCESS);
+        free(ops);
+        ops = next;
+    }
+}
 
-    if (pthread_mutexattr_init(bucket_engine.mutexattr) != 0 ||
-        pthread_mutexattr_settype(bucket_engine.mutexattr,
-                                  PTHREAD_MUTEX_ERRORCHECK) != 0)
-    {
-        return ENGINE_FAILED;
+/**
+ * Get the entry a name maps to in the negative cache.
+ */
+static negative_entry_t *negative_entry(struct bucket_engine *e,
+                                        const char *name, size_t nkey) {
+    size_t n = (unsigned int)genhash_seeded_hash(name, nkey) &
+        (e->negative.size - 1);
+    return &e->negative.entries[n];
+}
+
+/**
+ * Check if auth recently found no bucket with this name.
+ *
+ * @param generation set to what to pass negative_cache_insert if the
+ *                   name isn't cached and the bucket doesn't exist
+ */
+static bool negative_cache_find(struct bucket_engine *e, const char *name,
+                                uint64_t *generation) {
+    if (e->negative.ttl == 0) {
+        *generation = 0;
+        return false;
     }
-#else
-    bucket_engine.mutexattr = NULL;
-#endif
+    size_t nkey = strlen(name);
+    rel_time_t now = get_current_time();
+
+    must_lock(&e->negative.mutex);
+    negative_entry_t *ne = negative_entry(e, name, nkey);
+    bool found = ne->name != NULL && ne->name_len == nkey &&
+        memcmp(ne->name, name, nkey) == 0 && now < ne->expires;
+    if (found) {
+        ++e->negative.hits;
+    }
+    *generation = e->negative.generation;
+    must_unlock(&e->negative.mutex);
+    return found;
+}
 
-    if (pthread_mutex_init(&se->engines_mutex, bucket_engine.mutexattr) != 0) {
-        logger->log(EXTENSION_LOG_WARNING, NULL,
-                    "Error initializing mutex for bucket engine.\n");
-        return ENGINE_FAILED;
+/**
+ * Remember that there's no bucket with this name, unless a bucket was
+ * created since negative_cache_find returned the generation.
+ */
+static void negative_cache_insert(struct bucket_engine *e, const char *name,
+                                  uint64_t generation) {
+    if (e->negative.ttl == 0) {
+        return;
+    }
+    size_t nkey = strlen(name);
+    char *copy = strdup(name);
+    if (copy == NULL) {
+        return;
     }
 
-    ENGINE_ERROR_CODE ret = initialize_configuration(se, config_str);
-    if (ret != ENGINE_SUCCESS) {
-        return ret;
+    must_lock(&e->negative.mutex);
+    if (generation == e->negative.generation) {
+        negative_entry_t *ne = negative_entry(e, name, nkey);
+        char *old = ne->name;
+        ne->name = copy;
+        ne->name_len = nkey;
+        ne->expires = get_current_time() + e->negative.ttl;
+        ++e->negative.inserts;
+        copy = old;
     }
+    must_unlock(&e->negative.mutex);
+    free(copy);
+}
 
-    static struct hash_ops my_hash_ops = {
-        .hashfunc = genhash_string_hash,
-        .hasheq = my_hash_eq,
-        .dupKey = hash_strdup,
-        .dupValue = refcount_dup,
-        .freeKey = free,
-        .freeValue = engine_hash_free
-    };
+/**
+ * A bucket with this name now exists.
+ */
+static void negative_cache_forget(struct bucket_engine *e, const char *name) {
+    if (e->negative.ttl == 0) {
+        return;
+    }
+    size_t nkey = strlen(name);
+
+    must_lock(&e->negative.mutex);
+    ++e->negative.generation;
+    negative_entry_t *ne = negative_entry(e, name, nkey);
+    char *old = NULL;
+    if (ne->name != NULL && ne->name_len == nkey &&
+        memcmp(ne->name, name, nkey) == 0) {
+        old = ne->name;
+        ne->name = NULL;
+    }
+    must_unlock(&e->negative.mutex);
+    free(old);
+}
 
-    se->engines = genhash_init(1, my_hash_ops);
-    if (se->engines == NULL) {
-        return ENGINE_ENOMEM;
+/**
+ * Look for a bucket with the name we're about to create. If somebody
+ * else is creating it, wait for them rather than doing it again. If it
+ * exists (afterwards) report it like create_bucket does.
+ *
+ * Must be called with the engines lock held.
+ *
+ * @return true if the bucket exists
+ */
+static bool find_existing_bucket_UNLOCKED(struct bucket_engine *e,
+                                          const char *bucket_name,
+                                          proxied_engine_handle_t **e_out,
+                                          char *msg, size_t msglen) {
+    proxied_engine_handle_t *tmppeh;
+    bool joined = false;
+    while ((tmppeh = find_bucket_inner(bucket_name)) != NULL &&
+           tmppeh->state == STATE_CREATING) {
+        joined = true;
+        wait_for_bucket_UNLOCKED(e, tmppeh);
+    }
+    if (joined) {
+        ++e->creates_joined;
+    }
+    if (tmppeh == NULL) {
+        return false;
+    }
+    if (msg) {
+        snprintf(msg, msglen,
+                 "Bucket exists: %s", bucket_state_name(tmppeh->state));
+    }
+    if (e_out) {
+        *e_out = retain_handle(tmppeh);
+    }
+    return true;
+}
+
+/**
+ * Creates bucket and places it's handle into *e_out. NOTE: that
+ * caller is responsible for calling release_handle on that handle
+ *
+ * Loading and initializing the engine may take a long time, so it's
+ * done without holding the engines lock. A placeholder in
+ * STATE_CREATING reserves the name in the meantime; it isn't visible
+ * to find_bucket. Whoever tries to create a bucket with the same
+ * name waits until the placeholder is either running or gone. If it
+ * ends up running ENGINE_KEY_EEXISTS is returned, with the existing
+ * bucket in *e_out. We look before allocating our own handle, so a
+ * crowd of connections auto-creating the same bucket only sets up
+ * one.
+ */
+static ENGINE_ERROR_CODE create_bucket(struct bucket_engine *e,
+                                       const char *bucket_name,
+                                       const char *path,
+                                       const char *config,
+                                       proxied_engine_handle_t **e_out,
+                                       char *msg, size_t msglen) {
+
+    ENGINE_ERROR_CODE rv;
+
+    if (!has_valid_bucket_name(bucket_name)) {
+        return ENGINE_EINVAL;
+    }
+
+    lock_engines();
+    bool exists = find_existing_bucket_UNLOCKED(e, bucket_name, e_out,
+                                                msg, msglen);
+    unlock_engines();
+    if (exists) {
+        return ENGINE_KEY_EEXISTS;
+    }
+
+    proxied_engine_handle_t *peh = calloc_cache_aligned(sizeof(proxied_engine_handle_t));
+    if (peh == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    rv = init_engine_handle(peh, bucket_name, path);
+    if (rv != ENGINE_SUCCESS) {
+        release_memory(peh, sizeof(*peh));
+        return rv;
+    }
+    peh->state = STATE_CREATING;
+    peh->config = strdup(config ? config : "");
+    if (peh->config == NULL) {
+        free_engine_handle(peh);
+        return ENGINE_ENOMEM;
+    }
+    /* The limits are ours, the rest is the engine's */
+    char limit_config[strlen(peh->config) + 1];
+    split_bucket_config(peh->config, limit_config);
+    if (limit_config[0] != '\0') {
+        limit_config_t lc = {
+            .rate = 0, .delay = true, .max_inflight = 0, .weight = 1,
+            .slow_usec = 0
+        };
+        if (!parse_limit_config(limit_config, &lc)) {
+            if (msg) {
+                snprintf(msg, msglen, "Invalid ops limit.");
+            }
+            free_engine_handle(peh);
+            return ENGINE_EINVAL;
+        }
+        set_bucket_limit(peh, &lc);
+    }
+
+    /* Somebody may have beaten us to it while we set up the handle */
+    lock_engines();
+    if (find_existing_bucket_UNLOCKED(e, bucket_name, e_out, msg, msglen)) {
+        unlock_engines();
+        free_engine_handle(peh);
+        return ENGINE_KEY_EEXISTS;
+    }
+    genhash_update(e->engines, bucket_name, strlen(bucket_name), peh, 0);
+    unlock_engines();
+
+    rv = ENGINE_FAILED;
+
+    if (claim_spare_engine(e, peh, path, peh->config)) {
+        rv = ENGINE_SUCCESS;
+    } else if ((peh->pe.v0 = load_engine(&peh->module, path)) == NULL) {
+        if (msg) {
+            snprintf(msg, msglen, "Failed to load engine.");
+        }
+    } else {
+        // This was already verified, but we'll check it anyway
+        assert(peh->pe.v0->interface == 1);
+
+        rv = ENGINE_SUCCESS;
+
+        if (peh->pe.v1->initialize(peh->pe.v0,
+                                   peh->config) != ENGINE_SUCCESS) {
+            peh->pe.v1->destroy(peh->pe.v0, false);
+            if (msg) {
+                snprintf(msg, msglen,
+                         "Failed to initialize instance. Error code: %d\n", rv);
+            }
+            rv = ENGINE_FAILED;
+        }
+    }
+
+    lock_engines();
+    if (rv == ENGINE_SUCCESS) {
+        peh->state = STATE_RUNNING;
+        /* Don't let lock-free readers see the bucket until it's
+         * initialized */
+        publish_registry_UNLOCKED(e);
+        negative_cache_forget(e, bucket_name);
+    } else {
+        /* It was never published, see registry_insert */
+        genhash_delete_all(e->engines, bucket_name, strlen(bucket_name));
+    }
+    wake_bucket_waiters_UNLOCKED(e, peh);
+    unlock_engines();
+
+    if (rv == ENGINE_SUCCESS) {
+        if (e_out) {
+            *e_out = peh;
+        } else {
+            release_handle(peh);
+        }
+    } else {
+        free_engine_handle(peh);
+    }
+
+    return rv;
+}
+
+#ifdef ENABLE_EPOCH_HANDLES
+/**
+ * Mark the calling thread as being inside the engine. Instead of
+ * counting the clients of each engine we announce the current epoch
+ * in a per-thread record, and shutdown_bucket waits for every
+ * thread that could have seen the engine running to leave (see
+ * epoch_synchronize). Neither this nor release_engine_handle writes
+ * to memory shared with other threads.
+ */
+static inline void enter_engine_handle(proxied_engine_handle_t *peh) {
+    (void)peh;
+    epoch_enter(EPOCH_HANDLES);
+}
+
+/**
+ * The client returned from the call inside the engine. If the engine
+ * is scheduled for removal, start its shutdown; the shutdown worker
+ * waits for the remaining clients.
+ *
+ * @param engine the proxied engine
+ */
+static void release_engine_handle(proxied_engine_handle_t *engine) {
+    epoch_exit(EPOCH_HANDLES);
+    if (engine->state == STATE_STOPPING) {
+        maybe_start_engine_shutdown(engine);
+    }
+}
+#else
+/** The slot the calling thread uses in every clients counter */
+static __thread int my_client_slot = -1;
+/** Used to hand out the slots to threads round robin */
+static volatile int next_client_slot;
+
+static inline volatile int *client_slot(proxied_engine_handle_t *peh) {
+    int slot = my_client_slot;
+    if (slot < 0) {
+        slot = (ATOMIC_INCR(&next_client_slot) - 1) & (CLIENT_SLOTS - 1);
+        my_client_slot = slot;
+    }
+    return &peh->clients[slot].count;
+}
+
+/**
+ * Count the calling thread as a client of the engine. It must be
+ * paired with a release_engine_handle on the same thread, so that no
+ * slot ever drops below the number of its threads currently inside
+ * the engine (see get_engine_handle).
+ */
+static inline void enter_engine_handle(proxied_engine_handle_t *peh) {
+    int count = ATOMIC_INCR(client_slot(peh));
+    assert(count > 0);
+}
+
+/**
+ * Sum up the clients counter. This reads every slot, so only use it
+ * when deciding whether to shut down (or for stats).
+ */
+static int count_clients(proxied_engine_handle_t *peh) {
+    int total = 0;
+    /* The callers check the state first, and the slots must not be
+     * read before that */
+    MEMORY_BARRIER();
+    for (int i = 0; i < CLIENT_SLOTS; i++) {
+        total += peh->clients[i].count;
+    }
+    return total;
+}
+
+/**
+ * The client returned from the call inside the engine. If this was the
+ * last client inside the engine, and the engine is scheduled for removal
+ * it should be safe to nuke the engine :)
+ *
+ * Only the last client leaving a slot needs to check, and whoever
+ * leaves last of them all will see all the slots at zero.
+ *
+ * @param engine the proxied engine
+ */
+static void release_engine_handle(proxied_engine_handle_t *engine) {
+    int count = ATOMIC_DECR(client_slot(engine));
+    assert(count >= 0);
+    if (count == 0) {
+        if (engine->state == STATE_STOPPING) {
+            maybe_start_engine_shutdown(engine);
+        } else if (engine->hibernate_drain) {
+            maybe_start_hibernation(engine);
+        }
+    }
+}
+#endif
+
+/**
+ * Returns engine handle for this connection.
+ * All access to underlying engine must go through this function, because
+ * we keep a counter of how many cookies that are currently calling into
+ * the engine..
+ *
+ * NOTE: this cannot ever return engine handle that's in STATE_STOPPED
+ * and if returns non-null it also prevents STATE_STOPPED to be
+ * reached until release_engine_handle is called that'll decrement
+ * clients counter. Here's why:
+ *
+ * Assume it returned non-null but engine's state is
+ * STATE_STOPPED. But that means state was changed after it was
+ * observed to be STATE_RUNNING in this function. And because we never
+ * change from running to stopped it changed twice. Because STATE_RUNNING was seen after incrementing clients count here's sequence of inter-dependendent events:
+ *
+ * - we bump clients count
+ *
+ * - we observe STATE_RUNNING (and that also implies didn't
+     have STATE_STOPPED & STATE_STOPPING in past because we don't
+     change from STOPPING/STOPPED back to RUNNING)
+ *
+ * - some other thread changes STATE_RUNNING to STATE_STOPPING
+ *
+ * - somebody sets STATE_STOPPED (see
+     maybe_start_engine_shutdown). But that implies that somebody
+     first observed STATE_STOPPING and _then_ observed clients ==
+     0. Which assuming nobody decrements it without first incrementing
+     it cannot happen because our bumped clients count prevents that.
+ *
+ * Q.E.D.
+ *
+ * The clients count is spread over CLIENT_SLOTS slots that
+ * maybe_start_engine_shutdown reads one at a time, which doesn't
+ * change the argument: a thread always bumps and drops the same slot,
+ * so no slot is ever below the number of its threads that are inside
+ * the engine. Our slot is read after STATE_STOPPING was observed, and
+ * thus after our bump, so it reads at least 1 and the sum can't be 0.
+ *
+ * With ENABLE_EPOCH_HANDLES STATE_STOPPED may well be reached while
+ * we're inside the engine, but shutdown_bucket doesn't destroy
+ * the engine before we're done: we announce our epoch and then
+ * observe STATE_RUNNING, while STATE_STOPPING is set before
+ * shutdown_bucket advances the epoch and waits for older readers.
+ * Either we see the new state, or it sees our announcement.
+ */
+static proxied_engine_handle_t *get_engine_handle(ENGINE_HANDLE *h,
+                                                  const void *cookie) {
+    struct bucket_engine *e = (struct bucket_engine*)h;
+    engine_specific_t *es;
+    es = e->upstream_server->cookie->get_engine_specific(cookie);
+    assert(es);
+
+    proxied_engine_handle_t *peh = es->peh;
+    if (!peh) {
+        if (e->default_engine.pe.v0) {
+            peh = &e->default_engine;
+        } else {
+            return NULL;
+        }
+    }
+
+    enter_engine_handle(peh);
+
+    if (peh->state != STATE_RUNNING) {
+        release_engine_handle(peh);
+        peh = NULL;
+    } else if (e->hibernate_after != 0) {
+        touch_bucket(peh);
+    }
+
+    return peh;
+}
+
+/**
+ * Returns engine handle for this connection.
+ * All access to underlying engine must go through this function, because
+ * we keep a counter of how many cookies that are currently calling into
+ * the engine..
+ */
+static proxied_engine_handle_t *try_get_engine_handle(ENGINE_HANDLE *h,
+                                                      const void *cookie) {
+    struct bucket_engine *e = (struct bucket_engine*)h;
+    engine_specific_t *es;
+    es = e->upstream_server->cookie->get_engine_specific(cookie);
+    if (es == NULL || es->peh == NULL) {
+        return NULL;
+    }
+    proxied_engine_handle_t *peh = es->peh;
+    proxied_engine_handle_t *ret = peh;
+
+    enter_engine_handle(peh);
+    if (peh->state != STATE_RUNNING) {
+        release_engine_handle(peh);
+        ret = NULL;
+    }
+
+    return ret;
+}
+
+/**
+ * get_engine_handle for the ops that count against the limits of the
+ * bucket. If the op may not go ahead (or there's no bucket) NULL is
+ * returned, and the error to return in *ret (see throttle_op and
+ * enter_inflight). Release the handle with
+ * release_limited_engine_handle.
+ */
+static proxied_engine_handle_t *get_limited_engine_handle(ENGINE_HANDLE *h,
+                                                          const void *cookie,
+                                                          ENGINE_ERROR_CODE *ret) {
+    proxied_engine_handle_t *peh = get_engine_handle(h, cookie);
+    if (peh == NULL) {
+        *ret = ENGINE_DISCONNECT;
+        engine_specific_t *es;
+        es = bucket_engine.upstream_server->cookie->get_engine_specific(cookie);
+        if (es != NULL) {
+            if (bucket_engine.fair.threshold != 0) {
+                fair_abandon(es);
+            }
+            /* The bucket is going away with its max_inflight slots, so
+             * don't take the grant along to the next bucket */
+            es->granted = false;
+            es->inflight = false;
+        }
+        return NULL;
+    }
+
+    bucket_limit_t *limit = peh->limit;
+    if (limit == NULL && bucket_engine.fair.threshold == 0) {
+        return peh;
+    }
+
+    engine_specific_t *es;
+    es = bucket_engine.upstream_server->cookie->get_engine_specific(cookie);
+    assert(es);
+    if (limit != NULL &&
+        ((*ret = throttle_op(limit, es, cookie)) != ENGINE_SUCCESS ||
+         (*ret = enter_inflight(limit, es, cookie)) != ENGINE_SUCCESS)) {
+        release_engine_handle(peh);
+        return NULL;
+    }
+    if (bucket_engine.fair.threshold != 0 &&
+        (*ret = fair_enter(peh, es, cookie)) != ENGINE_SUCCESS) {
+        /* The op keeps its max_inflight slot, and it has paid for
+         * the ops limit already */
+        if (limit != NULL) {
+            es->throttled = true;
+        }
+        release_engine_handle(peh);
+        return NULL;
+    }
+    return peh;
+}
+
+/**
+ * The op got its handle from get_limited_engine_handle and returned
+ * from the engine.
+ */
+static void release_limited_engine_handle(proxied_engine_handle_t *peh,
+                                          const void *cookie) {
+    bucket_limit_t *limit = peh->limit;
+    if (limit != NULL || bucket_engine.fair.threshold != 0) {
+        engine_specific_t *es;
+        es = bucket_engine.upstream_server->cookie->get_engine_specific(cookie);
+        if (limit != NULL && es->inflight) {
+            leave_inflight(limit, es);
+        }
+        if (es->fair) {
+            fair_leave(es);
+        }
+    }
+    release_engine_handle(peh);
+}
+
+/*
+ * The engine_specific_t are allocated for every connection and freed
+ * when it disconnects, so they're cached in per-thread magazines
+ * (Bonwick & Adams, "Magazines and Vmem"). A thread allocates from
+ * and frees to its own two magazines without any locking, and only
+ * goes to the depot to trade a whole magazine when both are empty (or
+ * full). That also balances the objects between the threads that
+ * mostly free and those that mostly allocate.
+ */
+
+static pthread_key_t es_cache_key;
+static pthread_once_t es_cache_once = PTHREAD_ONCE_INIT;
+static __thread es_thread_cache_t *my_es_cache;
+
+static es_magazine_t *new_es_magazine(void) {
+    es_magazine_t *m = calloc(1, sizeof(*m));
+    assert(m);
+    return m;
+}
+
+/**
+ * Give the magazines of an exiting thread to the depot.
+ */
+static void es_cache_thread_exit(void *arg) {
+    es_thread_cache_t *tc = arg;
+    es_magazine_t *mags[2] = { tc->loaded, tc->previous };
+
+    must_lock(&bucket_engine.es_depot.mutex);
+    for (int i = 0; i < 2; i++) {
+        es_magazine_t *m = mags[i];
+        if (m->count > 0 && bucket_engine.es_depot.nfull < ES_DEPOT_MAX) {
+            m->next = bucket_engine.es_depot.full;
+            bucket_engine.es_depot.full = m;
+            ++bucket_engine.es_depot.nfull;
+        } else {
+            while (m->count > 0) {
+                free(m->objs[--m->count]);
+            }
+            m->next = bucket_engine.es_depot.empty;
+            bucket_engine.es_depot.empty = m;
+        }
+    }
+    bucket_engine.es_depot.allocs += tc->allocs;
+    bucket_engine.es_depot.thread_hits += tc->thread_hits;
+    bucket_engine.es_depot.depot_hits += tc->depot_hits;
+    if (tc->prev != NULL) {
+        tc->prev->next = tc->next;
+    } else {
+        bucket_engine.es_depot.threads = tc->next;
+    }
+    if (tc->next != NULL) {
+        tc->next->prev = tc->prev;
+    }
+    must_unlock(&bucket_engine.es_depot.mutex);
+    free(tc);
+}
+
+static void es_cache_init_key(void) {
+    int r = pthread_key_create(&es_cache_key, es_cache_thread_exit);
+    assert(r == 0);
+}
+
+static es_thread_cache_t *get_es_cache(void) {
+    es_thread_cache_t *tc = my_es_cache;
+    if (tc == NULL) {
+        pthread_once(&es_cache_once, es_cache_init_key);
+        tc = calloc(1, sizeof(*tc));
+        assert(tc);
+        tc->loaded = new_es_magazine();
+        tc->previous = new_es_magazine();
+        must_lock(&bucket_engine.es_depot.mutex);
+        tc->next = bucket_engine.es_depot.threads;
+        if (tc->next != NULL) {
+            tc->next->prev = tc;
+        }
+        bucket_engine.es_depot.threads = tc;
+        must_unlock(&bucket_engine.es_depot.mutex);
+        pthread_setspecific(es_cache_key, tc);
+        my_es_cache = tc;
+    }
+    return tc;
+}
+
+/**
+ * Allocate a zeroed engine_specific_t.
+ */
+static engine_specific_t *alloc_engine_specific(void) {
+    es_thread_cache_t *tc = get_es_cache();
+    engine_specific_t *es = NULL;
+
+    ++tc->allocs;
+    if (tc->loaded->count == 0 && tc->previous->count > 0) {
+        es_magazine_t *m = tc->loaded;
+        tc->loaded = tc->previous;
+        tc->previous = m;
+    }
+    if (tc->loaded->count > 0) {
+        ++tc->thread_hits;
+        es = tc->loaded->objs[--tc->loaded->count];
+    } else {
+        /* Both are empty: swap one for a full magazine */
+        must_lock(&bucket_engine.es_depot.mutex);
+        es_magazine_t *m = bucket_engine.es_depot.full;
+        if (m != NULL) {
+            bucket_engine.es_depot.full = m->next;
+            --bucket_engine.es_depot.nfull;
+            tc->previous->next = bucket_engine.es_depot.empty;
+            bucket_engine.es_depot.empty = tc->previous;
+            tc->previous = tc->loaded;
+            tc->loaded = m;
+        }
+        must_unlock(&bucket_engine.es_depot.mutex);
+        if (m != NULL) {
+            ++tc->depot_hits;
+            es = tc->loaded->objs[--tc->loaded->count];
+        }
+    }
+
+    if (es == NULL) {
+        es = calloc(1, sizeof(*es));
+        assert(es);
+    } else {
+        memset(es, 0, sizeof(*es));
+    }
+    return es;
+}
+
+/**
+ * Return an engine_specific_t to the calling thread's magazines. Debug
+ * builds poison it first, like release_memory does.
+ */
+static void free_engine_specific(engine_specific_t *es) {
+#ifndef NDEBUG
+    memset(es, 0xae, sizeof(*es));
+#endif
+    es_thread_cache_t *tc = get_es_cache();
+
+    if (tc->loaded->count == ES_MAGAZINE_SIZE &&
+        tc->previous->count < ES_MAGAZINE_SIZE) {
+        es_magazine_t *m = tc->loaded;
+        tc->loaded = tc->previous;
+        tc->previous = m;
+    }
+    if (tc->loaded->count == ES_MAGAZINE_SIZE) {
+        /* Both are full: hand one to the depot for an empty one */
+        must_lock(&bucket_engine.es_depot.mutex);
+        if (bucket_engine.es_depot.nfull >= ES_DEPOT_MAX) {
+            must_unlock(&bucket_engine.es_depot.mutex);
+            free(es);
+            return;
+        }
+        tc->previous->next = bucket_engine.es_depot.full;
+        bucket_engine.es_depot.full = tc->previous;
+        ++bucket_engine.es_depot.nfull;
+        tc->previous = tc->loaded;
+        tc->loaded = bucket_engine.es_depot.empty;
+        if (tc->loaded != NULL) {
+            bucket_engine.es_depot.empty = tc->loaded->next;
+        }
+        must_unlock(&bucket_engine.es_depot.mutex);
+        if (tc->loaded == NULL) {
+            tc->loaded = new_es_magazine();
+        }
+    }
+    tc->loaded->objs[tc->loaded->count++] = es;
+}
+
+/**
+ * Free the magazines in the depot (the threads keep theirs).
+ */
+static void release_es_depot(void) {
+    must_lock(&bucket_engine.es_depot.mutex);
+    es_magazine_t *lists[2] = { bucket_engine.es_depot.full,
+                                bucket_engine.es_depot.empty };
+    for (int i = 0; i < 2; i++) {
+        es_magazine_t *m = lists[i];
+        while (m != NULL) {
+            es_magazine_t *next = m->next;
+            while (m->count > 0) {
+                free(m->objs[--m->count]);
+            }
+            free(m);
+            m = next;
+        }
+    }
+    bucket_engine.es_depot.full = bucket_engine.es_depot.empty = NULL;
+    bucket_engine.es_depot.nfull = 0;
+    must_unlock(&bucket_engine.es_depot.mutex);
+}
+
+/**
+ * Create an engine specific section for the cookie
+ */
+static void create_engine_specific(struct bucket_engine *e,
+                                   const void *cookie) {
+    engine_specific_t *es;
+    es = e->upstream_server->cookie->get_engine_specific(cookie);
+    assert(es == NULL);
+    es = alloc_engine_specific();
+    es->reserved = ES_CONNECTED_FLAG;
+    e->upstream_server->cookie->store_engine_specific(cookie, es);
+}
+
+/**
+ * Set the engine handle for a cookie (create if it doesn't exist)
+ */
+static proxied_engine_handle_t* set_engine_handle(ENGINE_HANDLE *h,
+                                                  const void *cookie,
+                                                  proxied_engine_handle_t *peh) {
+    (void)h;
+    engine_specific_t *es;
+    es = bucket_engine.upstream_server->cookie->get_engine_specific(cookie);
+    assert(es);
+
+    /* we cannot switch bucket for connection that's reserved. With
+     * current code at least. */
+    assert((es->reserved & ~ES_CONNECTED_FLAG) == 0);
+
+    proxied_engine_handle_t *old = es->peh;
+    // In with the new
+    es->peh = retain_handle(peh);
+
+    // out with the old (this may be NULL if we did't have an associated
+    // strucure...
+    release_handle(old);
+    return es->peh;
+}
+
+/**
+ * Helper function to convert an ENGINE_HANDLE* to a bucket engine pointer
+ * without a cast
+ */
+static inline struct bucket_engine* get_handle(ENGINE_HANDLE* handle) {
+    return (struct bucket_engine*)handle;
+}
+
+/**
+ * Implementation of the the get_info function in the engine interface
+ */
+static const engine_info* bucket_get_info(ENGINE_HANDLE* handle) {
+    return &(get_handle(handle)->info.engine_info);
+}
+
+/***********************************************************
+ **       Implementation of functions used by genhash     **
+ **********************************************************/
+
+/**
+ * Function used by genhash to check if two keys differ
+ */
+static int my_hash_eq(const void *k1, size_t nkey1,
+                      const void *k2, size_t nkey2) {
+    return nkey1 == nkey2 && memcmp(k1, k2, nkey1) == 0;
+}
+
+/**
+ * Function used by genhash to create a copy of a key
+ */
+static void* hash_strdup(const void *k, size_t nkey) {
+    void *rv = calloc(nkey, 1);
+    assert(rv);
+    memcpy(rv, k, nkey);
+    return rv;
+}
+
+/**
+ * Function used by genhash to create a copy of the value (this is
+ * the proxied engine handle). We don't copy that value, instead
+ * we increase the reference count.
+ */
+static void* refcount_dup(const void* ob, size_t vlen) {
+    (void)vlen;
+    proxied_engine_handle_t *peh = (proxied_engine_handle_t *)ob;
+    assert(peh);
+    int count = ATOMIC_INCR(&peh->refcount);
+    assert(count > 0);
+    return (void*)ob;
+}
+
+/**
+ * Function used by genhash to release an object.
+ */
+static void engine_hash_free(void* ob) {
+    proxied_engine_handle_t *peh = (proxied_engine_handle_t *)ob;
+    assert(peh);
+    peh->state = STATE_NULL;
+    release_handle(peh);
+}
+
+/**
+ * Get the module for a shared object, loading it and resolving
+ * create_instance the first time it's used.
+ *
+ * @param soname The name of the shared object to load
+ * @return The module, or NULL if it couldn't be loaded
+ */
+static engine_module_t *get_engine_module(const char *soname) {
+    const char *name = soname ? soname : "self";
+
+    must_lock(&bucket_engine.modules.mutex);
+    engine_module_t *m = bucket_engine.modules.list;
+    while (m != NULL && strcmp(m->name, name) != 0) {
+        m = m->next;
+    }
+    if (m != NULL) {
+        must_unlock(&bucket_engine.modules.mutex);
+        return m;
+    }
+
+    /* Maybe it's known under another name */
+    const char *path = name;
+#ifdef HAVE_REALPATH
+    char pathbuf[PATH_MAX];
+    if (soname != NULL && realpath(soname, pathbuf) != NULL) {
+        path = pathbuf;
+    }
+#endif
+    m = bucket_engine.modules.list;
+    while (m != NULL && strcmp(m->path, path) != 0) {
+        m = m->next;
+    }
+    if (m != NULL) {
+        must_unlock(&bucket_engine.modules.mutex);
+        return m;
+    }
+
+    /* Hack to remove the warning from C99 */
+    union my_hack {
+        CREATE_INSTANCE create;
+        void* voidptr;
+    } my_create = {.create = NULL };
+
+    void *handle = dlopen(soname, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        const char *msg = dlerror();
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to open library \"%s\": %s\n",
+                    soname ? soname : "self",
+                    msg ? msg : "unknown error");
+        must_unlock(&bucket_engine.modules.mutex);
+        return NULL;
+    }
+
+    void *symbol = dlsym(handle, "create_instance");
+    if (symbol == NULL) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                "Could not find symbol \"create_instance\" in %s: %s\n",
+                soname ? soname : "self",
+                dlerror());
+        dlclose(handle);
+        must_unlock(&bucket_engine.modules.mutex);
+        return NULL;
+    }
+    my_create.voidptr = symbol;
+
+    m = calloc(1, sizeof(*m));
+    assert(m);
+    m->path = strdup(path);
+    m->name = strdup(name);
+    assert(m->path && m->name);
+    m->dlhandle = handle;
+    m->create_instance = my_create.create;
+    m->next = bucket_engine.modules.list;
+    bucket_engine.modules.list = m;
+    must_unlock(&bucket_engine.modules.mutex);
+
+    return m;
+}
+
+/**
+ * Create an engine from a loaded module.
+ *
+ * @return the new (uninitialized) instance, or NULL if it failed
+ */
+static ENGINE_HANDLE *create_engine_instance(engine_module_t *m) {
+    ENGINE_HANDLE *engine = NULL;
+
+    /* request a instance with protocol version 1 */
+    ENGINE_ERROR_CODE error = m->create_instance(1,
+                                                 bucket_engine.get_server_api,
+                                                 &engine);
+
+    if (error != ENGINE_SUCCESS || engine == NULL) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to create instance. Error code: %d\n", error);
+        return NULL;
+    }
+    return engine;
+}
+
+/**
+ * Try to load a shared object and create an engine. Only the first
+ * bucket using a shared object loads it (see get_engine_module).
+ *
+ * @param module The module the engine was created from (OUT). The
+ *               caller is responsible for calling release_engine_module
+ *               if the function succeeds.
+ * @param soname The name of the shared object to load
+ * @return A pointer to the created instance, or NULL if anything
+ *         failed.
+ */
+static ENGINE_HANDLE *load_engine(engine_module_t **module, const char *soname) {
+    engine_module_t *m = get_engine_module(soname);
+    if (m == NULL) {
+        return NULL;
+    }
+
+    ENGINE_HANDLE *engine = create_engine_instance(m);
+    if (engine == NULL) {
+        return NULL;
+    }
+
+    ATOMIC_INCR(&m->instances);
+    *module = m;
+    return engine;
+}
+
+/**
+ * A handle created by load_engine is gone.
+ */
+static void release_engine_module(engine_module_t *m) {
+    int count = ATOMIC_DECR(&m->instances);
+    assert(count >= 0);
+}
+
+/***********************************************************
+ **  The pool of spare engines                            **
+ **********************************************************/
+
+static void destroy_spare_engine(spare_engine_t *spare) {
+    spare->pe.v1->destroy(spare->pe.v0, false);
+    release_engine_module(spare->module);
+    free(spare);
+}
+
+/**
+ * Load and initialize an engine the way create_bucket would for
+ * default_engine_path and default_bucket_config.
+ *
+ * @return the spare, or NULL if the engine failed to start
+ */
+static spare_engine_t *create_spare_engine(struct bucket_engine *e) {
+    spare_engine_t *spare = calloc(1, sizeof(*spare));
+    assert(spare);
+
+    spare->pe.v0 = load_engine(&spare->module, e->default_engine_path);
+    if (spare->pe.v0 == NULL) {
+        free(spare);
+        return NULL;
+    }
+    assert(spare->pe.v0->interface == 1);
+
+    initializing_spare = spare;
+    ENGINE_ERROR_CODE rv = spare->pe.v1->initialize(spare->pe.v0,
+                                                    e->default_bucket_config);
+    initializing_spare = NULL;
+    if (rv != ENGINE_SUCCESS) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to initialize spare engine. Error code: %d\n", rv);
+        destroy_spare_engine(spare);
+        return NULL;
+    }
+    return spare;
+}
+
+/**
+ * Keep spares.size engines ready in the pool, creating a new one
+ * every time one is claimed.
+ */
+static void *spare_engine_filler(void *arg) {
+    struct bucket_engine *e = arg;
+
+    must_lock(&e->spares.mutex);
+    while (e->spares.running) {
+        if ((size_t)e->spares.available >= e->spares.size) {
+            pthread_cond_wait(&e->spares.cond, &e->spares.mutex);
+            continue;
+        }
+        must_unlock(&e->spares.mutex);
+        spare_engine_t *spare = create_spare_engine(e);
+        must_lock(&e->spares.mutex);
+
+        if (spare == NULL) {
+            /* Don't keep retrying an engine that won't start. The
+             * buckets are created the slow way instead */
+            logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Giving up on filling the spare engine pool\n");
+            while (e->spares.running) {
+                pthread_cond_wait(&e->spares.cond, &e->spares.mutex);
+            }
+        } else {
+            spare->next = e->spares.list;
+            e->spares.list = spare;
+            ++e->spares.available;
+        }
+    }
+    must_unlock(&e->spares.mutex);
+    return NULL;
+}
+
+static void start_spare_engine_filler(struct bucket_engine *e) {
+    if (e->spares.size == 0 || e->default_engine_path == NULL ||
+        e->default_bucket_config == NULL) {
+        e->spares.size = 0;
+        return;
+    }
+
+    e->spares.running = true;
+    if (pthread_create(&e->spares.filler, NULL,
+                       spare_engine_filler, e) != 0) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to start the spare engine thread\n");
+        e->spares.running = false;
+        e->spares.size = 0;
+    }
+}
+
+/**
+ * Stop the filler and destroy the spares nobody claimed.
+ */
+static void stop_spare_engine_filler(struct bucket_engine *e) {
+    must_lock(&e->spares.mutex);
+    bool running = e->spares.running;
+    e->spares.running = false;
+    pthread_cond_broadcast(&e->spares.cond);
+    must_unlock(&e->spares.mutex);
+
+    if (running) {
+        pthread_join(e->spares.filler, NULL);
+    }
+
+    spare_engine_t *spare = e->spares.list;
+    while (spare != NULL) {
+        spare_engine_t *next = spare->next;
+        destroy_spare_engine(spare);
+        spare = next;
+    }
+    e->spares.list = NULL;
+    e->spares.available = 0;
+    e->spares.claimed = e->spares.missed = 0;
+}
+
+/**
+ * Give a bucket being created a spare engine, if it's to be created
+ * with the engine and config the pool was filled with. Only the name
+ * is bound; the engine is already initialized.
+ *
+ * @return true if peh got its engine from the pool
+ */
+static bool claim_spare_engine(struct bucket_engine *e,
+                               proxied_engine_handle_t *peh,
+                               const char *path, const char *config) {
+    if (e->spares.size == 0 || path == NULL ||
+        strcmp(path, e->default_engine_path) != 0 ||
+        strcmp(config ? config : "", e->default_bucket_config) != 0) {
+        return false;
+    }
+
+    must_lock(&e->spares.mutex);
+    spare_engine_t *spare = e->spares.list;
+    if (spare != NULL) {
+        e->spares.list = spare->next;
+        --e->spares.available;
+        ++e->spares.claimed;
+        /* have the filler replace it */
+        pthread_cond_signal(&e->spares.cond);
+    } else {
+        ++e->spares.missed;
+    }
+    must_unlock(&e->spares.mutex);
+
+    if (spare == NULL) {
+        return false;
+    }
+
+    peh->pe = spare->pe;
+    peh->module = spare->module;
+    if (spare->wants_disconnects) {
+        peh->cb = spare->cb;
+        peh->cb_data = spare->cb_data;
+        peh->wants_disconnects = true;
+    }
+    free(spare);
+    return true;
+}
+
+/***********************************************************
+ **  Hibernation of idle buckets                          **
+ **********************************************************/
+
+struct hibernate_context {
+    proxied_engine_handle_t **handles;
+    int count;
+    rel_time_t now;
+};
+
+/**
+ * The number of references to a bucket nobody is connected to: the
+ * engines table's, and the default named bucket cache's (see
+ * cache_default_named).
+ */
+static int idle_refcount(proxied_engine_handle_t *peh) {
+    return bucket_engine.default_named == peh ? 2 : 1;
+}
+
+/**
+ * A "genhash iterator" picking the buckets that nobody is connected
+ * to and that haven't been used for hibernate_after seconds. They're
+ * moved to STATE_HIBERNATING right away, so nobody can delete them or
+ * get into them while we decide.
+ */
+static void collect_idle_bucket(const void* key, size_t nkey,
+                                const void *val, size_t nval,
+                                void *args) {
+    (void)key; (void)nkey; (void)nval;
+    struct hibernate_context *ctx = args;
+    proxied_engine_handle_t *peh = (proxied_engine_handle_t *)val;
+    rel_time_t last_active = peh->last_active;
+    if (peh->state == STATE_RUNNING && peh->refcount == idle_refcount(peh) &&
+        ctx->now > last_active &&
+        ctx->now - last_active >= bucket_engine.hibernate_after &&
+        ATOMIC_CAS(&peh->state, STATE_RUNNING, STATE_HIBERNATING)) {
+        ctx->handles[ctx->count++] = peh;
+    }
+}
+
+/**
+ * Destroy the engines of the idle buckets, keeping the buckets in the
+ * engines table as STATE_HIBERNATED with the config to bring them back
+ * with (see find_bucket_awake).
+ *
+ * A client may have found the bucket in find_bucket just before we
+ * changed the state. Those are all done (and have bumped the
+ * refcount) once epoch_synchronize returns, and everybody after them
+ * sees that the bucket isn't running. The clients inside the engine
+ * are waited for the same way the deleted buckets wait for them: the
+ * last one to leave has a shutdown worker destroy the engine (see
+ * maybe_start_hibernation), so the reaper never waits for them.
+ */
+static void hibernate_idle_buckets(struct bucket_engine *e) {
+    struct hibernate_context ctx = { .count = 0, .now = get_current_time() };
+
+    lock_engines();
+    ctx.handles = calloc(genhash_size(e->engines) + 1,
+                         sizeof(ctx.handles[0]));
+    assert(ctx.handles);
+    genhash_iter(e->engines, collect_idle_bucket, &ctx);
+    unlock_engines();
+
+    if (ctx.count > 0) {
+        epoch_synchronize(EPOCH_REGISTRY);
+    }
+
+    for (int i = 0; i < ctx.count; i++) {
+        proxied_engine_handle_t *peh = ctx.handles[i];
+        if (peh->refcount != idle_refcount(peh)) {
+            /* Somebody got to it after all */
+            lock_engines();
+            peh->state = STATE_RUNNING;
+            wake_bucket_waiters_UNLOCKED(e, peh);
+            unlock_engines();
+            continue;
+        }
+
+        must_lock(&e->hibernation.mutex);
+        ++e->hibernation.pending;
+        must_unlock(&e->hibernation.mutex);
+        peh->hibernate_drain = 1;
+        maybe_start_hibernation(peh);
+    }
+    free(ctx.handles);
+}
+
+/**
+ * Queue the hibernation of a bucket the reaper picked once there are
+ * no clients inside the engine. Called by the reaper, and by every
+ * client leaving the engine while hibernate_drain is set. Whoever
+ * sees the last one gone queues the job: the reaper sets the flag
+ * before it counts, and the clients leave before they check it. Only
+ * one of them gets to clear it.
+ *
+ * With ENABLE_EPOCH_HANDLES the job waits for the clients instead
+ * (see run_hibernate_job).
+ */
+static void maybe_start_hibernation(proxied_engine_handle_t *peh) {
+#ifndef ENABLE_EPOCH_HANDLES
+    if (count_clients(peh) != 0) {
+        return;
+    }
+#endif
+    if (ATOMIC_CAS(&peh->hibernate_drain, 1, 0)) {
+        must_lock(&bucket_engine.shutdown.mutex);
+        peh->shutdown_hibernate = true;
+        schedule_shutdown_job_UNLOCKED(peh);
+        must_unlock(&bucket_engine.shutdown.mutex);
+    }
+}
+
+/**
+ * Destroy the engine of a bucket the reaper picked (see
+ * hibernate_idle_buckets). Run by a shutdown worker once the clients
+ * left the engine.
+ */
+static void run_hibernate_job(proxied_engine_handle_t *peh) {
+    struct bucket_engine *e = &bucket_engine;
+#ifdef ENABLE_EPOCH_HANDLES
+    /* Wait for the clients that were let in before the state changed */
+    epoch_synchronize(EPOCH_HANDLES);
+#endif
+    logger->log(EXTENSION_LOG_INFO, NULL,
+                "Hibernating \"%s\"\n", peh->name);
+    peh->pe.v1->destroy(peh->pe.v0, false);
+
+    lock_engines();
+    peh->pe.v0 = NULL;
+    /* the engine registers it again when it's woken up */
+    peh->wants_disconnects = false;
+    peh->state = STATE_HIBERNATED;
+    wake_bucket_waiters_UNLOCKED(e, peh);
+    unlock_engines();
+
+    must_lock(&e->hibernation.mutex);
+    ++e->hibernation.hibernated;
+    ++e->hibernation.hibernations;
+    if (--e->hibernation.pending == 0) {
+        pthread_cond_broadcast(&e->hibernation.cond);
+    }
+    must_unlock(&e->hibernation.mutex);
+}
+
+/**
+ * Create and initialize the engine of a bucket in STATE_WAKING again,
+ * from the module and config it was created with. Called without the
+ * engines lock, since initializing an engine may take a while.
+ *
+ * @return true if the engine is ready
+ */
+static bool wake_bucket(proxied_engine_handle_t *peh) {
+    logger->log(EXTENSION_LOG_INFO, NULL,
+                "Waking up \"%s\"\n", peh->name);
+    peh->pe.v0 = create_engine_instance(peh->module);
+    if (peh->pe.v0 == NULL) {
+        return false;
+    }
+    assert(peh->pe.v0->interface == 1);
+
+    /* The engine registers its callbacks from initialize, and
+     * bucket_register_callback finds the bucket by its engine */
+    if (peh->pe.v1->initialize(peh->pe.v0, peh->config) != ENGINE_SUCCESS) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to wake up \"%s\"\n", peh->name);
+        peh->pe.v1->destroy(peh->pe.v0, false);
+        peh->pe.v0 = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Search for a named bucket like find_bucket, but bring the bucket
+ * back if it's hibernated. The caller is blocked while the engine is
+ * initialized (or while somebody else does it).
+ */
+static proxied_engine_handle_t *find_bucket_awake(const char *name) {
+    struct bucket_engine *e = &bucket_engine;
+    proxied_engine_handle_t *peh = find_bucket(name);
+    if (peh != NULL || e->hibernate_after == 0) {
+        return peh;
+    }
+
+    lock_engines();
+    while ((peh = find_bucket_inner(name)) != NULL) {
+        if (peh->state == STATE_HIBERNATED) {
+            /* Nobody can delete it while it's waking up */
+            peh->state = STATE_WAKING;
+            unlock_engines();
+            bool woken = wake_bucket(peh);
+            lock_engines();
+            if (woken) {
+                /* make the engine visible before the state */
+                ATOMIC_CAS(&peh->state, STATE_WAKING, STATE_RUNNING);
+                touch_bucket(peh);
+            } else {
+                peh->state = STATE_HIBERNATED;
+            }
+            wake_bucket_waiters_UNLOCKED(e, peh);
+
+            must_lock(&e->hibernation.mutex);
+            if (woken) {
+                --e->hibernation.hibernated;
+                ++e->hibernation.wakeups;
+            }
+            must_unlock(&e->hibernation.mutex);
+            if (!woken) {
+                peh = NULL;
+                break;
+            }
+        } else if (peh->state == STATE_HIBERNATING ||
+                   peh->state == STATE_WAKING) {
+            wait_for_bucket_UNLOCKED(e, peh);
+        } else {
+            break;
+        }
+    }
+    peh = retain_handle(peh);
+    unlock_engines();
+    return peh;
+}
+
+/**
+ * Delete a hibernated bucket. Its engine is already destroyed, so it
+ * only has to be unlinked; a bucket on its way in or out of
+ * hibernation is waited for first.
+ *
+ * @return true if the bucket was hibernated and is now gone
+ */
+static bool delete_hibernated_bucket(const char *name) {
+    struct bucket_engine *e = &bucket_engine;
+    if (e->hibernate_after == 0) {
+        return false;
+    }
+
+    lock_engines();
+    proxied_engine_handle_t *peh;
+    while ((peh = find_bucket_inner(name)) != NULL &&
+           (peh->state == STATE_HIBERNATING || peh->state == STATE_WAKING)) {
+        wait_for_bucket_UNLOCKED(e, peh);
+    }
+    if (peh == NULL || peh->state != STATE_HIBERNATED) {
+        unlock_engines();
+        return false;
+    }
+    logger->log(EXTENSION_LOG_INFO, NULL,
+                "Unlink hibernated \"%s\" from engine table\n", peh->name);
+    /* Our own reference keeps the handle alive after we drop the one
+     * held by the engines table */
+    int count = ATOMIC_INCR(&peh->refcount);
+    assert(count > 1);
+    int upd = genhash_delete_all(e->engines, peh->name, peh->name_len);
+    assert(upd == 1);
+    publish_registry_UNLOCKED(e);
+    unlock_engines();
+
+    must_lock(&e->hibernation.mutex);
+    --e->hibernation.hibernated;
+    must_unlock(&e->hibernation.mutex);
+
+    must_lock(&e->shutdown.mutex);
+    ++e->shutdown.pending_release;
+    must_unlock(&e->shutdown.mutex);
+    /* The last one to let go frees it */
+    release_handle(peh);
+    return true;
+}
+
+/**
+ * Wake up a bucket for the clients that were told to wait (see
+ * queue_bucket_wake), and let them all retry. Run by a shutdown
+ * worker, with the reference queue_bucket_wake took.
+ */
+static void run_bucket_wake_job(proxied_engine_handle_t *peh) {
+    struct bucket_engine *e = &bucket_engine;
+    release_handle(find_bucket_awake(peh->name));
+
+    lock_engines();
+    parked_op_t *waiters = peh->wake_waiters;
+    peh->wake_waiters = NULL;
+    peh->wake_queued = false;
+    unlock_engines();
+    notify_granted(waiters);
+    release_handle(peh);
+
+    must_lock(&e->hibernation.mutex);
+    if (--e->hibernation.wakers == 0) {
+        pthread_cond_broadcast(&e->hibernation.cond);
+    }
+    must_unlock(&e->hibernation.mutex);
+}
+
+/**
+ * If the named bucket is hibernated (or on its way in or out of it),
+ * park the cookie on it and have a shutdown worker wake it up. Every
+ * client selecting the bucket meanwhile waits for the same job, so a
+ * burst of them costs one wake and no threads of their own.
+ *
+ * @return true if the cookie is notified when the wake is done
+ */
+static bool queue_bucket_wake(const char *name, const void *cookie) {
+    struct bucket_engine *e = &bucket_engine;
+    if (e->hibernate_after == 0) {
+        return false;
+    }
+
+    lock_engines();
+    proxied_engine_handle_t *peh = find_bucket_inner(name);
+    if (peh == NULL || (peh->state != STATE_HIBERNATING &&
+                        peh->state != STATE_HIBERNATED &&
+                        peh->state != STATE_WAKING)) {
+        unlock_engines();
+        return false;
+    }
+    parked_op_t *op = malloc(sizeof(*op));
+    assert(op);
+    op->cookie = cookie;
+    op->es = NULL;
+    op->since = now_usec();
+    op->next = peh->wake_waiters;
+    peh->wake_waiters = op;
+    bool start = !peh->wake_queued;
+    if (start) {
+        peh->wake_queued = true;
+        /* The job's reference, so the handle outlives a delete */
+        ATOMIC_INCR(&peh->refcount);
+        must_lock(&e->hibernation.mutex);
+        ++e->hibernation.wakers;
+        must_unlock(&e->hibernation.mutex);
+    }
+    unlock_engines();
+
+    if (start) {
+        must_lock(&e->shutdown.mutex);
+        peh->shutdown_wake = true;
+        /* The handle can only be queued once. A queued hibernation
+         * queues the wake when a worker picks it up */
+        if (!peh->shutdown_hibernate) {
+            schedule_shutdown_job_UNLOCKED(peh);
+        }
+        must_unlock(&e->shutdown.mutex);
+    }
+    return true;
+}
+
+/**
+ * Look for idle buckets once a second.
+ */
+static void *hibernation_reaper(void *arg) {
+    struct bucket_engine *e = arg;
+
+    must_lock(&e->hibernation.mutex);
+    while (e->hibernation.running) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        struct timespec ts = { .tv_sec = tv.tv_sec + 1,
+                               .tv_nsec = tv.tv_usec * 1000 };
+        pthread_cond_timedwait(&e->hibernation.cond, &e->hibernation.mutex,
+                               &ts);
+        if (!e->hibernation.running) {
+            break;
+        }
+        must_unlock(&e->hibernation.mutex);
+        hibernate_idle_buckets(e);
+        must_lock(&e->hibernation.mutex);
+    }
+    must_unlock(&e->hibernation.mutex);
+    return NULL;
+}
+
+static void start_hibernation(struct bucket_engine *e) {
+    if (e->hibernate_after == 0) {
+        return;
+    }
+
+    e->hibernation.running = true;
+    if (pthread_create(&e->hibernation.reaper, NULL,
+                       hibernation_reaper, e) != 0) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to start the hibernation thread\n");
+        e->hibernation.running = false;
+        e->hibernate_after = 0;
+    }
+}
+
+/**
+ * Stop the reaper and wait for the buckets being woken up in the
+ * background.
+ */
+static void stop_hibernation(struct bucket_engine *e) {
+    must_lock(&e->hibernation.mutex);
+    bool running = e->hibernation.running;
+    e->hibernation.running = false;
+    pthread_cond_broadcast(&e->hibernation.cond);
+    while (e->hibernation.wakers > 0 || e->hibernation.pending > 0) {
+        pthread_cond_wait(&e->hibernation.cond, &e->hibernation.mutex);
+    }
+    must_unlock(&e->hibernation.mutex);
+
+    if (running) {
+        pthread_join(e->hibernation.reaper, NULL);
+    }
+    e->hibernation.hibernated = 0;
+    e->hibernation.hibernations = e->hibernation.wakeups = 0;
+}
+
+/***********************************************************
+ **  Implementation of callbacks from the memcached core  **
+ **********************************************************/
+
+/**
+ * Handle the situation when a connection is disconnected
+ * from the upstream. Propagate the command downstream and
+ * release the allocated resources for the connection
+ * unless it is reserved.
+ *
+ * @param cookie the cookie representing the connection that was closed
+ * @param type The kind of event (should be ON_DISCONNECT)
+ * @param event_data not used
+ * @param cb_data The bucket instance in use
+ */
+static void handle_disconnect(const void *cookie,
+                              ENGINE_EVENT_TYPE type,
+                              const void *event_data,
+                              const void *cb_data)
+{
+    assert(type == ON_DISCONNECT);
+    struct bucket_engine *e = (struct bucket_engine*)cb_data;
+    engine_specific_t *es;
+
+    logger->log(EXTENSION_LOG_DETAIL, cookie,
+                "Handle disconnect for: %p", cookie);
+    es = e->upstream_server->cookie->get_engine_specific(cookie);
+    if (es == NULL) {
+        logger->log(EXTENSION_LOG_DETAIL, cookie,
+                    "The connection is no longer known to bucket_engine: %p",
+                    cookie);
+        return;
+    }
+    assert(es);
+    /* It won't be back for the slots it holds or was handed */
+    fair_abandon(es);
+    inflight_abandon(es);
+
+    proxied_engine_handle_t *peh = es->peh;
+    if (peh == NULL) {
+        logger->log(EXTENSION_LOG_DETAIL, cookie,
+                    "The connection is not connected to an engine %p", cookie);
+        // Not attached to an engine!
+        // Release the allocated memory, and clear the cookie data
+        // upstream
+        assert(es->reserved == ES_CONNECTED_FLAG);
+        free_engine_specific(es);
+        e->upstream_server->cookie->store_engine_specific(cookie, NULL);
+        return;
+    }
+
+    proxied_engine_handle_t *cb_peh;
+    cb_peh = try_get_engine_handle((ENGINE_HANDLE *)e, cookie);
+
+    bool do_callback = cb_peh != NULL && peh->wants_disconnects;
+    if (do_callback) {
+        logger->log(EXTENSION_LOG_DETAIL, NULL,
+                    "Send disconnect call to engine %p cookie %p",
+                    peh, cookie);
+        peh->cb(cookie, type, event_data, peh->cb_data);
+    }
+
+    if (cb_peh != NULL) {
+        release_engine_handle(cb_peh);
+    }
+
+    /*
+     * We can't release the bucket engine yet, because the connection is
+     * still reserved
+     */
+    if (es->reserved != ES_CONNECTED_FLAG) {
+        logger->log(EXTENSION_LOG_DETAIL, cookie,
+                    "We can't complete the shutdown due to reservations %p",
+                    cookie);
+        return;
+    }
+
+    logger->log(EXTENSION_LOG_DETAIL, cookie, "Complete the shutdown of %p",
+                cookie);
+
+    /* We don't expect concurrent calls to reserve because of
+     * restriction that reserve can be only called from upcall. And
+     * memcached will not upcall this while doing upcall for something
+     * else (e.g. tap_notify or tap_itertator). */
+    /* NOTE: that concurrent release is ok */
+    int count = ATOMIC_ADD(&es->reserved, -ES_CONNECTED_FLAG);
+    if (count == 0) {
+        /* if we're last just clear this thing */
+        // Release all the memory and clear the cookie data upstream.
+        free_engine_specific(es);
+        e->upstream_server->cookie->store_engine_specific(cookie, NULL);
+    }
+    /* we now have one less connection holding reference to this peh.
+     *
+     * NOTE: we have es->peh still has this peh, and es->reserved now
+     * guards peh 'alive'-dness so connection's engine-specific will
+     * still not outlive peh. */
+    release_handle(peh);
+}
+
+/**
+ * Get a reference to the cached default named bucket if it's still
+ * running. The cache holds a reference of its own, and the epoch keeps
+ * the handle around while we bump the refcount (shutdown_bucket
+ * uncaches it and synchronizes before dropping that reference).
+ */
+static proxied_engine_handle_t *retain_default_named(struct bucket_engine *e) {
+    epoch_enter(EPOCH_REGISTRY);
+    proxied_engine_handle_t *peh = retain_handle(e->default_named);
+    epoch_exit(EPOCH_REGISTRY);
+    return peh;
+}
+
+/**
+ * Remember the default named bucket the slow way found (or created).
+ * The cached one isn't running anymore: it's gone (and no longer
+ * cached), or it's hibernated (and cached still).
+ *
+ * @param peh the bucket (the caller holds a reference), or NULL
+ */
+static void cache_default_named(struct bucket_engine *e,
+                                proxied_engine_handle_t *peh) {
+    if (peh == NULL) {
+        return;
+    }
+    lock_engines();
+    /* Unless shutdown_bucket already unlinked it (and thus won't clear
+     * the cache for us), or it's cached already and was just woken up.
+     * Only the bucket in the engines table is ever cached, and there's
+     * only one with the name, so there's never another one to release
+     * (and to wait for the readers of) here on the connect path. */
+    if (e->default_named != peh &&
+        genhash_find(e->engines, peh->name, peh->name_len) == peh) {
+        assert(e->default_named == NULL);
+        int count = ATOMIC_INCR(&peh->refcount);
+        assert(count > 1);
+        e->default_named = peh;
+    }
+    unlock_engines();
+}
+
+/**
+ * Callback from the memcached core for a new connection. Associate
+ * it with the default bucket (if it exists) and create an engine
+ * specific structure.
+ *
+ * @param cookie the cookie representing the connection
+ * @param type The kind of event (should be ON_CONNECT)
+ * @param event_data not used
+ * @param cb_data The bucket instance in use
+ */
+static void handle_connect(const void *cookie,
+                           ENGINE_EVENT_TYPE type,
+                           const void *event_data,
+                           const void *cb_data) {
+    assert(type == ON_CONNECT);
+    (void)event_data;
+    struct bucket_engine *e = (struct bucket_engine*)cb_data;
+
+    proxied_engine_handle_t *peh = NULL;
+    if (e->default_bucket_name != NULL) {
+        // Assign a default named bucket (if there is one).
+        peh = retain_default_named(e);
+        if (!peh) {
+            peh = find_bucket_awake(e->default_bucket_name);
+            if (!peh && e->auto_create) {
+                create_bucket(e, e->default_bucket_name,
+                              e->default_engine_path,
+                              e->default_bucket_config, &peh, NULL, 0);
+            }
+            cache_default_named(e, peh);
+        }
+    } else {
+        // Assign the default bucket (if there is one).
+        peh = e->default_engine.pe.v0 ? &e->default_engine : NULL;
+        if (peh != NULL) {
+            /* increment refcount because final release_handle will
+             * decrement it */
+            proxied_engine_handle_t *t = retain_handle(peh);
+            assert(t == peh);
+        }
+    }
+
+    create_engine_specific(e, cookie);
+    set_engine_handle((ENGINE_HANDLE*)e, cookie, peh);
+    release_handle(peh);
+}
+
+/**
+ * Callback from the memcached core that a cookie succesfully
+ * authenticated itself. Associate the cookie with the bucket it is
+ * authenticated to.
+ *
+ * @param cookie the cookie representing the connection
+ * @param type The kind of event (should be ON_AUTH)
+ * @param event_data The authentication data
+ * @param cb_data The bucket instance in use
+ */
+static void handle_auth(const void *cookie,
+                        ENGINE_EVENT_TYPE type,
+                        const void *event_data,
+                        const void *cb_data) {
+    assert(type == ON_AUTH);
+    struct bucket_engine *e = (struct bucket_engine*)cb_data;
+
+    const auth_data_t *auth_data = (const auth_data_t*)event_data;
+    const char *name = auth_data->username;
+    proxied_engine_handle_t *peh = find_bucket(name);
+    uint64_t generation = 0;
+    if (!peh && (e->auto_create ||
+                 !negative_cache_find(e, name, &generation))) {
+        peh = find_bucket_awake(name);
+        if (!peh && e->auto_create) {
+            create_bucket(e, name, e->default_engine_path,
+                          auth_data->config ? auth_data->config : "",
+                          &peh, NULL, 0);
+        } else if (!peh) {
+            negative_cache_insert(e, name, generation);
+        }
+    }
+    set_engine_handle((ENGINE_HANDLE*)e, cookie, peh);
+    release_handle(peh);
+}
+
+/**
+ * Initialize the default bucket.
+ */
+static ENGINE_ERROR_CODE init_default_bucket(struct bucket_engine* se)
+{
+    ENGINE_ERROR_CODE ret;
+    memset(&se->default_engine, 0, sizeof(se->default_engine));
+    if ((ret = init_engine_handle(&se->default_engine, "",
+                                  se->default_engine_path)) != ENGINE_SUCCESS) {
+        return ret;
+    }
+    se->default_engine.pe.v0 = load_engine(&se->default_engine.module,
+                                           se->default_engine_path);
+    ENGINE_HANDLE_V1 *dv1 = (ENGINE_HANDLE_V1*)se->default_engine.pe.v0;
+    if (!dv1) {
+        return ENGINE_FAILED;
+    }
+
+    ret = dv1->initialize(se->default_engine.pe.v0, se->default_bucket_config);
+    if (ret != ENGINE_SUCCESS) {
+        dv1->destroy(se->default_engine.pe.v0, false);
+    }
+
+    return ret;
+}
+
+/**
+ * This is the implementation of the "initialize" function in the engine
+ * interface. It is called right after create_instance if memcached liked
+ * the interface we returned. Perform all initialization and load the
+ * default bucket (if specified in the config string).
+ */
+static ENGINE_ERROR_CODE bucket_initialize(ENGINE_HANDLE* handle,
+                                           const char* config_str) {
+    struct bucket_engine* se = get_handle(handle);
+    assert(!se->initialized);
+
+    char *tenv = getenv("MEMCACHED_TOP_KEYS");
+    if (tenv != NULL) {
+        se->topkeys = atoi(tenv);
+        if (se->topkeys < 0) {
+            se->topkeys = 0;
+        }
+    }
+
+    get_current_time = bucket_engine.upstream_server->core->get_current_time;
+
+
+#ifdef HAVE_PTHREAD_MUTEX_ERRORCHECK
+    bucket_engine.mutexattr = &bucket_engine.mutexattr_storage;
+
+    if (pthread_mutexattr_init(bucket_engine.mutexattr) != 0 ||
+        pthread_mutexattr_settype(bucket_engine.mutexattr,
+                                  PTHREAD_MUTEX_ERRORCHECK) != 0)
+    {
+        return ENGINE_FAILED;
+    }
+#else
+    bucket_engine.mutexattr = NULL;
+#endif
+
+    if (pthread_mutex_init(&se->engines_mutex, bucket_engine.mutexattr) != 0) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Error initializing mutex for bucket engine.\n");
+        return ENGINE_FAILED;
+    }
+
+    ENGINE_ERROR_CODE ret = initialize_configuration(se, config_str);
+    if (ret != ENGINE_SUCCESS) {
+        return ret;
+    }
+    se->timing_base_ticks = timing_ticks();
+    se->timing_base_nsec = now_nsec();
+
+    static struct hash_ops my_hash_ops = {
+        .hashfunc = genhash_seeded_hash,
+        .hasheq = my_hash_eq,
+        .dupKey = hash_strdup,
+        .dupValue = refcount_dup,
+        .freeKey = free,
+        .freeValue = engine_hash_free
+    };
+
+    se->engines = genhash_init(1, my_hash_ops);
+    if (se->engines == NULL) {
+        return ENGINE_ENOMEM;
+    }
+
+    if (se->negative.ttl != 0) {
+        size_t size = 1;
+        while (size < se->negative.size) {
+            size <<= 1;
+        }
+        se->negative.size = size;
+        se->negative.entries = calloc(size, sizeof(negative_entry_t));
+        assert(se->negative.entries);
+    }
+
+    if (se->slow_ops.size != 0) {
+        size_t size = 1;
+        while (size < se->slow_ops.size) {
+            size <<= 1;
+        }
+        se->slow_ops.size = size;
+        se->slow_ops.ring = calloc(size, sizeof(slow_op_t));
+        assert(se->slow_ops.ring);
+    }
+
+    se->upstream_server->callback->register_callback(handle, ON_CONNECT,
+                                                     handle_connect, se);
+    se->upstream_server->callback->register_callback(handle, ON_AUTH,
+                                                     handle_auth, se);
+    se->upstream_server->callback->register_callback(handle, ON_DISCONNECT,
+                                                     handle_disconnect, se);
+
+    // Initialization is useful to know if we *can* start up an
+    // engine, but we check flags here to see if we should have and
+    // shut it down if not.
+    if (se->has_default) {
+        if ((ret = init_default_bucket(se)) != ENGINE_SUCCESS) {
+            genhash_free(se->engines);
+            return ret;
+        }
+    }
+
+    start_spare_engine_filler(se);
+    start_hibernation(se);
+
+    se->initialized = true;
+    return ENGINE_SUCCESS;
+}
+
+/**
+ * The engines bucket_destroy shuts down. The threads shutting them
+ * down pick the next one by bumping next.
+ */
+struct destroy_context {
+    proxied_engine_handle_t **handles;
+    int count;
+    volatile int next;
+};
+
+/**
+ * A "genhash iterator" collecting the engines that haven't been
+ * destroyed yet into a destroy_context.
+ */
+static void collect_engine(const void* key, size_t nkey,
+                           const void *val, size_t nval,
+                           void *args) {
+    (void)key; (void)nkey; (void)nval;
+    struct destroy_context *ctx = args;
+    proxied_engine_handle_t *peh = (proxied_engine_handle_t *)val;
+    /* A bucket still being created (or woken up) belongs to its
+     * creator */
+    if (peh->pe.v0 && peh->state != STATE_CREATING &&
+        peh->state != STATE_WAKING) {
+        ctx->handles[ctx->count++] = peh;
+    }
+}
+
+/**
+ * During normal shutdown we want to shut down all of the engines
+ * cleanly. Persistent engines may take a long time to do so, so this
+ * is run by several threads at the same time (see bucket_destroy);
+ * each of them shuts down engines until there are no more left.
+ *
+ * No client connections should be running during the invocation
+ * of this function, so we don't have to check if there is any
+ * threads currently calling into the engine.
+ */
+static void *bucket_shutdown_engines(void *arg) {
+    struct destroy_context *ctx = arg;
+    int idx;
+    while ((idx = ATOMIC_INCR(&ctx->next) - 1) < ctx->count) {
+        proxied_engine_handle_t *peh = ctx->handles[idx];
+        logger->log(EXTENSION_LOG_INFO, NULL,
+                    "Shutting down \"%s\"\n", peh->name);
+        uint64_t start = now_usec();
+        peh->pe.v1->destroy(peh->pe.v0, false);
+        logger->log(EXTENSION_LOG_INFO, NULL,
+                    "Completed shutdown of \"%s\" in %llu ms\n", peh->name,
+                    (unsigned long long)(now_usec() - start) / 1000);
+    }
+    return NULL;
+}
+
+/**
+ * This is the implementation of the "destroy" function in the engine
+ * interface. It is called from memcached when memcached is shutting down,
+ * and memcached will never again reference this object when the function
+ * returns. Try to shut down all of the loaded engines cleanly.
+ *
+ * @todo we should probably pass the force variable down to the iterator.
+ *       Right now the core will always specify false here, but that may
+ *       change in the future...
+ *
+ */
+static void bucket_destroy(ENGINE_HANDLE* handle,
+                           const bool force) {
+    (void)force;
+    struct bucket_engine* se = get_handle(handle);
+
+    if (!se->initialized) {
+        return;
+    }
+
+    stop_spare_engine_filler(se);
+    stop_hibernation(se);
+    stop_throttle(se);
+    /* The engines table still references it */
+    release_handle(se->default_named);
+    se->default_named = NULL;
+
+    must_lock(&bucket_engine.shutdown.mutex);
+    bucket_engine.shutdown.in_progress = true;
+    /* The queued buckets are still in the engines table, so we'll
+     * destroy them below. Handles waiting to be freed are left be */
+    proxied_engine_handle_t *peh = bucket_engine.shutdown.queue_head;
+    while (peh != NULL) {
+        if (peh->pe.v1 != NULL) {
+            --bucket_engine.shutdown.bucket_counter;
+        }
+        peh = peh->shutdown_next;
+    }
+    bucket_engine.shutdown.queue_head = bucket_engine.shutdown.queue_tail = NULL;
+    bucket_engine.shutdown.queue_depth = 0;
+    /* tell the idle workers to go away */
+    pthread_cond_broadcast(&bucket_engine.shutdown.work_cond);
+    // Ensure that we don't race with another thread shutting down a bucket
+    while (bucket_engine.shutdown.bucket_counter ||
+           bucket_engine.shutdown.num_workers) {
+        pthread_cond_wait(&bucket_engine.shutdown.cond,
+                          &bucket_engine.shutdown.mutex);
+    }
+    must_unlock(&bucket_engine.shutdown.mutex);
+
+    uint64_t start = now_usec();
+    struct destroy_context ctx = { .count = 0, .next = 0 };
+    ctx.handles = calloc(genhash_size(se->engines) + 1, sizeof(ctx.handles[0]));
+    assert(ctx.handles);
+    genhash_iter(se->engines, collect_engine, &ctx);
+
+    /* Use up to shutdown_threads threads, counting this one */
+    int nthreads = ctx.count;
+    if ((size_t)nthreads > se->shutdown_threads) {
+        nthreads = (int)se->shutdown_threads;
+    }
+    pthread_t tids[nthreads > 0 ? nthreads : 1];
+    int started = 0;
+    for (int i = 1; i < nthreads; i++) {
+        /* the others do the work if we can't start a thread */
+        if (pthread_create(&tids[started], NULL,
+                           bucket_shutdown_engines, &ctx) == 0) {
+            ++started;
+        }
+    }
+    bucket_shutdown_engines(&ctx);
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(ctx.handles);
+    logger->log(EXTENSION_LOG_INFO, NULL,
+                "Shut down %d buckets in %llu ms using %d threads\n",
+                ctx.count, (unsigned long long)(now_usec() - start) / 1000,
+                started + 1);
+
+    if (se->has_default) {
+        uninit_engine_handle(&se->default_engine);
+    }
+
+    genhash_free(se->engines);
+    se->engines = NULL;
+    free(se->registry);
+    se->registry = NULL;
+    free(se->default_engine_path);
+    se->default_engine_path = NULL;
+    free(se->admin_user);
+    se->admin_user = NULL;
+    free(se->default_bucket_name);
+    se->default_bucket_name = NULL;
+    free(se->default_bucket_config);
+    se->default_bucket_config = NULL;
+    for (size_t i = 0; se->negative.entries && i < se->negative.size; i++) {
+        free(se->negative.entries[i].name);
+    }
+    free(se->negative.entries);
+    se->negative.entries = NULL;
+    free(se->slow_ops.ring);
+    se->slow_ops.ring = NULL;
+    release_es_depot();
+    pthread_mutex_destroy(&se->engines_mutex);
+    se->initialized = false;
+}
+
+/**
+ * Destroy the engine of a stopped bucket and unlink it from the
+ * engines table. This is run by one of the shutdown workers (since we
+ * can't block the worker threads in memcached while the engine shuts
+ * down).
+ *
+ * The state for the proxied_engine_handle should be "STOPPED" before
+ * the job is queued, so that no new connections are allowed access
+ * into the engine. Since we don't have any connections calling functions
+ * into the engine we can safely start shutdown of the engine, but we can't
+ * delete the proxied engine handle until all of the connections has
+ * released their reference to the proxied engine handle. That's done
+ * by a separate job queued by release_handle.
+ */
+static void shutdown_bucket(proxied_engine_handle_t *peh) {
+    logger->log(EXTENSION_LOG_INFO, NULL,
+                "Started to shut down \"%s\"\n", peh->name);
+
+    // Sanity check
+    assert(peh->state == STATE_STOPPED);
+    /*
+     * Note we can check for peh->clients == 0 but that's not actually
+     * right because get_engine_handle can temporarily increment it.
+     */
+#ifdef ENABLE_EPOCH_HANDLES
+    /* Wait for the clients that were let in before the state changed */
+    epoch_synchronize(EPOCH_HANDLES);
+#endif
+
+    if (peh->limit != NULL) {
+        /* The queued ops find the bucket gone when they retry */
+        must_lock(&peh->limit->mutex);
+        parked_op_t *granted = grant_parked_UNLOCKED(peh->limit, true);
+        must_unlock(&peh->limit->mutex);
+        notify_granted(granted);
+    }
+    fair_forget_bucket(peh);
+
+    /* Our own reference keeps the handle alive after we drop the one
+     * held by the engines table */
+    int count = ATOMIC_INCR(&peh->refcount);
+    assert(count > 1);
+
+    logger->log(EXTENSION_LOG_INFO, NULL,
+                "Destroy engine \"%s\"\n", peh->name);
+    peh->pe.v1->destroy(peh->pe.v0, peh->force_shutdown);
+    logger->log(EXTENSION_LOG_INFO, NULL,
+                "Engine \"%s\" destroyed\n", peh->name);
+
+    peh->pe.v1 = NULL;
+
+    // Unlink it from the engine table so that others may create
+    // it while we're waiting for the remaining clients to disconnect
+    logger->log(EXTENSION_LOG_INFO, NULL,
+                "Unlink \"%s\" from engine table\n", peh->name);
+    lock_engines();
+    int upd = genhash_delete_all(bucket_engine.engines,
+                                 peh->name, peh->name_len);
+    assert(upd == 1);
+    assert(genhash_find(bucket_engine.engines,
+                        peh->name, peh->name_len) == NULL);
+    bool cached = bucket_engine.default_named == peh;
+    if (cached) {
+        bucket_engine.default_named = NULL;
+    }
+    /* After this returns no reader in find_bucket (or
+     * retain_default_named) can reach peh */
+    publish_registry_UNLOCKED(&bucket_engine);
+    unlock_engines();
+    if (cached) {
+        release_handle(peh);
+    }
+
+    if (peh->cookie != NULL) {
+        logger->log(EXTENSION_LOG_INFO, NULL,
+                    "Notify %p that \"%s\" is deleted", peh->cookie, peh->name);
+        bucket_engine.upstream_server->cookie->notify_io_complete(peh->cookie,
+                                                                  ENGINE_SUCCESS);
+    }
+
+    uint64_t elapsed = now_usec() - peh->shutdown_queued;
+    must_lock(&bucket_engine.shutdown.mutex);
+    bucket_engine.shutdown.destroyed++;
+    bucket_engine.shutdown.destroy_usec_total += elapsed;
+    if (elapsed > bucket_engine.shutdown.destroy_usec_max) {
+        bucket_engine.shutdown.destroy_usec_max = elapsed;
+    }
+    ++bucket_engine.shutdown.pending_release;
+    must_unlock(&bucket_engine.shutdown.mutex);
+
+    if (peh->refcount > 1) {
+        logger->log(EXTENSION_LOG_INFO, NULL,
+                    "There are %d references to \"%s\".. releasing it later\n",
+                    peh->refcount - 1, peh->name);
+    }
+    /* The last one to let go frees it */
+    release_handle(peh);
+}
+
+/**
+ * Free the handle of a destroyed bucket that nobody references
+ * anymore.
+ */
+static void shutdown_release_bucket(proxied_engine_handle_t *peh) {
+    assert(peh->refcount == 0);
+    logger->log(EXTENSION_LOG_INFO, NULL,
+                "Release all resources for engine \"%s\"\n", peh->name);
+
+    /* and free it */
+    free_engine_handle(peh);
+}
+
+/**
+ * The body of the shutdown workers. A worker sleeps until there's a
+ * job in the queue, and exits when the global shutdown starts.
+ */
+static void *shutdown_worker(void *arg) {
+    (void)arg;
+    must_lock(&bucket_engine.shutdown.mutex);
+    while (!bucket_engine.shutdown.in_progress) {
+        proxied_engine_handle_t *peh = bucket_engine.shutdown.queue_head;
+        if (peh == NULL) {
+            ++bucket_engine.shutdown.idle_workers;
+            pthread_cond_wait(&bucket_engine.shutdown.work_cond,
+                              &bucket_engine.shutdown.mutex);
+            --bucket_engine.shutdown.idle_workers;
+            continue;
+        }
+
+        bucket_engine.shutdown.queue_head = peh->shutdown_next;
+        if (bucket_engine.shutdown.queue_head == NULL) {
+            bucket_engine.shutdown.queue_tail = NULL;
+        }
+        peh->shutdown_next = NULL;
+        --bucket_engine.shutdown.queue_depth;
+        bool hibernate = peh->shutdown_hibernate;
+        bool wake = !hibernate && peh->shutdown_wake;
+        if (hibernate) {
+            peh->shutdown_hibernate = false;
+            if (peh->shutdown_wake) {
+                /* Asked for while we were queued (see queue_bucket_wake),
+                 * it waits for us to finish */
+                schedule_shutdown_job_UNLOCKED(peh);
+            }
+        } else {
+            peh->shutdown_wake = false;
+        }
+        must_unlock(&bucket_engine.shutdown.mutex);
+
+        /* The engine is only gone after the first of the others */
+        bool destroy = !hibernate && !wake && peh->pe.v1 != NULL;
+        if (hibernate) {
+            run_hibernate_job(peh);
+        } else if (wake) {
+            run_bucket_wake_job(peh);
+        } else if (destroy) {
+            shutdown_bucket(peh);
+        } else {
+            shutdown_release_bucket(peh);
+        }
+
+        must_lock(&bucket_engine.shutdown.mutex);
+        if (destroy) {
+            --bucket_engine.shutdown.bucket_counter;
+            if (bucket_engine.shutdown.in_progress &&
+                bucket_engine.shutdown.bucket_counter == 0) {
+                pthread_cond_signal(&bucket_engine.shutdown.cond);
+            }
+        } else if (!hibernate && !wake) {
+            --bucket_engine.shutdown.pending_release;
+        }
+    }
+
+    --bucket_engine.shutdown.num_workers;
+    pthread_cond_signal(&bucket_engine.shutdown.cond);
+    must_unlock(&bucket_engine.shutdown.mutex);
+    return NULL;
+}
+
+/**
+ * Queue a job for the shutdown workers: hibernate the bucket if
+ * shutdown_hibernate is set (see maybe_start_hibernation), wake it up
+ * if shutdown_wake is set (see queue_bucket_wake), else destroy the
+ * engine if it's still there, free the handle otherwise. Only one
+ * worker is woken up, and a new one is started if they're all busy
+ * and we're below the limit.
+ *
+ * Must be called with the shutdown mutex held.
+ */
+static void schedule_shutdown_job_UNLOCKED(proxied_engine_handle_t *peh) {
+    peh->shutdown_next = NULL;
+    if (bucket_engine.shutdown.queue_tail == NULL) {
+        bucket_engine.shutdown.queue_head = peh;
+    } else {
+        bucket_engine.shutdown.queue_tail->shutdown_next = peh;
+    }
+    bucket_engine.shutdown.queue_tail = peh;
+    ++bucket_engine.shutdown.queue_depth;
+
+    if (bucket_engine.shutdown.idle_workers > 0) {
+        pthread_cond_signal(&bucket_engine.shutdown.work_cond);
+    } else if ((size_t)bucket_engine.shutdown.num_workers <
+               bucket_engine.shutdown_threads) {
+        pthread_attr_t attr;
+        pthread_t tid;
+        if (pthread_attr_init(&attr) != 0 ||
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0 ||
+            pthread_create(&tid, &attr, shutdown_worker, NULL) != 0)
+        {
+            logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Failed to start shutdown of \"%s\"!", peh->name);
+            abort();
+        }
+        pthread_attr_destroy(&attr);
+        ++bucket_engine.shutdown.num_workers;
+    }
+}
+
+/**
+ * Check to see if we should start shutdown of the specified engine. The
+ * critera for starting shutdown is that no clients are currently calling
+ * into the engine, and that someone requested shutdown of that engine.
+ * (With ENABLE_EPOCH_HANDLES we can't tell if there are clients, so
+ * the shutdown starts right away and waits for them.)
+ *
+ * Note: we always call it with refcount protecting bucket from being
+ * deleted under us.
+ */
+static void maybe_start_engine_shutdown(proxied_engine_handle_t *e) {
+    assert(e->state == STATE_STOPPING || e->state == STATE_STOPPED || e->state == STATE_NULL);
+    /* observing 'state' before clients == 0 is _crucial_. See
+     * get_engine_handle. */
+#ifdef ENABLE_EPOCH_HANDLES
+    if (ATOMIC_CAS(&e->state, STATE_STOPPING, STATE_STOPPED)) {
+#else
+    if (e->state == STATE_STOPPING && count_clients(e) == 0 && ATOMIC_CAS(&e->state, STATE_STOPPING, STATE_STOPPED)) {
+#endif
+        e->shutdown_queued = now_usec();
+        must_lock(&bucket_engine.shutdown.mutex);
+        // Leave it to bucket_destroy if we're racing the global shutdown
+        if (!bucket_engine.shutdown.in_progress) {
+            ++bucket_engine.shutdown.bucket_counter;
+            schedule_shutdown_job_UNLOCKED(e);
+        }
+        must_unlock(&bucket_engine.shutdown.mutex);
+    }
+}
+
+/**
+ * Implementation of the "item_allocate" function in the engine
+ * specification. Look up the correct engine and call into the
+ * underlying engine if the underlying engine is "running". Disconnect
+ * the caller if the engine isn't "running" anymore.
+ */
+static ENGINE_ERROR_CODE bucket_item_allocate(ENGINE_HANDLE* handle,
+                                              const void* cookie,
+                                              item **itm,
+                                              const void* key,
+                                              const size_t nkey,
+                                              const size_t nbytes,
+                                              const int flags,
+                                              const rel_time_t exptime) {
+
+    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    if (peh != NULL) {
+        ENGINE_ERROR_CODE ret;
+        op_start_t start = timing_start();
+        ret = peh->pe.v1->allocate(peh->pe.v0, cookie, itm, key,
+                                   nkey, nbytes, flags, exptime);
+        record_op_timing(peh, TIMING_ALLOCATE, start, ret, key, nkey);
+        release_engine_handle(peh);
+        return ret;
+    } else {
+        return ENGINE_DISCONNECT;
+    }
+}
+
+/**
+ * Implementation of the "item_delete" function in the engine
+ * specification. Look up the correct engine and call into the
+ * underlying engine if the underlying engine is "running". Disconnect
+ * the caller if the engine isn't "running" anymore.
+ */
+static ENGINE_ERROR_CODE bucket_item_delete(ENGINE_HANDLE* handle,
+                                            const void* cookie,
+                                            const void* key,
+                                            const size_t nkey,
+                                            uint64_t* cas,
+                                            uint16_t vbucket) {
+    ENGINE_ERROR_CODE ret;
+    proxied_engine_handle_t *peh = get_limited_engine_handle(handle, cookie,
+                                                             &ret);
+    if (peh) {
+        op_start_t start = timing_start();
+        ret = peh->pe.v1->remove(peh->pe.v0, cookie, key, nkey, cas, vbucket);
+        record_op_timing(peh, TIMING_REMOVE, start, ret, key, nkey);
+        release_limited_engine_handle(peh, cookie);
+
+        if (ret == ENGINE_SUCCESS) {
+            stats_add(&op_counters(peh)->delete_hits, 1);
+            TK(peh->topkeys, delete_hits, key, nkey, get_current_time());
+        } else if (ret == ENGINE_KEY_ENOENT) {
+            stats_add(&op_counters(peh)->delete_misses, 1);
+            TK(peh->topkeys, delete_misses, key, nkey, get_current_time());
+        } else if (ret == ENGINE_KEY_EEXISTS) {
+            TK(peh->topkeys, cas_badval, key, nkey, get_current_time());
+        }
+    }
+    return ret;
+}
+
+/**
+ * Implementation of the "item_release" function in the engine
+ * specification. Look up the correct engine and call into the
+ * underlying engine if the underlying engine is "running".
+ */
+static void bucket_item_release(ENGINE_HANDLE* handle,
+                                const void *cookie,
+                                item* itm) {
+    proxied_engine_handle_t *peh = try_get_engine_handle(handle, cookie);
+    if (peh) {
+        peh->pe.v1->release(peh->pe.v0, cookie, itm);
+        release_engine_handle(peh);
+    } else {
+        logger->log(EXTENSION_LOG_DEBUG, NULL,
+                    "Potential memory leak. Failed to get engine handle for %p",
+                    cookie);
+    }
+}
+
+/**
+ * Implementation of the "get" function in the engine
+ * specification. Look up the correct engine and call into the
+ * underlying engine if the underlying engine is "running". Disconnect
+ * the caller if the engine isn't "running" anymore.
+ */
+static ENGINE_ERROR_CODE bucket_get(ENGINE_HANDLE* handle,
+                                    const void* cookie,
+                                    item** itm,
+                                    const void* key,
+                                    const int nkey,
+                                    uint16_t vbucket) {
+    ENGINE_ERROR_CODE ret;
+    proxied_engine_handle_t *peh = get_limited_engine_handle(handle, cookie,
+                                                             &ret);
+    if (peh) {
+        op_start_t start = timing_start();
+        ret = peh->pe.v1->get(peh->pe.v0, cookie, itm, key, nkey, vbucket);
+        record_op_timing(peh, TIMING_GET, start, ret, key, nkey);
+
+        if (ret != ENGINE_EWOULDBLOCK) {
+            op_counters_t *c = op_counters(peh);
+            stats_add(&c->cmd_get, 1);
+            if (ret == ENGINE_SUCCESS) {
+                stats_add(&c->get_hits, 1);
+                if (bucket_engine.op_timings) {
+                    stats_add(&c->get_bytes, item_nbytes(peh, cookie, *itm));
+                }
+            } else if (ret == ENGINE_KEY_ENOENT) {
+                stats_add(&c->get_misses, 1);
+            }
+        }
+        if (ret == ENGINE_SUCCESS) {
+            TK(peh->topkeys, get_hits, key, nkey, get_current_time());
+        } else if (ret == ENGINE_KEY_ENOENT) {
+            TK(peh->topkeys, get_misses, key, nkey, get_current_time());
+        }
+
+        release_limited_engine_handle(peh, cookie);
+    }
+    return ret;
+}
+
+static void add_engine(const void *key, size_t nkey,
+                       const void *val, size_t nval,
+                       void *arg) {
+    (void)nval;
+    struct bucket_list **blist_ptr = (struct bucket_list **)arg;
+    struct bucket_list *n = calloc(sizeof(struct bucket_list), 1);
+    n->name = (char*)key;
+    n->namelen = nkey;
+    n->peh = (proxied_engine_handle_t*) val;
+    assert(n->peh);
+
+    /* we must not leak dead buckets outside of engines_mutex. Those
+     * can be freed by bucket destructor at any time (when
+     * engines_mutex is not held) */
+    if (retain_handle(n->peh) == NULL) {
+        free(n);
+        return;
+    }
+
+    n->next = *blist_ptr;
+    *blist_ptr = n;
+}
+
+static bool list_buckets(struct bucket_engine *e, struct bucket_list **blist) {
+    lock_engines();
+    genhash_iter(e->engines, add_engine, blist);
+    unlock_engines();
+    return true;
+}
+
+static void bucket_list_free(struct bucket_list *blist) {
+    struct bucket_list *p = blist;
+    while (p) {
+        release_handle(p->peh);
+        struct bucket_list *tmp = p->next;
+        free(p);
+        p = tmp;
+    }
+}
+
+/**
+ * Implementation of the "aggregate_stats" function in the engine
+ * specification. Look up the correct engine and call into the
+ * underlying engine if the underlying engine is "running". Disconnect
+ * the caller if the engine isn't "running" anymore.
+ */
+static ENGINE_ERROR_CODE bucket_aggregate_stats(ENGINE_HANDLE* handle,
+                                                const void* cookie,
+                                                void (*callback)(void*, void*),
+                                                void *stats) {
+    (void)cookie;
+    struct bucket_engine *e = (struct bucket_engine*)handle;
+    struct bucket_list *blist = NULL;
+    if (! list_buckets(e, &blist)) {
+        return ENGINE_FAILED;
+    }
+
+    struct bucket_list *p = blist;
+    while (p) {
+        callback(p->peh->stats, stats);
+        p = p->next;
+    }
+
+    bucket_list_free(blist);
+    return ENGINE_SUCCESS;
+}
+
+struct stat_context {
+    ADD_STAT add_stat;
+    const void *cookie;
+};
+
+static void stat_ht_builder(const void *key, size_t nkey,
+                            const void *val, size_t nval,
+                            void *arg) {
+    (void)nval;
+    assert(arg);
+    struct stat_context *ctx = (struct stat_context*)arg;
+    proxied_engine_handle_t *bucket = (proxied_engine_handle_t*)val;
+    const char * const bucketState = bucket_state_name(bucket->state);
+    ctx->add_stat(key, nkey, bucketState, strlen(bucketState),
+                  ctx->cookie);
+}
+
+/**
+ * Report a counter of the node (see get_node_stats).
+ */
+static void add_node_stat(const char *name, uint64_t value,
+                          ADD_STAT add_stat, const void *cookie) {
+    char statval[32];
+    int len = snprintf(statval, sizeof(statval), "%llu",
+                       (unsigned long long)value);
+    add_stat(name, strlen(name), statval, len, cookie);
+}
+
+/**
+ * Report a ratio of the node, with two decimals.
+ */
+static void add_node_ratio_stat(const char *name, double value,
+                                ADD_STAT add_stat, const void *cookie) {
+    char statval[32];
+    int len = snprintf(statval, sizeof(statval), "%.2f", value);
+    add_stat(name, strlen(name), statval, len, cookie);
+}
+
+/**
+ * Report the shape of the engines hash table.
+ */
+static void add_engines_table_stats(const struct genhash_stats *hstats,
+                                    ADD_STAT add_stat,
+                                    const void *cookie) {
+    add_node_stat("engines_table:size", hstats->size, add_stat, cookie);
+    add_node_stat("engines_table:items", hstats->items, add_stat, cookie);
+    add_node_ratio_stat("engines_table:load_factor",
+                        (double)hstats->items / (double)hstats->size,
+                        add_stat, cookie);
+    add_node_ratio_stat("engines_table:avg_chain",
+                        hstats->used_buckets == 0 ? 0.0 :
+                        (double)hstats->items / (double)hstats->used_buckets,
+                        add_stat, cookie);
+    add_node_stat("engines_table:max_chain", hstats->max_chain,
+                  add_stat, cookie);
+    add_stat("engines_table:growing", sizeof("engines_table:growing") - 1,
+             hstats->growing ? "true" : "false",
+             hstats->growing ? 4 : 5, cookie);
+}
+
+/**
+ * Report how often the threads waiting for a bucket to be created
+ * (or woken up) were signalled, how many times we didn't have to
+ * because nobody was waiting for that bucket, and how many creates
+ * waited for the same bucket being created instead of creating it.
+ */
+static void add_waiter_stats(uint64_t wakeups, uint64_t avoided,
+                             uint64_t joined,
+                             ADD_STAT add_stat, const void *cookie) {
+    add_node_stat("waiters:wakeups", wakeups, add_stat, cookie);
+    add_node_stat("waiters:wakeups_avoided", avoided, add_stat, cookie);
+    add_node_stat("waiters:creates_joined", joined, add_stat, cookie);
+}
+
+/**
+ * Report the state of the shutdown workers and how long it took to
+ * destroy the deleted buckets (from queueing the job until the bucket
+ * was unlinked).
+ */
+static void add_shutdown_stats(ADD_STAT add_stat, const void *cookie) {
+    must_lock(&bucket_engine.shutdown.mutex);
+    int threads = bucket_engine.shutdown.num_workers;
+    int queue_depth = bucket_engine.shutdown.queue_depth;
+    int pending_release = bucket_engine.shutdown.pending_release;
+    uint64_t destroyed = bucket_engine.shutdown.destroyed;
+    uint64_t usec_total = bucket_engine.shutdown.destroy_usec_total;
+    uint64_t usec_max = bucket_engine.shutdown.destroy_usec_max;
+    must_unlock(&bucket_engine.shutdown.mutex);
+
+    add_node_stat("shutdown:threads", threads, add_stat, cookie);
+    add_node_stat("shutdown:queue_depth", queue_depth, add_stat, cookie);
+    add_node_stat("shutdown:pending_release", pending_release,
+                  add_stat, cookie);
+    add_node_stat("shutdown:destroyed", destroyed, add_stat, cookie);
+    add_node_stat("shutdown:destroy_avg_usec",
+                  destroyed == 0 ? 0 : usec_total / destroyed,
+                  add_stat, cookie);
+    add_node_stat("shutdown:destroy_max_usec", usec_max, add_stat, cookie);
+}
+
+/**
+ * Report the spare engine pool (only when it's enabled).
+ */
+static void add_spare_stats(ADD_STAT add_stat, const void *cookie) {
+    if (bucket_engine.spares.size == 0) {
+        return;
     }
 
-    se->upstream_server->callback->register_callback(handle, ON_CONNECT,
-                                                     handle_connect, se);
-    se->upstream_server->callback->register_callback(handle, ON_AUTH,
-                                                     handle_auth, se);
-    se->upstream_server->callback->register_callback(handle, ON_DISCONNECT,
-                                                     handle_disconnect, se);
+    must_lock(&bucket_engine.spares.mutex);
+    int available = bucket_engine.spares.available;
+    uint64_t claimed = bucket_engine.spares.claimed;
+    uint64_t missed = bucket_engine.spares.missed;
+    must_unlock(&bucket_engine.spares.mutex);
 
-    // Initialization is useful to know if we *can* start up an
-    // engine, but we check flags here to see if we should have and
-    // shut it down if not.
-    if (se->has_default) {
-        if ((ret = init_default_bucket(se)) != ENGINE_SUCCESS) {
-            genhash_free(se->engines);
-            return ret;
-        }
+    add_node_stat("spares:available", available, add_stat, cookie);
+    add_node_stat("spares:claimed", claimed, add_stat, cookie);
+    add_node_stat("spares:missed", missed, add_stat, cookie);
+}
+
+/**
+ * Report the hibernation (only when it's enabled).
+ */
+static void add_hibernation_stats(ADD_STAT add_stat, const void *cookie) {
+    if (bucket_engine.hibernate_after == 0) {
+        return;
     }
 
+    must_lock(&bucket_engine.hibernation.mutex);
+    int hibernated = bucket_engine.hibernation.hibernated;
+    uint64_t hibernations = bucket_engine.hibernation.hibernations;
+    uint64_t wakeups = bucket_engine.hibernation.wakeups;
+    must_unlock(&bucket_engine.hibernation.mutex);
 
-    se->initialized = true;
-    return ENGINE_SUCCESS;
+    add_node_stat("hibernation:hibernated", hibernated, add_stat, cookie);
+    add_node_stat("hibernation:hibernations", hibernations, add_stat, cookie);
+    add_node_stat("hibernation:wakeups", wakeups, add_stat, cookie);
 }
 
 /**
- * During normal shutdown we want to shut down all of the engines
- * cleanly. The bucket_shutdown_engine is an implementation of a
- * "genhash iterator", so it is called once for each engine
- * stored in the hash table.
- *
- * No client connections should be running during the invocation
- * of this function, so we don't have to check if there is any
- * threads currently calling into the engine.
+ * Report the negative cache (only when it's enabled).
  */
-static void bucket_shutdown_engine(const void* key, size_t nkey,
-                                   const void *val, size_t nval,
-                                   void *args) {
-    (void)key; (void)nkey; (void)nval; (void)args;
-    const proxied_engine_handle_t *peh = val;
-    if (peh->pe.v0) {
-        logger->log(EXTENSION_LOG_INFO, NULL,
-                    "Shutting down \"%s\"\n", peh->name);
-        peh->pe.v1->destroy(peh->pe.v0, false);
-        logger->log(EXTENSION_LOG_INFO, NULL,
-                    "Completed shutdown of \"%s\"\n", peh->name);
+static void add_negative_cache_stats(ADD_STAT add_stat, const void *cookie) {
+    if (bucket_engine.negative.ttl == 0) {
+        return;
     }
+
+    must_lock(&bucket_engine.negative.mutex);
+    uint64_t hits = bucket_engine.negative.hits;
+    uint64_t inserts = bucket_engine.negative.inserts;
+    must_unlock(&bucket_engine.negative.mutex);
+
+    add_node_stat("negative_cache:hits", hits, add_stat, cookie);
+    add_node_stat("negative_cache:inserts", inserts, add_stat, cookie);
 }
 
 /**
- * This is the implementation of the "destroy" function in the engine
- * interface. It is called from memcached when memcached is shutting down,
- * and memcached will never again reference this object when the function
- * returns. Try to shut down all of the loaded engines cleanly.
- *
- * @todo we should probably pass the force variable down to the iterator.
- *       Right now the core will always specify false here, but that may
- *       change in the future...
- *
+ * Report how busy the engines are, and how many ops were queued
+ * because they were overloaded (see fair_enter).
  */
-static void bucket_destroy(ENGINE_HANDLE* handle,
-                           const bool force) {
-    (void)force;
-    struct bucket_engine* se = get_handle(handle);
-
-    if (!se->initialized) {
+static void add_fair_stats(ADD_STAT add_stat, const void *cookie) {
+    if (bucket_engine.fair.threshold == 0) {
         return;
     }
 
-    must_lock(&bucket_engine.shutdown.mutex);
-    bucket_engine.shutdown.in_progress = true;
-    /* kick bucket deletion threads in butt broadcasting in_progress = true condition */
-    pthread_cond_broadcast(&bucket_engine.shutdown.refcount_cond);
-    // Ensure that we don't race with another thread shutting down a bucket
-    while (bucket_engine.shutdown.bucket_counter) {
-        pthread_cond_wait(&bucket_engine.shutdown.cond,
-                          &bucket_engine.shutdown.mutex);
-    }
-    must_unlock(&bucket_engine.shutdown.mutex);
+    must_lock(&bucket_engine.fair.mutex);
+    int queued = bucket_engine.fair.queued;
+    uint64_t parked = bucket_engine.fair.parked;
+    must_unlock(&bucket_engine.fair.mutex);
 
-    genhash_iter(se->engines, bucket_shutdown_engine, NULL);
+    add_node_stat("fair:inflight", bucket_engine.fair.inflight,
+                  add_stat, cookie);
+    add_node_stat("fair:queue_depth", queued, add_stat, cookie);
+    add_node_stat("fair:parked", parked, add_stat, cookie);
+}
 
-    if (se->has_default) {
-        uninit_engine_handle(&se->default_engine);
+/**
+ * Report how many slow ops were traced, and how many were dropped
+ * because their record was busy (see record_slow_op).
+ */
+static void add_slow_op_tracer_stats(ADD_STAT add_stat, const void *cookie) {
+    if (bucket_engine.slow_ops.size == 0) {
+        return;
     }
+    add_node_stat("slow_ops:recorded",
+                  (unsigned int)(bucket_engine.slow_ops.next -
+                                 bucket_engine.slow_ops.dropped),
+                  add_stat, cookie);
+    add_node_stat("slow_ops:dropped",
+                  (unsigned int)bucket_engine.slow_ops.dropped,
+                  add_stat, cookie);
+}
 
-    genhash_free(se->engines);
-    se->engines = NULL;
-    free(se->default_engine_path);
-    se->default_engine_path = NULL;
-    free(se->admin_user);
-    se->admin_user = NULL;
-    free(se->default_bucket_name);
-    se->default_bucket_name = NULL;
-    free(se->default_bucket_config);
-    se->default_bucket_config = NULL;
-    pthread_mutex_destroy(&se->engines_mutex);
-    se->initialized = false;
+/**
+ * Report how the engine_specific_t allocations were served: from the
+ * thread's own magazines, from a magazine from the depot, or by
+ * calloc (the rest).
+ */
+static void add_es_cache_stats(ADD_STAT add_stat, const void *cookie) {
+    must_lock(&bucket_engine.es_depot.mutex);
+    uint64_t allocs = bucket_engine.es_depot.allocs;
+    uint64_t thread_hits = bucket_engine.es_depot.thread_hits;
+    uint64_t depot_hits = bucket_engine.es_depot.depot_hits;
+    for (es_thread_cache_t *tc = bucket_engine.es_depot.threads;
+         tc != NULL; tc = tc->next) {
+        allocs += tc->allocs;
+        thread_hits += tc->thread_hits;
+        depot_hits += tc->depot_hits;
+    }
+    must_unlock(&bucket_engine.es_depot.mutex);
+
+    add_node_stat("es_cache:allocs", allocs, add_stat, cookie);
+    add_node_stat("es_cache:thread_hits", thread_hits, add_stat, cookie);
+    add_node_stat("es_cache:depot_hits", depot_hits, add_stat, cookie);
+    add_node_ratio_stat("es_cache:hit_rate",
+                        allocs == 0 ? 0.0 :
+                        (double)(thread_hits + depot_hits) / (double)allocs,
+                        add_stat, cookie);
 }
 
 /**
- * The deletion (shutdown) of a bucket is performed by its own thread
- * for simplicity (since we can't block the worker threads while we're
- * waiting for all of the connections to leave the engine).
- *
- * The state for the proxied_engine_handle should be "STOPPING" before
- * the thread is started, so that no new connections are allowed access
- * into the engine. Since we don't have any connections calling functions
- * into the engine we can safely start shutdown of the engine, but we can't
- * delete the proxied engine handle until all of the connections has
- * released their reference to the proxied engine handle.
+ * Report the number of buckets using each of the loaded engine
+ * modules, as "module:<path>".
  */
-static void *engine_shutdown_thread(void *arg) {
-    bool skip;
-    // XXX:  Move state from STOPPED -> NULL.  This is an unbucket.
-    must_lock(&bucket_engine.shutdown.mutex);
-    skip = bucket_engine.shutdown.in_progress;
-    if (!skip) {
-        ++bucket_engine.shutdown.bucket_counter;
+static void add_module_stats(ADD_STAT add_stat, const void *cookie) {
+    /* Modules are only ever added at the head, so the rest of the
+     * list can be walked without the lock */
+    must_lock(&bucket_engine.modules.mutex);
+    engine_module_t *m = bucket_engine.modules.list;
+    must_unlock(&bucket_engine.modules.mutex);
+
+    for (; m != NULL; m = m->next) {
+        char statname[PATH_MAX + sizeof("module:")];
+        char statval[20];
+        int klen = snprintf(statname, sizeof(statname), "module:%s", m->path);
+        if (klen >= (int)sizeof(statname)) {
+            klen = sizeof(statname) - 1;
+        }
+        int vlen = snprintf(statval, sizeof(statval), "%d", m->instances);
+        add_stat(statname, klen, statval, vlen, cookie);
     }
-    must_unlock(&bucket_engine.shutdown.mutex);
+}
 
-    if (skip) {
-        // Skip shutdown because we're racing the global shutdown..
-        return NULL;
+/**
+ * Get bucket-engine specific statistics: the buckets and their states.
+ */
+static ENGINE_ERROR_CODE get_bucket_stats(ENGINE_HANDLE* handle,
+                                          const void *cookie,
+                                          ADD_STAT add_stat) {
+
+    if (!is_authorized(handle, cookie)) {
+        return ENGINE_FAILED;
     }
 
-    proxied_engine_handle_t *peh = arg;
-    logger->log(EXTENSION_LOG_INFO, NULL,
-                "Started thread to shut down \"%s\"\n", peh->name);
+    struct bucket_engine *e = (struct bucket_engine*)handle;
+    struct stat_context sctx = {.add_stat = add_stat, .cookie = cookie};
 
-    // Sanity check
-    assert(peh->state == STATE_STOPPED);
-    /*
-     * Note we can check for peh->clients == 0 but that's not actually
-     * right because get_engine_handle can temporarily increment it.
-     */
+    lock_engines();
+    genhash_iter(e->engines, stat_ht_builder, &sctx);
+    unlock_engines();
+    return ENGINE_SUCCESS;
+}
 
-    logger->log(EXTENSION_LOG_INFO, NULL,
-                "Destroy engine \"%s\"\n", peh->name);
-    peh->pe.v1->destroy(peh->pe.v0, peh->force_shutdown);
-    logger->log(EXTENSION_LOG_INFO, NULL,
-                "Engine \"%s\" destroyed\n", peh->name);
+/**
+ * Get the stats of bucket engine itself (the "bucket_engine" stats,
+ * admin only), as "<part>:<stat>".
+ */
+static ENGINE_ERROR_CODE get_node_stats(ENGINE_HANDLE* handle,
+                                        const void *cookie,
+                                        ADD_STAT add_stat) {
+    if (!is_authorized(handle, cookie)) {
+        return ENGINE_FAILED;
+    }
 
-    peh->pe.v1 = NULL;
+    struct bucket_engine *e = (struct bucket_engine*)handle;
+    struct genhash_stats hstats;
 
-    // Unlink it from the engine table so that others may create
-    // it while we're waiting for the remaining clients to disconnect
-    logger->log(EXTENSION_LOG_INFO, NULL,
-                "Unlink \"%s\" from engine table\n", peh->name);
     lock_engines();
-    int upd = genhash_delete_all(bucket_engine.engines,
-                                 peh->name, peh->name_len);
-    assert(upd == 1);
-    assert(genhash_find(bucket_engine.engines,
-                        peh->name, peh->name_len) == NULL);
+    genhash_get_stats(e->engines, &hstats);
+    uint64_t waiter_wakeups = e->waiter_wakeups;
+    uint64_t wakeups_avoided = e->wakeups_avoided;
+    uint64_t creates_joined = e->creates_joined;
     unlock_engines();
 
-    if (peh->cookie != NULL) {
-        logger->log(EXTENSION_LOG_INFO, NULL,
-                    "Notify %p that \"%s\" is deleted", peh->cookie, peh->name);
-        bucket_engine.upstream_server->cookie->notify_io_complete(peh->cookie,
-                                                                  ENGINE_SUCCESS);
-    }
+    add_engines_table_stats(&hstats, add_stat, cookie);
+    add_waiter_stats(waiter_wakeups, wakeups_avoided, creates_joined,
+                     add_stat, cookie);
+    add_shutdown_stats(add_stat, cookie);
+    add_spare_stats(add_stat, cookie);
+    add_hibernation_stats(add_stat, cookie);
+    add_negative_cache_stats(add_stat, cookie);
+    add_fair_stats(add_stat, cookie);
+    add_slow_op_tracer_stats(add_stat, cookie);
+    add_es_cache_stats(add_stat, cookie);
+    add_module_stats(add_stat, cookie);
+    return ENGINE_SUCCESS;
+}
 
-    /* NOTE: that even though DECR in release_handle happens without
-     * lock, engine_shutdown_thread cannot miss wakeup event. That's
-     * because broadcast happens under lock. Here's why.
-     *
-     * Suppose engine_shutdown_thread went to cond_wait sleep with
-     * refcount = 0 and was never awaken (we want to prove by
-     * contradiction that this cannot happen). But we know it have
-     * observed refcount > 0. This means concurrent release_handle
-     * decremented it after we've observed refcount value. But we know
-     * that if this happened, release_handle would go and broadcast
-     * signal. But our assumtion tells us we've missed this
-     * broadcast. But this cannot happen because nobody can do
-     * broadcast between us observing refcount value and going to
-     * sleep because we're holding mutex that broadcast takes.
-     */
-    must_lock(&bucket_engine.shutdown.mutex);
-    while (peh->refcount > 0 && !bucket_engine.shutdown.in_progress) {
-        logger->log(EXTENSION_LOG_INFO, NULL,
-                    "There are %d references to \"%s\".. waiting more\n",
-                    peh->refcount, peh->name);
+/**
+ * Report the limits of a bucket (if it ever had any), how many ops
+ * they delayed and rejected, and how long the ops queued for
+ * max_inflight waited.
+ */
+static void add_limit_stats(proxied_engine_handle_t *peh,
+                            ADD_STAT add_stat, const void *cookie) {
+    bucket_limit_t *limit = peh->limit;
+    char statval[32];
+    int len;
 
-        pthread_cond_wait(&bucket_engine.shutdown.refcount_cond,
-                          &bucket_engine.shutdown.mutex);
+    if (limit == NULL) {
+        return;
     }
-    must_unlock(&bucket_engine.shutdown.mutex);
 
-    logger->log(EXTENSION_LOG_INFO, NULL,
-                "Release all resources for engine \"%s\"\n", peh->name);
+    must_lock(&limit->mutex);
+    size_t rate = limit->rate;
+    uint64_t delayed = limit->delayed;
+    uint64_t rejected = limit->rejected;
+    int queued = limit->queued;
+    uint64_t parked = limit->parked;
+    uint64_t waits[INFLIGHT_WAIT_BUCKETS];
+    memcpy(waits, limit->waits, sizeof(waits));
+    must_unlock(&limit->mutex);
+
+    len = snprintf(statval, sizeof(statval), "%llu",
+                   (unsigned long long)rate);
+    add_stat("ops_limit", sizeof("ops_limit") - 1, statval, len, cookie);
+    len = snprintf(statval, sizeof(statval), "%llu",
+                   (unsigned long long)delayed);
+    add_stat("ops_limit_delayed", sizeof("ops_limit_delayed") - 1,
+             statval, len, cookie);
+    len = snprintf(statval, sizeof(statval), "%llu",
+                   (unsigned long long)rejected);
+    add_stat("ops_limit_rejected", sizeof("ops_limit_rejected") - 1,
+             statval, len, cookie);
+
+    len = snprintf(statval, sizeof(statval), "%d", limit->max_inflight);
+    add_stat("max_inflight", sizeof("max_inflight") - 1,
+             statval, len, cookie);
+    len = snprintf(statval, sizeof(statval), "%d", limit->inflight);
+    add_stat("inflight", sizeof("inflight") - 1, statval, len, cookie);
+    len = snprintf(statval, sizeof(statval), "%d", queued);
+    add_stat("inflight_queue_depth", sizeof("inflight_queue_depth") - 1,
+             statval, len, cookie);
+    len = snprintf(statval, sizeof(statval), "%llu",
+                   (unsigned long long)parked);
+    add_stat("inflight_parked", sizeof("inflight_parked") - 1,
+             statval, len, cookie);
+
+    static const char *wait_names[INFLIGHT_WAIT_BUCKETS] = {
+        "inflight_wait_100us", "inflight_wait_1ms", "inflight_wait_10ms",
+        "inflight_wait_100ms", "inflight_wait_1s", "inflight_wait_slower"
+    };
+    for (int i = 0; i < INFLIGHT_WAIT_BUCKETS; i++) {
+        len = snprintf(statval, sizeof(statval), "%llu",
+                       (unsigned long long)waits[i]);
+        add_stat(wait_names[i], strlen(wait_names[i]), statval, len, cookie);
+    }
+}
 
-    /* and free it */
-    free_engine_handle(peh);
+/**
+ * Report the weight of a bucket, and how its ops fared while the
+ * engines were overloaded.
+ */
+static void add_bucket_fair_stats(proxied_engine_handle_t *peh,
+                                  ADD_STAT add_stat, const void *cookie) {
+    char statval[32];
+    int len;
 
-    must_lock(&bucket_engine.shutdown.mutex);
-    --bucket_engine.shutdown.bucket_counter;
-    if (bucket_engine.shutdown.in_progress && bucket_engine.shutdown.bucket_counter == 0){
-        pthread_cond_signal(&bucket_engine.shutdown.cond);
+    if (bucket_engine.fair.threshold == 0) {
+        return;
     }
-    must_unlock(&bucket_engine.shutdown.mutex);
 
-    return NULL;
+    must_lock(&bucket_engine.fair.mutex);
+    int queued = peh->fair.queued;
+    uint64_t parked = peh->fair.parked;
+    uint64_t waits[INFLIGHT_WAIT_BUCKETS];
+    memcpy(waits, peh->fair.waits, sizeof(waits));
+    must_unlock(&bucket_engine.fair.mutex);
+
+    len = snprintf(statval, sizeof(statval), "%llu",
+                   (unsigned long long)peh->fair.weight);
+    add_stat("weight", sizeof("weight") - 1, statval, len, cookie);
+    len = snprintf(statval, sizeof(statval), "%d", queued);
+    add_stat("fair_queue_depth", sizeof("fair_queue_depth") - 1,
+             statval, len, cookie);
+    len = snprintf(statval, sizeof(statval), "%llu",
+                   (unsigned long long)parked);
+    add_stat("fair_parked", sizeof("fair_parked") - 1,
+             statval, len, cookie);
+
+    static const char *wait_names[INFLIGHT_WAIT_BUCKETS] = {
+        "fair_wait_100us", "fair_wait_1ms", "fair_wait_10ms",
+        "fair_wait_100ms", "fair_wait_1s", "fair_wait_slower"
+    };
+    for (int i = 0; i < INFLIGHT_WAIT_BUCKETS; i++) {
+        len = snprintf(statval, sizeof(statval), "%llu",
+                       (unsigned long long)waits[i]);
+        add_stat(wait_names[i], strlen(wait_names[i]), statval, len, cookie);
+    }
 }
 
+/** The names of the timed ops in the stats */
+static const char *timing_op_names[TIMING_OPS] = {
+    "allocate", "get", "store", "remove", "arithmetic", "flush",
+    "unknown_command", "tap_notify"
+};
+
 /**
- * Check to see if we should start shutdown of the specified engine. The
- * critera for starting shutdown is that no clients are currently calling
- * into the engine, and that someone requested shutdown of that engine.
- *
- * Note: we always call it with refcount protecting bucket from being
- * deleted under us.
+ * The time (ticks) under which permille thousandths of the times in a
+ * histogram are (rounded up to the end of its bucket).
  */
-static void maybe_start_engine_shutdown(proxied_engine_handle_t *e) {
-    assert(e->state == STATE_STOPPING || e->state == STATE_STOPPED || e->state == STATE_NULL);
-    /* observing 'state' before clients == 0 is _crucial_. See
-     * get_engine_handle. */
-    if (e->state == STATE_STOPPING && e->clients == 0 && ATOMIC_CAS(&e->state, STATE_STOPPING, STATE_STOPPED)) {
-        // Spin off a new thread to shut down the engine..
-        pthread_attr_t attr;
-        pthread_t tid;
-        if (pthread_attr_init(&attr) != 0 ||
-            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0 ||
-            pthread_create(&tid, &attr, engine_shutdown_thread, e) != 0)
-        {
-            logger->log(EXTENSION_LOG_WARNING, NULL,
-                        "Failed to start shutdown of \"%s\"!", e->name);
-            abort();
+static uint64_t timing_percentile(const uint64_t *hist, uint64_t count,
+                                  uint64_t permille) {
+    uint64_t target = (count * permille + 999) / 1000;
+    uint64_t seen = 0;
+    int b = 0;
+    for (; b < TIMING_BUCKETS - 1; b++) {
+        seen += hist[b];
+        if (seen >= target) {
+            return timing_bucket_low(b + 1);
         }
-        pthread_attr_destroy(&attr);
     }
+    return timing_bucket_low(b);
 }
 
 /**
- * Implementation of the "item_allocate" function in the engine
- * specification. Look up the correct engine and call into the
- * underlying engine if the underlying engine is "running". Disconnect
- * the caller if the engine isn't "running" anymore.
+ * Report the times (ns) the ops on a bucket spent in its engine: for
+ * every op that was timed, the count, the median, 99th and 99.9th
+ * percentiles, and the histogram buckets with anything in them
+ * ("<op>:<from>,<to>", to being exclusive). The slots of all the
+ * threads are added up.
  */
-static ENGINE_ERROR_CODE bucket_item_allocate(ENGINE_HANDLE* handle,
-                                              const void* cookie,
-                                              item **itm,
-                                              const void* key,
-                                              const size_t nkey,
-                                              const size_t nbytes,
-                                              const int flags,
-                                              const rel_time_t exptime) {
+static void add_timing_stats(proxied_engine_handle_t *peh,
+                             ADD_STAT add_stat, const void *cookie) {
+    static const uint64_t percentiles[] = { 500, 990, 999 };
+    static const char *percentile_names[] = { "p50", "p99", "p999" };
+    char statkey[64];
+    char statval[32];
+    int klen, len;
+    double ticks_per_nsec = timing_ticks_per_nsec();
+
+    for (int op = 0; op < TIMING_OPS; op++) {
+        uint64_t hist[TIMING_BUCKETS] = { 0 };
+        uint64_t count = 0;
+        for (int i = 0; i < STATS_SLOTS; i++) {
+            timing_slot_t *slot = peh->timings->slots[i];
+            if (slot == NULL) {
+                continue;
+            }
+            for (int b = 0; b < TIMING_BUCKETS; b++) {
+                hist[b] += slot->hist[op][b];
+            }
+        }
+        for (int b = 0; b < TIMING_BUCKETS; b++) {
+            count += hist[b];
+        }
+        if (count == 0) {
+            continue;
+        }
 
-    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
-    if (peh != NULL) {
-        ENGINE_ERROR_CODE ret;
-        ret = peh->pe.v1->allocate(peh->pe.v0, cookie, itm, key,
-                                   nkey, nbytes, flags, exptime);
-        release_engine_handle(peh);
-        return ret;
-    } else {
-        return ENGINE_DISCONNECT;
+        const char *name = timing_op_names[op];
+        klen = snprintf(statkey, sizeof(statkey), "%s:count", name);
+        len = snprintf(statval, sizeof(statval), "%llu",
+                       (unsigned long long)count);
+        add_stat(statkey, klen, statval, len, cookie);
+        for (int i = 0; i < 3; i++) {
+            klen = snprintf(statkey, sizeof(statkey), "%s:%s", name,
+                            percentile_names[i]);
+            uint64_t ticks = timing_percentile(hist, count, percentiles[i]);
+            len = snprintf(statval, sizeof(statval), "%llu",
+                           (unsigned long long)(ticks / ticks_per_nsec));
+            add_stat(statkey, klen, statval, len, cookie);
+        }
+        /* The buckets narrower than a ns are added to the next one */
+        uint64_t acc = 0;
+        uint64_t from = 0;
+        for (int b = 0; b < TIMING_BUCKETS; b++) {
+            if (acc == 0) {
+                from = timing_bucket_low(b) / ticks_per_nsec;
+            }
+            acc += hist[b];
+            if (acc == 0) {
+                continue;
+            }
+            if (b == TIMING_BUCKETS - 1) {
+                klen = snprintf(statkey, sizeof(statkey), "%s:%llu,inf", name,
+                                (unsigned long long)from);
+            } else {
+                uint64_t to = timing_bucket_low(b + 1) / ticks_per_nsec;
+                if (to <= from) {
+                    continue;
+                }
+                klen = snprintf(statkey, sizeof(statkey), "%s:%llu,%llu", name,
+                                (unsigned long long)from,
+                                (unsigned long long)to);
+            }
+            len = snprintf(statval, sizeof(statval), "%llu",
+                           (unsigned long long)acc);
+            add_stat(statkey, klen, statval, len, cookie);
+            acc = 0;
+        }
     }
 }
 
 /**
- * Implementation of the "item_delete" function in the engine
- * specification. Look up the correct engine and call into the
- * underlying engine if the underlying engine is "running". Disconnect
- * the caller if the engine isn't "running" anymore.
+ * Report the op counters of a bucket, adding up the slots of all the
+ * threads.
  */
-static ENGINE_ERROR_CODE bucket_item_delete(ENGINE_HANDLE* handle,
-                                            const void* cookie,
-                                            const void* key,
-                                            const size_t nkey,
-                                            uint64_t* cas,
-                                            uint16_t vbucket) {
-    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
-    if (peh) {
-        ENGINE_ERROR_CODE ret;
-        ret = peh->pe.v1->remove(peh->pe.v0, cookie, key, nkey, cas, vbucket);
-        release_engine_handle(peh);
+static void add_op_counter_stats(proxied_engine_handle_t *peh,
+                                 ADD_STAT add_stat, const void *cookie) {
+    static const struct {
+        const char *name;
+        size_t offset;
+    } counters[] = {
+        { "cmd_get", offsetof(op_counters_t, cmd_get) },
+        { "get_hits", offsetof(op_counters_t, get_hits) },
+        { "get_misses", offsetof(op_counters_t, get_misses) },
+        { "get_bytes", offsetof(op_counters_t, get_bytes) },
+        { "cmd_set", offsetof(op_counters_t, cmd_set) },
+        { "set_bytes", offsetof(op_counters_t, set_bytes) },
+        { "delete_hits", offsetof(op_counters_t, delete_hits) },
+        { "delete_misses", offsetof(op_counters_t, delete_misses) },
+        { "incr_hits", offsetof(op_counters_t, incr_hits) },
+        { "incr_misses", offsetof(op_counters_t, incr_misses) },
+        { "decr_hits", offsetof(op_counters_t, decr_hits) },
+        { "decr_misses", offsetof(op_counters_t, decr_misses) },
+        { "cpu_nsec", offsetof(op_counters_t, cpu_nsec) },
+        { "cpu_samples", offsetof(op_counters_t, cpu_samples) }
+    };
+    char statval[32];
 
-        if (ret == ENGINE_SUCCESS) {
-            TK(peh->topkeys, delete_hits, key, nkey, get_current_time());
-        } else if (ret == ENGINE_KEY_ENOENT) {
-            TK(peh->topkeys, delete_misses, key, nkey, get_current_time());
-        } else if (ret == ENGINE_KEY_EEXISTS) {
-            TK(peh->topkeys, cas_badval, key, nkey, get_current_time());
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        uint64_t total = 0;
+        for (int s = 0; s < STATS_SLOTS; s++) {
+            const char *c = (const char *)&peh->counters[s].counters;
+            total += *(const uint64_t *)(c + counters[i].offset);
+        }
+        int len = snprintf(statval, sizeof(statval), "%llu",
+                           (unsigned long long)total);
+        add_stat(counters[i].name, strlen(counters[i].name),
+                 statval, len, cookie);
+    }
+}
+
+/**
+ * Copy a slow op record, unless it's unused or a writer has it.
+ *
+ * @return true if out is a complete record
+ */
+static bool copy_slow_op(const slow_op_t *rec, slow_op_t *out) {
+    int seq = rec->seq;
+    if (seq == 0 || seq == SLOW_OP_BUSY) {
+        return false;
+    }
+    MEMORY_BARRIER();
+    memcpy(out, (const void *)rec, sizeof(*out));
+    MEMORY_BARRIER();
+    /* A writer took it while we copied it */
+    return rec->seq == seq;
+}
+
+static int slow_op_cmp(const void *a, const void *b) {
+    const slow_op_t *sa = a;
+    const slow_op_t *sb = b;
+    if (sa->when != sb->when) {
+        return sa->when > sb->when ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Report the slow ops of a bucket in the tracer's ring, newest first,
+ * as "slow:<n>" = "op=..,rc=..,usec=..,time=..,bucket=..,key=..". The
+ * key comes last since it may have anything in it (the bytes that
+ * aren't printable are shown as '.'), and is cut at
+ * SLOW_OP_NAME_LEN - 1 bytes (nkey is its full length). The records
+ * are read without stopping the writers; the ones being written are
+ * skipped.
+ */
+static void add_slow_op_stats(proxied_engine_handle_t *peh,
+                              ADD_STAT add_stat, const void *cookie) {
+    struct bucket_engine *e = &bucket_engine;
+    char statval[SLOW_OP_NAME_LEN * 2 + 160];
+    int len;
+
+    len = snprintf(statval, sizeof(statval), "%llu",
+                   (unsigned long long)(peh->timings ?
+                                        peh->timings->slow_usec : 0));
+    add_stat("slow_op_usec", sizeof("slow_op_usec") - 1, statval, len, cookie);
+    if (e->slow_ops.size == 0) {
+        return;
+    }
+
+    slow_op_t *ops = malloc(e->slow_ops.size * sizeof(slow_op_t));
+    assert(ops);
+    size_t n = 0;
+    size_t cmp_len = peh->name_len < SLOW_OP_NAME_LEN ?
+        peh->name_len : SLOW_OP_NAME_LEN - 1;
+    for (size_t i = 0; i < e->slow_ops.size; i++) {
+        if (copy_slow_op(&e->slow_ops.ring[i], &ops[n]) &&
+            ops[n].name_len == peh->name_len &&
+            memcmp(ops[n].name, peh->name, cmp_len) == 0) {
+            ++n;
         }
+    }
+    qsort(ops, n, sizeof(slow_op_t), slow_op_cmp);
 
-        return ret;
-    } else {
-        return ENGINE_DISCONNECT;
+    for (size_t i = 0; i < n; i++) {
+        slow_op_t *op = &ops[i];
+        for (char *p = op->key; *p != 0x00; p++) {
+            if (!isprint((unsigned char)*p)) {
+                *p = '.';
+            }
+        }
+        char statname[32];
+        int nlen = snprintf(statname, sizeof(statname), "slow:%zu", i);
+        len = snprintf(statval, sizeof(statval),
+                       "op=%s,rc=%d,usec=%llu,time=%llu.%06llu,bucket=%s,"
+                       "nkey=%u,key=%s",
+                       timing_op_names[op->op], (int)op->rc,
+                       (unsigned long long)(op->nsec / 1000),
+                       (unsigned long long)(op->when / 1000000),
+                       (unsigned long long)(op->when % 1000000),
+                       op->name, (unsigned int)op->nkey, op->key);
+        add_stat(statname, nlen, statval, len, cookie);
     }
+    free(ops);
 }
 
 /**
- * Implementation of the "item_release" function in the engine
- * specification. Look up the correct engine and call into the
- * underlying engine if the underlying engine is "running".
+ * The CPU time the ops on a bucket used, as far as the samples tell.
  */
-static void bucket_item_release(ENGINE_HANDLE* handle,
-                                const void *cookie,
-                                item* itm) {
-    proxied_engine_handle_t *peh = try_get_engine_handle(handle, cookie);
-    if (peh) {
-        peh->pe.v1->release(peh->pe.v0, cookie, itm);
-        release_engine_handle(peh);
-    } else {
-        logger->log(EXTENSION_LOG_DEBUG, NULL,
-                    "Potential memory leak. Failed to get engine handle for %p",
-                    cookie);
+static uint64_t bucket_cpu_nsec(proxied_engine_handle_t *peh) {
+    uint64_t total = 0;
+    for (int s = 0; s < STATS_SLOTS; s++) {
+        total += peh->counters[s].counters.cpu_nsec;
     }
+    return total;
 }
 
+/** A bucket in the "bucket_cpu" stats */
+struct cpu_entry {
+    char *name;
+    uint64_t cpu_nsec;
+};
+
+/** What get_bucket_cpu_stats collects the buckets into */
+struct cpu_context {
+    struct cpu_entry *entries;
+    size_t count;
+};
+
 /**
- * Implementation of the "get" function in the engine
- * specification. Look up the correct engine and call into the
- * underlying engine if the underlying engine is "running". Disconnect
- * the caller if the engine isn't "running" anymore.
+ * A "genhash iterator" collecting the CPU time of the buckets into a
+ * cpu_context.
  */
-static ENGINE_ERROR_CODE bucket_get(ENGINE_HANDLE* handle,
-                                    const void* cookie,
-                                    item** itm,
-                                    const void* key,
-                                    const int nkey,
-                                    uint16_t vbucket) {
-    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
-    if (peh) {
-        ENGINE_ERROR_CODE ret;
-        ret = peh->pe.v1->get(peh->pe.v0, cookie, itm, key, nkey, vbucket);
-
-        if (ret == ENGINE_SUCCESS) {
-            TK(peh->topkeys, get_hits, key, nkey, get_current_time());
-        } else if (ret == ENGINE_KEY_ENOENT) {
-            TK(peh->topkeys, get_misses, key, nkey, get_current_time());
-        }
+static void collect_bucket_cpu(const void *key, size_t nkey,
+                               const void *val, size_t nval,
+                               void *arg) {
+    (void)nval;
+    struct cpu_context *ctx = arg;
+    struct cpu_entry *entry = &ctx->entries[ctx->count++];
+    entry->name = malloc(nkey + 1);
+    assert(entry->name);
+    memcpy(entry->name, key, nkey);
+    entry->name[nkey] = 0x00;
+    entry->cpu_nsec = bucket_cpu_nsec((proxied_engine_handle_t *)val);
+}
 
-        release_engine_handle(peh);
-        return ret;
-    } else {
-        return ENGINE_DISCONNECT;
+static int cpu_entry_cmp(const void *a, const void *b) {
+    const struct cpu_entry *ea = a;
+    const struct cpu_entry *eb = b;
+    if (ea->cpu_nsec != eb->cpu_nsec) {
+        return ea->cpu_nsec > eb->cpu_nsec ? -1 : 1;
     }
+    return strcmp(ea->name, eb->name);
 }
 
-static void add_engine(const void *key, size_t nkey,
-                       const void *val, size_t nval,
-                       void *arg) {
-    (void)nval;
-    struct bucket_list **blist_ptr = (struct bucket_list **)arg;
-    struct bucket_list *n = calloc(sizeof(struct bucket_list), 1);
-    n->name = (char*)key;
-    n->namelen = nkey;
-    n->peh = (proxied_engine_handle_t*) val;
-    assert(n->peh);
+/**
+ * The "bucket_cpu" stats (admin only): the CPU time (ns) the ops on
+ * every bucket used, busiest first.
+ */
+static ENGINE_ERROR_CODE get_bucket_cpu_stats(ENGINE_HANDLE* handle,
+                                              const void *cookie,
+                                              ADD_STAT add_stat) {
+    if (!is_authorized(handle, cookie)) {
+        return ENGINE_FAILED;
+    }
 
-    /* we must not leak dead buckets outside of engines_mutex. Those
-     * can be freed by bucket destructor at any time (when
-     * engines_mutex is not held) */
-    if (retain_handle(n->peh) == NULL) {
-        free(n);
+    struct bucket_engine *e = (struct bucket_engine*)handle;
+    struct cpu_context ctx = { .entries = NULL, .count = 0 };
+    lock_engines();
+    ctx.entries = calloc(genhash_size(e->engines) + 1, sizeof(ctx.entries[0]));
+    assert(ctx.entries);
+    genhash_iter(e->engines, collect_bucket_cpu, &ctx);
+    unlock_engines();
+
+    qsort(ctx.entries, ctx.count, sizeof(ctx.entries[0]), cpu_entry_cmp);
+    char statval[32];
+    for (size_t i = 0; i < ctx.count; i++) {
+        int len = snprintf(statval, sizeof(statval), "%llu",
+                           (unsigned long long)ctx.entries[i].cpu_nsec);
+        add_stat(ctx.entries[i].name, strlen(ctx.entries[i].name),
+                 statval, len, cookie);
+        free(ctx.entries[i].name);
+    }
+    free(ctx.entries);
+    return ENGINE_SUCCESS;
+}
+
+/**
+ * Bring the "topbuckets" rates of a bucket up to date: the ops and
+ * bytes since the last update are averaged in with a weight that
+ * grows with the time since then, so the rates decay by e every
+ * TOPBUCKETS_DECAY_SEC whether or not anybody looks at them. Only one
+ * thread updates them at a time; the others use them as they are.
+ */
+static void update_bucket_rates(proxied_engine_handle_t *peh, uint64_t now) {
+    bucket_rates_t *r = &peh->rates;
+    if (!ATOMIC_CAS(&r->updating, 0, 1)) {
         return;
     }
+    if (now > r->updated) {
+        uint64_t ops = 0, bytes = 0;
+        for (int i = 0; i < STATS_SLOTS; i++) {
+            const op_counters_t *c = &peh->counters[i].counters;
+            ops += c->cmd_get + c->cmd_set + c->delete_hits +
+                c->delete_misses + c->incr_hits + c->incr_misses +
+                c->decr_hits + c->decr_misses;
+            bytes += c->get_bytes + c->set_bytes;
+        }
+        /* reset_stats may have cleared the counters since */
+        uint64_t dops = ops >= r->ops ? ops - r->ops : ops;
+        uint64_t dbytes = bytes >= r->bytes ? bytes - r->bytes : bytes;
+        double secs = (double)(now - r->updated) / 1000000;
+        double w = exp(-secs / TOPBUCKETS_DECAY_SEC);
+        r->ops_rate = r->ops_rate * w + (dops / secs) * (1 - w);
+        r->bytes_rate = r->bytes_rate * w + (dbytes / secs) * (1 - w);
+        r->updated = now;
+        r->ops = ops;
+        r->bytes = bytes;
+    }
+    ATOMIC_RELEASE_ZERO(&r->updating);
+}
 
-    n->next = *blist_ptr;
-    *blist_ptr = n;
+/** A bucket in the "topbuckets" stats */
+struct top_entry {
+    char *name;
+    double ops_rate;
+    double bytes_rate;
+    int inflight;
+    int conns;
+};
+
+static int top_ops_cmp(const void *a, const void *b) {
+    const struct top_entry *ea = a;
+    const struct top_entry *eb = b;
+    if (ea->ops_rate != eb->ops_rate) {
+        return ea->ops_rate > eb->ops_rate ? -1 : 1;
+    }
+    return strcmp(ea->name, eb->name);
 }
 
-static bool list_buckets(struct bucket_engine *e, struct bucket_list **blist) {
-    lock_engines();
-    genhash_iter(e->engines, add_engine, blist);
-    unlock_engines();
-    return true;
+static int top_bytes_cmp(const void *a, const void *b) {
+    const struct top_entry *ea = a;
+    const struct top_entry *eb = b;
+    if (ea->bytes_rate != eb->bytes_rate) {
+        return ea->bytes_rate > eb->bytes_rate ? -1 : 1;
+    }
+    return strcmp(ea->name, eb->name);
 }
 
-static void bucket_list_free(struct bucket_list *blist) {
-    struct bucket_list *p = blist;
-    while (p) {
-        release_handle(p->peh);
-        struct bucket_list *tmp = p->next;
-        free(p);
-        p = tmp;
+#ifndef ENABLE_EPOCH_HANDLES
+static int top_inflight_cmp(const void *a, const void *b) {
+    const struct top_entry *ea = a;
+    const struct top_entry *eb = b;
+    if (ea->inflight != eb->inflight) {
+        return ea->inflight > eb->inflight ? -1 : 1;
     }
+    return strcmp(ea->name, eb->name);
 }
+#endif
 
 /**
- * Implementation of the "aggregate_stats" function in the engine
- * specification. Look up the correct engine and call into the
- * underlying engine if the underlying engine is "running". Disconnect
- * the caller if the engine isn't "running" anymore.
+ * The "topbuckets [ops|bytes|inflight]" stats (admin only): the
+ * running buckets ranked by their decayed ops per second (the
+ * default), bytes per second (of the values got and stored) or
+ * number of clients inside the engine, as
+ * "<bucket>" = "ops_per_sec=..,bytes_per_sec=..,inflight=..,conns=..".
+ *
+ * The buckets are read from the registry snapshot in one pass, like
+ * find_bucket does, so it takes no lock. Epochs don't tell which
+ * engine a thread is in, so there's no inflight with them.
  */
-static ENGINE_ERROR_CODE bucket_aggregate_stats(ENGINE_HANDLE* handle,
-                                                const void* cookie,
-                                                void (*callback)(void*, void*),
-                                                void *stats) {
-    (void)cookie;
-    struct bucket_engine *e = (struct bucket_engine*)handle;
-    struct bucket_list *blist = NULL;
-    if (! list_buckets(e, &blist)) {
+static ENGINE_ERROR_CODE get_topbuckets_stats(ENGINE_HANDLE* handle,
+                                              const void *cookie,
+                                              const char *stat_key,
+                                              int nkey,
+                                              ADD_STAT add_stat) {
+    if (!is_authorized(handle, cookie)) {
         return ENGINE_FAILED;
     }
 
-    struct bucket_list *p = blist;
-    while (p) {
-        callback(p->peh->stats, stats);
-        p = p->next;
+    const int prefix = sizeof("topbuckets");
+    const char *rank = nkey > prefix ? stat_key + prefix : "ops";
+    int nrank = nkey > prefix ? nkey - prefix : 3;
+    int (*cmp)(const void *, const void *);
+    if (nrank == 3 && memcmp(rank, "ops", 3) == 0) {
+        cmp = top_ops_cmp;
+    } else if (nrank == 5 && memcmp(rank, "bytes", 5) == 0) {
+        cmp = top_bytes_cmp;
+    } else if (nrank == 8 && memcmp(rank, "inflight", 8) == 0) {
+#ifdef ENABLE_EPOCH_HANDLES
+        return ENGINE_ENOTSUP;
+#else
+        cmp = top_inflight_cmp;
+#endif
+    } else {
+        return ENGINE_EINVAL;
     }
 
-    bucket_list_free(blist);
+    uint64_t now = now_usec();
+    struct top_entry *entries = NULL;
+    size_t count = 0;
+    epoch_enter(EPOCH_REGISTRY);
+    bucket_registry_t *reg = bucket_engine.registry;
+    if (reg != NULL) {
+        entries = calloc(reg->size, sizeof(entries[0]));
+        assert(entries);
+        for (size_t i = 0; i < reg->size; i++) {
+            proxied_engine_handle_t *peh = reg->slots[i].peh;
+            if (peh == NULL || peh->state != STATE_RUNNING) {
+                continue;
+            }
+            update_bucket_rates(peh, now);
+            struct top_entry *entry = &entries[count++];
+            entry->name = strdup(peh->name);
+            assert(entry->name);
+            entry->ops_rate = peh->rates.ops_rate;
+            entry->bytes_rate = peh->rates.bytes_rate;
+#ifndef ENABLE_EPOCH_HANDLES
+            entry->inflight = count_clients(peh);
+#endif
+            entry->conns = peh->refcount - 1;
+        }
+    }
+    epoch_exit(EPOCH_REGISTRY);
+
+    qsort(entries, count, sizeof(entries[0]), cmp);
+    char statval[128];
+    for (size_t i = 0; i < count; i++) {
+        struct top_entry *entry = &entries[i];
+#ifdef ENABLE_EPOCH_HANDLES
+        int len = snprintf(statval, sizeof(statval),
+                           "ops_per_sec=%.1f,bytes_per_sec=%.1f,conns=%d",
+                           entry->ops_rate, entry->bytes_rate, entry->conns);
+#else
+        int len = snprintf(statval, sizeof(statval),
+                           "ops_per_sec=%.1f,bytes_per_sec=%.1f,"
+                           "inflight=%d,conns=%d",
+                           entry->ops_rate, entry->bytes_rate,
+                           entry->inflight, entry->conns);
+#endif
+        add_stat(entry->name, strlen(entry->name), statval, len, cookie);
+        free(entry->name);
+    }
+    free(entries);
     return ENGINE_SUCCESS;
 }
 
-struct stat_context {
-    ADD_STAT add_stat;
-    const void *cookie;
-};
-
-static void stat_ht_builder(const void *key, size_t nkey,
-                            const void *val, size_t nval,
-                            void *arg) {
-    (void)nval;
-    assert(arg);
-    struct stat_context *ctx = (struct stat_context*)arg;
-    proxied_engine_handle_t *bucket = (proxied_engine_handle_t*)val;
-    const char * const bucketState = bucket_state_name(bucket->state);
-    ctx->add_stat(key, nkey, bucketState, strlen(bucketState),
-                  ctx->cookie);
+/**
+ * Is the stat key the stats group, with or without a bucket name
+ * after it?
+ */
+static bool is_stat_group(const char *stat_key, int nkey, const char *group) {
+    int len = (int)strlen(group);
+    return nkey >= len && memcmp(group, stat_key, len) == 0 &&
+        (nkey == len || stat_key[len] == ' ');
 }
 
 /**
- * Get bucket-engine specific statistics
+ * The stats groups bucket_engine keeps for every bucket itself
+ * ("bucket_timings", "bucket_ops" and "slow_ops"): the stats of the
+ * connection's bucket, or with "<group> <bucket>" (admin only) of the
+ * named bucket.
  */
-static ENGINE_ERROR_CODE get_bucket_stats(ENGINE_HANDLE* handle,
-                                          const void *cookie,
-                                          ADD_STAT add_stat) {
+static ENGINE_ERROR_CODE get_bucket_group_stats(ENGINE_HANDLE* handle,
+                                                const void *cookie,
+                                                const char *stat_key,
+                                                int nkey,
+                                                const char *group,
+                                                void (*add_group)(proxied_engine_handle_t *,
+                                                                  ADD_STAT,
+                                                                  const void *),
+                                                ADD_STAT add_stat) {
+    const int prefix = (int)strlen(group) + 1;
+    if (nkey <= prefix) {
+        proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+        if (peh == NULL) {
+            return ENGINE_DISCONNECT;
+        }
+        add_group(peh, add_stat, cookie);
+        release_engine_handle(peh);
+        return ENGINE_SUCCESS;
+    }
 
     if (!is_authorized(handle, cookie)) {
         return ENGINE_FAILED;
     }
-
-    struct bucket_engine *e = (struct bucket_engine*)handle;
-    struct stat_context sctx = {.add_stat = add_stat, .cookie = cookie};
-
-    lock_engines();
-    genhash_iter(e->engines, stat_ht_builder, &sctx);
-    unlock_engines();
+    char name[nkey - prefix + 1];
+    memcpy(name, stat_key + prefix, nkey - prefix);
+    name[nkey - prefix] = 0x00;
+    proxied_engine_handle_t *peh = find_bucket(name);
+    if (peh == NULL) {
+        return ENGINE_KEY_ENOENT;
+    }
+    add_group(peh, add_stat, cookie);
+    release_handle(peh);
     return ENGINE_SUCCESS;
 }
 
@@ -1712,6 +5515,39 @@ static ENGINE_ERROR_CODE bucket_get_stats(ENGINE_HANDLE* handle,
         memcmp("bucket", stat_key, nkey) == 0) {
         return get_bucket_stats(handle, cookie, add_stat);
     }
+    if (nkey == (sizeof("bucket_engine") - 1) &&
+        memcmp("bucket_engine", stat_key, nkey) == 0) {
+        return get_node_stats(handle, cookie, add_stat);
+    }
+    /* Not "timings": that's the underlying engine's own group */
+    if (is_stat_group(stat_key, nkey, "bucket_timings")) {
+        if (!bucket_engine.op_timings) {
+            return ENGINE_ENOTSUP;
+        }
+        return get_bucket_group_stats(handle, cookie, stat_key, nkey,
+                                      "bucket_timings", add_timing_stats,
+                                      add_stat);
+    }
+    if (nkey == (sizeof("bucket_cpu") - 1) &&
+        memcmp("bucket_cpu", stat_key, nkey) == 0) {
+        return get_bucket_cpu_stats(handle, cookie, add_stat);
+    }
+    if (is_stat_group(stat_key, nkey, "topbuckets")) {
+        return get_topbuckets_stats(handle, cookie, stat_key, nkey, add_stat);
+    }
+    if (is_stat_group(stat_key, nkey, "bucket_ops")) {
+        return get_bucket_group_stats(handle, cookie, stat_key, nkey,
+                                      "bucket_ops", add_op_counter_stats,
+                                      add_stat);
+    }
+    if (is_stat_group(stat_key, nkey, "slow_ops")) {
+        if (!bucket_engine.op_timings) {
+            return ENGINE_ENOTSUP;
+        }
+        return get_bucket_group_stats(handle, cookie, stat_key, nkey,
+                                      "slow_ops", add_slow_op_stats,
+                                      add_stat);
+    }
 
     ENGINE_ERROR_CODE rc = ENGINE_DISCONNECT;
     proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
@@ -1729,9 +5565,14 @@ static ENGINE_ERROR_CODE bucket_get_stats(ENGINE_HANDLE* handle,
                 snprintf(statval, sizeof(statval), "%d", peh->refcount - 1);
                 add_stat("bucket_conns", sizeof("bucket_conns") - 1, statval,
                          strlen(statval), cookie);
-                snprintf(statval, sizeof(statval), "%d", peh->clients);
+                add_limit_stats(peh, add_stat, cookie);
+                add_bucket_fair_stats(peh, add_stat, cookie);
+#ifndef ENABLE_EPOCH_HANDLES
+                /* Epochs don't tell which engine a thread is in */
+                snprintf(statval, sizeof(statval), "%d", count_clients(peh));
                 add_stat("bucket_active_conns", sizeof("bucket_active_conns") -1,
                          statval, strlen(statval), cookie);
+#endif
             }
         }
         release_engine_handle(peh);
@@ -1769,13 +5610,33 @@ static ENGINE_ERROR_CODE bucket_store(ENGINE_HANDLE* handle,
                                       uint64_t *cas,
                                       ENGINE_STORE_OPERATION operation,
                                       uint16_t vbucket) {
-    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    ENGINE_ERROR_CODE ret;
+    proxied_engine_handle_t *peh = get_limited_engine_handle(handle, cookie,
+                                                             &ret);
     if (peh) {
-        ENGINE_ERROR_CODE ret;
+        /* The slow op tracer needs the key, in case the store is slow */
+        item_info key_info = { .nvalue = 1 };
+        if (traces_slow_ops(peh) &&
+            !peh->pe.v1->get_item_info(peh->pe.v0, cookie, itm, &key_info)) {
+            key_info.key = NULL;
+        }
+        op_start_t start = timing_start();
         ret = peh->pe.v1->store(peh->pe.v0, cookie, itm, cas, operation, vbucket);
-        if (ret != ENGINE_EWOULDBLOCK && peh->topkeys) {
+        record_op_timing(peh, TIMING_STORE, start, ret,
+                         key_info.key, key_info.nkey);
+        if (ret != ENGINE_EWOULDBLOCK) {
+            /* Only topkeys and the byte counters (see item_nbytes)
+             * need the item info */
+            bool count_bytes = bucket_engine.op_timings;
             item_info itm_info = { .nvalue = 1 };
-            if (peh->pe.v1->get_item_info(peh->pe.v0, cookie, itm, &itm_info)) {
+            bool have_info = (peh->topkeys || count_bytes) &&
+                peh->pe.v1->get_item_info(peh->pe.v0, cookie, itm, &itm_info);
+            op_counters_t *c = op_counters(peh);
+            stats_add(&c->cmd_set, 1);
+            if (ret == ENGINE_SUCCESS && have_info && count_bytes) {
+                stats_add(&c->set_bytes, itm_info.nbytes);
+            }
+            if (have_info && peh->topkeys) {
                 const void* key = itm_info.key;
                 const int nkey = itm_info.nkey;
 
@@ -1795,11 +5656,9 @@ static ENGINE_ERROR_CODE bucket_store(ENGINE_HANDLE* handle,
                 }
             }
         }
-        release_engine_handle(peh);
-        return ret;
-    } else {
-        return ENGINE_DISCONNECT;
+        release_limited_engine_handle(peh, cookie);
     }
+    return ret;
 }
 
 /**
@@ -1820,35 +5679,40 @@ static ENGINE_ERROR_CODE bucket_arithmetic(ENGINE_HANDLE* handle,
                                            uint64_t *cas,
                                            uint64_t *result,
                                            uint16_t vbucket) {
-    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    ENGINE_ERROR_CODE ret;
+    proxied_engine_handle_t *peh = get_limited_engine_handle(handle, cookie,
+                                                             &ret);
     if (peh) {
-        ENGINE_ERROR_CODE ret;
+        op_start_t start = timing_start();
         ret = peh->pe.v1->arithmetic(peh->pe.v0, cookie, key, nkey,
                                 increment, create, delta, initial,
                                 exptime, cas, result, vbucket);
+        record_op_timing(peh, TIMING_ARITHMETIC, start, ret, key, nkey);
 
 
         if (ret == ENGINE_SUCCESS) {
             if (increment) {
+                stats_add(&op_counters(peh)->incr_hits, 1);
                 TK(peh->topkeys, incr_hits, key, nkey, get_current_time());
             } else {
+                stats_add(&op_counters(peh)->decr_hits, 1);
                 TK(peh->topkeys, decr_hits, key, nkey, get_current_time());
 
             }
         } else if (ret == ENGINE_KEY_ENOENT) {
             if (increment) {
+                stats_add(&op_counters(peh)->incr_misses, 1);
                 TK(peh->topkeys, incr_misses, key, nkey, get_current_time());
             } else {
+                stats_add(&op_counters(peh)->decr_misses, 1);
                 TK(peh->topkeys, decr_misses, key, nkey, get_current_time());
 
             }
         }
 
-        release_engine_handle(peh);
-        return ret;
-    } else {
-        return ENGINE_DISCONNECT;
+        release_limited_engine_handle(peh, cookie);
     }
+    return ret;
 }
 
 /**
@@ -1862,7 +5726,9 @@ static ENGINE_ERROR_CODE bucket_flush(ENGINE_HANDLE* handle,
     proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
     if (peh) {
         ENGINE_ERROR_CODE ret;
+        op_start_t start = timing_start();
         ret = peh->pe.v1->flush(peh->pe.v0, cookie, when);
+        record_op_timing(peh, TIMING_FLUSH, start, ret, NULL, 0);
         release_engine_handle(peh);
         return ret;
     } else {
@@ -1879,6 +5745,15 @@ static void bucket_reset_stats(ENGINE_HANDLE* handle, const void *cookie) {
     proxied_engine_handle_t *peh = try_get_engine_handle(handle, cookie);
     if (peh) {
         peh->pe.v1->reset_stats(peh->pe.v0, cookie);
+        memset(peh->counters, 0, STATS_SLOTS * sizeof(op_counter_slot_t));
+        if (peh->timings != NULL) {
+            for (int i = 0; i < STATS_SLOTS; i++) {
+                timing_slot_t *slot = peh->timings->slots[i];
+                if (slot != NULL) {
+                    memset(slot, 0, sizeof(*slot));
+                }
+            }
+        }
         release_engine_handle(peh);
     }
 }
@@ -1944,10 +5819,12 @@ static ENGINE_ERROR_CODE bucket_tap_notify(ENGINE_HANDLE* handle,
     proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
     if (peh) {
         ENGINE_ERROR_CODE ret;
+        op_start_t start = timing_start();
         ret = peh->pe.v1->tap_notify(peh->pe.v0, cookie, engine_specific,
                                 nengine, ttl, tap_flags, tap_event, tap_seqno,
                                 key, nkey, flags, exptime, cas, data, ndata,
                                 vbucket);
+        record_op_timing(peh, TIMING_TAP_NOTIFY, start, ret, key, nkey);
         release_engine_handle(peh);
         return ret;
     } else {
@@ -2062,6 +5939,15 @@ static ENGINE_ERROR_CODE initialize_configuration(struct bucket_engine *me,
     ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
 
     me->auto_create = true;
+    me->shutdown_threads = 4;
+    me->spares.size = 0;
+    me->hibernate_after = 0;
+    me->negative.ttl = 0;
+    me->negative.size = 1024;
+    me->fair.threshold = 0;
+    me->op_timings = false;
+    me->cpu_sample_rate = 0;
+    me->slow_ops.size = 256;
 
     if (cfg_str != NULL) {
         struct config_item items[] = {
@@ -2083,6 +5969,33 @@ static ENGINE_ERROR_CODE initialize_configuration(struct bucket_engine *me,
             { .key = "auto_create",
               .datatype = DT_BOOL,
               .value.dt_bool = &me->auto_create },
+            { .key = "shutdown_threads",
+              .datatype = DT_SIZE,
+              .value.dt_size = &me->shutdown_threads },
+            { .key = "spare_engines",
+              .datatype = DT_SIZE,
+              .value.dt_size = &me->spares.size },
+            { .key = "hibernate_after",
+              .datatype = DT_SIZE,
+              .value.dt_size = &me->hibernate_after },
+            { .key = "negative_cache_ttl",
+              .datatype = DT_SIZE,
+              .value.dt_size = &me->negative.ttl },
+            { .key = "negative_cache_size",
+              .datatype = DT_SIZE,
+              .value.dt_size = &me->negative.size },
+            { .key = "cpu_sample_rate",
+              .datatype = DT_SIZE,
+              .value.dt_size = &me->cpu_sample_rate },
+            { .key = "op_timings",
+              .datatype = DT_BOOL,
+              .value.dt_bool = &me->op_timings },
+            { .key = "slow_ops_size",
+              .datatype = DT_SIZE,
+              .value.dt_size = &me->slow_ops.size },
+            { .key = "overload_inflight",
+              .datatype = DT_SIZE,
+              .value.dt_size = &me->fair.threshold },
             { .key = "config_file",
               .datatype = DT_CONFIGFILE },
             { .key = NULL}
@@ -2102,6 +6015,18 @@ static ENGINE_ERROR_CODE initialize_configuration(struct bucket_engine *me,
             if (!items[4].found) {
                 me->default_bucket_config = strdup("");
             }
+            if (me->shutdown_threads == 0) {
+                me->shutdown_threads = 1;
+            }
+            if (me->fair.threshold > INT_MAX) {
+                me->fair.threshold = INT_MAX;
+            }
+            if (me->cpu_sample_rate > (1 << 30)) {
+                me->cpu_sample_rate = 1 << 30;
+            }
+            if (me->slow_ops.size > (1 << 20)) {
+                me->slow_ops.size = 1 << 20;
+            }
         } else {
             ret = ENGINE_FAILED;
         }
@@ -2164,10 +6089,8 @@ static ENGINE_ERROR_CODE handle_create_bucket(ENGINE_HANDLE* handle,
     const size_t msglen = 1024;
     char msg[msglen];
     msg[0] = 0;
-    lock_engines();
-    ENGINE_ERROR_CODE ret = create_bucket_UNLOCKED(e, keyz, spec, config,
-                                                   NULL, msg, msglen);
-    unlock_engines();
+    ENGINE_ERROR_CODE ret = create_bucket(e, keyz, spec, config,
+                                          NULL, msg, msglen);
 
     protocol_binary_response_status rc;
     switch(ret) {
@@ -2240,15 +6163,21 @@ static ENGINE_ERROR_CODE handle_delete_bucket(ENGINE_HANDLE* handle,
             }
         }
 
+        /* There's no engine to shut down in a hibernated bucket */
+        if (delete_hibernated_bucket(keyz)) {
+            response(NULL, 0, NULL, 0, NULL, 0, 0,
+                     PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+            return ENGINE_SUCCESS;
+        }
+
         bool found = false;
         proxied_engine_handle_t *peh = find_bucket(keyz);
 
         if (peh) {
-            /* bumped clients count protects transition from
-             * STATE_RUNNING to STATE_STOPPED while peh->cookie is not
-             * yet set. */
-            int count = ATOMIC_INCR(&peh->clients);
-            assert(count > 0);
+            /* bumped clients count (or our epoch) protects transition
+             * from STATE_RUNNING to STATE_STOPPED (or the shutdown
+             * thread) while peh->cookie is not yet set. */
+            enter_engine_handle(peh);
             if (ATOMIC_CAS(&peh->state, STATE_RUNNING, STATE_STOPPING)) {
                 peh->cookie = cookie;
                 found = true;
@@ -2354,7 +6283,23 @@ static ENGINE_ERROR_CODE handle_select_bucket(ENGINE_HANDLE* handle,
 
     EXTRACT_KEY(breq, keyz);
 
+    /* We've been here before if the bucket was hibernated (we only
+     * try to wake it up once) */
+    bool retry = bucket_get_engine_specific(cookie) == request;
+    if (retry) {
+        bucket_store_engine_specific(cookie, NULL);
+    }
+
     proxied_engine_handle_t *proxied = find_bucket(keyz);
+    if (proxied == NULL && !retry) {
+        /* Wake it up in the background, and have the client come
+         * back when it's done (like handle_delete_bucket does) */
+        bucket_store_engine_specific(cookie, request);
+        if (queue_bucket_wake(keyz, cookie)) {
+            return ENGINE_EWOULDBLOCK;
+        }
+        bucket_store_engine_specific(cookie, NULL);
+    }
     set_engine_handle(handle, cookie, proxied);
     release_handle(proxied);
 
@@ -2370,6 +6315,60 @@ static ENGINE_ERROR_CODE handle_select_bucket(ENGINE_HANDLE* handle,
     return ENGINE_SUCCESS;
 }
 
+/**
+ * Implementation of the "CONFIG" command. Change the limits of a
+ * running bucket (see parse_limit_config for the settings).
+ */
+static ENGINE_ERROR_CODE handle_config_bucket(ENGINE_HANDLE* handle,
+                                              const void* cookie,
+                                              protocol_binary_request_header *request,
+                                              ADD_RESPONSE response) {
+    (void)handle;
+    protocol_binary_request_config_bucket *breq = (void*)request;
+
+    EXTRACT_KEY(breq, keyz);
+
+    size_t bodylen = ntohl(breq->message.header.request.bodylen)
+        - ntohs(breq->message.header.request.keylen);
+    if (bodylen >= (1 << 16)) {
+        return ENGINE_DISCONNECT;
+    }
+    char config[bodylen + 1];
+    memcpy(config, ((char*)request) + sizeof(breq->message.header)
+           + ntohs(breq->message.header.request.keylen), bodylen);
+    config[bodylen] = 0x00;
+
+    proxied_engine_handle_t *peh = find_bucket(keyz);
+    if (peh == NULL) {
+        const char *msg = "Engine not found";
+        response(NULL, 0, NULL, 0, msg, strlen(msg), 0,
+                 PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0, cookie);
+        return ENGINE_SUCCESS;
+    }
+
+    bucket_limit_t *limit = peh->limit;
+    limit_config_t lc = {
+        .rate = limit ? limit->rate : 0,
+        .delay = limit ? limit->delay : true,
+        .max_inflight = limit ? (size_t)limit->max_inflight : 0,
+        .weight = peh->fair.weight,
+        .slow_usec = peh->timings ? peh->timings->slow_usec : 0
+    };
+    if (config[0] == 0 || !parse_limit_config(config, &lc)) {
+        release_handle(peh);
+        const char *msg = "Invalid config parameters";
+        response(msg, strlen(msg), "", 0, "", 0, 0,
+                 PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+        return ENGINE_SUCCESS;
+    }
+    set_bucket_limit(peh, &lc);
+    release_handle(peh);
+
+    response(NULL, 0, NULL, 0, NULL, 0, 0,
+             PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+    return ENGINE_SUCCESS;
+}
+
 /**
  * Check if a command opcode is one of the commands bucket_engine
  * implements. Bucket_engine used command opcodes from the reserved range
@@ -2387,6 +6386,7 @@ static inline bool is_admin_command(uint8_t opcode) {
     case LIST_BUCKETS_DEPRECATED:
     case SELECT_BUCKET:
     case SELECT_BUCKET_DEPRECATED:
+    case CONFIG_BUCKET:
         return true;
     default:
         return false;
@@ -2489,19 +6489,26 @@ static ENGINE_ERROR_CODE bucket_unknown_command(ENGINE_HANDLE* handle,
             case SELECT_BUCKET_DEPRECATED:
                 rv = handle_select_bucket(handle, cookie, request, response);
                 break;
+            case CONFIG_BUCKET:
+                rv = handle_config_bucket(handle, cookie, request, response);
+                break;
             default:
                 assert(false);
             }
         }
     } else {
-        proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+        proxied_engine_handle_t *peh = get_limited_engine_handle(handle, cookie,
+                                                                 &rv);
         if (peh) {
+            op_start_t start = timing_start();
             rv = peh->pe.v1->unknown_command(peh->pe.v0, cookie, request,
                                              response);
+            record_op_timing(peh, TIMING_UNKNOWN_COMMAND, start, rv,
+                             (char*)request + sizeof(request->request) +
+                             request->request.extlen,
+                             ntohs(request->request.keylen));
             update_topkey_command(peh, request, rv);
-            release_engine_handle(peh);
-        } else {
-            rv = ENGINE_DISCONNECT;
+            release_limited_engine_handle(peh, cookie);
         }
     }
 
@@ -2539,7 +6546,9 @@ static ENGINE_ERROR_CODE bucket_engine_reserve_cookie(const void *cookie)
     /* This can only be reliably called form engine up-call so that
      * it's impossible to transition to STATE_STOPPED while we're
      * here. */
-    assert(peh->clients >= 0);
+#ifndef ENABLE_EPOCH_HANDLES
+    assert(count_clients(peh) >= 0);
+#endif
 
     if (peh->state != STATE_RUNNING) {
         return ENGINE_FAILED;
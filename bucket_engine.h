@@ -16,10 +16,12 @@
 #define DELETE_BUCKET 0x86
 #define LIST_BUCKETS  0x87
 #define SELECT_BUCKET 0x89
+#define CONFIG_BUCKET 0x8a
 
 typedef protocol_binary_request_no_extras protocol_binary_request_create_bucket;
 typedef protocol_binary_request_no_extras protocol_binary_request_delete_bucket;
 typedef protocol_binary_request_no_extras protocol_binary_request_list_buckets;
 typedef protocol_binary_request_no_extras protocol_binary_request_select_bucket;
+typedef protocol_binary_request_no_extras protocol_binary_request_config_bucket;
 
 #endif /* BUCKET_ENGINE_H */
@@ -5,6 +5,7 @@
 #include <memcached/engine.h>
 #include "genhash.h"
 #include "topkeys.h"
+#include "epoch.h"
 #include "bucket_engine.h"
 
 typedef union proxied_engine {
@@ -16,15 +17,413 @@ typedef enum {
     STATE_NULL,
     STATE_RUNNING,
     STATE_STOPPING,
-    STATE_STOPPED
+    STATE_STOPPED,
+    /* Placeholder for a bucket being loaded and initialized */
+    STATE_CREATING,
+    /* An idle bucket whose engine is being destroyed, has been
+     * destroyed, or is being initialized again (see
+     * hibernate_idle_buckets and find_bucket_awake) */
+    STATE_HIBERNATING,
+    STATE_HIBERNATED,
+    STATE_WAKING
 } bucket_state_t;
 
+#if defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+static inline int ATOMIC_ADD(volatile int *dest, int value) {
+    return atomic_add_int_nv((volatile unsigned int *)dest, value);
+}
+
+static inline int ATOMIC_INCR(volatile int *dest) {
+    return atomic_inc_32_nv((volatile unsigned int *)dest);
+}
+
+static inline int ATOMIC_DECR(volatile int *dest) {
+    return atomic_dec_32_nv((volatile unsigned int *)dest);
+}
+
+static inline int ATOMIC_CAS(volatile bucket_state_t *dest, int prev, int next) {
+    return (prev == atomic_cas_uint((volatile uint_t*)dest, (uint_t)prev,
+                                    (uint_t)next));
+}
+
+#define ATOMIC_ADD64(i, by) atomic_add_64((volatile uint64_t *)(i), (by))
+#define MEMORY_BARRIER() do { membar_enter(); membar_exit(); } while (0)
+#define ATOMIC_RELEASE_ZERO(i) do { membar_exit(); *(i) = 0; } while (0)
+#else
+#define ATOMIC_ADD(i, by) __sync_add_and_fetch(i, by)
+#define ATOMIC_INCR(i) ATOMIC_ADD(i, 1)
+#define ATOMIC_DECR(i) ATOMIC_ADD(i, -1)
+#define ATOMIC_ADD64(i, by) ((void)__sync_add_and_fetch(i, by))
+#define ATOMIC_CAS(ptr, oldval, newval) \
+            __sync_bool_compare_and_swap(ptr, oldval, newval)
+#define MEMORY_BARRIER() __sync_synchronize()
+/* Store 0 after all preceding loads and stores (a release store) */
+#define ATOMIC_RELEASE_ZERO(i) __sync_lock_release(i)
+#endif
+
+#define CACHE_LINE_SIZE 64
+
+/* Start a member on a new cache line (and pad the struct to a whole
+ * number of cache lines). Only effective for objects that are
+ * allocated on a cache line boundary, see calloc_cache_aligned */
+#ifdef __GNUC__
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+#else
+#define CACHE_ALIGNED
+#endif
+
+#ifndef ENABLE_EPOCH_HANDLES
+/** Number of slots in the clients counter (must be a power of two) */
+#define CLIENT_SLOTS 64
+
+/**
+ * One slot of the distributed clients counter. Each thread always
+ * uses the same slot, and slots live on separate cache lines, so
+ * threads calling into the same bucket don't contend on the counter.
+ */
+typedef struct client_slot {
+    volatile int count;
+    char pad[CACHE_LINE_SIZE - sizeof(int)];
+} client_slot_t;
+#endif
+
+/** Number of slots in an ops limit (must be a power of two) */
+#define LIMIT_SLOTS 16
+
+/**
+ * The tokens one slot of an ops limit has taken from the shared
+ * bucket. Like the clients counter, each thread always uses the same
+ * slot.
+ */
+typedef struct limit_slot {
+    volatile int tokens;
+    char pad[CACHE_LINE_SIZE - sizeof(int)];
+} limit_slot_t;
+
+/**
+ * The limits of a bucket, as given in its config (see
+ * parse_limit_config).
+ */
+typedef struct limit_config {
+    size_t rate;
+    bool delay;
+    size_t max_inflight;
+    size_t weight;
+    size_t slow_usec;
+} limit_config_t;
+
+/**
+ * A thread waiting for a bucket to leave STATE_CREATING,
+ * STATE_HIBERNATING or STATE_WAKING. It lives on the waiter's stack,
+ * and sleeps on a condition of its own so only the waiters of the
+ * bucket that changed are woken (see wait_for_bucket_UNLOCKED).
+ */
+typedef struct bucket_waiter {
+    pthread_cond_t cond;
+    /* Set by the one waking us up, under the engines lock */
+    bool woken;
+    struct bucket_waiter *next;
+} bucket_waiter_t;
+
+/**
+ * An op waiting for a slot under the max_inflight of its bucket.
+ */
+typedef struct parked_op {
+    const void *cookie;
+    /* The connection's engine specific, if it has to be told it was
+     * handed a slot (see grant_parked_UNLOCKED) */
+    struct engine_specific *es;
+    /* When it was parked (usec) */
+    uint64_t since;
+    struct parked_op *next;
+} parked_op_t;
+
+/** Number of buckets in the histogram of the parked ops' waits */
+#define INFLIGHT_WAIT_BUCKETS 6
+
+/**
+ * The limits of a bucket: a token bucket limiting the ops per second
+ * (see throttle_op), and a cap on the ops inside the engine at once
+ * (see enter_inflight). It's allocated the first time a limit is set
+ * for the bucket, and lives as long as the handle.
+ */
+typedef struct bucket_limit {
+    /* Ops per second (0 means no limit) */
+    volatile size_t rate;
+    /* Delay the ops over the limit instead of failing them */
+    volatile bool delay;
+    /* Max number of ops inside the engine at once (0 means no cap) */
+    volatile int max_inflight;
+    /* Number of ops queued for a slot under max_inflight */
+    volatile int queued;
+    pthread_mutex_t mutex;
+    /* The shared bucket. It goes below 0 when ops are delayed, which
+     * delays the ones after them even more */
+    double tokens;
+    /* When the tokens were last added (usec) */
+    uint64_t refilled;
+    uint64_t delayed;
+    uint64_t rejected;
+    /* The queued ops, oldest first */
+    parked_op_t *parked_head;
+    parked_op_t *parked_tail;
+    /* Number of ops ever queued, and how long they waited */
+    uint64_t parked;
+    uint64_t waits[INFLIGHT_WAIT_BUCKETS];
+    /* Number of ops inside the engine (when there's a max_inflight) */
+    CACHE_ALIGNED volatile int inflight;
+    CACHE_ALIGNED limit_slot_t slots[LIMIT_SLOTS];
+} bucket_limit_t;
+
+/** The ops whose time in the engine is recorded per bucket */
+typedef enum {
+    TIMING_ALLOCATE,
+    TIMING_GET,
+    TIMING_STORE,
+    TIMING_REMOVE,
+    TIMING_ARITHMETIC,
+    TIMING_FLUSH,
+    TIMING_UNKNOWN_COMMAND,
+    TIMING_TAP_NOTIFY,
+    TIMING_OPS
+} timing_op_t;
+
+/** The timing histograms split every power of two (of timing_ticks)
+ * into 1 << TIMING_SUB_BITS linear buckets */
+#define TIMING_SUB_BITS 2
+/** Times from 1 << TIMING_MAX_BITS ticks (tens of seconds) up go in
+ * the last bucket */
+#define TIMING_MAX_BITS 36
+#define TIMING_BUCKETS ((TIMING_MAX_BITS - TIMING_SUB_BITS + 1) << TIMING_SUB_BITS)
+/** Number of slots the threads keep the per-bucket op stats in (see
+ * stats_slot). At most 32, the owned slots are kept in an int */
+#define STATS_SLOTS 16
+
+/**
+ * What the ops on a bucket did, counted by bucket_engine the same way
+ * for every engine type (the "bucket_ops" stats). The bytes are the
+ * values' sizes.
+ */
+typedef struct op_counters {
+    uint64_t cmd_get;
+    uint64_t get_hits;
+    uint64_t get_misses;
+    uint64_t get_bytes;
+    uint64_t cmd_set;
+    uint64_t set_bytes;
+    uint64_t delete_hits;
+    uint64_t delete_misses;
+    uint64_t incr_hits;
+    uint64_t incr_misses;
+    uint64_t decr_hits;
+    uint64_t decr_misses;
+    /* The CPU time the threads spent in the engine, estimated from
+     * the sampled ops (see cpu_sample_start), and the number of
+     * samples */
+    uint64_t cpu_nsec;
+    uint64_t cpu_samples;
+} op_counters_t;
+
+/**
+ * The op counters of a bucket kept by the threads using one slot.
+ * Slots live on separate cache lines.
+ */
+typedef struct op_counter_slot {
+    op_counters_t counters;
+    char pad[2 * CACHE_LINE_SIZE - sizeof(op_counters_t)];
+} op_counter_slot_t;
+
+/**
+ * The op timing histograms of a bucket recorded by the threads using
+ * one slot (see record_op_timing).
+ */
+typedef struct timing_slot {
+    uint64_t hist[TIMING_OPS][TIMING_BUCKETS];
+} timing_slot_t;
+
+/**
+ * The op timings of a bucket. A slot is allocated the first time a
+ * thread using it times an op on the bucket.
+ */
+typedef struct bucket_timings {
+    timing_slot_t * volatile slots[STATS_SLOTS];
+    /* The ops taking longer than slow_usec (0 for none) are traced
+     * (see record_slow_op). slow_ticks is where record_op_timing
+     * starts looking at them */
+    volatile size_t slow_usec;
+    volatile uint64_t slow_ticks;
+} bucket_timings_t;
+
+/** Number of bytes of the bucket name and the key a slow op record
+ * keeps (including the terminating 0) */
+#define SLOW_OP_NAME_LEN 32
+/** The largest slow_op_usec a bucket may be given */
+#define SLOW_OP_MAX_USEC 1000000000
+/** What the seq of a slow op record is while it's being written */
+#define SLOW_OP_BUSY -1
+
+/**
+ * An op that took longer than the slow_usec of its bucket, in the ring
+ * of the slow op tracer (see record_slow_op).
+ */
+typedef struct slow_op {
+    /* 0 while the record is unused, SLOW_OP_BUSY while it's being
+     * written, else which record it is, so the readers can tell it
+     * wasn't overwritten while they copied it */
+    volatile int seq;
+    timing_op_t op;
+    ENGINE_ERROR_CODE rc;
+    /* The full lengths of the bucket name and the key */
+    uint16_t name_len;
+    uint16_t nkey;
+    /* When it returned (usec since the epoch) and how long it took */
+    uint64_t when;
+    uint64_t nsec;
+    char name[SLOW_OP_NAME_LEN];
+    char key[SLOW_OP_NAME_LEN];
+} slow_op_t;
+
+/** Number of seconds over which the "topbuckets" rates decay by e */
+#define TOPBUCKETS_DECAY_SEC 10.0
+
+/**
+ * The decayed op and byte rates of a bucket, for the "topbuckets"
+ * stats (see update_bucket_rates).
+ */
+typedef struct bucket_rates {
+    /* Set by the thread updating the rates. The others use the rates
+     * as they are rather than wait */
+    volatile int updating;
+    /* When the rates were last updated (usec), and the op and byte
+     * counts then */
+    uint64_t updated;
+    uint64_t ops;
+    uint64_t bytes;
+    /* Per second */
+    double ops_rate;
+    double bytes_rate;
+} bucket_rates_t;
+
+/** The largest weight a bucket may be given */
+#define FAIR_MAX_WEIGHT 1000
+
+/**
+ * A bucket's queue for the engines when they're overloaded (see
+ * fair_enter). The buckets with ops queued are on a ring, which is
+ * served in deficit round robin order: a bucket gets weight ops in
+ * before the next bucket gets its turn.
+ */
+typedef struct fair_queue {
+    /* Number of ops the bucket gets in per turn (1 to FAIR_MAX_WEIGHT) */
+    volatile size_t weight;
+    /* Number of ops it still gets in this turn */
+    size_t deficit;
+    /* The queued ops, oldest first */
+    parked_op_t *head;
+    parked_op_t *tail;
+    int queued;
+    /* The next bucket on the ring (while queued > 0) */
+    struct proxied_engine_handle *next;
+    /* Number of ops ever queued, and how long they waited */
+    uint64_t parked;
+    uint64_t waits[INFLIGHT_WAIT_BUCKETS];
+} fair_queue_t;
+
+/**
+ * An op delayed by an ops limit, waiting for the throttle thread to
+ * tell the client to retry it.
+ */
+typedef struct throttled_op {
+    uint64_t due;
+    const void *cookie;
+} throttled_op_t;
+
+/**
+ * A loaded engine module. Modules are looked up by their canonical
+ * path, so every bucket using the same engine shares one dlopen and
+ * the resolved create_instance. They are never unloaded (see
+ * uninit_engine_handle).
+ */
+typedef struct engine_module {
+    /** The canonical path (the name given if it can't be resolved) */
+    char *path;
+    /** The name it was first loaded by, so we don't need to resolve
+     * that one again */
+    char *name;
+    void *dlhandle;
+    CREATE_INSTANCE create_instance;
+    /** Number of engine handles using the module */
+    int instances;
+    struct engine_module *next;
+} engine_module_t;
+
+/**
+ * An engine instance that was loaded and initialized ahead of time
+ * (see spare_engine_filler), waiting for create_bucket to bind a
+ * bucket name to it.
+ */
+typedef struct spare_engine {
+    proxied_engine_t pe;
+    engine_module_t *module;
+    /* ON_DISCONNECT callback registered during initialize */
+    EVENT_CALLBACK cb;
+    const void *cb_data;
+    bool wants_disconnects;
+    struct spare_engine *next;
+} spare_engine_t;
+
+/**
+ * A name auth recently found no bucket for (see negative_cache_find).
+ * An entry with a NULL name is free.
+ */
+typedef struct {
+    char *name;
+    size_t name_len;
+    rel_time_t expires;
+} negative_entry_t;
+
+/**
+ * The handle is split in regions by how the fields are accessed, so
+ * that the fields written all the time don't invalidate the cache
+ * lines every op has to read:
+ *
+ * - the first cache line holds what every call into the bucket reads
+ *   (see get_engine_handle). It's only written during bucket
+ *   creation and deletion.
+ * - then the fields used on less frequent paths (tap, disconnects,
+ *   creation, deletion), which are also rarely written.
+ * - refcount, written on every connect, disconnect and bucket
+ *   lookup, gets a cache line of its own (shared with last_active,
+ *   which is written on the same paths).
+ * - the fair queue, only written while the engines are overloaded.
+ *
+ * The clients counter is also written by every op, which is why it
+ * lives in a separate allocation. It's not used at all when the
+ * handles are protected by epochs (see enter_engine_handle).
+ */
 typedef struct proxied_engine_handle {
-    const char          *name;
-    size_t               name_len;
+    /* Read by every op */
+    volatile bucket_state_t state;
+    /* The reaper picked the bucket, and the last client to leave the
+     * engine queues the hibernation (see maybe_start_hibernation) */
+    volatile int         hibernate_drain;
     proxied_engine_t     pe;
-    void                *stats;
+#ifndef ENABLE_EPOCH_HANDLES
+    /* # of clients currently calling functions in the engine, spread
+     * over CLIENT_SLOTS cache lines (see get_engine_handle) */
+    client_slot_t       *clients;
+#endif
     topkeys_t          **topkeys;
+    void                *stats;
+    /* NULL unless an ops limit was ever set (see throttle_op) */
+    bucket_limit_t * volatile limit;
+    /* NULL unless op_timings is on */
+    bucket_timings_t    *timings;
+    /* STATS_SLOTS of them, indexed by stats_slot() (see op_counters()) */
+    op_counter_slot_t   *counters;
+
+    /* Read-mostly */
     TAP_ITERATOR         tap_iterator;
     bool                 tap_iterator_disabled;
     /* ON_DISCONNECT handling */
@@ -33,6 +432,38 @@ typedef struct proxied_engine_handle {
     bool                 force_shutdown;
     EVENT_CALLBACK       cb;
     const void          *cb_data;
+    const char          *name;
+    size_t               name_len;
+    const void          *cookie;
+    engine_module_t     *module;
+    /* The config the engine was initialized with, to initialize it
+     * again after hibernation */
+    char                *config;
+    /* The threads waiting for the bucket to leave STATE_CREATING,
+     * STATE_HIBERNATING or STATE_WAKING (see wait_for_bucket_UNLOCKED).
+     * Under the engines lock */
+    bucket_waiter_t     *waiters;
+    /* The SELECT_BUCKETs waiting for the bucket to be woken up, and
+     * whether a shutdown worker was asked to do it (see
+     * queue_bucket_wake). Under the engines lock */
+    parked_op_t         *wake_waiters;
+    bool                 wake_queued;
+#ifndef ENABLE_EPOCH_HANDLES
+    void                *clients_mem;
+#endif
+    /* Next in the shutdown queue (see schedule_shutdown_job) */
+    struct proxied_engine_handle *shutdown_next;
+    /* The queued job is a wake (see queue_bucket_wake). Under the
+     * shutdown mutex */
+    bool                 shutdown_wake;
+    /* The queued job is a hibernation (see maybe_start_hibernation).
+     * Under the shutdown mutex */
+    bool                 shutdown_hibernate;
+    /* When the destruction was queued (usec) */
+    uint64_t             shutdown_queued;
+    /* Only written by the "topbuckets" stats */
+    bucket_rates_t       rates;
+
     /* count of connections + 1 for hashtable reference + number of
      * reserved connections for this bucket + number of temporary
      * references created by find_bucket & frieds.
@@ -48,11 +479,12 @@ typedef struct proxied_engine_handle {
      * Handle itself can be freed when this drops to zero. This can
      * only happen when bucket is deleted (but can happen later
      * because some connection can hold pointer longer) */
-    volatile int         refcount;
-    volatile int clients; /* # of clients currently calling functions in the engine */
-    const void *cookie;
-    void *dlhandle;
-    volatile bucket_state_t state;
+    CACHE_ALIGNED volatile int refcount;
+    /* When a client last used the bucket (see touch_bucket) */
+    volatile rel_time_t  last_active;
+
+    /* Only used when the engines are overloaded, under fair.mutex */
+    CACHE_ALIGNED fair_queue_t fair;
 } proxied_engine_handle_t;
 
 #define ES_CONNECTED_FLAG 0x1000
@@ -75,22 +507,105 @@ typedef struct engine_specific {
      * alive. We'll decrement it when processing ON_DISCONNECT
      * callback. */
     int reserved;
+    /** The op was delayed by the ops limit and has been paid for, so
+     * let it through when it's retried */
+    bool throttled;
+    /** The op is queued for a slot under max_inflight (set and cleared
+     * under the bucket limit's lock) */
+    bool parked;
+    /** The op was handed a slot under max_inflight while it was
+     * queued, to use when it's retried */
+    bool granted;
+    /** The op holds one of the max_inflight slots */
+    bool inflight;
+    /** The op is queued for a slot under overload_inflight (set and
+     * cleared under fair.mutex) */
+    bool fair_parked;
+    /** The op was handed a slot under overload_inflight while it was
+     * queued, to use when it's retried */
+    bool fair_granted;
+    /** The op holds one of the overload_inflight slots */
+    bool fair;
 } engine_specific_t;
 
+/** Number of objects in a magazine (see alloc_engine_specific) */
+#define ES_MAGAZINE_SIZE 32
+/** Max number of full magazines kept in the depot */
+#define ES_DEPOT_MAX 64
+
+/**
+ * A stack of free engine_specific_t. Each thread keeps two of them,
+ * and trades full and empty ones with the depot as a whole.
+ */
+typedef struct es_magazine {
+    int count;
+    struct es_magazine *next;
+    engine_specific_t *objs[ES_MAGAZINE_SIZE];
+} es_magazine_t;
+
+/**
+ * The magazines of a thread, and its counters (only written by the
+ * owning thread).
+ */
+typedef struct es_thread_cache {
+    es_magazine_t *loaded;
+    es_magazine_t *previous;
+    uint64_t allocs;
+    /* served from our own magazines */
+    uint64_t thread_hits;
+    /* served from a magazine taken from the depot */
+    uint64_t depot_hits;
+    struct es_thread_cache *next;
+    struct es_thread_cache *prev;
+} es_thread_cache_t;
+
+
+/**
+ * An immutable snapshot of the engines table. Lookups through the
+ * snapshot don't need engines_mutex; they're protected by an epoch
+ * read-side critical section instead (see find_bucket). Writers
+ * rebuild and publish a new snapshot while holding engines_mutex.
+ */
+typedef struct bucket_registry {
+    /** Number of slots (always a power of two) */
+    size_t size;
+    /** Open addressed with linear probing. Empty slots have peh == NULL */
+    struct bucket_registry_entry {
+        const char *name;
+        size_t name_len;
+        proxied_engine_handle_t *peh;
+    } slots[];
+} bucket_registry_t;
 
+/**
+ * The fields that are written at runtime (the default bucket's handle,
+ * the engines table and its mutex and the shutdown bookkeeping) each
+ * start on their own cache line, so a busy default bucket doesn't
+ * contend with bucket creation and deletion, and neither of them
+ * slows down reading the configuration.
+ */
 struct bucket_engine {
     ENGINE_HANDLE_V1 engine;
     SERVER_HANDLE_V1 *upstream_server;
     bool initialized;
     bool has_default;
     bool auto_create;
+    /* Time the ops in the engines (see record_op_timing) */
+    bool op_timings;
+    /* Measure the CPU time of 1 in this many ops (0 disables it) */
+    size_t cpu_sample_rate;
+    /* timing_ticks and now_nsec at initialization, to tell how long a
+     * tick is */
+    uint64_t timing_base_ticks;
+    uint64_t timing_base_nsec;
     char *default_engine_path;
     char *admin_user;
     char *default_bucket_name;
     char *default_bucket_config;
-    proxied_engine_handle_t default_engine;
-    pthread_mutex_t engines_mutex;
-    genhash_t *engines;
+    bucket_registry_t * volatile registry;
+    /* The bucket named default_bucket_name, so connect doesn't have to
+     * look it up (see retain_default_named). Holds a reference */
+    proxied_engine_handle_t * volatile default_named;
     GET_SERVER_API get_server_api;
     SERVER_HANDLE_V1 server;
     SERVER_CALLBACK_API callback_api;
@@ -102,23 +617,6 @@ struct bucket_engine {
     pthread_mutexattr_t mutexattr_storage;
 #endif
 
-    struct {
-        bool in_progress; /* Is the global shutdown in progress */
-        int bucket_counter; /* Number of treads currently running shutdown */
-        pthread_mutex_t mutex;
-        pthread_cond_t cond;
-        /* this condition signals either in_progress being true or
-         * some bucket's refcount being 0.
-         *
-         * This means that under some conditions (lots of buckets
-         * recently deleted but still have connections assigned on
-         * them) we'll have a bit of thundering herd problem, where
-         * too many bucket deletion threads are woken up
-         * needlessly. But that can be improved much later when and if
-         * we actually find this to be a problem. */
-        pthread_cond_t refcount_cond;
-    } shutdown;
-
     union {
       engine_info engine_info;
       char buffer[sizeof(engine_info) +
@@ -126,6 +624,171 @@ struct bucket_engine {
     } info;
 
     int topkeys;
+    /* Max number of threads destroying buckets */
+    size_t shutdown_threads;
+    /* Seconds a bucket nobody is connected to may be idle before it's
+     * hibernated (0 disables hibernation) */
+    size_t hibernate_after;
+
+    struct {
+        pthread_mutex_t mutex;
+        engine_module_t *list;
+    } modules;
+
+    /* Engines of default_engine_path initialized with
+     * default_bucket_config ahead of time, so creating a bucket with
+     * that engine and config doesn't have to wait for them */
+    struct {
+        /* How many to keep ready (0 disables the pool) */
+        size_t size;
+        pthread_mutex_t mutex;
+        /* signals a spare being claimed or the pool shutting down */
+        pthread_cond_t cond;
+        spare_engine_t *list;
+        int available;
+        /* Number of creates served from the pool, and creates with the
+         * pool's engine and config that found it empty */
+        uint64_t claimed;
+        uint64_t missed;
+        bool running;
+        pthread_t filler;
+    } spares;
+
+    struct {
+        pthread_mutex_t mutex;
+        /* wakes up the reaper, and signals wakers or pending dropping
+         * to 0 */
+        pthread_cond_t cond;
+        bool running;
+        pthread_t reaper;
+        /* Number of wake jobs for SELECT_BUCKET queued or running */
+        int wakers;
+        /* Number of hibernations waiting for the clients inside the
+         * engine, queued or running (see maybe_start_hibernation) */
+        int pending;
+        /* Number of buckets currently hibernated, and how many times
+         * buckets were hibernated and woken up */
+        int hibernated;
+        uint64_t hibernations;
+        uint64_t wakeups;
+    } hibernation;
+
+    /* The names auth recently found no bucket for when auto_create is
+     * off, so an unknown user doesn't look for the bucket the slow way
+     * on every auth. It's direct mapped; a colliding name replaces the
+     * entry */
+    struct {
+        /* Seconds an entry is valid (0 disables the cache) */
+        size_t ttl;
+        /* Number of entries (a power of two) */
+        size_t size;
+        pthread_mutex_t mutex;
+        negative_entry_t *entries;
+        /* Bumped by every bucket created, so a lookup that raced with
+         * the create doesn't insert the name afterwards */
+        uint64_t generation;
+        uint64_t hits;
+        uint64_t inserts;
+    } negative;
+
+    /* The ops delayed by the ops limits (see delay_op) */
+    struct {
+        pthread_mutex_t mutex;
+        /* signals a new earliest op or the thread having to stop */
+        pthread_cond_t cond;
+        /* The thread is started by the first op delayed */
+        bool running;
+        pthread_t thread;
+        /* A binary heap ordered by due */
+        throttled_op_t *heap;
+        size_t count;
+        size_t size;
+    } throttle;
+
+    /* Weighted fair admission of the ops when the engines are
+     * overloaded (see fair_enter) */
+    struct {
+        /* Number of ops inside the engines at once over which the
+         * ops are queued per bucket (0 disables it) */
+        size_t threshold;
+        pthread_mutex_t mutex;
+        /* The ring of buckets with ops queued. tail->fair.next is
+         * served next */
+        struct proxied_engine_handle *tail;
+        volatile int queued;
+        uint64_t parked;
+        CACHE_ALIGNED volatile int inflight;
+    } fair;
+
+    /* The last ops slower than their bucket's slow_op_usec (see
+     * record_slow_op) */
+    struct {
+        /* Number of records (a power of two, 0 disables the tracer) */
+        size_t size;
+        slow_op_t *ring;
+        /* Number of records ever written to, and the slow ops not
+         * recorded because their record was being written */
+        CACHE_ALIGNED volatile int next;
+        volatile int dropped;
+    } slow_ops;
+
+    /* The free engine_specific_t not cached by any thread */
+    struct {
+        pthread_mutex_t mutex;
+        es_magazine_t *full;
+        int nfull;
+        es_magazine_t *empty;
+        /* All the thread caches, for the stats */
+        es_thread_cache_t *threads;
+        /* The counters of the threads that are gone */
+        uint64_t allocs;
+        uint64_t thread_hits;
+        uint64_t depot_hits;
+    } es_depot;
+
+    /* Aligned as every handle is */
+    proxied_engine_handle_t default_engine;
+
+    CACHE_ALIGNED pthread_mutex_t engines_mutex;
+    genhash_t *engines;
+    /* Number of threads woken by their bucket leaving STATE_CREATING,
+     * STATE_HIBERNATING or STATE_WAKING, and the number of those
+     * transitions nobody was waiting for (see bucket_waiter_t) */
+    uint64_t waiter_wakeups;
+    uint64_t wakeups_avoided;
+    /* Number of creates that found the name being created by somebody
+     * else and waited for that instead */
+    uint64_t creates_joined;
+
+    /* The buckets are destroyed by a pool of at most shutdown_threads
+     * workers, which pick the jobs off a queue. There are two kinds
+     * of jobs: destroying the engine of a stopped bucket, and freeing
+     * the handle once the last reference to a destroyed bucket is
+     * gone. The latter is queued by whoever drops the last reference,
+     * so nobody waits for the references and a single worker is woken
+     * for each job. */
+    CACHE_ALIGNED struct {
+        bool in_progress; /* Is the global shutdown in progress */
+        int bucket_counter; /* Number of buckets queued or being destroyed */
+        pthread_mutex_t mutex;
+        /* signals bucket_counter or num_workers dropping while
+         * in_progress is set */
+        pthread_cond_t cond;
+        /* signals a new job or in_progress being true to the workers */
+        pthread_cond_t work_cond;
+        proxied_engine_handle_t *queue_head;
+        proxied_engine_handle_t *queue_tail;
+        int queue_depth;
+        int num_workers;
+        int idle_workers;
+        /* Destroyed buckets waiting for their last reference */
+        int pending_release;
+        /* Number of buckets destroyed and how long it took from
+         * queueing the job until they were unlinked (usec) */
+        uint64_t destroyed;
+        uint64_t destroy_usec_total;
+        uint64_t destroy_usec_max;
+    } shutdown;
 };
 
 #endif
@@ -0,0 +1,114 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "bucket_engine_internal.h"
+#include "epoch.h"
+
+/** The current epoch of each domain. Only advanced by epoch_synchronize */
+static volatile uint64_t global_epoch[EPOCH_DOMAINS] = { 1, 1 };
+
+/** All records ever registered. Records are never removed */
+static epoch_record_t * volatile records;
+
+/** Serializes registration of new records and epoch advancement */
+static pthread_mutex_t epoch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread epoch_record_t *my_record;
+
+/**
+ * Get (and register on first use) the calling thread's record. The
+ * worker threads in memcached live for the lifetime of the process,
+ * so we don't bother to reclaim the records. The records start on a
+ * cache line, so the padding keeps each on a line of its own.
+ */
+static epoch_record_t *get_record(void) {
+    epoch_record_t *r = my_record;
+    if (r == NULL) {
+#ifdef HAVE_POSIX_MEMALIGN
+        void *mem = NULL;
+        if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(*r)) == 0) {
+            r = mem;
+            memset(r, 0, sizeof(*r));
+        }
+#endif
+        if (r == NULL) {
+            /* Not aligned, the record may share a line with its
+             * neighbours. That's slower, but still correct */
+            r = calloc(1, sizeof(*r));
+        }
+        if (r == NULL) {
+            /* We can't let the thread in without a record */
+            fprintf(stderr, "FATAL: Failed to allocate an epoch record\n");
+            abort();
+        }
+        must_lock(&epoch_mutex);
+        r->next = records;
+        MEMORY_BARRIER();
+        records = r;
+        must_unlock(&epoch_mutex);
+        my_record = r;
+    }
+    return r;
+}
+
+void epoch_enter(epoch_domain_t domain) {
+    epoch_record_t *r = get_record();
+    if (r->nesting[domain]++ == 0) {
+        r->epoch[domain] = global_epoch[domain];
+        /* The announcement must be visible before we read any of the
+         * protected pointers. Pairs with the barrier in
+         * epoch_synchronize */
+        MEMORY_BARRIER();
+    }
+}
+
+void epoch_exit(epoch_domain_t domain) {
+    epoch_record_t *r = my_record;
+    assert(r != NULL && r->nesting[domain] > 0);
+    if (--r->nesting[domain] == 0) {
+        /* Complete all reads of protected data before we announce
+         * that we're quiescent. Only the announcement on entry needs
+         * a full barrier */
+        ATOMIC_RELEASE_ZERO(&r->epoch[domain]);
+    }
+}
+
+/**
+ * Wait for all readers of the domain that entered before the call to
+ * leave their critical section. The caller must have unpublished the objects it
+ * wants to release before calling this function.
+ *
+ * Suppose a reader is still using an unpublished object after we
+ * return. It must have loaded the pointer before it was unpublished,
+ * so its announcement happened before our barrier and we would have
+ * seen a non-zero epoch older than the target and kept waiting.
+ * Readers announcing an epoch >= target entered after the advance and
+ * can't see the old pointer.
+ */
+void epoch_synchronize(epoch_domain_t domain) {
+    /* Waiting from inside a read-side critical section would deadlock */
+    assert(my_record == NULL || my_record->nesting[domain] == 0);
+
+    must_lock(&epoch_mutex);
+    MEMORY_BARRIER();
+    uint64_t target = ++global_epoch[domain];
+    MEMORY_BARRIER();
+    epoch_record_t *head = records;
+    must_unlock(&epoch_mutex);
+
+    for (epoch_record_t *r = head; r != NULL; r = r->next) {
+        uint64_t e;
+        while ((e = r->epoch[domain]) != 0 && e < target) {
+            sched_yield();
+        }
+    }
+    /* Pairs with the release in epoch_exit: nothing the caller does
+     * next may happen before the readers were done */
+    MEMORY_BARRIER();
+}
@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef EPOCH_H
+#define EPOCH_H 1
+
+#include <stdint.h>
+
+/**
+ * A minimal epoch based reclamation scheme used to protect the
+ * read-mostly structures in bucket_engine.
+ *
+ * Readers bracket their access with epoch_enter() / epoch_exit().
+ * Neither of them takes a lock or performs an atomic read-modify-write
+ * (except the very first time a thread enters, when it registers its
+ * per-thread record). Writers unpublish an object, call
+ * epoch_synchronize() to wait until every reader that could have
+ * observed it has left its critical section, and may then release it.
+ *
+ * Read-side critical sections may nest, but must never block on
+ * anything a writer may hold while calling epoch_synchronize().
+ *
+ * The domains are independent: epoch_synchronize() only waits for
+ * the readers of its own domain. The registry readers never stay
+ * long, so the registry may be synchronized with the engines lock
+ * held, while the readers of the handles stay inside the engine for
+ * the whole call (and may take the engines lock there).
+ */
+typedef enum {
+    /** The registry snapshot and the cached default named bucket */
+    EPOCH_REGISTRY,
+    /** The clients inside the engines (ENABLE_EPOCH_HANDLES) */
+    EPOCH_HANDLES,
+    EPOCH_DOMAINS
+} epoch_domain_t;
+
+typedef struct epoch_record {
+    /** The epoch observed when the thread entered, 0 when quiescent */
+    volatile uint64_t epoch[EPOCH_DOMAINS];
+    /** Next record in the global list of registered threads */
+    struct epoch_record *next;
+    /** Read-side nesting depth (only touched by the owning thread) */
+    int nesting[EPOCH_DOMAINS];
+    /** Pad the record to a cache line so readers don't share lines */
+    char pad[64 - EPOCH_DOMAINS * (sizeof(uint64_t) + sizeof(int)) -
+             sizeof(void*)];
+} epoch_record_t;
+
+void epoch_enter(epoch_domain_t domain);
+void epoch_exit(epoch_domain_t domain);
+void epoch_synchronize(epoch_domain_t domain);
+
+#endif
@@ -4,8 +4,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <math.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include "genhash.h"
 #include "genhash_int.h"
@@ -18,60 +22,139 @@ static int prime_size_table[]={
     1610612741
 };
 
-static inline void*
-dup_key(genhash_t *h, const void *key, size_t klen)
+#define NPRIMES ((int)(sizeof(prime_size_table) / sizeof(int)))
+
+/* Grow the table once the average chain is longer than this */
+#define GENHASH_MAX_LOAD 1
+
+/* Number of old buckets moved by each modification while growing */
+#define GENHASH_REHASH_STEP 4
+
+static int
+estimate_table_index(int est)
 {
-    if (h->ops.dupKey != NULL) {
-        return h->ops.dupKey(key, klen);
-    } else {
-        return (void*)key;
-    }
+    size_t magn=0;
+    assert(est > 0);
+    magn=(int)log((double)est)/log(2);
+    magn--;
+    magn = ((int)magn < 0) ? 0 : magn;
+    assert(magn < (sizeof(prime_size_table) / sizeof(int)));
+    return (int)magn;
 }
 
-static inline void*
-dup_value(genhash_t *h, const void *value, size_t vlen)
+static inline size_t
+hash_key(genhash_t *h, const void *k, size_t klen)
 {
-    if (h->ops.dupValue != NULL) {
-        return h->ops.dupValue(value, vlen);
-    } else {
-        return (void*)value;
+    return (size_t)h->ops.hashfunc(k, klen);
+}
+
+/**
+ * Move an entire chain from the old bucket array to the current one.
+ */
+static void
+move_old_bucket(genhash_t *h, size_t i)
+{
+    struct genhash_entry_t *p=h->old_buckets[i];
+    struct genhash_entry_t *rev=NULL;
+
+    h->old_buckets[i]=NULL;
+
+    /* Reverse the chain first so that entries sharing a key keep
+     * their relative order (most recent first) in the new chain */
+    while(p) {
+        struct genhash_entry_t *next=p->next;
+        p->next=rev;
+        rev=p;
+        p=next;
+    }
+
+    while(rev) {
+        struct genhash_entry_t *next=rev->next;
+        size_t n=hash_key(h, rev->key, rev->nkey) % h->size;
+        rev->next=h->buckets[n];
+        h->buckets[n]=rev;
+        rev=next;
     }
 }
 
-static inline void
-free_key(genhash_t *h, void *key)
+/**
+ * Move a few more chains to the current bucket array, and release the
+ * old one once it's empty.
+ */
+static void
+rehash_step(genhash_t *h)
 {
-    if (h->ops.freeKey != NULL) {
-        h->ops.freeKey(key);
+    int i=0;
+
+    if(h->old_buckets == NULL) {
+        return;
+    }
+
+    for(i=0; i < GENHASH_REHASH_STEP && h->rehash_idx < h->old_size; i++) {
+        move_old_bucket(h, h->rehash_idx++);
+    }
+
+    if(h->rehash_idx == h->old_size) {
+        free(h->old_buckets);
+        h->old_buckets=NULL;
+        h->old_size=0;
+        h->rehash_idx=0;
     }
 }
 
+/**
+ * Make sure all the entries for a key live in the current bucket
+ * array before it is modified.
+ */
 static inline void
-free_value(genhash_t *h, void *value)
+rehash_key(genhash_t *h, size_t hv)
 {
-    if (h->ops.freeValue != NULL) {
-        h->ops.freeValue(value);
+    if(h->old_buckets != NULL) {
+        move_old_bucket(h, hv % h->old_size);
     }
 }
 
-static int
-estimate_table_size(int est)
+/**
+ * Start growing the table if the load factor got too high. The
+ * entries are moved over by subsequent modifications.
+ */
+static void
+maybe_grow(genhash_t *h)
 {
-    int rv=0;
-    size_t magn=0;
-    assert(est > 0);
-    magn=(int)log((double)est)/log(2);
-    magn--;
-    magn = ((int)magn < 0) ? 0 : magn;
-    assert(magn < (sizeof(prime_size_table) / sizeof(int)));
-    rv=prime_size_table[magn];
-    return rv;
+    struct genhash_entry_t **nb=NULL;
+    size_t newsize=0;
+
+    if(h->old_buckets != NULL ||
+       h->nitems <= h->size * GENHASH_MAX_LOAD ||
+       h->size_idx + 1 >= NPRIMES) {
+        return;
+    }
+
+    newsize=prime_size_table[h->size_idx + 1];
+    nb=calloc(newsize, sizeof(struct genhash_entry_t *));
+    if(nb == NULL) {
+        /* We'll just have to live with longer chains */
+        return;
+    }
+
+    h->old_buckets=h->buckets;
+    h->old_size=h->size;
+    h->rehash_idx=0;
+    h->buckets=nb;
+    h->size=newsize;
+    h->size_idx++;
 }
 
 genhash_t* genhash_init(int est, struct hash_ops ops)
+{
+    return genhash_init_impl(est, ops, GENHASH_CHAINED);
+}
+
+genhash_t* genhash_init_impl(int est, struct hash_ops ops,
+                             enum genhash_impl impl)
 {
     genhash_t* rv=NULL;
-    int size=0;
+    int idx=0;
     if (est < 1) {
         return NULL;
     }
@@ -81,13 +164,22 @@ genhash_t* genhash_init(int est, struct hash_ops ops)
     assert((ops.dupKey != NULL && ops.freeKey != NULL) || ops.freeKey == NULL);
     assert((ops.dupValue != NULL && ops.freeValue != NULL) || ops.freeValue == NULL);
 
-    size=estimate_table_size(est);
-    rv=calloc(1, sizeof(genhash_t)
-              + (size * sizeof(struct genhash_entry_t *)));
+    rv=calloc(1, sizeof(genhash_t));
     assert(rv != NULL);
-    rv->size=size;
+    rv->impl=impl;
     rv->ops=ops;
 
+    if(impl == GENHASH_FLAT) {
+        genhash_flat_init(rv, est);
+    } else {
+        assert(impl == GENHASH_CHAINED);
+        idx=estimate_table_index(est);
+        rv->size=prime_size_table[idx];
+        rv->size_idx=idx;
+        rv->buckets=calloc(rv->size, sizeof(struct genhash_entry_t *));
+        assert(rv->buckets != NULL);
+    }
+
     return rv;
 }
 
@@ -95,7 +187,12 @@ void
 genhash_free(genhash_t* h)
 {
     if(h != NULL) {
-        genhash_clear(h);
+        if(h->impl == GENHASH_FLAT) {
+            genhash_flat_free(h);
+        } else {
+            genhash_clear(h);
+            free(h->buckets);
+        }
         free(h);
     }
 }
@@ -103,14 +200,28 @@ genhash_free(genhash_t* h)
 void
 genhash_store(genhash_t *h, const void* k, size_t klen,
               const void* v, size_t vlen)
+{
+    assert(h != NULL);
+    genhash_store_hashed(h, h->ops.hashfunc(k, klen), k, klen, v, vlen);
+}
+
+void
+genhash_store_hashed(genhash_t *h, int khash, const void* k, size_t klen,
+                     const void* v, size_t vlen)
 {
     size_t n=0;
+    size_t hv=(size_t)khash;
     struct genhash_entry_t *p;
 
     assert(h != NULL);
 
-    n=h->ops.hashfunc(k, klen) % h->size;
-    assert((int)n >= 0);
+    if(h->impl == GENHASH_FLAT) {
+        genhash_flat_store(h, khash, k, klen, v, vlen);
+        return;
+    }
+
+    rehash_key(h, hv);
+    n=hv % h->size;
     assert(n < h->size);
 
     p=calloc(1, sizeof(struct genhash_entry_t));
@@ -123,34 +234,65 @@ genhash_store(genhash_t *h, const void* k, size_t klen,
 
     p->next=h->buckets[n];
     h->buckets[n]=p;
+    h->nitems++;
+
+    rehash_step(h);
+    maybe_grow(h);
 }
 
 static struct genhash_entry_t *
-genhash_find_entry(genhash_t *h, const void* k, size_t klen)
+genhash_find_entry(genhash_t *h, int khash, const void* k, size_t klen)
 {
-    size_t n=0;
+    size_t hv=(size_t)khash;
     struct genhash_entry_t *p;
 
     assert(h != NULL);
-    n=h->ops.hashfunc(k, klen) % h->size;
-    assert((int)n >= 0);
-    assert(n < h->size);
+    assert(h->impl == GENHASH_CHAINED);
 
-    p=h->buckets[n];
-    for(p=h->buckets[n]; p && !h->ops.hasheq(k, klen, p->key, p->nkey); p=p->next);
+    for(p=h->buckets[hv % h->size];
+        p && !h->ops.hasheq(k, klen, p->key, p->nkey); p=p->next);
+
+    if(p == NULL && h->old_buckets != NULL) {
+        for(p=h->old_buckets[hv % h->old_size];
+            p && !h->ops.hasheq(k, klen, p->key, p->nkey); p=p->next);
+    }
     return p;
 }
 
+/**
+ * Find where the most recent value for a key is stored in either
+ * implementation.
+ */
+static void **
+genhash_find_value(genhash_t *h, int khash, const void* k, size_t klen)
+{
+    assert(h != NULL);
+    if(h->impl == GENHASH_FLAT) {
+        struct genhash_slot_t *s=genhash_flat_find(h, khash, k, klen);
+        return s ? &s->value : NULL;
+    } else {
+        struct genhash_entry_t *p=genhash_find_entry(h, khash, k, klen);
+        return p ? &p->value : NULL;
+    }
+}
+
 void*
 genhash_find(genhash_t *h, const void* k, size_t klen)
 {
-    struct genhash_entry_t *p;
+    assert(h != NULL);
+    return genhash_find_hashed(h, h->ops.hashfunc(k, klen), k, klen);
+}
+
+void*
+genhash_find_hashed(genhash_t *h, int khash, const void* k, size_t klen)
+{
+    void **vp;
     void *rv=NULL;
 
-    p=genhash_find_entry(h, k, klen);
+    vp=genhash_find_value(h, khash, k, klen);
 
-    if(p) {
-        rv=p->value;
+    if(vp) {
+        rv=*vp;
     }
     return rv;
 }
@@ -159,14 +301,14 @@ enum update_type
 genhash_update(genhash_t* h, const void* k, size_t klen,
                const void* v, size_t vlen)
 {
-    struct genhash_entry_t *p;
+    void **vp;
     enum update_type rv=0;
 
-    p=genhash_find_entry(h, k, klen);
+    vp=genhash_find_value(h, h->ops.hashfunc(k, klen), k, klen);
 
-    if(p) {
-        free_value(h, p->value);
-        p->value=dup_value(h, v, vlen);
+    if(vp) {
+        free_value(h, *vp);
+        *vp=dup_value(h, v, vlen);
         rv=MODIFICATION;
     } else {
         genhash_store(h, k, klen, v, vlen);
@@ -184,16 +326,16 @@ genhash_fun_update(genhash_t* h, const void* k, size_t klen,
                    const void *def, size_t deflen)
 {
     (void)deflen;
-    struct genhash_entry_t *p;
+    void **vp;
     enum update_type rv=0;
     size_t newSize = 0;
 
-    p=genhash_find_entry(h, k, klen);
+    vp=genhash_find_value(h, h->ops.hashfunc(k, klen), k, klen);
 
-    if(p) {
-        void *newValue=upd(k, p->value, &newSize, arg);
-        free_value(h, p->value);
-        p->value=dup_value(h, newValue, newSize);
+    if(vp) {
+        void *newValue=upd(k, *vp, &newSize, arg);
+        free_value(h, *vp);
+        *vp=dup_value(h, newValue, newSize);
         fr(newValue);
         rv=MODIFICATION;
     } else {
@@ -220,11 +362,18 @@ genhash_delete(genhash_t* h, const void* k, size_t klen)
 {
     struct genhash_entry_t *deleteme=NULL;
     size_t n=0;
+    size_t hv=0;
     int rv=0;
 
     assert(h != NULL);
-    n=h->ops.hashfunc(k, klen) % h->size;
-    assert((int)n >= 0);
+
+    if(h->impl == GENHASH_FLAT) {
+        return genhash_flat_delete(h, k, klen);
+    }
+
+    hv=hash_key(h, k, klen);
+    rehash_key(h, hv);
+    n=hv % h->size;
     assert(n < h->size);
 
     if(h->buckets[n] != NULL) {
@@ -244,9 +393,12 @@ genhash_delete(genhash_t* h, const void* k, size_t klen)
     }
     if(deleteme != NULL) {
         free_item(h, deleteme);
+        h->nitems--;
         rv++;
     }
 
+    rehash_step(h);
+
     return rv;
 }
 
@@ -270,11 +422,24 @@ genhash_iter(genhash_t* h,
     struct genhash_entry_t *p=NULL;
     assert(h != NULL);
 
+    if(h->impl == GENHASH_FLAT) {
+        genhash_flat_iter(h, iterfunc, arg);
+        return;
+    }
+
     for(i=0; i<h->size; i++) {
         for(p=h->buckets[i]; p!=NULL; p=p->next) {
             iterfunc(p->key, p->nkey, p->value, p->nvalue, arg);
         }
     }
+
+    if(h->old_buckets != NULL) {
+        for(i=0; i<h->old_size; i++) {
+            for(p=h->old_buckets[i]; p!=NULL; p=p->next) {
+                iterfunc(p->key, p->nkey, p->value, p->nvalue, arg);
+            }
+        }
+    }
 }
 
 int
@@ -284,6 +449,15 @@ genhash_clear(genhash_t *h)
     int rv = 0;
     assert(h != NULL);
 
+    if(h->impl == GENHASH_FLAT) {
+        return genhash_flat_clear(h);
+    }
+
+    /* Finish moving everything to the current array first */
+    while(h->old_buckets != NULL) {
+        rehash_step(h);
+    }
+
     for(i = 0; i < h->size; i++) {
         while(h->buckets[i]) {
             struct genhash_entry_t *p = NULL;
@@ -292,6 +466,7 @@ genhash_clear(genhash_t *h)
             free_item(h, p);
         }
     }
+    h->nitems = 0;
 
     return rv;
 }
@@ -310,10 +485,8 @@ count_entries(const void *key, size_t klen,
 
 int
 genhash_size(genhash_t* h) {
-    int rv=0;
     assert(h != NULL);
-    genhash_iter(h, count_entries, &rv);
-    return rv;
+    return (int)h->nitems;
 }
 
 int
@@ -331,19 +504,72 @@ genhash_iter_key(genhash_t* h, const void* key, size_t klen,
                                   const void* val, size_t vlen,
                                   void *arg), void *arg)
 {
-    size_t n=0;
+    size_t hv=0;
     struct genhash_entry_t *p=NULL;
 
     assert(h != NULL);
-    n=h->ops.hashfunc(key, klen) % h->size;
-    assert((int)n >= 0);
-    assert(n < h->size);
 
-    for(p=h->buckets[n]; p!=NULL; p=p->next) {
+    if(h->impl == GENHASH_FLAT) {
+        genhash_flat_iter_key(h, key, klen, iterfunc, arg);
+        return;
+    }
+
+    hv=hash_key(h, key, klen);
+
+    for(p=h->buckets[hv % h->size]; p!=NULL; p=p->next) {
         if(h->ops.hasheq(key, klen, p->key, p->nkey)) {
             iterfunc(p->key, p->nkey, p->value, p->nvalue, arg);
         }
     }
+
+    if(h->old_buckets != NULL) {
+        for(p=h->old_buckets[hv % h->old_size]; p!=NULL; p=p->next) {
+            if(h->ops.hasheq(key, klen, p->key, p->nkey)) {
+                iterfunc(p->key, p->nkey, p->value, p->nvalue, arg);
+            }
+        }
+    }
+}
+
+static void
+chain_stats(struct genhash_entry_t **buckets, size_t size,
+            struct genhash_stats *stats)
+{
+    size_t i=0;
+    for(i=0; i<size; i++) {
+        size_t len=0;
+        struct genhash_entry_t *p=NULL;
+        for(p=buckets[i]; p!=NULL; p=p->next) {
+            len++;
+        }
+        if(len > 0) {
+            stats->used_buckets++;
+        }
+        if(len > stats->max_chain) {
+            stats->max_chain=len;
+        }
+    }
+}
+
+void
+genhash_get_stats(genhash_t *h, struct genhash_stats *stats)
+{
+    assert(h != NULL);
+    assert(stats != NULL);
+
+    memset(stats, 0, sizeof(*stats));
+    if(h->impl == GENHASH_FLAT) {
+        genhash_flat_get_stats(h, stats);
+        return;
+    }
+
+    stats->size=h->size;
+    stats->items=h->nitems;
+    stats->growing=h->old_buckets != NULL;
+    chain_stats(h->buckets, h->size, stats);
+    if(h->old_buckets != NULL) {
+        chain_stats(h->old_buckets, h->old_size, stats);
+    }
 }
 
 int
@@ -359,3 +585,73 @@ genhash_string_hash(const void* p, size_t nkey)
 
     return rv;
 }
+
+/* Seed for genhash_hash64, set up before main() runs */
+static uint64_t hash_seed;
+
+static inline uint64_t
+rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+static void
+init_hash_seed(void)
+{
+    struct timeval tv;
+    int local;
+    gettimeofday(&tv, NULL);
+    hash_seed=fmix64(((uint64_t)tv.tv_sec << 32) ^ (uint64_t)tv.tv_usec ^
+                     ((uint64_t)getpid() << 16) ^
+                     (uint64_t)(uintptr_t)&local);
+}
+
+static inline uint64_t
+hash_word(uint64_t h, uint64_t w)
+{
+    w *= 0x87c37b91114253d5ULL;
+    w = rotl64(w, 31);
+    w *= 0x4cf5ad432745937fULL;
+    h ^= w;
+    return rotl64(h, 27) * 5 + 0x52dce729;
+}
+
+uint64_t
+genhash_hash64(const void* p, size_t nkey)
+{
+    const unsigned char *str=p;
+    uint64_t h=hash_seed ^ nkey;
+    uint64_t w=0;
+
+    for(; nkey >= 8; nkey-=8, str+=8) {
+        memcpy(&w, str, 8);
+        h=hash_word(h, w);
+    }
+    if(nkey > 0) {
+        w=0;
+        memcpy(&w, str, nkey);
+        h=hash_word(h, w);
+    }
+
+    return fmix64(h);
+}
+
+int
+genhash_seeded_hash(const void* p, size_t nkey)
+{
+    return (int)(uint32_t)genhash_hash64(p, nkey);
+}
@@ -7,6 +7,7 @@
 #ifndef GENHASH_H
 #define GENHASH_H 1
 
+#include <stdint.h>
 #include <memcached/visibility.h>
 
 #ifdef __cplusplus
@@ -78,7 +79,27 @@ enum update_type {
 };
 
 /**
- * Create a new generic hashtable.
+ * The available hash table implementations.
+ */
+enum genhash_impl {
+    /**
+     * Separate chaining with one allocation per entry. Grows
+     * incrementally, so no single store pays for a full rehash.
+     */
+    GENHASH_CHAINED,
+    /**
+     * Open addressing with the entries stored inline and a byte of
+     * the hash per slot, probed 16 slots at a time (with SSE2 when
+     * available). Much denser and faster to search, but the whole
+     * table is rehashed at once when it grows, so size it up front
+     * where that matters.
+     */
+    GENHASH_FLAT
+};
+
+/**
+ * Create a new generic hashtable. The table grows incrementally as
+ * items are added, so the estimate only decides the initial size.
  *
  * @param est the estimated number of items to store (must be > 0)
  * @param ops the key and value operations
@@ -88,6 +109,20 @@ enum update_type {
 MEMCACHED_PUBLIC_API
 genhash_t* genhash_init(int est, struct hash_ops ops);
 
+/**
+ * Create a new generic hashtable using the given implementation. All
+ * the other functions work the same for both implementations.
+ *
+ * @param est the estimated number of items to store (must be > 0)
+ * @param ops the key and value operations
+ * @param impl the implementation to use
+ *
+ * @return the new genhash_t or NULL if one cannot be created
+ */
+MEMCACHED_PUBLIC_API
+genhash_t* genhash_init_impl(int est, struct hash_ops ops,
+                             enum genhash_impl impl);
+
 /**
  * Free a gen hash.
  *
@@ -107,6 +142,19 @@ MEMCACHED_PUBLIC_API
 void genhash_store(genhash_t *h, const void *k, size_t klen,
                    const void *v, size_t vlen);
 
+/**
+ * Store an item using a hash value the caller already computed.
+ *
+ * @param h the genhash
+ * @param hv the hash of the key (must be what the table's hashfunc
+ *           returns for it)
+ * @param k the key
+ * @param v the value
+ */
+MEMCACHED_PUBLIC_API
+void genhash_store_hashed(genhash_t *h, int hv, const void *k, size_t klen,
+                          const void *v, size_t vlen);
+
 /**
  * Get the most recent value stored for the given key.
  *
@@ -118,6 +166,20 @@ void genhash_store(genhash_t *h, const void *k, size_t klen,
 MEMCACHED_PUBLIC_API
 void* genhash_find(genhash_t *h, const void *k, size_t klen);
 
+/**
+ * Get the most recent value stored for the given key using a hash
+ * value the caller already computed.
+ *
+ * @param h the genhash
+ * @param hv the hash of the key (must be what the table's hashfunc
+ *           returns for it)
+ * @param k the key
+ *
+ * @return the value, or NULL if one cannot be found
+ */
+MEMCACHED_PUBLIC_API
+void* genhash_find_hashed(genhash_t *h, int hv, const void *k, size_t klen);
+
 /**
  * Delete the most recent value stored for a key.
  *
@@ -237,6 +299,35 @@ int genhash_clear(genhash_t *h);
 MEMCACHED_PUBLIC_API
 int genhash_size_for_key(genhash_t *h, const void *k, size_t nkey);
 
+/**
+ * Statistics describing the shape of a hash table.
+ */
+struct genhash_stats {
+    /** Number of buckets (slots for GENHASH_FLAT) in the table */
+    size_t size;
+    /** Number of entries in the table */
+    size_t items;
+    /** Number of buckets with at least one entry */
+    size_t used_buckets;
+    /**
+     * Length of the longest chain (for GENHASH_FLAT, the largest
+     * number of groups probed to reach an entry)
+     */
+    size_t max_chain;
+    /** Non-zero while entries are being moved to a larger table */
+    int growing;
+};
+
+/**
+ * Get statistics about the table. This walks every chain, so it
+ * should not be called on a hot path.
+ *
+ * @param h the genhash
+ * @param stats where to store the statistics
+ */
+MEMCACHED_PUBLIC_API
+void genhash_get_stats(genhash_t *h, struct genhash_stats *stats);
+
 /**
  * Convenient hash function for strings.
  *
@@ -247,6 +338,32 @@ int genhash_size_for_key(genhash_t *h, const void *k, size_t nkey);
 MEMCACHED_PUBLIC_API
 int genhash_string_hash(const void *k, size_t nkey);
 
+/**
+ * Fast 64 bit hash for arbitrary keys. The key is consumed 8 bytes at
+ * a time and mixed with a seed picked when the process starts, so the
+ * values (and the layout of the tables) differ from run to run.
+ *
+ * @param k the key
+ * @param nkey the length of the key
+ *
+ * @return a hash value for this key
+ */
+MEMCACHED_PUBLIC_API
+uint64_t genhash_hash64(const void *k, size_t nkey);
+
+/**
+ * genhash_hash64() truncated to fit the hashfunc in struct hash_ops.
+ * Callers that need the full hash for something else (e.g. to pick a
+ * shard) can pass the low bits of it to the *_hashed functions.
+ *
+ * @param k the key
+ * @param nkey the length of the key
+ *
+ * @return (int)(uint32_t)genhash_hash64(k, nkey)
+ */
+MEMCACHED_PUBLIC_API
+int genhash_seeded_hash(const void *k, size_t nkey);
+
 /**
  * @}
  */
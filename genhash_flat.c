@@ -0,0 +1,548 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Open addressed implementation of genhash (GENHASH_FLAT).
+ *
+ * The entries live inline in one array of slots, with a parallel
+ * array of control bytes. A used slot's control byte holds the low 7
+ * bits of its hash, free slots hold one of the negative markers
+ * below. The rest of the hash picks the group of GENHASH_GROUP_SIZE
+ * slots where probing starts, and the groups are visited in
+ * triangular order (which covers every group, as the number of
+ * groups is a power of two). A lookup compares all the control bytes
+ * of a group against the tag at once and only calls hasheq for the
+ * slots that matched, and stops at the first group with an empty
+ * slot.
+ *
+ * The entries stored for a key are kept in probe order from the most
+ * recent to the oldest, so lookups and deletes can stop at the first
+ * match just like the chained implementation.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "genhash.h"
+#include "genhash_int.h"
+
+#define GENHASH_GROUP_SIZE 16
+
+/* Markers for free slots. Both have the top bit set, tags never do */
+#define GENHASH_CTRL_EMPTY ((int8_t)-128)
+#define GENHASH_CTRL_DELETED ((int8_t)-2)
+
+/* Bitmask with one bit per slot in a group */
+typedef uint32_t group_mask_t;
+
+#ifdef __SSE2__
+static inline group_mask_t
+group_match(const int8_t *ctrl, int8_t tag)
+{
+    __m128i g=_mm_loadu_si128((const __m128i *)ctrl);
+    return (group_mask_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(tag)));
+}
+
+static inline group_mask_t
+group_match_free(const int8_t *ctrl)
+{
+    /* The sign bits are exactly the free slots */
+    __m128i g=_mm_loadu_si128((const __m128i *)ctrl);
+    return (group_mask_t)_mm_movemask_epi8(g);
+}
+#else
+static inline group_mask_t
+group_match(const int8_t *ctrl, int8_t tag)
+{
+    group_mask_t rv=0;
+    int i;
+    for(i=0; i < GENHASH_GROUP_SIZE; i++) {
+        if(ctrl[i] == tag) {
+            rv |= (group_mask_t)1 << i;
+        }
+    }
+    return rv;
+}
+
+static inline group_mask_t
+group_match_free(const int8_t *ctrl)
+{
+    group_mask_t rv=0;
+    int i;
+    for(i=0; i < GENHASH_GROUP_SIZE; i++) {
+        if(ctrl[i] < 0) {
+            rv |= (group_mask_t)1 << i;
+        }
+    }
+    return rv;
+}
+#endif
+
+static inline group_mask_t
+group_match_empty(const int8_t *ctrl)
+{
+    return group_match(ctrl, GENHASH_CTRL_EMPTY);
+}
+
+/* Index of the lowest set bit of a non-zero mask */
+static inline int
+lowest_bit(group_mask_t m)
+{
+#ifdef __GNUC__
+    return __builtin_ctz(m);
+#else
+    int i=0;
+    while((m & 1) == 0) {
+        m >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+/**
+ * Prepare a value returned by the hash function. Unlike the prime
+ * sized chained table we simply mask off bits, so the value is mixed
+ * first to make sure all of its bits count.
+ */
+static inline size_t
+mix_hash(int khash)
+{
+    uint64_t x=(unsigned int)khash;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return (size_t)x;
+}
+
+static inline size_t
+flat_hash(genhash_t *h, const void *k, size_t klen)
+{
+    return mix_hash(h->ops.hashfunc(k, klen));
+}
+
+static inline int8_t
+hash_tag(size_t hv)
+{
+    return (int8_t)(hv & 0x7f);
+}
+
+static inline size_t
+hash_group(struct genhash_flat_table *t, size_t hv)
+{
+    return (hv >> 7) & (t->capacity / GENHASH_GROUP_SIZE - 1);
+}
+
+static inline size_t
+max_growth(size_t capacity)
+{
+    /* Keep at most 7/8 of the slots in use */
+    return capacity - capacity / 8;
+}
+
+static void
+table_alloc(struct genhash_flat_table *t, size_t capacity)
+{
+    assert(capacity >= GENHASH_GROUP_SIZE);
+    assert((capacity & (capacity - 1)) == 0);
+    t->ctrl=malloc(capacity);
+    assert(t->ctrl != NULL);
+    memset(t->ctrl, GENHASH_CTRL_EMPTY, capacity);
+    t->slots=malloc(capacity * sizeof(struct genhash_slot_t));
+    assert(t->slots != NULL);
+    t->capacity=capacity;
+    t->growth_left=max_growth(capacity);
+}
+
+/**
+ * Check if there's another entry for the key further along the probe
+ * sequence, starting with the slots in match (in group g, visited at
+ * the given step). Normally the group we just inserted into still has
+ * an empty slot, so this costs nothing.
+ */
+static int
+has_older_entry(genhash_t *h, struct genhash_flat_table *t,
+                size_t g, size_t step, group_mask_t match,
+                const struct genhash_slot_t *entry)
+{
+    size_t ngroups=t->capacity / GENHASH_GROUP_SIZE;
+    int8_t tag=t->ctrl[(entry - t->slots)];
+
+    for(;;) {
+        size_t base=g * GENHASH_GROUP_SIZE;
+        while(match) {
+            size_t idx=base + lowest_bit(match);
+            match &= match - 1;
+            if(h->ops.hasheq(entry->key, entry->nkey,
+                             t->slots[idx].key, t->slots[idx].nkey)) {
+                return 1;
+            }
+        }
+        if(group_match_empty(t->ctrl + base) || ++step >= ngroups) {
+            return 0;
+        }
+        g=(g + step) & (ngroups - 1);
+        match=group_match(t->ctrl + g * GENHASH_GROUP_SIZE, tag);
+    }
+}
+
+/**
+ * Place an entry along the probe sequence for hv. Any entries for
+ * the same key found before the free slot are older than the one
+ * we're placing, so each of them is shifted one position further
+ * along to keep the newest first.
+ */
+static void
+table_insert(genhash_t *h, struct genhash_flat_table *t, size_t hv,
+             struct genhash_slot_t entry)
+{
+    size_t ngroups=t->capacity / GENHASH_GROUP_SIZE;
+    size_t g=hash_group(t, hv);
+    int8_t tag=hash_tag(hv);
+    size_t step=0;
+
+    for(step=0; step < ngroups; step++) {
+        size_t base=g * GENHASH_GROUP_SIZE;
+        group_mask_t match=group_match(t->ctrl + base, tag);
+        group_mask_t avail=group_match_free(t->ctrl + base);
+        group_mask_t bits=match | avail;
+
+        while(bits) {
+            int i=lowest_bit(bits);
+            size_t idx=base + i;
+            bits &= bits - 1;
+
+            if(avail & ((group_mask_t)1 << i)) {
+                if(t->ctrl[idx] == GENHASH_CTRL_EMPTY) {
+                    t->growth_left--;
+                }
+                t->ctrl[idx]=tag;
+                t->slots[idx]=entry;
+                if(!t->has_dups &&
+                   has_older_entry(h, t, g, step,
+                                   match & ~(((group_mask_t)2 << i) - 1),
+                                   &t->slots[idx])) {
+                    t->has_dups=1;
+                }
+                return;
+            }
+
+            if(h->ops.hasheq(entry.key, entry.nkey,
+                             t->slots[idx].key, t->slots[idx].nkey)) {
+                struct genhash_slot_t older=t->slots[idx];
+                t->slots[idx]=entry;
+                entry=older;
+                t->has_dups=1;
+            }
+        }
+        g=(g + step + 1) & (ngroups - 1);
+    }
+    /* growth_left guarantees there's always a free slot */
+    abort();
+}
+
+static struct genhash_slot_t *
+table_find(genhash_t *h, struct genhash_flat_table *t, size_t hv,
+           const void *k, size_t klen)
+{
+    size_t ngroups=t->capacity / GENHASH_GROUP_SIZE;
+    size_t g=hash_group(t, hv);
+    int8_t tag=hash_tag(hv);
+    size_t step=0;
+
+    for(step=0; step < ngroups; step++) {
+        size_t base=g * GENHASH_GROUP_SIZE;
+        group_mask_t match=group_match(t->ctrl + base, tag);
+
+        while(match) {
+            size_t idx=base + lowest_bit(match);
+            match &= match - 1;
+            if(h->ops.hasheq(k, klen, t->slots[idx].key, t->slots[idx].nkey)) {
+                return &t->slots[idx];
+            }
+        }
+        if(group_match_empty(t->ctrl + base)) {
+            break;
+        }
+        g=(g + step + 1) & (ngroups - 1);
+    }
+    return NULL;
+}
+
+/**
+ * Call fn for every entry for the key in probe order (newest first).
+ */
+static void
+table_each_for_key(genhash_t *h, struct genhash_flat_table *t, size_t hv,
+                   const void *k, size_t klen,
+                   void (*fn)(struct genhash_slot_t *s, void *arg),
+                   void *arg)
+{
+    size_t ngroups=t->capacity / GENHASH_GROUP_SIZE;
+    size_t g=hash_group(t, hv);
+    int8_t tag=hash_tag(hv);
+    size_t step=0;
+
+    for(step=0; step < ngroups; step++) {
+        size_t base=g * GENHASH_GROUP_SIZE;
+        group_mask_t match=group_match(t->ctrl + base, tag);
+
+        while(match) {
+            size_t idx=base + lowest_bit(match);
+            match &= match - 1;
+            if(h->ops.hasheq(k, klen, t->slots[idx].key, t->slots[idx].nkey)) {
+                fn(&t->slots[idx], arg);
+            }
+        }
+        if(group_match_empty(t->ctrl + base)) {
+            break;
+        }
+        g=(g + step + 1) & (ngroups - 1);
+    }
+}
+
+struct slot_list {
+    struct genhash_slot_t *slots;
+    size_t count;
+    size_t size;
+    /* Most keys only have a single entry */
+    struct genhash_slot_t inline_slots[4];
+};
+
+static void
+collect_slot(struct genhash_slot_t *s, void *arg)
+{
+    struct slot_list *l=arg;
+    if(l->count == l->size) {
+        struct genhash_slot_t *n=malloc(l->size * 2 * sizeof(*n));
+        assert(n != NULL);
+        memcpy(n, l->slots, l->count * sizeof(*n));
+        if(l->slots != l->inline_slots) {
+            free(l->slots);
+        }
+        l->slots=n;
+        l->size *= 2;
+    }
+    l->slots[l->count++]=*s;
+}
+
+/**
+ * Move everything over to a new table. Doubles the capacity unless
+ * most of the used slots were only holding tombstones.
+ */
+static void
+flat_rehash(genhash_t *h)
+{
+    struct genhash_flat_table *t=&h->flat;
+    struct genhash_flat_table old=*t;
+    size_t capacity=old.capacity;
+    size_t i=0;
+
+    if(h->nitems >= max_growth(capacity) / 2) {
+        capacity *= 2;
+    }
+    table_alloc(t, capacity);
+    t->has_dups=old.has_dups;
+
+    for(i=0; i < old.capacity; i++) {
+        size_t hv=0;
+        struct genhash_slot_t *s=&old.slots[i];
+        if(old.ctrl[i] < 0) {
+            continue;
+        }
+        hv=flat_hash(h, s->key, s->nkey);
+        if(!old.has_dups) {
+            table_insert(h, t, hv, *s);
+        } else if(table_find(h, &old, hv, s->key, s->nkey) == s) {
+            /* This is the newest entry for its key. Move all of them
+             * over together, oldest first, so they keep their order */
+            struct slot_list l;
+            l.slots=l.inline_slots;
+            l.count=0;
+            l.size=sizeof(l.inline_slots) / sizeof(l.inline_slots[0]);
+            table_each_for_key(h, &old, hv, s->key, s->nkey, collect_slot, &l);
+            while(l.count > 0) {
+                table_insert(h, t, hv, l.slots[--l.count]);
+            }
+            if(l.slots != l.inline_slots) {
+                free(l.slots);
+            }
+        }
+    }
+
+    free(old.ctrl);
+    free(old.slots);
+}
+
+void
+genhash_flat_init(genhash_t *h, int est)
+{
+    size_t capacity=GENHASH_GROUP_SIZE;
+    while(max_growth(capacity) < (size_t)est) {
+        capacity *= 2;
+    }
+    table_alloc(&h->flat, capacity);
+}
+
+void
+genhash_flat_free(genhash_t *h)
+{
+    genhash_flat_clear(h);
+    free(h->flat.ctrl);
+    free(h->flat.slots);
+}
+
+void
+genhash_flat_store(genhash_t *h, int khash, const void *k, size_t klen,
+                   const void *v, size_t vlen)
+{
+    struct genhash_slot_t entry;
+
+    if(h->flat.growth_left == 0) {
+        flat_rehash(h);
+    }
+
+    entry.key=dup_key(h, k, klen);
+    entry.nkey=klen;
+    entry.value=dup_value(h, v, vlen);
+    entry.nvalue=vlen;
+
+    table_insert(h, &h->flat, mix_hash(khash), entry);
+    h->nitems++;
+}
+
+struct genhash_slot_t *
+genhash_flat_find(genhash_t *h, int khash, const void *k, size_t klen)
+{
+    return table_find(h, &h->flat, mix_hash(khash), k, klen);
+}
+
+int
+genhash_flat_delete(genhash_t *h, const void *k, size_t klen)
+{
+    struct genhash_flat_table *t=&h->flat;
+    struct genhash_slot_t *s=genhash_flat_find(h, h->ops.hashfunc(k, klen),
+                                               k, klen);
+    size_t idx=0;
+
+    if(s == NULL) {
+        return 0;
+    }
+
+    idx=s - t->slots;
+    free_key(h, s->key);
+    free_value(h, s->value);
+
+    /* A probe reaching this group stops here anyway if it still has an
+     * empty slot, so we can hand the slot back instead of leaving a
+     * tombstone */
+    if(group_match_empty(t->ctrl + (idx & ~(size_t)(GENHASH_GROUP_SIZE - 1)))) {
+        t->ctrl[idx]=GENHASH_CTRL_EMPTY;
+        t->growth_left++;
+    } else {
+        t->ctrl[idx]=GENHASH_CTRL_DELETED;
+    }
+    h->nitems--;
+
+    return 1;
+}
+
+void
+genhash_flat_iter(genhash_t *h,
+                  void (*iterfunc)(const void* key, size_t nkey,
+                                   const void* val, size_t nval,
+                                   void *arg),
+                  void *arg)
+{
+    struct genhash_flat_table *t=&h->flat;
+    size_t i=0;
+
+    for(i=0; i < t->capacity; i++) {
+        if(t->ctrl[i] >= 0) {
+            struct genhash_slot_t *s=&t->slots[i];
+            iterfunc(s->key, s->nkey, s->value, s->nvalue, arg);
+        }
+    }
+}
+
+struct iter_key_arg {
+    void (*iterfunc)(const void* key, size_t nkey,
+                     const void* val, size_t nval,
+                     void *arg);
+    void *arg;
+};
+
+static void
+iter_key_slot(struct genhash_slot_t *s, void *arg)
+{
+    struct iter_key_arg *a=arg;
+    a->iterfunc(s->key, s->nkey, s->value, s->nvalue, a->arg);
+}
+
+void
+genhash_flat_iter_key(genhash_t *h, const void *k, size_t klen,
+                      void (*iterfunc)(const void* key, size_t nkey,
+                                       const void* val, size_t nval,
+                                       void *arg),
+                      void *arg)
+{
+    struct iter_key_arg a={ iterfunc, arg };
+    table_each_for_key(h, &h->flat, flat_hash(h, k, klen), k, klen,
+                       iter_key_slot, &a);
+}
+
+int
+genhash_flat_clear(genhash_t *h)
+{
+    struct genhash_flat_table *t=&h->flat;
+    size_t i=0;
+    int rv=0;
+
+    for(i=0; i < t->capacity; i++) {
+        if(t->ctrl[i] >= 0) {
+            free_key(h, t->slots[i].key);
+            free_value(h, t->slots[i].value);
+            rv++;
+        }
+    }
+    memset(t->ctrl, GENHASH_CTRL_EMPTY, t->capacity);
+    t->growth_left=max_growth(t->capacity);
+    t->has_dups=0;
+    h->nitems=0;
+
+    return rv;
+}
+
+void
+genhash_flat_get_stats(genhash_t *h, struct genhash_stats *stats)
+{
+    struct genhash_flat_table *t=&h->flat;
+    size_t ngroups=t->capacity / GENHASH_GROUP_SIZE;
+    size_t i=0;
+
+    stats->size=t->capacity;
+    stats->items=h->nitems;
+    stats->used_buckets=h->nitems;
+    stats->growing=0;
+
+    for(i=0; i < t->capacity; i++) {
+        size_t g=0;
+        size_t probes=1;
+        if(t->ctrl[i] < 0) {
+            continue;
+        }
+        g=hash_group(t, flat_hash(h, t->slots[i].key, t->slots[i].nkey));
+        while(g != i / GENHASH_GROUP_SIZE && probes <= ngroups) {
+            g=(g + probes) & (ngroups - 1);
+            probes++;
+        }
+        if(probes > stats->max_chain) {
+            stats->max_chain=probes;
+        }
+    }
+}
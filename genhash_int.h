@@ -14,8 +14,130 @@ struct genhash_entry_t {
     struct genhash_entry_t *next;
 };
 
+/**
+ * \private
+ *
+ * A slot in the flat (open addressed) implementation. Entries are
+ * stored inline, so there is no per-entry allocation.
+ */
+struct genhash_slot_t {
+    /** The key for this entry */
+    void *key;
+    /** Size of the key */
+    size_t nkey;
+    /** The value for this entry */
+    void *value;
+    /** Size of the value */
+    size_t nvalue;
+};
+
+/**
+ * \private
+ *
+ * The storage for the flat implementation. ctrl holds one byte per
+ * slot: a 7 bit tag from the hash for used slots, or one of the
+ * GENHASH_CTRL_* markers. The slots are probed in groups of
+ * GENHASH_GROUP_SIZE.
+ */
+struct genhash_flat_table {
+    int8_t *ctrl;
+    struct genhash_slot_t *slots;
+    /** Number of slots (a power of two and a multiple of the group size) */
+    size_t capacity;
+    /** Number of empty slots we may still fill before we must grow */
+    size_t growth_left;
+    /** Set once a key has had more than one entry at the same time */
+    int has_dups;
+};
+
+/**
+ * \private
+ *
+ * The chained table grows incrementally. When the load factor exceeds
+ * GENHASH_MAX_LOAD a new, larger bucket array is allocated and the
+ * old one is kept around while its chains are moved over a few at a
+ * time by each subsequent modification. Lookups search both arrays
+ * until the move is complete.
+ *
+ * All the entries for a given key live in the same array: before a
+ * modification touches the new array, the old chain the key hashes to
+ * is moved over in full.
+ */
 struct _genhash {
+    /** The implementation used by this table */
+    enum genhash_impl impl;
+    /** Number of buckets in the current array */
     size_t size;
+    /** Index of size in the prime table */
+    int size_idx;
+    /** Number of entries stored in both arrays */
+    size_t nitems;
     struct hash_ops ops;
-    struct genhash_entry_t *buckets[];
+    /** The current bucket array */
+    struct genhash_entry_t **buckets;
+    /** The array being drained, or NULL when not growing */
+    struct genhash_entry_t **old_buckets;
+    /** Number of buckets in old_buckets */
+    size_t old_size;
+    /** Index of the next old bucket to move */
+    size_t rehash_idx;
+    /** The storage when impl is GENHASH_FLAT */
+    struct genhash_flat_table flat;
 };
+
+static inline void*
+dup_key(genhash_t *h, const void *key, size_t klen)
+{
+    if (h->ops.dupKey != NULL) {
+        return h->ops.dupKey(key, klen);
+    } else {
+        return (void*)key;
+    }
+}
+
+static inline void*
+dup_value(genhash_t *h, const void *value, size_t vlen)
+{
+    if (h->ops.dupValue != NULL) {
+        return h->ops.dupValue(value, vlen);
+    } else {
+        return (void*)value;
+    }
+}
+
+static inline void
+free_key(genhash_t *h, void *key)
+{
+    if (h->ops.freeKey != NULL) {
+        h->ops.freeKey(key);
+    }
+}
+
+static inline void
+free_value(genhash_t *h, void *value)
+{
+    if (h->ops.freeValue != NULL) {
+        h->ops.freeValue(value);
+    }
+}
+
+/* The flat implementation (genhash_flat.c) */
+void genhash_flat_init(genhash_t *h, int est);
+void genhash_flat_free(genhash_t *h);
+void genhash_flat_store(genhash_t *h, int khash, const void *k, size_t klen,
+                        const void *v, size_t vlen);
+struct genhash_slot_t *genhash_flat_find(genhash_t *h, int khash,
+                                         const void *k, size_t klen);
+int genhash_flat_delete(genhash_t *h, const void *k, size_t klen);
+void genhash_flat_iter(genhash_t *h,
+                       void (*iterfunc)(const void* key, size_t nkey,
+                                        const void* val, size_t nval,
+                                        void *arg),
+                       void *arg);
+void genhash_flat_iter_key(genhash_t *h, const void *k, size_t klen,
+                           void (*iterfunc)(const void* key, size_t nkey,
+                                            const void* val, size_t nval,
+                                            void *arg),
+                           void *arg);
+int genhash_flat_clear(genhash_t *h);
+void genhash_flat_get_stats(genhash_t *h, struct genhash_stats *stats);
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
 
 #include <memcached/engine.h>
 #include <ep-engine/command_ids.h>
@@ -29,6 +30,12 @@ struct mock_engine {
     genhash_t *hashtbl;
     struct mock_stats stats;
     int disconnects;
+    /* Take a while to shut down, like a persistent engine would */
+    bool slow_destroy;
+    /* Take a while to get an item, for the slow op tests */
+    bool slow_get;
+    /* Stay in the engine for a long while when getting an item */
+    bool stall_get;
     uint64_t magic2;
 
     union {
@@ -280,7 +287,7 @@ static void noop_free(void* ob) {
 }
 
 static struct hash_ops my_hash_ops = {
-    .hashfunc = genhash_string_hash,
+    .hashfunc = genhash_seeded_hash,
     .hasheq = my_hash_eq,
     .dupKey = hash_strdup,
     .dupValue = noop_dup,
@@ -296,9 +303,15 @@ static ENGINE_ERROR_CODE mock_initialize(ENGINE_HANDLE* handle,
     assert(my_hash_ops.dupKey);
 
     if (strcmp(config_str, "no_alloc") != 0) {
-        se->hashtbl = genhash_init(1, my_hash_ops);
+        se->hashtbl = genhash_init_impl(1, my_hash_ops, GENHASH_FLAT);
         assert(se->hashtbl);
     }
+    se->slow_destroy = strcmp(config_str, "slow_destroy") == 0;
+    se->slow_get = strcmp(config_str, "slow_get") == 0;
+    se->stall_get = strcmp(config_str, "stall_get") == 0;
+    if (strcmp(config_str, "slow_init") == 0) {
+        usleep(500000);
+    }
 
     se->server->callback->register_callback((ENGINE_HANDLE*)se, ON_DISCONNECT,
                                             handle_disconnect, se);
@@ -315,6 +328,9 @@ static void mock_destroy(ENGINE_HANDLE* handle,
 
     if (se->initialized) {
         se->initialized = false;
+        if (se->slow_destroy) {
+            usleep(100000);
+        }
         genhash_free(se->hashtbl);
         free(se);
     }
@@ -384,6 +400,12 @@ static ENGINE_ERROR_CODE mock_get(ENGINE_HANDLE* handle,
                                   uint16_t vbucket) {
     (void)cookie;
     (void)vbucket;
+    if (get_handle(handle)->slow_get) {
+        usleep(2000);
+    }
+    if (get_handle(handle)->stall_get) {
+        usleep(500000);
+    }
     *itm = genhash_find(get_ht(handle), key, nkey);
 
     return *itm ? ENGINE_SUCCESS : ENGINE_KEY_ENOENT;
@@ -396,11 +418,13 @@ static ENGINE_ERROR_CODE mock_get_stats(ENGINE_HANDLE* handle,
                                         ADD_STAT add_stat)
 {
     (void)handle;
-    (void)cookie;
-    (void)stat_key;
-    (void)nkey;
-    (void)add_stat;
-    // TODO:  Implement
+    if (nkey == (sizeof("timings") - 1) &&
+        memcmp("timings", stat_key, nkey) == 0) {
+        /* Stands in for the engine's own timings, which bucket_engine
+         * must pass through */
+        add_stat("mock_timings", sizeof("mock_timings") - 1, "1", 1, cookie);
+    }
+    // TODO:  Implement the rest
     return ENGINE_SUCCESS;
 }
 
@@ -12,6 +12,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sys/time.h>
+#include <limits.h>
 
 #include "genhash.h"
 
@@ -32,17 +34,24 @@
     ";auto_create=true"
 
 #define MOCK_CONFIG_NO_ALLOC "no_alloc"
+/* destroy takes 100ms */
+#define MOCK_CONFIG_SLOW_DESTROY "slow_destroy"
+/* initialize takes 500ms */
+#define MOCK_CONFIG_SLOW_INIT "slow_init"
 
 #define CONN_MAGIC 16369814453946373207ULL
 
 pthread_mutex_t notify_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t notify_cond = PTHREAD_COND_INITIALIZER;
 ENGINE_ERROR_CODE notify_code;
+const void *notify_cookie;
+int notify_count;
 
 static void notify_io_complete(const void *cookie, ENGINE_ERROR_CODE code) {
-    (void)cookie;
     pthread_mutex_lock(&notify_mutex);
     notify_code = code;
+    notify_cookie = cookie;
+    ++notify_count;
     pthread_cond_signal(&notify_cond);
     pthread_mutex_unlock(&notify_mutex);
 }
@@ -1022,8 +1031,12 @@ static enum test_result do_test_delete_bucket_concurrent(ENGINE_HANDLE *h,
     assert(peh);
 
     assert(peh->refcount == 1);
+    uint64_t destroyed = bucket_engine->shutdown.destroyed;
+    /* a connection that outlives the bucket */
+    struct connstruct *holder = NULL;
     if (keep_one_refcount) {
-        peh->refcount++;
+        holder = mk_conn("someuser", NULL);
+        assert(peh->refcount == 2);
     }
 
     int n_threads = getenv_int_with_default("DELETE_BUCKET_CONCURRENT_THREADS", 17);
@@ -1068,28 +1081,35 @@ static enum test_result do_test_delete_bucket_concurrent(ENGINE_HANDLE *h,
         assert(r == 0);
     }
 
-    if (keep_one_refcount) {
-        assert(peh->refcount == 1);
-        assert(peh->state == STATE_NULL);
-        assert(bucket_engine->shutdown.bucket_counter == 1);
+    /* we cannot use shutdown.cond because it'll only be signalled
+     * when in_progress is set, but we don't want to set in_progress
+     * to avoid aborting the normal shutdown of the bucket. */
+    pthread_mutex_lock(&bucket_engine->shutdown.mutex);
+    while (bucket_engine->shutdown.bucket_counter == 1) {
+        pthread_mutex_unlock(&bucket_engine->shutdown.mutex);
+        usleep(1000);
+        pthread_mutex_lock(&bucket_engine->shutdown.mutex);
     }
+    assert(bucket_engine->shutdown.bucket_counter == 0);
+    assert(bucket_engine->shutdown.destroyed == destroyed + 1);
 
-    pthread_mutex_lock(&bucket_engine->shutdown.mutex);
     if (keep_one_refcount) {
+        /* the bucket is destroyed, but the handle waits for us */
         assert(peh->refcount == 1);
-        peh->refcount = 0;
-        assert(bucket_engine->shutdown.bucket_counter == 1);
-        pthread_cond_broadcast(&bucket_engine->shutdown.refcount_cond);
+        assert(peh->state == STATE_NULL);
+        assert(bucket_engine->shutdown.pending_release == 1);
+        assert(bucket_engine->shutdown.queue_depth == 0);
+        pthread_mutex_unlock(&bucket_engine->shutdown.mutex);
+        mock_disconnect(holder);
+        pthread_mutex_lock(&bucket_engine->shutdown.mutex);
     }
-    /* we cannot use shutdown.cond because it'll only be signalled
-     * when in_progress is set, but we don't want to set in_progress
-     * to avoid aborting normal "refcount drops to 0" loop. */
-    while (bucket_engine->shutdown.bucket_counter == 1) {
+    while (bucket_engine->shutdown.pending_release != 0) {
         pthread_mutex_unlock(&bucket_engine->shutdown.mutex);
         usleep(1000);
         pthread_mutex_lock(&bucket_engine->shutdown.mutex);
     }
-    assert(bucket_engine->shutdown.bucket_counter == 0);
+    assert(bucket_engine->shutdown.queue_depth == 0);
+    assert(bucket_engine->shutdown.num_workers <= 4);
     pthread_mutex_unlock(&bucket_engine->shutdown.mutex);
 
     pthread_mutex_init(&notify_mutex, 0);
@@ -1119,6 +1139,37 @@ static enum test_result test_delete_bucket_concurrent_multi(ENGINE_HANDLE *h,
     return rv;
 }
 
+static enum test_result test_parallel_shutdown(ENGINE_HANDLE *h,
+                                               ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    const int nbuckets = 8;
+
+    for (int i = 0; i < nbuckets; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "bucket%d", i);
+        void *pkt = create_create_bucket_pkt(name, ENGINE_PATH,
+                                             MOCK_CONFIG_SLOW_DESTROY);
+        ENGINE_ERROR_CODE rv = h1->unknown_command(h, adm_cookie, pkt,
+                                                   add_response);
+        free(pkt);
+        assert(rv == ENGINE_SUCCESS);
+        assert(last_status == 0);
+    }
+
+    /* One after another it would take 800ms */
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    h1->destroy(h, false);
+    gettimeofday(&end, NULL);
+    long ms = (end.tv_sec - start.tv_sec) * 1000 +
+        (end.tv_usec - start.tv_usec) / 1000;
+    assert(ms >= 100);
+    assert(ms < 400);
+    connstructs = NULL;
+
+    return SUCCESS;
+}
+
 static enum test_result test_delete_bucket_shutdown_race(ENGINE_HANDLE *h,
                                                          ENGINE_HANDLE_V1 *h1)
 {
@@ -1164,6 +1215,76 @@ static enum test_result test_delete_bucket_shutdown_race(ENGINE_HANDLE *h,
     return SUCCESS;
 }
 
+struct auth_storm_arg {
+    struct handle_pair hp;
+    volatile bool done;
+};
+
+static void *auth_storm_thread(void *arg) {
+    struct auth_storm_arg *aa = arg;
+    struct connstruct *c = mk_conn("someuser", NULL);
+
+    while (!aa->done) {
+        /* reconnect and reauth, which looks the bucket up again */
+        mock_disconnect(c);
+        mock_connect(c);
+
+        item *itm;
+        ENGINE_ERROR_CODE rv = aa->hp.h1->allocate(aa->hp.h, c, &itm,
+                                                   "somekey", 7, 9, 0, 0);
+        assert(rv == ENGINE_SUCCESS || rv == ENGINE_DISCONNECT);
+        if (rv == ENGINE_SUCCESS) {
+            aa->hp.h1->release(aa->hp.h, c, itm);
+        }
+    }
+    mock_disconnect(c);
+    return NULL;
+}
+
+static enum test_result test_auth_during_create_delete(ENGINE_HANDLE *h,
+                                                       ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    struct auth_storm_arg aa = { .hp = {.h = h, .h1 = h1}, .done = false };
+    const int n_threads = 8;
+    pthread_t threads[n_threads];
+
+    for (int i = 0; i < n_threads; i++) {
+        int r = pthread_create(&threads[i], NULL, auth_storm_thread, &aa);
+        assert(r == 0);
+    }
+
+    for (int i = 0; i < 20; i++) {
+        ENGINE_ERROR_CODE rv;
+        void *pkt = create_create_bucket_pkt("someuser", ENGINE_PATH, "");
+        rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+        free(pkt);
+        assert(rv == ENGINE_SUCCESS);
+        assert(last_status == 0);
+
+        usleep(1000);
+
+        pkt = create_packet(DELETE_BUCKET, "someuser", "force=false");
+        pthread_mutex_lock(&notify_mutex);
+        notify_code = ENGINE_FAILED;
+        rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+        assert(rv == ENGINE_EWOULDBLOCK);
+        pthread_cond_wait(&notify_cond, &notify_mutex);
+        assert(notify_code == ENGINE_SUCCESS);
+        pthread_mutex_unlock(&notify_mutex);
+        rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+        free(pkt);
+        assert(rv == ENGINE_SUCCESS);
+    }
+
+    aa.done = true;
+    for (int i = 0; i < n_threads; i++) {
+        int r = pthread_join(threads[i], NULL);
+        assert(r == 0);
+    }
+
+    return SUCCESS;
+}
+
 static enum test_result test_bucket_name_validation(ENGINE_HANDLE *h,
                                                     ENGINE_HANDLE_V1 *h1) {
 
@@ -1354,17 +1475,39 @@ static enum test_result test_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
 
     rv = h1->get_stats(h, mk_conn("user", NULL), NULL, 0, add_stats);
     assert(rv == ENGINE_SUCCESS);
+#ifdef ENABLE_EPOCH_HANDLES
+    /* No per-bucket client count with epoch protected handles */
+    assert(genhash_size(stats_hash) == 1);
+#else
     assert(genhash_size(stats_hash) == 2);
+#endif
 
     assert(memcmp("0",
                   genhash_find(stats_hash, "bucket_conns", strlen("bucket_conns")),
                   1) == 0);
+#ifndef ENABLE_EPOCH_HANDLES
     assert(genhash_find(stats_hash, "bucket_active_conns",
                         strlen("bucket_active_conns")) != NULL);
+#endif
 
     return SUCCESS;
 }
 
+/**
+ * Get the number of buckets using the mock engine module from the
+ * "bucket_engine" stats in stats_hash.
+ */
+static int mock_module_instances(void) {
+    char path[PATH_MAX];
+    char statname[PATH_MAX + sizeof("module:")];
+    char *rp = realpath(ENGINE_PATH, path);
+    assert(rp);
+    snprintf(statname, sizeof(statname), "module:%s", path);
+    char *val = genhash_find(stats_hash, statname, strlen(statname));
+    assert(val != NULL);
+    return atoi(val);
+}
+
 static enum test_result test_stats_bucket(ENGINE_HANDLE *h,
                                           ENGINE_HANDLE_V1 *h1) {
     ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
@@ -1390,143 +1533,1647 @@ static enum test_result test_stats_bucket(ENGINE_HANDLE *h,
                   genhash_find(stats_hash, "someuser", strlen("someuser")),
                   7) == 0);
 
+    /* The internals of bucket engine have a group of their own */
+    genhash_clear(stats_hash);
+    rv = h1->get_stats(h, mk_conn("user", NULL), "bucket_engine", 13,
+                       add_stats);
+    assert(rv == ENGINE_FAILED);
+    assert(genhash_size(stats_hash) == 0);
+
+    rv = h1->get_stats(h, adm_cookie, "bucket_engine", 13, add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    assert(NULL == genhash_find(stats_hash, "someuser", strlen("someuser")));
+    assert(memcmp("1",
+                  genhash_find(stats_hash, "engines_table:items",
+                               strlen("engines_table:items")),
+                  1) == 0);
+    /* the bucket and the default bucket */
+    assert(mock_module_instances() == 2);
+
     return SUCCESS;
 }
 
-static enum test_result test_unknown_call_no_bucket(ENGINE_HANDLE *h,
-                                                    ENGINE_HANDLE_V1 *h1) {
+static enum test_result test_delete_many_buckets(ENGINE_HANDLE *h,
+                                                 ENGINE_HANDLE_V1 *h1) {
+    struct bucket_engine *bucket_engine = (struct bucket_engine *)h;
+    const int nbuckets = 64;
+    struct connstruct *holders[nbuckets];
+
+    for (int i = 0; i < nbuckets; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "bucket%d", i);
+        void *pkt = create_create_bucket_pkt(name, ENGINE_PATH, "");
+        ENGINE_ERROR_CODE rv = h1->unknown_command(h, mk_conn("admin", NULL),
+                                                   pkt, add_response);
+        free(pkt);
+        assert(rv == ENGINE_SUCCESS);
+        assert(last_status == 0);
+        holders[i] = mk_conn(name, NULL);
+    }
 
-    ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
+    /* Delete them all at once, the deletions are completed later */
+    for (int i = 0; i < nbuckets; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "bucket%d", i);
+        void *pkt = create_packet(DELETE_BUCKET, name, "force=false");
+        ENGINE_ERROR_CODE rv = h1->unknown_command(h, mk_conn("admin", NULL),
+                                                   pkt, add_response);
+        free(pkt);
+        assert(rv == ENGINE_EWOULDBLOCK);
+    }
 
-    void *pkt = create_packet(0xfe, "somekey", "someval");
-    rv = h1->unknown_command(h, mk_conn("someuser", NULL), pkt, add_response);
-    free(pkt);
-    assert(rv == ENGINE_DISCONNECT);
+    /* Every bucket is still referenced by its connection, but that
+     * doesn't keep a worker busy */
+    pthread_mutex_lock(&bucket_engine->shutdown.mutex);
+    while (bucket_engine->shutdown.destroyed != (uint64_t)nbuckets) {
+        assert(bucket_engine->shutdown.num_workers <= 4);
+        pthread_mutex_unlock(&bucket_engine->shutdown.mutex);
+        usleep(1000);
+        pthread_mutex_lock(&bucket_engine->shutdown.mutex);
+    }
+    assert(bucket_engine->shutdown.pending_release == nbuckets);
+    pthread_mutex_unlock(&bucket_engine->shutdown.mutex);
+
+    for (int i = 0; i < nbuckets; i++) {
+        mock_disconnect(holders[i]);
+    }
+
+    pthread_mutex_lock(&bucket_engine->shutdown.mutex);
+    while (bucket_engine->shutdown.pending_release != 0) {
+        pthread_mutex_unlock(&bucket_engine->shutdown.mutex);
+        usleep(1000);
+        pthread_mutex_lock(&bucket_engine->shutdown.mutex);
+    }
+    assert(bucket_engine->shutdown.queue_depth == 0);
+    assert(bucket_engine->shutdown.bucket_counter == 0);
+    pthread_mutex_unlock(&bucket_engine->shutdown.mutex);
+
+    ENGINE_ERROR_CODE rv = h1->get_stats(h, mk_conn("admin", NULL),
+                                         "bucket_engine", 13, add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    char *val = genhash_find(stats_hash, "shutdown:destroyed",
+                             strlen("shutdown:destroyed"));
+    assert(val != NULL && atoi(val) == nbuckets);
+    val = genhash_find(stats_hash, "shutdown:queue_depth",
+                       strlen("shutdown:queue_depth"));
+    assert(val != NULL && atoi(val) == 0);
+    assert(mock_module_instances() == 0);
 
     return SUCCESS;
 }
 
-static enum test_result test_auto_config(ENGINE_HANDLE *h,
-                                         ENGINE_HANDLE_V1 *h1) {
-    item *itm = NULL;
-    const void *cookie = mk_conn("someuser", MOCK_CONFIG_NO_ALLOC);
-    char *key = "somekey";
-    char *value = "some value";
-
-    ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
+static uint16_t slow_create_status;
 
-    rv = h1->allocate(h, cookie, &itm,
-                      key, strlen(key),
-                      strlen(value), 9258, 3600);
-    assert(rv == ENGINE_ENOMEM);
+static bool slow_create_response(const void *key, uint16_t keylen,
+                                 const void *ext, uint8_t extlen,
+                                 const void *body, uint32_t bodylen,
+                                 uint8_t datatype, uint16_t status,
+                                 uint64_t cas, const void *cookie) {
+    (void)key; (void)keylen; (void)ext; (void)extlen; (void)body;
+    (void)bodylen; (void)datatype; (void)cas; (void)cookie;
+    slow_create_status = status;
+    return true;
+}
 
-    return SUCCESS;
+static void *slow_create_thread(void *arg) {
+    struct handle_pair *hp = arg;
+    void *pkt = create_create_bucket_pkt("slowbucket", ENGINE_PATH,
+                                         MOCK_CONFIG_SLOW_INIT);
+    ENGINE_ERROR_CODE rv = hp->h1->unknown_command(hp->h, mk_conn("admin", NULL),
+                                                   pkt, slow_create_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    return NULL;
 }
 
-static enum test_result test_get_tap_iterator(ENGINE_HANDLE *h,
-                                              ENGINE_HANDLE_V1 *h1) {
-    // This is run for its side effect of not crashing.
-    const void *cookie = mk_conn(NULL, NULL);
+static enum test_result test_create_bucket_unlocked(ENGINE_HANDLE *h,
+                                                    ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    struct handle_pair hp = {.h = h, .h1 = h1};
+    pthread_t tid;
+
+    slow_create_status = 0xffff;
+    int r = pthread_create(&tid, NULL, slow_create_thread, &hp);
+    assert(r == 0);
+
+    /* The stats (and everything else taking the engines lock) keep
+     * working while the bucket is initialized */
+    bool creating = false;
+    for (int i = 0; i < 200 && !creating; i++) {
+        genhash_clear(stats_hash);
+        ENGINE_ERROR_CODE rv = h1->get_stats(h, adm_cookie, "bucket", 6,
+                                             add_stats);
+        assert(rv == ENGINE_SUCCESS);
+        char *state = genhash_find(stats_hash, "slowbucket",
+                                   strlen("slowbucket"));
+        creating = state != NULL && memcmp(state, "creating", 8) == 0;
+        if (!creating) {
+            usleep(1000);
+        }
+    }
+    assert(creating);
 
-    TAP_ITERATOR ti = h1->get_tap_iterator(h, cookie,
-                                           NULL, 0, 0, NULL, 0);
-    assert(ti != NULL);
+    /* Nobody gets to use it yet */
+    void *cookie = mk_conn("slowbucket", NULL);
+    item *itm;
+    ENGINE_ERROR_CODE rv = h1->allocate(h, cookie, &itm, "key", 3, 1, 0, 0);
+    assert(rv == ENGINE_DISCONNECT);
 
-    tap_event_t e;
-    do {
-        item *it;
-        void *engine_specific;
-        uint16_t nengine_specific;
-        uint8_t ttl;
-        uint16_t flags;
-        uint32_t seqno;
-        uint16_t vbucket;
-        e = ti(h, cookie, &it, &engine_specific, &nengine_specific, &ttl,
-               &flags, &seqno, &vbucket);
-    } while (e != TAP_DISCONNECT);
+    /* Other buckets can be created in the meantime */
+    void *pkt = create_create_bucket_pkt("otherbucket", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+    assert(slow_create_status == 0xffff);
 
-    mock_disconnect((void*)cookie);
+    /* Creating it again waits for the first one to complete */
+    pkt = create_create_bucket_pkt("slowbucket", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS);
 
-    return SUCCESS;
-}
+    r = pthread_join(tid, NULL);
+    assert(r == 0);
+    assert(slow_create_status == 0);
+
+    /* Only the create waiting for slowbucket was woken up, otherbucket
+     * had nobody to wake */
+    genhash_clear(stats_hash);
+    rv = h1->get_stats(h, adm_cookie, "bucket_engine", 13, add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    char *val = genhash_find(stats_hash, "waiters:wakeups",
+                             strlen("waiters:wakeups"));
+    assert(val != NULL && strcmp(val, "1") == 0);
+    val = genhash_find(stats_hash, "waiters:wakeups_avoided",
+                       strlen("waiters:wakeups_avoided"));
+    assert(val != NULL && strcmp(val, "1") == 0);
+    /* and it didn't set up a bucket of its own */
+    val = genhash_find(stats_hash, "waiters:creates_joined",
+                       strlen("waiters:creates_joined"));
+    assert(val != NULL && strcmp(val, "1") == 0);
+
+    cookie = mk_conn("slowbucket", NULL);
+    rv = h1->allocate(h, cookie, &itm, "key", 3, 1, 0, 0);
+    assert(rv == ENGINE_SUCCESS);
+    h1->release(h, cookie, itm);
 
-static enum test_result test_tap_notify(ENGINE_HANDLE *h,
-                                        ENGINE_HANDLE_V1 *h1) {
-    ENGINE_ERROR_CODE ec = h1->tap_notify(h, mk_conn("someuser", ""),
-                                          NULL, 0, 0, 0, TAP_MUTATION, 0,
-                                          "akey", 4,
-                                          0, 0, 0,
-                                          "aval", 4, 0);
-    assert(ec == ENGINE_SUCCESS);
     return SUCCESS;
 }
 
+struct create_job {
+    struct handle_pair hp;
+    const char *name;
+    volatile bool done;
+};
 
-#define MAX_CONNECTIONS_IN_POOL 1000
-struct {
-    pthread_mutex_t mutex;
-    int connected;
-    int pend_close;
-    TAP_ITERATOR iter;
-    struct connstruct *conn;
-} connection_pool[MAX_CONNECTIONS_IN_POOL];
+static bool ignore_response(const void *key, uint16_t keylen,
+                            const void *ext, uint8_t extlen,
+                            const void *body, uint32_t bodylen,
+                            uint8_t datatype, uint16_t status,
+                            uint64_t cas, const void *cookie) {
+    (void)key; (void)keylen; (void)ext; (void)extlen; (void)body;
+    (void)bodylen; (void)datatype; (void)status; (void)cas; (void)cookie;
+    return true;
+}
 
-static void init_connection_pool(void) {
-    for (int ii = 0; ii < MAX_CONNECTIONS_IN_POOL; ++ii) {
-        connection_pool[ii].conn = mk_conn(NULL, NULL);
-        mock_disconnect(connection_pool[ii].conn);
-        connection_pool[ii].connected = 0;
-        connection_pool[ii].pend_close = 0;
-        connection_pool[ii].iter = NULL;
-        pthread_mutex_init(&connection_pool[ii].mutex, NULL);
-    }
+static void *create_job_thread(void *arg) {
+    struct create_job *job = arg;
+    void *pkt = create_create_bucket_pkt(job->name, ENGINE_PATH,
+                                         MOCK_CONFIG_SLOW_INIT);
+    ENGINE_ERROR_CODE rv = job->hp.h1->unknown_command(job->hp.h,
+                                                       mk_conn("admin", NULL),
+                                                       pkt, ignore_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    job->done = true;
+    return NULL;
 }
 
-static void cleanup_connection_pool(ENGINE_HANDLE *h) {
-    for (int ii = 0; ii < MAX_CONNECTIONS_IN_POOL; ++ii) {
-        if (connection_pool[ii].pend_close) {
-            tap_event_t e = connection_pool[ii].iter(h,
-                                                     connection_pool[ii].conn,
-                                                     NULL, NULL, NULL,
-                                                     NULL, NULL, NULL, NULL);
-            assert(e == TAP_DISCONNECT);
+/**
+ * Wait for the bucket to have a thread waiting for it (with the
+ * engines lock held, so the waiter is asleep), and return the waiter.
+ */
+static bucket_waiter_t *bucket_waiter(struct bucket_engine *be,
+                                      const char *name) {
+    bucket_waiter_t *w = NULL;
+    for (int i = 0; i < 2000 && w == NULL; i++) {
+        pthread_mutex_lock(&be->engines_mutex);
+        proxied_engine_handle_t *peh = genhash_find(be->engines, name,
+                                                    strlen(name));
+        if (peh != NULL) {
+            w = peh->waiters;
+        }
+        pthread_mutex_unlock(&be->engines_mutex);
+        if (w == NULL) {
+            usleep(1000);
         }
-        mock_disconnect(connection_pool[ii].conn);
-        pthread_mutex_destroy(&connection_pool[ii].mutex);
     }
+    assert(w != NULL);
+    return w;
 }
 
-static void *network_io_thread(void *arg) {
-    int num_ops = 500000;
-    ENGINE_HANDLE *h = arg;
-    ENGINE_HANDLE_V1 *h1 = arg;
+static enum test_result test_bucket_waiters(ENGINE_HANDLE *h,
+                                            ENGINE_HANDLE_V1 *h1) {
+    struct bucket_engine *be = (struct bucket_engine *)h;
+    struct create_job jobs[4] = {
+        { .hp = { h, h1 }, .name = "slowb" },
+        { .hp = { h, h1 }, .name = "slowb" },
+        { .hp = { h, h1 }, .name = "slowa" },
+        { .hp = { h, h1 }, .name = "slowa" },
+    };
+    pthread_t tids[4];
+
+    /* slowb is created (taking 500ms) and waited for, and slowa a
+     * while later, so slowb is ready while slowa is still creating */
+    int r = pthread_create(&tids[0], NULL, create_job_thread, &jobs[0]);
+    assert(r == 0);
+    r = pthread_create(&tids[1], NULL, create_job_thread, &jobs[1]);
+    assert(r == 0);
+    bucket_waiter(be, "slowb");
+    usleep(250000);
+    r = pthread_create(&tids[2], NULL, create_job_thread, &jobs[2]);
+    assert(r == 0);
+    r = pthread_create(&tids[3], NULL, create_job_thread, &jobs[3]);
+    assert(r == 0);
+    bucket_waiter_t *a_waiter = bucket_waiter(be, "slowa");
+
+    for (int i = 0; i < 2; i++) {
+        r = pthread_join(tids[i], NULL);
+        assert(r == 0);
+    }
 
-    for (int ii = 0; ii < num_ops; ++ii) {
-        long idx = (random() & 0xffff) % 1000;
-        pthread_mutex_lock(&connection_pool[idx].mutex);
-        if (!connection_pool[idx].pend_close) {
-            if (!connection_pool[idx].connected) {
-                mock_connect(connection_pool[idx].conn);
-                connection_pool[idx].connected = 1;
-                if (h != NULL) {
-                    // run tap connect
-                    TAP_ITERATOR ti;
-                    ti = h1->get_tap_iterator(h,
-                                              connection_pool[idx].conn,
-                                              NULL, 0, 0, NULL, 0);
-                    assert(ti != NULL);
-                    connection_pool[idx].iter = ti;
-                    connection_pool[idx].pend_close = 1;
-                }
-            } else {
-                mock_disconnect(connection_pool[idx].conn);
-                connection_pool[idx].connected = 0;
-            }
-        } else {
-            tap_event_t e = connection_pool[idx].iter(h,
-                                                     connection_pool[idx].conn,
-                                                     NULL, NULL, NULL,
-                                                     NULL, NULL, NULL, NULL);
+    /* slowb waking its waiter left the one waiting for slowa be */
+    pthread_mutex_lock(&be->engines_mutex);
+    proxied_engine_handle_t *peh = genhash_find(be->engines, "slowa",
+                                                strlen("slowa"));
+    assert(peh != NULL && peh->state == STATE_CREATING);
+    assert(peh->waiters == a_waiter);
+    assert(a_waiter->next == NULL && !a_waiter->woken);
+    assert(be->waiter_wakeups == 1);
+    pthread_mutex_unlock(&be->engines_mutex);
+    assert(!jobs[2].done && !jobs[3].done);
+
+    for (int i = 2; i < 4; i++) {
+        r = pthread_join(tids[i], NULL);
+        assert(r == 0);
+    }
+    assert(be->waiter_wakeups == 2);
+
+    return SUCCESS;
+}
+
+struct stall_job {
+    ENGINE_HANDLE *h;
+    ENGINE_HANDLE_V1 *h1;
+    const void *cookie;
+};
+
+static void *stall_get_thread(void *arg) {
+    struct stall_job *job = arg;
+    item *itm = NULL;
+    ENGINE_ERROR_CODE rv = job->h1->get(job->h, job->cookie, &itm,
+                                        "key", 3, 0);
+    assert(rv == ENGINE_KEY_ENOENT);
+    return NULL;
+}
+
+/**
+ * Creating a bucket doesn't wait for the clients inside the other
+ * engines.
+ */
+static enum test_result test_create_while_inside(ENGINE_HANDLE *h,
+                                                 ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+
+    void *pkt = create_create_bucket_pkt("stalled", ENGINE_PATH,
+                                         "stall_get");
+    ENGINE_ERROR_CODE rv = h1->unknown_command(h, adm_cookie, pkt,
+                                               add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+
+    struct stall_job job = { .h = h, .h1 = h1,
+                             .cookie = mk_conn("stalled", NULL) };
+    pthread_t tid;
+    int r = pthread_create(&tid, NULL, stall_get_thread, &job);
+    assert(r == 0);
+    /* Let it get into the engine (it stays there for 500ms) */
+    usleep(100000);
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    pkt = create_create_bucket_pkt("other", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+    gettimeofday(&end, NULL);
+    uint64_t usec = (end.tv_sec - start.tv_sec) * 1000000ULL +
+        end.tv_usec - start.tv_usec;
+    assert(usec < 250000);
+
+    r = pthread_join(tid, NULL);
+    assert(r == 0);
+
+    return SUCCESS;
+}
+
+/**
+ * Get a numeric stat from the "bucket_engine" stats.
+ */
+static int node_stat(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                     const void *cookie, const char *name) {
+    genhash_clear(stats_hash);
+    ENGINE_ERROR_CODE rv = h1->get_stats(h, cookie, "bucket_engine", 13,
+                                         add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    char *val = genhash_find(stats_hash, name, strlen(name));
+    assert(val != NULL);
+    return atoi(val);
+}
+
+static enum test_result test_spare_engines(ENGINE_HANDLE *h,
+                                           ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+
+    /* Each spare takes 500ms to initialize */
+    for (int i = 0; i < 300; i++) {
+        if (node_stat(h, h1, adm_cookie, "spares:available") == 2) {
+            break;
+        }
+        usleep(10000);
+    }
+    assert(node_stat(h, h1, adm_cookie, "spares:available") == 2);
+
+    /* Auto creating a bucket with the pool's config only binds the name */
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    void *cookie = mk_conn("tenant1", MOCK_CONFIG_SLOW_INIT);
+    gettimeofday(&end, NULL);
+    uint64_t usec = (end.tv_sec - start.tv_sec) * 1000000ULL +
+        end.tv_usec - start.tv_usec;
+    assert(usec < 250000);
+
+    item *itm;
+    ENGINE_ERROR_CODE rv = h1->allocate(h, cookie, &itm, "key", 3, 1, 0, 0);
+    assert(rv == ENGINE_SUCCESS);
+    h1->release(h, cookie, itm);
+
+    assert(node_stat(h, h1, adm_cookie, "spares:claimed") == 1);
+    assert(node_stat(h, h1, adm_cookie, "spares:missed") == 0);
+
+    /* A different config takes the slow path */
+    cookie = mk_conn("tenant2", NULL);
+    rv = h1->allocate(h, cookie, &itm, "key", 3, 1, 0, 0);
+    assert(rv == ENGINE_SUCCESS);
+    h1->release(h, cookie, itm);
+    assert(node_stat(h, h1, adm_cookie, "spares:claimed") == 1);
+
+    /* Running out of spares falls back to creating the engine inline */
+    mk_conn("tenant3", MOCK_CONFIG_SLOW_INIT);
+    mk_conn("tenant4", MOCK_CONFIG_SLOW_INIT);
+    assert(node_stat(h, h1, adm_cookie, "spares:claimed") +
+           node_stat(h, h1, adm_cookie, "spares:missed") == 3);
+    cookie = mk_conn("tenant4", NULL);
+    rv = h1->allocate(h, cookie, &itm, "key", 3, 1, 0, 0);
+    assert(rv == ENGINE_SUCCESS);
+    h1->release(h, cookie, itm);
+
+    /* The claimed spares get replaced */
+    for (int i = 0; i < 300; i++) {
+        if (node_stat(h, h1, adm_cookie, "spares:available") == 2) {
+            break;
+        }
+        usleep(10000);
+    }
+    assert(node_stat(h, h1, adm_cookie, "spares:available") == 2);
+    /* The four tenants, the admin's bucket and the spares */
+    assert(mock_module_instances() == 7);
+
+    return SUCCESS;
+}
+
+/**
+ * Check the state of a bucket in the "bucket" stats.
+ */
+static bool bucket_in_state(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                            const void *cookie, const char *name,
+                            const char *state) {
+    genhash_clear(stats_hash);
+    ENGINE_ERROR_CODE rv = h1->get_stats(h, cookie, "bucket", 6, add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    char *val = genhash_find(stats_hash, name, strlen(name));
+    return val != NULL && strcmp(val, state) == 0;
+}
+
+static enum test_result test_hibernation(ENGINE_HANDLE *h,
+                                         ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    const char *names[] = { "busy", "sleepy1", "sleepy2", "sleepy3" };
+
+    for (int i = 0; i < 4; i++) {
+        /* sleepy2 takes a while to wake up */
+        void *pkt = create_create_bucket_pkt(names[i], ENGINE_PATH,
+                                             i == 2 ? "slow_init" : "");
+        ENGINE_ERROR_CODE rv = h1->unknown_command(h, adm_cookie, pkt,
+                                                   add_response);
+        free(pkt);
+        assert(rv == ENGINE_SUCCESS);
+        assert(last_status == 0);
+    }
+
+    /* A bucket somebody is connected to is never idle */
+    const void *busy = mk_conn("busy", NULL);
+
+    for (int i = 0; i < 500; i++) {
+        if (bucket_in_state(h, h1, adm_cookie, "sleepy3", "hibernated")) {
+            break;
+        }
+        usleep(10000);
+    }
+    for (int i = 1; i < 4; i++) {
+        assert(bucket_in_state(h, h1, adm_cookie, names[i], "hibernated"));
+    }
+    assert(bucket_in_state(h, h1, adm_cookie, "busy", "running"));
+    assert(node_stat(h, h1, adm_cookie, "hibernation:hibernated") == 3);
+
+    item *itm;
+    ENGINE_ERROR_CODE rv = h1->allocate(h, busy, &itm, "key", 3, 1, 0, 0);
+    assert(rv == ENGINE_SUCCESS);
+    h1->release(h, busy, itm);
+
+    /* Authenticating to it brings it back */
+    const void *cookie = mk_conn("sleepy1", NULL);
+    rv = h1->allocate(h, cookie, &itm, "key", 3, 1, 0, 0);
+    assert(rv == ENGINE_SUCCESS);
+    h1->release(h, cookie, itm);
+    assert(bucket_in_state(h, h1, adm_cookie, "sleepy1", "running"));
+
+    /* Selecting it has the clients wait while it wakes up, all of
+     * them for the same wake */
+    void *pkt = create_packet(SELECT_BUCKET, "sleepy2", "");
+    const void *other = mk_conn("admin", NULL);
+    pthread_mutex_lock(&notify_mutex);
+    int notified = notify_count;
+    notify_code = ENGINE_FAILED;
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    assert(rv == ENGINE_EWOULDBLOCK);
+    rv = h1->unknown_command(h, other, pkt, add_response);
+    assert(rv == ENGINE_EWOULDBLOCK);
+    while (notify_count < notified + 2) {
+        pthread_cond_wait(&notify_cond, &notify_mutex);
+    }
+    assert(notify_code == ENGINE_SUCCESS);
+    pthread_mutex_unlock(&notify_mutex);
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+    rv = h1->unknown_command(h, other, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+    rv = h1->allocate(h, adm_cookie, &itm, "key", 3, 1, 0, 0);
+    assert(rv == ENGINE_SUCCESS);
+    h1->release(h, adm_cookie, itm);
+
+    assert(node_stat(h, h1, adm_cookie, "hibernation:hibernated") == 1);
+    assert(node_stat(h, h1, adm_cookie, "hibernation:wakeups") == 2);
+
+    /* A hibernated bucket can still be deleted, without waking it */
+    pkt = create_packet(DELETE_BUCKET, "sleepy3", "force=false");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+    assert(!bucket_in_state(h, h1, adm_cookie, "sleepy3", "running"));
+    assert(genhash_find(stats_hash, "sleepy3", strlen("sleepy3")) == NULL);
+    assert(node_stat(h, h1, adm_cookie, "hibernation:hibernated") == 0);
+    assert(node_stat(h, h1, adm_cookie, "hibernation:wakeups") == 2);
+
+    return SUCCESS;
+}
+
+static enum test_result test_engine_specific_cache(ENGINE_HANDLE *h,
+                                                   ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    int before = node_stat(h, h1, adm_cookie, "es_cache:allocs");
+
+    for (int i = 0; i < 1000; i++) {
+        struct connstruct *c = mk_conn("user", NULL);
+        item *itm;
+        ENGINE_ERROR_CODE rv = h1->allocate(h, c, &itm, "key", 3, 1, 0, 0);
+        assert(rv == ENGINE_SUCCESS);
+        h1->release(h, c, itm);
+        mock_disconnect(c);
+    }
+
+    /* Everything but the first one is reused */
+    assert(node_stat(h, h1, adm_cookie, "es_cache:allocs") - before == 1000);
+    assert(node_stat(h, h1, adm_cookie, "es_cache:thread_hits") >= 999);
+    return SUCCESS;
+}
+
+static enum test_result test_default_named_bucket(ENGINE_HANDLE *h,
+                                                  ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    item *itm = NULL;
+
+    /* The first connect creates it, the others reuse it */
+    struct connstruct *c1 = mk_conn(NULL, NULL);
+    store(h, h1, c1, "key", "v1", &itm);
+    struct connstruct *c2 = mk_conn(NULL, NULL);
+    item *fetched = NULL;
+    ENGINE_ERROR_CODE rv = h1->get(h, c2, &fetched, "key", 3, 0);
+    assert(rv == ENGINE_SUCCESS);
+    mock_disconnect(c1);
+    mock_disconnect(c2);
+
+    /* Deleting it drops the cached reference, so it's released once
+     * the connections are gone */
+    void *pkt = create_packet(DELETE_BUCKET, "dflt", "force=false");
+    pthread_mutex_lock(&notify_mutex);
+    notify_code = ENGINE_FAILED;
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    assert(rv == ENGINE_EWOULDBLOCK);
+    pthread_cond_wait(&notify_cond, &notify_mutex);
+    assert(notify_code == ENGINE_SUCCESS);
+    pthread_mutex_unlock(&notify_mutex);
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+
+    for (int i = 0; i < 500; i++) {
+        if (node_stat(h, h1, adm_cookie, "shutdown:pending_release") == 0) {
+            break;
+        }
+        usleep(1000);
+    }
+    assert(node_stat(h, h1, adm_cookie, "shutdown:pending_release") == 0);
+
+    /* and the next connect gets a new one */
+    struct connstruct *c3 = mk_conn(NULL, NULL);
+    rv = h1->get(h, c3, &fetched, "key", 3, 0);
+    assert(rv == ENGINE_KEY_ENOENT);
+
+    return SUCCESS;
+}
+
+/**
+ * The default named bucket cache holds a reference of its own, which
+ * doesn't keep the bucket from hibernating.
+ */
+static enum test_result test_default_named_hibernation(ENGINE_HANDLE *h,
+                                                       ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    item *itm = NULL;
+
+    struct connstruct *c1 = mk_conn(NULL, NULL);
+    store(h, h1, c1, "key", "v1", &itm);
+    mock_disconnect(c1);
+
+    for (int i = 0; i < 500; i++) {
+        if (bucket_in_state(h, h1, adm_cookie, "dflt", "hibernated")) {
+            break;
+        }
+        usleep(10000);
+    }
+    assert(bucket_in_state(h, h1, adm_cookie, "dflt", "hibernated"));
+
+    /* The next connect wakes it up, and it's cached still */
+    struct connstruct *c2 = mk_conn(NULL, NULL);
+    ENGINE_ERROR_CODE rv = h1->allocate(h, c2, &itm, "key", 3, 1, 0, 0);
+    assert(rv == ENGINE_SUCCESS);
+    h1->release(h, c2, itm);
+    assert(bucket_in_state(h, h1, adm_cookie, "dflt", "running"));
+    assert(node_stat(h, h1, adm_cookie, "hibernation:wakeups") == 1);
+    mock_disconnect(c2);
+
+    for (int i = 0; i < 500; i++) {
+        if (bucket_in_state(h, h1, adm_cookie, "dflt", "hibernated")) {
+            break;
+        }
+        usleep(10000);
+    }
+    assert(bucket_in_state(h, h1, adm_cookie, "dflt", "hibernated"));
+    assert(node_stat(h, h1, adm_cookie, "hibernation:hibernations") == 2);
+
+    return SUCCESS;
+}
+
+static enum test_result test_negative_cache(ENGINE_HANDLE *h,
+                                            ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    item *itm;
+
+    /* The second auth doesn't look for the bucket */
+    void *cookie = mk_conn("nosuch", NULL);
+    cookie = mk_conn("nosuch", NULL);
+    ENGINE_ERROR_CODE rv = h1->allocate(h, cookie, &itm, "key", 3, 1, 0, 0);
+    assert(rv == ENGINE_DISCONNECT);
+    /* admin doesn't have a bucket either */
+    assert(node_stat(h, h1, adm_cookie, "negative_cache:inserts") == 2);
+    assert(node_stat(h, h1, adm_cookie, "negative_cache:hits") == 1);
+
+    /* Creating the bucket drops the name */
+    void *pkt = create_create_bucket_pkt("nosuch", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+
+    cookie = mk_conn("nosuch", NULL);
+    rv = h1->allocate(h, cookie, &itm, "key", 3, 1, 0, 0);
+    assert(rv == ENGINE_SUCCESS);
+    h1->release(h, cookie, itm);
+    assert(node_stat(h, h1, adm_cookie, "negative_cache:hits") == 1);
+
+    return SUCCESS;
+}
+
+static int conn_stat(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                     const void *cookie, const char *name) {
+    genhash_clear(stats_hash);
+    ENGINE_ERROR_CODE rv = h1->get_stats(h, cookie, NULL, 0, add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    char *val = genhash_find(stats_hash, name, strlen(name));
+    assert(val != NULL);
+    return atoi(val);
+}
+
+static enum test_result test_ops_limit(ENGINE_HANDLE *h,
+                                       ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    struct bucket_engine *be = (struct bucket_engine *)h;
+    item *itm = NULL;
+
+    void *pkt = create_create_bucket_pkt("limited", ENGINE_PATH,
+                                         "ops_limit=2;ops_limit_policy=reject");
+    ENGINE_ERROR_CODE rv = h1->unknown_command(h, adm_cookie, pkt,
+                                               add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+    /* The engine doesn't get our settings */
+    proxied_engine_handle_t *peh = genhash_find(be->engines, "limited",
+                                                strlen("limited"));
+    assert(peh != NULL && strcmp(peh->config, "") == 0);
+
+    /* A second's worth of ops goes through, the next one doesn't */
+    const void *cookie = mk_conn("limited", NULL);
+    for (int i = 0; i < 2; i++) {
+        rv = h1->get(h, cookie, &itm, "key", 3, 0);
+        assert(rv == ENGINE_KEY_ENOENT);
+    }
+    rv = h1->get(h, cookie, &itm, "key", 3, 0);
+    assert(rv == ENGINE_TMPFAIL);
+    assert(conn_stat(h, h1, cookie, "ops_limit") == 2);
+    assert(conn_stat(h, h1, cookie, "ops_limit_rejected") == 1);
+
+    /* Delayed ops are retried once there's a token for them */
+    pkt = create_packet(CONFIG_BUCKET, "limited", "ops_limit_policy=delay");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+
+    pthread_mutex_lock(&notify_mutex);
+    notify_code = ENGINE_FAILED;
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    rv = h1->get(h, cookie, &itm, "key", 3, 0);
+    assert(rv == ENGINE_EWOULDBLOCK);
+    pthread_cond_wait(&notify_cond, &notify_mutex);
+    assert(notify_code == ENGINE_SUCCESS);
+    pthread_mutex_unlock(&notify_mutex);
+    gettimeofday(&end, NULL);
+    rv = h1->get(h, cookie, &itm, "key", 3, 0);
+    assert(rv == ENGINE_KEY_ENOENT);
+    long waited = (end.tv_sec - start.tv_sec) * 1000000L +
+        (end.tv_usec - start.tv_usec);
+    assert(waited >= 250000);
+    assert(conn_stat(h, h1, cookie, "ops_limit_delayed") == 1);
+
+    /* and the limit can be lifted */
+    pkt = create_packet(CONFIG_BUCKET, "limited", "ops_limit=0");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+    for (int i = 0; i < 100; i++) {
+        rv = h1->get(h, cookie, &itm, "key", 3, 0);
+        assert(rv == ENGINE_KEY_ENOENT);
+    }
+
+    pkt = create_packet(CONFIG_BUCKET, "limited", "ops_limit_policy=later");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == PROTOCOL_BINARY_RESPONSE_EINVAL);
+
+    pkt = create_packet(CONFIG_BUCKET, "nosuch", "ops_limit=1");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+
+    return SUCCESS;
+}
+
+static enum test_result test_max_inflight(ENGINE_HANDLE *h,
+                                          ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    struct bucket_engine *be = (struct bucket_engine *)h;
+    item *itm = NULL;
+
+    void *pkt = create_create_bucket_pkt("capped", ENGINE_PATH,
+                                         "max_inflight=1");
+    ENGINE_ERROR_CODE rv = h1->unknown_command(h, adm_cookie, pkt,
+                                               add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+    proxied_engine_handle_t *peh = genhash_find(be->engines, "capped",
+                                                strlen("capped"));
+    assert(peh != NULL && strcmp(peh->config, "") == 0);
+    assert(peh->limit != NULL);
+
+    const void *cookie1 = mk_conn("capped", NULL);
+    const void *cookie2 = mk_conn("capped", NULL);
+    rv = h1->get(h, cookie1, &itm, "key", 3, 0);
+    assert(rv == ENGINE_KEY_ENOENT);
+    assert(peh->limit->inflight == 0);
+
+    /* Pretend an op is inside the engine: the next ones queue up */
+    peh->limit->inflight = 1;
+    rv = h1->get(h, cookie1, &itm, "key", 3, 0);
+    assert(rv == ENGINE_EWOULDBLOCK);
+    rv = h1->get(h, cookie2, &itm, "key", 3, 0);
+    assert(rv == ENGINE_EWOULDBLOCK);
+    assert(conn_stat(h, h1, cookie1, "inflight_queue_depth") == 2);
+
+    /* Raising the cap lets the oldest one in... */
+    notify_code = ENGINE_FAILED;
+    pkt = create_packet(CONFIG_BUCKET, "capped", "max_inflight=2");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+    assert(notify_code == ENGINE_SUCCESS);
+    assert(conn_stat(h, h1, cookie1, "inflight_queue_depth") == 1);
+
+    /* ...and it hands its slot to the next one when it's done */
+    notify_code = ENGINE_FAILED;
+    rv = h1->get(h, cookie1, &itm, "key", 3, 0);
+    assert(rv == ENGINE_KEY_ENOENT);
+    assert(notify_code == ENGINE_SUCCESS);
+    rv = h1->get(h, cookie2, &itm, "key", 3, 0);
+    assert(rv == ENGINE_KEY_ENOENT);
+    assert(peh->limit->inflight == 1);
+    peh->limit->inflight = 0;
+
+    assert(conn_stat(h, h1, cookie1, "max_inflight") == 2);
+    assert(conn_stat(h, h1, cookie1, "inflight_queue_depth") == 0);
+    assert(conn_stat(h, h1, cookie1, "inflight_parked") == 2);
+    int waits = 0;
+    const char *names[] = {
+        "inflight_wait_100us", "inflight_wait_1ms", "inflight_wait_10ms",
+        "inflight_wait_100ms", "inflight_wait_1s", "inflight_wait_slower"
+    };
+    for (int i = 0; i < 6; i++) {
+        waits += conn_stat(h, h1, cookie1, names[i]);
+    }
+    assert(waits == 2);
+
+    /* Lifting the cap lets everybody in */
+    peh->limit->inflight = 2;
+    rv = h1->get(h, cookie1, &itm, "key", 3, 0);
+    assert(rv == ENGINE_EWOULDBLOCK);
+    notify_code = ENGINE_FAILED;
+    pkt = create_packet(CONFIG_BUCKET, "capped", "max_inflight=0");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(notify_code == ENGINE_SUCCESS);
+    rv = h1->get(h, cookie1, &itm, "key", 3, 0);
+    assert(rv == ENGINE_KEY_ENOENT);
+    for (int i = 0; i < 10; i++) {
+        rv = h1->get(h, cookie2, &itm, "key", 3, 0);
+        assert(rv == ENGINE_KEY_ENOENT);
+    }
+
+    /* A queued connection that goes away leaves the queue, and one
+     * that goes away with the slot it was handed gives it on */
+    pkt = create_packet(CONFIG_BUCKET, "capped", "max_inflight=1");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    peh->limit->inflight = 1;
+    const void *cookie3 = mk_conn("capped", NULL);
+    rv = h1->get(h, cookie2, &itm, "key", 3, 0);
+    assert(rv == ENGINE_EWOULDBLOCK);
+    rv = h1->get(h, cookie3, &itm, "key", 3, 0);
+    assert(rv == ENGINE_EWOULDBLOCK);
+    rv = h1->get(h, cookie1, &itm, "key", 3, 0);
+    assert(rv == ENGINE_EWOULDBLOCK);
+    mock_disconnect((void *)cookie3);
+    assert(conn_stat(h, h1, cookie1, "inflight_queue_depth") == 2);
+
+    peh->limit->inflight = 0;
+    notify_cookie = NULL;
+    pkt = create_packet(CONFIG_BUCKET, "capped", "max_inflight=1");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(notify_cookie == cookie2);
+    assert(peh->limit->inflight == 1);
+    notify_cookie = NULL;
+    mock_disconnect((void *)cookie2);
+    assert(notify_cookie == cookie1);
+    assert(conn_stat(h, h1, cookie1, "inflight_queue_depth") == 0);
+    rv = h1->get(h, cookie1, &itm, "key", 3, 0);
+    assert(rv == ENGINE_KEY_ENOENT);
+    assert(peh->limit->inflight == 0);
+
+    pkt = create_packet(CONFIG_BUCKET, "capped", "max_inflight=-1");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == PROTOCOL_BINARY_RESPONSE_EINVAL);
+
+    return SUCCESS;
+}
+
+static enum test_result test_fair_share(ENGINE_HANDLE *h,
+                                        ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    struct bucket_engine *be = (struct bucket_engine *)h;
+    item *itm = NULL;
+    const int nflood = 1000;
+    const int nlatency = 50;
+
+    void *pkt = create_create_bucket_pkt("flood", ENGINE_PATH, "");
+    ENGINE_ERROR_CODE rv = h1->unknown_command(h, adm_cookie, pkt,
+                                               add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+    pkt = create_create_bucket_pkt("latency", ENGINE_PATH, "weight=4");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+    proxied_engine_handle_t *peh = genhash_find(be->engines, "latency",
+                                                strlen("latency"));
+    assert(peh != NULL && strcmp(peh->config, "") == 0);
+    assert(peh->limit == NULL);
+
+    const void *flood[nflood + 1];
+    const void *latency[nlatency];
+    for (int i = 0; i <= nflood; i++) {
+        flood[i] = mk_conn("flood", NULL);
+    }
+    for (int i = 0; i < nlatency; i++) {
+        latency[i] = mk_conn("latency", NULL);
+    }
+
+    /* Below the threshold the ops go right in */
+    rv = h1->get(h, flood[0], &itm, "key", 3, 0);
+    assert(rv == ENGINE_KEY_ENOENT);
+    assert(be->fair.inflight == 0);
+
+    /* Pretend the engines are busy, and let the flood queue up before
+     * the latency sensitive ops arrive */
+    be->fair.inflight = 1;
+    for (int i = 0; i < nflood; i++) {
+        rv = h1->get(h, flood[i], &itm, "key", 3, 0);
+        assert(rv == ENGINE_EWOULDBLOCK);
+    }
+    for (int i = 0; i < nlatency; i++) {
+        rv = h1->get(h, latency[i], &itm, "key", 3, 0);
+        assert(rv == ENGINE_EWOULDBLOCK);
+    }
+    assert(node_stat(h, h1, adm_cookie, "fair:queue_depth") ==
+           nflood + nlatency);
+
+    /* The busy op leaves. The next op queues up behind the others,
+     * and the first one in line gets the slot */
+    be->fair.inflight = 0;
+    notify_cookie = NULL;
+    rv = h1->get(h, flood[nflood], &itm, "key", 3, 0);
+    assert(rv == ENGINE_EWOULDBLOCK);
+
+    /* Run the ops in the order they're let in; each one hands its
+     * slot to the next */
+    int admitted = 0;
+    int latency_done = 0;
+    int worst_latency = 0;
+    while (notify_cookie != NULL) {
+        const void *cookie = notify_cookie;
+        notify_cookie = NULL;
+        rv = h1->get(h, cookie, &itm, "key", 3, 0);
+        assert(rv == ENGINE_KEY_ENOENT);
+        for (int i = 0; i < nlatency; i++) {
+            if (cookie == latency[i]) {
+                ++latency_done;
+                worst_latency = admitted;
+            }
+        }
+        ++admitted;
+    }
+    assert(admitted == nflood + nlatency + 1);
+    assert(latency_done == nlatency);
+    /* In first-come order the latency sensitive ops would all wait
+     * for the whole flood; by weight they share the engines 4:1 */
+    assert(worst_latency < nlatency + nlatency / 4 + 2);
+    assert(be->fair.inflight == 0);
+
+    assert(node_stat(h, h1, adm_cookie, "fair:queue_depth") == 0);
+    assert(node_stat(h, h1, adm_cookie, "fair:parked") ==
+           nflood + nlatency + 1);
+    assert(conn_stat(h, h1, latency[0], "weight") == 4);
+    assert(conn_stat(h, h1, latency[0], "fair_parked") == nlatency);
+    assert(conn_stat(h, h1, flood[0], "fair_parked") == nflood + 1);
+
+    /* The weight can be changed on the fly, within bounds */
+    pkt = create_packet(CONFIG_BUCKET, "flood", "weight=2");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+    assert(conn_stat(h, h1, flood[0], "weight") == 2);
+    pkt = create_packet(CONFIG_BUCKET, "flood", "weight=0");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == PROTOCOL_BINARY_RESPONSE_EINVAL);
+
+    /* A queued connection that goes away leaves the queue without
+     * taking a slot, and one that goes away with the slot it was
+     * handed gives it on */
+    be->fair.inflight = 1;
+    rv = h1->get(h, flood[0], &itm, "key", 3, 0);
+    assert(rv == ENGINE_EWOULDBLOCK);
+    rv = h1->get(h, flood[1], &itm, "key", 3, 0);
+    assert(rv == ENGINE_EWOULDBLOCK);
+    mock_disconnect((void *)flood[0]);
+    assert(node_stat(h, h1, adm_cookie, "fair:queue_depth") == 1);
+    assert(be->fair.inflight == 1);
+
+    be->fair.inflight = 0;
+    notify_cookie = NULL;
+    rv = h1->get(h, flood[2], &itm, "key", 3, 0);
+    assert(rv == ENGINE_EWOULDBLOCK);
+    assert(notify_cookie == flood[1]);
+    assert(be->fair.inflight == 1);
+    notify_cookie = NULL;
+    mock_disconnect((void *)flood[1]);
+    assert(notify_cookie == flood[2]);
+    assert(node_stat(h, h1, adm_cookie, "fair:queue_depth") == 0);
+    rv = h1->get(h, flood[2], &itm, "key", 3, 0);
+    assert(rv == ENGINE_KEY_ENOENT);
+    assert(be->fair.inflight == 0);
+
+    /* Deleting a bucket sends its queued ops away */
+    be->fair.inflight = 1;
+    rv = h1->get(h, latency[0], &itm, "key", 3, 0);
+    assert(rv == ENGINE_EWOULDBLOCK);
+    pkt = create_packet(DELETE_BUCKET, "latency", "");
+    pthread_mutex_lock(&notify_mutex);
+    notify_cookie = NULL;
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    assert(rv == ENGINE_EWOULDBLOCK);
+    while (notify_cookie != adm_cookie) {
+        pthread_cond_wait(&notify_cond, &notify_mutex);
+    }
+    pthread_mutex_unlock(&notify_mutex);
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    rv = h1->get(h, latency[0], &itm, "key", 3, 0);
+    assert(rv == ENGINE_DISCONNECT);
+    assert(node_stat(h, h1, adm_cookie, "fair:queue_depth") == 0);
+    be->fair.inflight = 0;
+
+    return SUCCESS;
+}
+
+static int timing_stat(const char *name) {
+    char *val = genhash_find(stats_hash, name, strlen(name));
+    return val != NULL ? atoi(val) : -1;
+}
+
+static void add_timing_bucket(const void *key, size_t nkey,
+                              const void *val, size_t nval, void *arg) {
+    (void)nval;
+    if (nkey > 4 && memcmp(key, "get:", 4) == 0 &&
+        memchr(key, ',', nkey) != NULL) {
+        *(int *)arg += atoi(val);
+    }
+}
+
+static enum test_result test_op_timings(ENGINE_HANDLE *h,
+                                        ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    struct bucket_engine *be = (struct bucket_engine *)h;
+    item *itm = NULL;
+
+    void *pkt = create_create_bucket_pkt("timed", ENGINE_PATH, "");
+    ENGINE_ERROR_CODE rv = h1->unknown_command(h, adm_cookie, pkt,
+                                               add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+
+    const void *cookie = mk_conn("timed", NULL);
+    for (int i = 0; i < 100; i++) {
+        rv = h1->get(h, cookie, &itm, "key", 3, 0);
+        assert(rv == ENGINE_KEY_ENOENT);
+    }
+    rv = h1->allocate(h, cookie, &itm, "key", 3, 1, 0, 0);
+    assert(rv == ENGINE_SUCCESS);
+    rv = h1->store(h, cookie, itm, 0, OPERATION_SET, 0);
+    assert(rv == ENGINE_SUCCESS);
+
+    genhash_clear(stats_hash);
+    rv = h1->get_stats(h, cookie, "bucket_timings", 14, add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    assert(timing_stat("get:count") == 100);
+    assert(timing_stat("allocate:count") == 1);
+    assert(timing_stat("store:count") == 1);
+    assert(timing_stat("remove:count") == -1);
+    assert(timing_stat("get:p50") <= timing_stat("get:p99"));
+    assert(timing_stat("get:p99") <= timing_stat("get:p999"));
+    int in_buckets = 0;
+    genhash_iter(stats_hash, add_timing_bucket, &in_buckets);
+    assert(in_buckets == 100);
+
+    /* The admin may look at any bucket */
+    genhash_clear(stats_hash);
+    rv = h1->get_stats(h, adm_cookie, "bucket_timings timed", 20, add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    assert(timing_stat("get:count") == 100);
+    rv = h1->get_stats(h, adm_cookie, "bucket_timings nosuch", 21, add_stats);
+    assert(rv == ENGINE_KEY_ENOENT);
+    rv = h1->get_stats(h, cookie, "bucket_timings timed", 20, add_stats);
+    assert(rv == ENGINE_FAILED);
+
+    /* Resetting the stats starts the timings over */
+    h1->reset_stats(h, cookie);
+    genhash_clear(stats_hash);
+    rv = h1->get_stats(h, cookie, "bucket_timings", 14, add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    assert(genhash_size(stats_hash) == 0);
+
+    /* "timings" is left to the bucket's engine */
+    genhash_clear(stats_hash);
+    rv = h1->get_stats(h, cookie, "timings", 7, add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    assert(timing_stat("mock_timings") == 1);
+    assert(timing_stat("get:count") == -1);
+
+    be->op_timings = false;
+    rv = h1->get_stats(h, cookie, "bucket_timings", 14, add_stats);
+    assert(rv == ENGINE_ENOTSUP);
+    genhash_clear(stats_hash);
+    rv = h1->get_stats(h, cookie, "timings", 7, add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    assert(timing_stat("mock_timings") == 1);
+    be->op_timings = true;
+
+    return SUCCESS;
+}
+
+static int group_stat(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                      const void *cookie, const char *group,
+                      const char *name) {
+    genhash_clear(stats_hash);
+    ENGINE_ERROR_CODE rv = h1->get_stats(h, cookie, group, strlen(group),
+                                         add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    char *val = genhash_find(stats_hash, name, strlen(name));
+    assert(val != NULL);
+    return atoi(val);
+}
+
+#define COUNTED_GETS_THREADS (STATS_SLOTS * 2 + 1)
+#define COUNTED_GETS 1000
+
+struct counted_gets {
+    struct handle_pair hp;
+    volatile int ready;
+    volatile bool go;
+};
+
+static void *counted_gets_thread(void *arg) {
+    struct counted_gets *cg = arg;
+    const void *cookie = mk_conn("counted", NULL);
+    item *itm = NULL;
+    /* The first op finds the thread its stats slot */
+    ENGINE_ERROR_CODE rv = cg->hp.h1->get(cg->hp.h, cookie, &itm, "miss", 4, 0);
+    assert(rv == ENGINE_KEY_ENOENT);
+    __sync_add_and_fetch(&cg->ready, 1);
+    while (!cg->go) {
+        usleep(100);
+    }
+    for (int i = 0; i < COUNTED_GETS; i++) {
+        rv = cg->hp.h1->get(cg->hp.h, cookie, &itm, "miss", 4, 0);
+        assert(rv == ENGINE_KEY_ENOENT);
+    }
+    return NULL;
+}
+
+static enum test_result test_bucket_ops(ENGINE_HANDLE *h,
+                                        ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    item *itm = NULL;
+    uint64_t cas = 0, result = 0;
+
+    void *pkt = create_create_bucket_pkt("counted", ENGINE_PATH, "");
+    ENGINE_ERROR_CODE rv = h1->unknown_command(h, adm_cookie, pkt,
+                                               add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+    pkt = create_create_bucket_pkt("other", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+
+    const void *cookie = mk_conn("counted", NULL);
+    for (int i = 0; i < 3; i++) {
+        rv = h1->get(h, cookie, &itm, "key", 3, 0);
+        assert(rv == ENGINE_KEY_ENOENT);
+    }
+    rv = h1->allocate(h, cookie, &itm, "key", 3, 5, 0, 0);
+    assert(rv == ENGINE_SUCCESS);
+    rv = h1->store(h, cookie, itm, &cas, OPERATION_SET, 0);
+    assert(rv == ENGINE_SUCCESS);
+    for (int i = 0; i < 2; i++) {
+        rv = h1->get(h, cookie, &itm, "key", 3, 0);
+        assert(rv == ENGINE_SUCCESS);
+    }
+    rv = h1->arithmetic(h, cookie, "num", 3, true, false, 1, 0, 0,
+                        &cas, &result, 0);
+    assert(rv == ENGINE_KEY_ENOENT);
+    rv = h1->arithmetic(h, cookie, "num", 3, true, true, 1, 0, 0,
+                        &cas, &result, 0);
+    assert(rv == ENGINE_SUCCESS);
+    rv = h1->arithmetic(h, cookie, "num", 3, false, false, 1, 0, 0,
+                        &cas, &result, 0);
+    assert(rv == ENGINE_SUCCESS);
+    rv = h1->remove(h, cookie, "key", 3, &cas, 0);
+    assert(rv == ENGINE_SUCCESS);
+    rv = h1->remove(h, cookie, "key", 3, &cas, 0);
+    assert(rv == ENGINE_KEY_ENOENT);
+
+    assert(group_stat(h, h1, cookie, "bucket_ops", "cmd_get") == 5);
+    assert(group_stat(h, h1, cookie, "bucket_ops", "get_hits") == 2);
+    assert(group_stat(h, h1, cookie, "bucket_ops", "get_misses") == 3);
+    assert(group_stat(h, h1, cookie, "bucket_ops", "get_bytes") == 10);
+    assert(group_stat(h, h1, cookie, "bucket_ops", "cmd_set") == 1);
+    assert(group_stat(h, h1, cookie, "bucket_ops", "set_bytes") == 5);
+    assert(group_stat(h, h1, cookie, "bucket_ops", "delete_hits") == 1);
+    assert(group_stat(h, h1, cookie, "bucket_ops", "delete_misses") == 1);
+    assert(group_stat(h, h1, cookie, "bucket_ops", "incr_hits") == 1);
+    assert(group_stat(h, h1, cookie, "bucket_ops", "incr_misses") == 1);
+    assert(group_stat(h, h1, cookie, "bucket_ops", "decr_hits") == 1);
+    assert(group_stat(h, h1, cookie, "bucket_ops", "decr_misses") == 0);
+
+    /* Without op_timings the bytes aren't counted */
+    struct bucket_engine *be = (struct bucket_engine *)h;
+    be->op_timings = false;
+    rv = h1->allocate(h, cookie, &itm, "key", 3, 5, 0, 0);
+    assert(rv == ENGINE_SUCCESS);
+    rv = h1->store(h, cookie, itm, &cas, OPERATION_SET, 0);
+    assert(rv == ENGINE_SUCCESS);
+    rv = h1->get(h, cookie, &itm, "key", 3, 0);
+    assert(rv == ENGINE_SUCCESS);
+    assert(group_stat(h, h1, cookie, "bucket_ops", "get_hits") == 3);
+    assert(group_stat(h, h1, cookie, "bucket_ops", "get_bytes") == 10);
+    assert(group_stat(h, h1, cookie, "bucket_ops", "cmd_set") == 2);
+    assert(group_stat(h, h1, cookie, "bucket_ops", "set_bytes") == 5);
+    be->op_timings = true;
+
+    /* Every bucket counts its own */
+    assert(group_stat(h, h1, adm_cookie, "bucket_ops counted",
+                      "cmd_get") == 6);
+    assert(group_stat(h, h1, adm_cookie, "bucket_ops other",
+                      "cmd_get") == 0);
+    rv = h1->get_stats(h, cookie, "bucket_ops other", 16, add_stats);
+    assert(rv == ENGINE_FAILED);
+
+    h1->reset_stats(h, cookie);
+    assert(group_stat(h, h1, cookie, "bucket_ops", "cmd_get") == 0);
+
+    /* More threads than stats slots share them without losing counts
+     * (once they've all found their slot) */
+    struct counted_gets cg = { .hp = { h, h1 } };
+    pthread_t tids[COUNTED_GETS_THREADS];
+    for (int i = 0; i < COUNTED_GETS_THREADS; i++) {
+        int r = pthread_create(&tids[i], NULL, counted_gets_thread, &cg);
+        assert(r == 0);
+    }
+    while (cg.ready < COUNTED_GETS_THREADS) {
+        usleep(100);
+    }
+    int before = group_stat(h, h1, cookie, "bucket_ops", "cmd_get");
+    cg.go = true;
+    for (int i = 0; i < COUNTED_GETS_THREADS; i++) {
+        int r = pthread_join(tids[i], NULL);
+        assert(r == 0);
+    }
+    assert(group_stat(h, h1, cookie, "bucket_ops", "cmd_get") - before ==
+           COUNTED_GETS_THREADS * COUNTED_GETS);
+
+    return SUCCESS;
+}
+
+static enum test_result test_slow_ops(ENGINE_HANDLE *h,
+                                      ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    item *itm = NULL;
+
+    void *pkt = create_create_bucket_pkt("slowpoke", ENGINE_PATH,
+                                         "slow_get;slow_op_usec=1000");
+    ENGINE_ERROR_CODE rv = h1->unknown_command(h, adm_cookie, pkt,
+                                               add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+    pkt = create_create_bucket_pkt("quick", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+
+    const void *cookie = mk_conn("slowpoke", NULL);
+    for (int i = 0; i < 3; i++) {
+        rv = h1->get(h, cookie, &itm, "slowkey", 7, 0);
+        assert(rv == ENGINE_KEY_ENOENT);
+    }
+    /* Not slow enough */
+    rv = h1->allocate(h, cookie, &itm, "key", 3, 5, 0, 0);
+    assert(rv == ENGINE_SUCCESS);
+    h1->release(h, cookie, itm);
+
+    genhash_clear(stats_hash);
+    rv = h1->get_stats(h, cookie, "slow_ops", 8, add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    assert(genhash_size(stats_hash) == 4);
+    assert(group_stat(h, h1, cookie, "slow_ops", "slow_op_usec") == 1000);
+    char *val = genhash_find(stats_hash, "slow:0", 6);
+    assert(val != NULL);
+    assert(strncmp(val, "op=get,", 7) == 0);
+    assert(strstr(val, ",bucket=slowpoke,") != NULL);
+    assert(strstr(val, ",nkey=7,key=slowkey") != NULL);
+    assert(genhash_find(stats_hash, "slow:2", 6) != NULL);
+
+    /* The other buckets only see their own */
+    genhash_clear(stats_hash);
+    rv = h1->get_stats(h, adm_cookie, "slow_ops quick", 14, add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    assert(genhash_size(stats_hash) == 1);
+    rv = h1->get_stats(h, cookie, "slow_ops quick", 14, add_stats);
+    assert(rv == ENGINE_FAILED);
+    assert(group_stat(h, h1, adm_cookie, "bucket_engine", "slow_ops:recorded") == 3);
+
+    /* It can be turned off */
+    pkt = create_packet(CONFIG_BUCKET, "slowpoke", "slow_op_usec=0");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+    rv = h1->get(h, cookie, &itm, "slowkey", 7, 0);
+    assert(rv == ENGINE_KEY_ENOENT);
+    assert(group_stat(h, h1, adm_cookie, "bucket_engine", "slow_ops:recorded") == 3);
+    assert(group_stat(h, h1, cookie, "slow_ops", "slow_op_usec") == 0);
+
+    return SUCCESS;
+}
+
+static char stat_order[4][32];
+static int stat_order_count;
+
+static void add_stat_order(const char *key, const uint16_t klen,
+                          const char *val, const uint32_t vlen,
+                          const void *cookie) {
+    (void)val;
+    (void)vlen;
+    (void)cookie;
+    assert(stat_order_count < 4);
+    assert(klen < sizeof(stat_order[0]));
+    memcpy(stat_order[stat_order_count], key, klen);
+    stat_order[stat_order_count++][klen] = 0x00;
+}
+
+static enum test_result test_bucket_cpu(ENGINE_HANDLE *h,
+                                        ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    item *itm = NULL;
+
+    void *pkt = create_create_bucket_pkt("busy", ENGINE_PATH, "");
+    ENGINE_ERROR_CODE rv = h1->unknown_command(h, adm_cookie, pkt,
+                                               add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+    pkt = create_create_bucket_pkt("idle", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+
+    const void *busy = mk_conn("busy", NULL);
+    const void *idle = mk_conn("idle", NULL);
+    for (int i = 0; i < 1000; i++) {
+        rv = h1->get(h, busy, &itm, "key", 3, 0);
+        assert(rv == ENGINE_KEY_ENOENT);
+    }
+    rv = h1->get(h, idle, &itm, "key", 3, 0);
+    assert(rv == ENGINE_KEY_ENOENT);
+
+    /* Every op is sampled with cpu_sample_rate=1 */
+    assert(group_stat(h, h1, busy, "bucket_ops", "cpu_samples") == 1000);
+    assert(group_stat(h, h1, busy, "bucket_ops", "cpu_nsec") > 0);
+    assert(group_stat(h, h1, idle, "bucket_ops", "cpu_samples") == 1);
+
+    stat_order_count = 0;
+    rv = h1->get_stats(h, adm_cookie, "bucket_cpu", 10, add_stat_order);
+    assert(rv == ENGINE_SUCCESS);
+    assert(stat_order_count == 2);
+    assert(strcmp(stat_order[0], "busy") == 0);
+    assert(strcmp(stat_order[1], "idle") == 0);
+
+    rv = h1->get_stats(h, busy, "bucket_cpu", 10, add_stat_order);
+    assert(rv == ENGINE_FAILED);
+
+    h1->reset_stats(h, busy);
+    assert(group_stat(h, h1, busy, "bucket_ops", "cpu_nsec") == 0);
+
+    return SUCCESS;
+}
+
+static enum test_result test_topbuckets(ENGINE_HANDLE *h,
+                                        ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    item *itm = NULL;
+    uint64_t cas = 0;
+
+    void *pkt = create_create_bucket_pkt("hot", ENGINE_PATH, "");
+    ENGINE_ERROR_CODE rv = h1->unknown_command(h, adm_cookie, pkt,
+                                               add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+    pkt = create_create_bucket_pkt("big", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+
+    /* Lots of small ops on one, one large store on the other */
+    const void *hot = mk_conn("hot", NULL);
+    const void *big = mk_conn("big", NULL);
+    for (int i = 0; i < 100; i++) {
+        rv = h1->get(h, hot, &itm, "key", 3, 0);
+        assert(rv == ENGINE_KEY_ENOENT);
+    }
+    rv = h1->allocate(h, big, &itm, "key", 3, 4096, 0, 0);
+    assert(rv == ENGINE_SUCCESS);
+    rv = h1->store(h, big, itm, &cas, OPERATION_SET, 0);
+    assert(rv == ENGINE_SUCCESS);
+    usleep(10000);
+
+    stat_order_count = 0;
+    rv = h1->get_stats(h, adm_cookie, "topbuckets", 10, add_stat_order);
+    assert(rv == ENGINE_SUCCESS);
+    assert(stat_order_count == 2);
+    assert(strcmp(stat_order[0], "hot") == 0);
+    assert(strcmp(stat_order[1], "big") == 0);
+
+    stat_order_count = 0;
+    rv = h1->get_stats(h, adm_cookie, "topbuckets bytes", 16,
+                       add_stat_order);
+    assert(rv == ENGINE_SUCCESS);
+    assert(stat_order_count == 2);
+    assert(strcmp(stat_order[0], "big") == 0);
+    assert(strcmp(stat_order[1], "hot") == 0);
+
+    genhash_clear(stats_hash);
+    rv = h1->get_stats(h, adm_cookie, "topbuckets ops", 14, add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    const char *val = genhash_find(stats_hash, "hot", 3);
+    assert(val != NULL);
+    assert(strncmp(val, "ops_per_sec=", 12) == 0);
+    assert(atof(val + 12) > 0);
+
+    stat_order_count = 0;
+    rv = h1->get_stats(h, adm_cookie, "topbuckets inflight", 19,
+                       add_stat_order);
+#ifdef ENABLE_EPOCH_HANDLES
+    assert(rv == ENGINE_ENOTSUP);
+#else
+    assert(rv == ENGINE_SUCCESS);
+    assert(stat_order_count == 2);
+#endif
+
+    rv = h1->get_stats(h, adm_cookie, "topbuckets keys", 15, add_stats);
+    assert(rv == ENGINE_EINVAL);
+    rv = h1->get_stats(h, hot, "topbuckets", 10, add_stats);
+    assert(rv == ENGINE_FAILED);
+
+    return SUCCESS;
+}
+
+static enum test_result test_engines_table_growth(ENGINE_HANDLE *h,
+                                                  ENGINE_HANDLE_V1 *h1) {
+    ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
+    const void *adm_cookie = mk_conn("admin", NULL);
+    const int nbuckets = 200;
+
+    for (int i = 0; i < nbuckets; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "bucket%d", i);
+        void *pkt = create_create_bucket_pkt(name, ENGINE_PATH, "");
+        rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+        free(pkt);
+        assert(rv == ENGINE_SUCCESS);
+        assert(last_status == 0);
+    }
+
+    rv = h1->get_stats(h, adm_cookie, "bucket", 6, add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    assert(genhash_size(stats_hash) == nbuckets);
+
+    genhash_clear(stats_hash);
+    rv = h1->get_stats(h, adm_cookie, "bucket_engine", 13, add_stats);
+    assert(rv == ENGINE_SUCCESS);
+    /* all of them use the same module */
+    assert(mock_module_instances() == nbuckets + 1);
+
+    char *val = genhash_find(stats_hash, "engines_table:items",
+                             strlen("engines_table:items"));
+    assert(val != NULL && atoi(val) == nbuckets);
+    val = genhash_find(stats_hash, "engines_table:size",
+                       strlen("engines_table:size"));
+    assert(val != NULL && atoi(val) >= nbuckets / 2);
+    val = genhash_find(stats_hash, "engines_table:max_chain",
+                       strlen("engines_table:max_chain"));
+    assert(val != NULL && atoi(val) < 10);
+
+    /* every bucket must still be reachable */
+    for (int i = 0; i < nbuckets; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "bucket%d", i);
+        void *pkt = create_packet(SELECT_BUCKET, name, "");
+        rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+        free(pkt);
+        assert(rv == ENGINE_SUCCESS);
+        assert(last_status == 0);
+    }
+
+    return SUCCESS;
+}
+
+static enum test_result test_unknown_call_no_bucket(ENGINE_HANDLE *h,
+                                                    ENGINE_HANDLE_V1 *h1) {
+
+    ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
+
+    void *pkt = create_packet(0xfe, "somekey", "someval");
+    rv = h1->unknown_command(h, mk_conn("someuser", NULL), pkt, add_response);
+    free(pkt);
+    assert(rv == ENGINE_DISCONNECT);
+
+    return SUCCESS;
+}
+
+static enum test_result test_auto_config(ENGINE_HANDLE *h,
+                                         ENGINE_HANDLE_V1 *h1) {
+    item *itm = NULL;
+    const void *cookie = mk_conn("someuser", MOCK_CONFIG_NO_ALLOC);
+    char *key = "somekey";
+    char *value = "some value";
+
+    ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
+
+    rv = h1->allocate(h, cookie, &itm,
+                      key, strlen(key),
+                      strlen(value), 9258, 3600);
+    assert(rv == ENGINE_ENOMEM);
+
+    return SUCCESS;
+}
+
+static enum test_result test_get_tap_iterator(ENGINE_HANDLE *h,
+                                              ENGINE_HANDLE_V1 *h1) {
+    // This is run for its side effect of not crashing.
+    const void *cookie = mk_conn(NULL, NULL);
+
+    TAP_ITERATOR ti = h1->get_tap_iterator(h, cookie,
+                                           NULL, 0, 0, NULL, 0);
+    assert(ti != NULL);
+
+    tap_event_t e;
+    do {
+        item *it;
+        void *engine_specific;
+        uint16_t nengine_specific;
+        uint8_t ttl;
+        uint16_t flags;
+        uint32_t seqno;
+        uint16_t vbucket;
+        e = ti(h, cookie, &it, &engine_specific, &nengine_specific, &ttl,
+               &flags, &seqno, &vbucket);
+    } while (e != TAP_DISCONNECT);
+
+    mock_disconnect((void*)cookie);
+
+    return SUCCESS;
+}
+
+static enum test_result test_tap_notify(ENGINE_HANDLE *h,
+                                        ENGINE_HANDLE_V1 *h1) {
+    ENGINE_ERROR_CODE ec = h1->tap_notify(h, mk_conn("someuser", ""),
+                                          NULL, 0, 0, 0, TAP_MUTATION, 0,
+                                          "akey", 4,
+                                          0, 0, 0,
+                                          "aval", 4, 0);
+    assert(ec == ENGINE_SUCCESS);
+    return SUCCESS;
+}
+
+
+#define MAX_CONNECTIONS_IN_POOL 1000
+struct {
+    pthread_mutex_t mutex;
+    int connected;
+    int pend_close;
+    TAP_ITERATOR iter;
+    struct connstruct *conn;
+} connection_pool[MAX_CONNECTIONS_IN_POOL];
+
+static void init_connection_pool(void) {
+    for (int ii = 0; ii < MAX_CONNECTIONS_IN_POOL; ++ii) {
+        connection_pool[ii].conn = mk_conn(NULL, NULL);
+        mock_disconnect(connection_pool[ii].conn);
+        connection_pool[ii].connected = 0;
+        connection_pool[ii].pend_close = 0;
+        connection_pool[ii].iter = NULL;
+        pthread_mutex_init(&connection_pool[ii].mutex, NULL);
+    }
+}
+
+static void cleanup_connection_pool(ENGINE_HANDLE *h) {
+    for (int ii = 0; ii < MAX_CONNECTIONS_IN_POOL; ++ii) {
+        if (connection_pool[ii].pend_close) {
+            tap_event_t e = connection_pool[ii].iter(h,
+                                                     connection_pool[ii].conn,
+                                                     NULL, NULL, NULL,
+                                                     NULL, NULL, NULL, NULL);
+            assert(e == TAP_DISCONNECT);
+        }
+        mock_disconnect(connection_pool[ii].conn);
+        pthread_mutex_destroy(&connection_pool[ii].mutex);
+    }
+}
+
+static void *network_io_thread(void *arg) {
+    int num_ops = 500000;
+    ENGINE_HANDLE *h = arg;
+    ENGINE_HANDLE_V1 *h1 = arg;
+
+    for (int ii = 0; ii < num_ops; ++ii) {
+        long idx = (random() & 0xffff) % 1000;
+        pthread_mutex_lock(&connection_pool[idx].mutex);
+        if (!connection_pool[idx].pend_close) {
+            if (!connection_pool[idx].connected) {
+                mock_connect(connection_pool[idx].conn);
+                connection_pool[idx].connected = 1;
+                if (h != NULL) {
+                    // run tap connect
+                    TAP_ITERATOR ti;
+                    ti = h1->get_tap_iterator(h,
+                                              connection_pool[idx].conn,
+                                              NULL, 0, 0, NULL, 0);
+                    assert(ti != NULL);
+                    connection_pool[idx].iter = ti;
+                    connection_pool[idx].pend_close = 1;
+                }
+            } else {
+                mock_disconnect(connection_pool[idx].conn);
+                connection_pool[idx].connected = 0;
+            }
+        } else {
+            tap_event_t e = connection_pool[idx].iter(h,
+                                                     connection_pool[idx].conn,
+                                                     NULL, NULL, NULL,
+                                                     NULL, NULL, NULL, NULL);
             assert(e == TAP_DISCONNECT);
             connection_pool[idx].pend_close = 0;
         }
@@ -1791,6 +3438,523 @@ static void runBench(void) {
     }
 }
 
+static double bench_now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+#define CLIENTS_BENCH_OPS 2000000
+
+struct clients_bench_arg {
+    ENGINE_HANDLE *h;
+    ENGINE_HANDLE_V1 *h1;
+    const void *cookie;
+    item *itm;
+};
+
+static void *clients_bench_worker(void *arg) {
+    struct clients_bench_arg *a = arg;
+    for (int i = 0; i < CLIENTS_BENCH_OPS; i++) {
+        item_info info = { .nvalue = 1 };
+        bool ok = a->h1->get_item_info(a->h, a->cookie, a->itm, &info);
+        assert(ok);
+    }
+    return NULL;
+}
+
+/**
+ * Measure how the per-op bookkeeping in bucket_engine scales with the
+ * number of worker threads hitting the same bucket. get_item_info is
+ * about as cheap as an op gets in the mock engine, so this mostly
+ * measures getting and releasing the engine handle. Build with and
+ * without --enable-epoch-handles to compare the two schemes.
+ */
+static void runClientsBench(void) {
+    ENGINE_HANDLE_V1 *h1 = start_your_engines(DEFAULT_CONFIG);
+    ENGINE_HANDLE *h = (ENGINE_HANDLE*)h1;
+    const int max_threads = 64;
+    struct clients_bench_arg args[max_threads];
+    pthread_t workers[max_threads];
+
+    const void *adm_cookie = mk_conn("admin", NULL);
+    void *pkt = create_create_bucket_pkt("bench", ENGINE_PATH, "");
+    ENGINE_ERROR_CODE rv = h1->unknown_command(h, adm_cookie, pkt,
+                                               add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+
+    const void *cookie = mk_conn("bench", NULL);
+    item *itm = NULL;
+    store(h, h1, cookie, "clients_bench", "v", &itm);
+    assert(itm);
+
+    for (int i = 0; i < max_threads; i++) {
+        args[i].h = h;
+        args[i].h1 = h1;
+        args[i].cookie = mk_conn("bench", NULL);
+        args[i].itm = itm;
+    }
+
+#ifdef ENABLE_EPOCH_HANDLES
+    printf("handles protected by epochs\n");
+#else
+    printf("handles protected by the clients counter\n");
+#endif
+    printf("threads    Mops/s  (%d ops per thread)\n", CLIENTS_BENCH_OPS);
+    for (int n = 1; n <= max_threads; n *= 2) {
+        double t0 = bench_now();
+        for (int i = 0; i < n; i++) {
+            int rc = pthread_create(&workers[i], NULL,
+                                    clients_bench_worker, &args[i]);
+            assert(rc == 0);
+        }
+        for (int i = 0; i < n; i++) {
+            int rc = pthread_join(workers[i], NULL);
+            assert(rc == 0);
+        }
+        double t = bench_now() - t0;
+        printf("%7d  %8.2f\n", n, (double)n * CLIENTS_BENCH_OPS / t / 1000000.0);
+    }
+
+    h1->release(h, cookie, itm);
+}
+
+#define SHARING_BENCH_OPS 5000000
+#define SHARING_BENCH_READERS 4
+#define SHARING_BENCH_WRITERS 2
+
+struct sharing_bench_arg {
+    ENGINE_HANDLE *h;
+    ENGINE_HANDLE_V1 *h1;
+    const void *cookie;
+    volatile bool *stop;
+};
+
+static void *sharing_bench_reader(void *arg) {
+    struct sharing_bench_arg *a = arg;
+    for (int i = 0; i < SHARING_BENCH_OPS; i++) {
+        item *itm = NULL;
+        ENGINE_ERROR_CODE rv = a->h1->get(a->h, a->cookie, &itm, "nokey", 5, 0);
+        assert(rv == ENGINE_KEY_ENOENT);
+    }
+    return NULL;
+}
+
+/* Does to the shared state what connection churn (the default bucket's
+ * refcount) and bucket management (engines_mutex) do */
+static void *sharing_bench_writer(void *arg) {
+    struct sharing_bench_arg *a = arg;
+    struct bucket_engine *be = (struct bucket_engine *)a->h;
+    while (!*a->stop) {
+        ATOMIC_INCR(&be->default_engine.refcount);
+        ATOMIC_DECR(&be->default_engine.refcount);
+        pthread_mutex_lock(&be->engines_mutex);
+        pthread_mutex_unlock(&be->engines_mutex);
+    }
+    return NULL;
+}
+
+static double sharing_bench_run(struct sharing_bench_arg *args, int writers) {
+    pthread_t readers[SHARING_BENCH_READERS];
+    pthread_t writer_tids[SHARING_BENCH_WRITERS];
+    volatile bool stop = false;
+
+    for (int i = 0; i < writers; i++) {
+        args[i].stop = &stop;
+        int rc = pthread_create(&writer_tids[i], NULL,
+                                sharing_bench_writer, &args[i]);
+        assert(rc == 0);
+    }
+    double t0 = bench_now();
+    for (int i = 0; i < SHARING_BENCH_READERS; i++) {
+        int rc = pthread_create(&readers[i], NULL,
+                                sharing_bench_reader, &args[i]);
+        assert(rc == 0);
+    }
+    for (int i = 0; i < SHARING_BENCH_READERS; i++) {
+        int rc = pthread_join(readers[i], NULL);
+        assert(rc == 0);
+    }
+    double t = bench_now() - t0;
+    stop = true;
+    for (int i = 0; i < writers; i++) {
+        int rc = pthread_join(writer_tids[i], NULL);
+        assert(rc == 0);
+    }
+    return (double)SHARING_BENCH_READERS * SHARING_BENCH_OPS / t / 1000000.0;
+}
+
+#define LINE_OF(base, field) \
+    (int)(((uintptr_t)&(field) - (uintptr_t)(base)) / CACHE_LINE_SIZE)
+
+#define CREATE_BENCH_BUCKETS 300
+
+/**
+ * Measure how long it takes to create buckets of the same engine
+ * module, one after another.
+ */
+static void runCreateBench(void) {
+    ENGINE_HANDLE_V1 *h1 = start_your_engines(DEFAULT_CONFIG_NO_DEF);
+    ENGINE_HANDLE *h = (ENGINE_HANDLE*)h1;
+    const void *adm_cookie = mk_conn("admin", NULL);
+
+    double t0 = bench_now();
+    for (int i = 0; i < CREATE_BENCH_BUCKETS; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "bench%d", i);
+        void *pkt = create_create_bucket_pkt(name, ENGINE_PATH, "");
+        ENGINE_ERROR_CODE rv = h1->unknown_command(h, adm_cookie, pkt,
+                                                   add_response);
+        free(pkt);
+        assert(rv == ENGINE_SUCCESS);
+        assert(last_status == 0);
+    }
+    double t = bench_now() - t0;
+    printf("created %d buckets in %.3f s (%.1f usec per bucket)\n",
+           CREATE_BENCH_BUCKETS, t, t * 1000000.0 / CREATE_BENCH_BUCKETS);
+}
+
+#define CONNECT_BENCH_CONNS 1000
+#define CONNECT_BENCH_ROUNDS 1000
+
+/**
+ * Measure how fast anonymous connections are bound to the default
+ * named bucket.
+ */
+static void runConnectBench(void) {
+    ENGINE_HANDLE_V1 *h1 =
+        start_your_engines(DEFAULT_CONFIG_NO_DEF ";default_bucket_name=bench");
+    ENGINE_HANDLE *h = (ENGINE_HANDLE*)h1;
+    const void *adm_cookie = mk_conn("admin", NULL);
+    struct connstruct *conns[CONNECT_BENCH_CONNS];
+
+    void *pkt = create_create_bucket_pkt("bench", ENGINE_PATH, "");
+    ENGINE_ERROR_CODE rv = h1->unknown_command(h, adm_cookie, pkt,
+                                               add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+
+    for (int i = 0; i < CONNECT_BENCH_CONNS; i++) {
+        conns[i] = mk_conn(NULL, NULL);
+        mock_disconnect(conns[i]);
+    }
+
+    double t0 = bench_now();
+    for (int r = 0; r < CONNECT_BENCH_ROUNDS; r++) {
+        for (int i = 0; i < CONNECT_BENCH_CONNS; i++) {
+            mock_connect(conns[i]);
+        }
+        for (int i = 0; i < CONNECT_BENCH_CONNS; i++) {
+            mock_disconnect(conns[i]);
+        }
+    }
+    double t = bench_now() - t0;
+    double n = (double)CONNECT_BENCH_CONNS * CONNECT_BENCH_ROUNDS;
+    printf("%.0f connects in %.3f s (%.2f M connects/s)\n",
+           n, t, n / t / 1000000.0);
+}
+
+#define LIMIT_BENCH_OPS 10000000
+
+static double limit_bench_run(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                              const char *name, const char *config) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    void *pkt = create_create_bucket_pkt(name, ENGINE_PATH, config);
+    ENGINE_ERROR_CODE rv = h1->unknown_command(h, adm_cookie, pkt,
+                                               add_response);
+    free(pkt);
+    assert(rv == ENGINE_SUCCESS);
+    assert(last_status == 0);
+
+    const void *cookie = mk_conn(name, NULL);
+    item *itm;
+    double t0 = bench_now();
+    for (int i = 0; i < LIMIT_BENCH_OPS; i++) {
+        rv = h1->get(h, cookie, &itm, "key", 3, 0);
+        assert(rv == ENGINE_KEY_ENOENT);
+    }
+    return (bench_now() - t0) * 1000000000.0 / LIMIT_BENCH_OPS;
+}
+
+/**
+ * Measure what checking the ops limit adds to a get, with a limit
+ * that's never reached.
+ */
+static void runLimitBench(void) {
+    ENGINE_HANDLE_V1 *h1 = start_your_engines(DEFAULT_CONFIG_NO_DEF);
+    ENGINE_HANDLE *h = (ENGINE_HANDLE*)h1;
+
+    printf("get without a limit  %6.1f ns\n",
+           limit_bench_run(h, h1, "unlimited", ""));
+    printf("get with a limit     %6.1f ns\n",
+           limit_bench_run(h, h1, "limited", "ops_limit=1000000000"));
+}
+
+/**
+ * Measure what timing the ops in the engine adds to a get.
+ */
+static void runTimingBench(void) {
+    ENGINE_HANDLE_V1 *h1 = start_your_engines(DEFAULT_CONFIG_NO_DEF);
+    ENGINE_HANDLE *h = (ENGINE_HANDLE*)h1;
+    struct bucket_engine *be = (struct bucket_engine *)h;
+
+    be->op_timings = false;
+    printf("get without timings  %6.1f ns\n",
+           limit_bench_run(h, h1, "untimed", ""));
+    be->op_timings = true;
+    printf("get with timings     %6.1f ns\n",
+           limit_bench_run(h, h1, "timed", ""));
+}
+
+/**
+ * Show where the hot fields of the default bucket ended up, and how
+ * much ops on the default bucket slow down while other threads keep
+ * writing its refcount and the engines mutex.
+ */
+static void runFalseSharingBench(void) {
+    /* Keep the topkeys locks out of the picture */
+    putenv("MEMCACHED_TOP_KEYS=0");
+    ENGINE_HANDLE_V1 *h1 = start_your_engines(DEFAULT_CONFIG);
+    ENGINE_HANDLE *h = (ENGINE_HANDLE*)h1;
+    putenv("MEMCACHED_TOP_KEYS=10");
+    struct bucket_engine *be = (struct bucket_engine *)h;
+    proxied_engine_handle_t *peh = &be->default_engine;
+    struct sharing_bench_arg args[SHARING_BENCH_READERS];
+
+    printf("cache line (from the start of bucket_engine):\n");
+    printf("  default_engine.state     %d\n", LINE_OF(be, peh->state));
+    printf("  default_engine.pe        %d\n", LINE_OF(be, peh->pe));
+#ifndef ENABLE_EPOCH_HANDLES
+    printf("  default_engine.clients   %d\n", LINE_OF(be, peh->clients));
+#endif
+    printf("  default_engine.refcount  %d\n", LINE_OF(be, peh->refcount));
+    printf("  engines_mutex            %d\n", LINE_OF(be, be->engines_mutex));
+    printf("  shutdown                 %d\n", LINE_OF(be, be->shutdown));
+
+    for (int i = 0; i < SHARING_BENCH_READERS; i++) {
+        args[i].h = h;
+        args[i].h1 = h1;
+        args[i].cookie = mk_conn(NULL, NULL);
+    }
+
+    printf("default bucket gets with %d readers:\n", SHARING_BENCH_READERS);
+    printf("  no writers     %8.2f Mops/s\n", sharing_bench_run(args, 0));
+    printf("  %d writers      %8.2f Mops/s\n", SHARING_BENCH_WRITERS,
+           sharing_bench_run(args, SHARING_BENCH_WRITERS));
+}
+
+static int bench_key_eq(const void *k1, size_t nkey1,
+                        const void *k2, size_t nkey2) {
+    return nkey1 == nkey2 && memcmp(k1, k2, nkey1) == 0;
+}
+
+#define GENHASH_BENCH_KEYLEN 16
+
+static void bench_genhash_impl(enum genhash_impl impl, const char *keys,
+                               const char *misses, const int *order, int n) {
+    static struct hash_ops ops = {
+        .hashfunc = genhash_string_hash,
+        .hasheq = bench_key_eq,
+        .dupKey = NULL,
+        .dupValue = NULL,
+        .freeKey = NULL,
+        .freeValue = NULL
+    };
+    /* Do at least 10M of each operation so the small tables give
+     * meaningful numbers */
+    int rounds = n < 10000000 ? 10000000 / n : 1;
+    double store_t = 0, hit_t = 0, miss_t = 0, del_t = 0;
+    int found = 0;
+
+    for (int r = 0; r < rounds; r++) {
+        genhash_t *h = genhash_init_impl(1, ops, impl);
+        assert(h);
+        double t0 = bench_now();
+        for (int i = 0; i < n; i++) {
+            const char *k = keys + (size_t)i * GENHASH_BENCH_KEYLEN;
+            genhash_store(h, k, strlen(k), k, 0);
+        }
+        double t1 = bench_now();
+        for (int i = 0; i < n; i++) {
+            const char *k = keys + (size_t)order[i] * GENHASH_BENCH_KEYLEN;
+            found += genhash_find(h, k, strlen(k)) != NULL;
+        }
+        double t2 = bench_now();
+        for (int i = 0; i < n; i++) {
+            const char *k = misses + (size_t)order[i] * GENHASH_BENCH_KEYLEN;
+            found += genhash_find(h, k, strlen(k)) != NULL;
+        }
+        double t3 = bench_now();
+        for (int i = 0; i < n; i++) {
+            const char *k = keys + (size_t)order[i] * GENHASH_BENCH_KEYLEN;
+            genhash_delete(h, k, strlen(k));
+        }
+        double t4 = bench_now();
+        assert(genhash_size(h) == 0);
+        genhash_free(h);
+
+        store_t += t1 - t0;
+        hit_t += t2 - t1;
+        miss_t += t3 - t2;
+        del_t += t4 - t3;
+    }
+    assert(found == n * rounds);
+
+    double ops_done = (double)n * rounds / 1000000000.0;
+    printf("%-8s %9d keys: store %6.1f ns  hit %6.1f ns  "
+           "miss %6.1f ns  delete %6.1f ns\n",
+           impl == GENHASH_FLAT ? "flat" : "chained", n,
+           store_t / ops_done, hit_t / ops_done,
+           miss_t / ops_done, del_t / ops_done);
+}
+
+/**
+ * Compare the two genhash implementations. Set GENHASH_BENCH to a
+ * comma separated list of key counts to override the default sizes.
+ */
+static void runGenhashBench(const char *sizes) {
+    char buf[256];
+    if (*sizes == '\0') {
+        sizes = "1000,100000,10000000";
+    }
+    snprintf(buf, sizeof(buf), "%s", sizes);
+
+    for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        int n = atoi(tok);
+        assert(n > 0);
+        char *keys = malloc((size_t)n * GENHASH_BENCH_KEYLEN);
+        char *misses = malloc((size_t)n * GENHASH_BENCH_KEYLEN);
+        int *order = malloc((size_t)n * sizeof(int));
+        assert(keys && misses && order);
+        for (int i = 0; i < n; i++) {
+            snprintf(keys + (size_t)i * GENHASH_BENCH_KEYLEN,
+                     GENHASH_BENCH_KEYLEN, "key:%d", i);
+            snprintf(misses + (size_t)i * GENHASH_BENCH_KEYLEN,
+                     GENHASH_BENCH_KEYLEN, "miss:%d", i);
+            order[i] = i;
+        }
+        /* Look the keys up in random order, like a real workload */
+        srand(42);
+        for (int i = n - 1; i > 0; i--) {
+            int j = rand() % (i + 1);
+            int tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+        bench_genhash_impl(GENHASH_CHAINED, keys, misses, order, n);
+        bench_genhash_impl(GENHASH_FLAT, keys, misses, order, n);
+        free(keys);
+        free(misses);
+        free(order);
+    }
+}
+
+/* Small enough to stay in cache; the server hashes keys it just read */
+#define HASH_BENCH_KEYS 4096
+#define HASH_BENCH_ROUNDS 2500
+#define HASH_BENCH_MAXKEY 250
+
+static double bench_hash(int (*fn)(const void *, size_t), const char *keys,
+                         const int *lens, int nkeys, int rounds) {
+    unsigned int sink = 0;
+    double t0 = bench_now();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < nkeys; i++) {
+            sink += fn(keys + (size_t)i * HASH_BENCH_MAXKEY, lens[i]);
+        }
+    }
+    double t = bench_now() - t0;
+    /* Make sure the calls can't be optimized away */
+    if (sink == 0xdeadbeef) {
+        printf(" ");
+    }
+    return t * 1000000000.0 / ((double)nkeys * rounds);
+}
+
+static void report_shards(const char *name, const int *counts) {
+    int min = counts[0], max = counts[0];
+    for (int i = 1; i < TK_SHARDS; i++) {
+        min = counts[i] < min ? counts[i] : min;
+        max = counts[i] > max ? counts[i] : max;
+    }
+    printf("  %-20s min %7d  max %7d\n", name, min, max);
+}
+
+/**
+ * Compare genhash_string_hash and genhash_seeded_hash over keys with
+ * a length mix typical of memcached deployments, and over fixed key
+ * lengths. Also shows how evenly keys that differ in the middle spread
+ * over the topkeys shards.
+ */
+static void runHashBench(void) {
+    static const struct {
+        int min, max, percent;
+    } mix[] = {
+        { 4, 10, 10 }, { 11, 24, 35 }, { 25, 48, 35 },
+        { 49, 100, 15 }, { 101, 250, 5 }
+    };
+    static const char alphabet[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789:_-";
+    char *keys = malloc((size_t)HASH_BENCH_KEYS * HASH_BENCH_MAXKEY);
+    int *lens = malloc(HASH_BENCH_KEYS * sizeof(int));
+    assert(keys && lens);
+
+    srand(42);
+    for (int i = 0; i < HASH_BENCH_KEYS; i++) {
+        int pick = rand() % 100, c = 0;
+        size_t m = 0;
+        while (pick >= c + mix[m].percent) {
+            c += mix[m++].percent;
+        }
+        lens[i] = mix[m].min + rand() % (mix[m].max - mix[m].min + 1);
+        char *k = keys + (size_t)i * HASH_BENCH_MAXKEY;
+        for (int j = 0; j < lens[i]; j++) {
+            k[j] = alphabet[rand() % (sizeof(alphabet) - 1)];
+        }
+    }
+
+    printf("hash ns/key            string_hash  seeded_hash\n");
+    printf("  %-20s %11.1f  %11.1f\n", "mixed lengths",
+           bench_hash(genhash_string_hash, keys, lens, HASH_BENCH_KEYS,
+                      HASH_BENCH_ROUNDS),
+           bench_hash(genhash_seeded_hash, keys, lens, HASH_BENCH_KEYS,
+                      HASH_BENCH_ROUNDS));
+
+    static const int fixed[] = { 8, 16, 32, 64, 128, 250 };
+    for (size_t f = 0; f < sizeof(fixed) / sizeof(fixed[0]); f++) {
+        char name[32];
+        for (int i = 0; i < HASH_BENCH_KEYS; i++) {
+            lens[i] = fixed[f];
+        }
+        snprintf(name, sizeof(name), "%d bytes", fixed[f]);
+        printf("  %-20s %11.1f  %11.1f\n", name,
+               bench_hash(genhash_string_hash, keys, lens, HASH_BENCH_KEYS,
+                      HASH_BENCH_ROUNDS),
+               bench_hash(genhash_seeded_hash, keys, lens, HASH_BENCH_KEYS,
+                      HASH_BENCH_ROUNDS));
+    }
+
+    int old_shards[TK_SHARDS] = { 0 };
+    int new_shards[TK_SHARDS] = { 0 };
+    const int nshardkeys = 1000000;
+    for (int i = 0; i < nshardkeys; i++) {
+        char key[32];
+        int nkey = snprintf(key, sizeof(key), "user:%d:profile", i);
+        old_shards[genhash_string_hash(key, nkey) & (TK_SHARDS - 1)]++;
+        new_shards[tk_shard(genhash_hash64(key, nkey))]++;
+    }
+    printf("topkeys shard spread for %d \"user:<n>:profile\" keys\n",
+           nshardkeys);
+    report_shards("string_hash & 7", old_shards);
+    report_shards("tk_shard", new_shards);
+
+    free(keys);
+    free(lens);
+}
+
 int main(int argc, char **argv) {
     int i = 0;
     int rc = 0;
@@ -1830,8 +3994,14 @@ int main(int argc, char **argv) {
          DEFAULT_CONFIG_NO_DEF},
         {"concurrent access delete bucket multiple times", test_delete_bucket_concurrent_multi,
          DEFAULT_CONFIG_NO_DEF},
+        {"delete many buckets", test_delete_many_buckets,
+         DEFAULT_CONFIG_NO_DEF},
         {"delete bucket shutdwn race", test_delete_bucket_shutdown_race,
          DEFAULT_CONFIG_NO_DEF},
+        {"parallel shutdown", test_parallel_shutdown,
+         DEFAULT_CONFIG_NO_DEF ";shutdown_threads=8"},
+        {"auth during bucket create/delete", test_auth_during_create_delete,
+         DEFAULT_CONFIG_NO_DEF},
         {"list buckets with none", test_list_buckets_none, NULL},
         {"list buckets with one", test_list_buckets_one, NULL},
         {"list buckets", test_list_buckets_two, NULL},
@@ -1841,6 +4011,39 @@ int main(int argc, char **argv) {
          test_select_no_bucket, NULL},
         {"stats call", test_stats, NULL},
         {"stats bucket call", test_stats_bucket, NULL},
+        {"engines table growth", test_engines_table_growth, NULL},
+        {"create bucket in the background", test_create_bucket_unlocked,
+         DEFAULT_CONFIG_NO_DEF},
+        {"bucket waiters", test_bucket_waiters, DEFAULT_CONFIG_NO_DEF},
+        {"create while inside", test_create_while_inside,
+         DEFAULT_CONFIG_NO_DEF},
+        {"spare engines", test_spare_engines,
+         "engine=.libs/mock_engine.so;default=false;admin=admin"
+         ";auto_create=true;default_bucket_config=" MOCK_CONFIG_SLOW_INIT
+         ";spare_engines=2"},
+        {"hibernation", test_hibernation,
+         DEFAULT_CONFIG_NO_DEF ";hibernate_after=1"},
+        {"engine specific cache", test_engine_specific_cache, NULL},
+        {"default named bucket", test_default_named_bucket,
+         DEFAULT_CONFIG_AC ";default=false;default_bucket_name=dflt"},
+        {"default named hibernation", test_default_named_hibernation,
+         DEFAULT_CONFIG_AC ";default=false;default_bucket_name=dflt;"
+         "hibernate_after=1"},
+        {"negative cache", test_negative_cache,
+         DEFAULT_CONFIG_NO_DEF ";negative_cache_ttl=60"},
+        {"ops limit", test_ops_limit, DEFAULT_CONFIG_NO_DEF},
+        {"max inflight", test_max_inflight, DEFAULT_CONFIG_NO_DEF},
+        {"fair share", test_fair_share,
+         DEFAULT_CONFIG_NO_DEF ";overload_inflight=1"},
+        {"op timings", test_op_timings,
+         DEFAULT_CONFIG_NO_DEF ";op_timings=true"},
+        {"bucket ops", test_bucket_ops,
+         DEFAULT_CONFIG_NO_DEF ";op_timings=true"},
+        {"bucket cpu", test_bucket_cpu,
+         DEFAULT_CONFIG_NO_DEF ";cpu_sample_rate=1"},
+        {"slow ops", test_slow_ops,
+         DEFAULT_CONFIG_NO_DEF ";op_timings=true"},
+        {"topbuckets", test_topbuckets, DEFAULT_CONFIG_NO_DEF},
         {"release call", test_release, NULL},
         {"unknown call delegation", test_unknown_call, NULL},
         {"unknown call delegation (no bucket)", test_unknown_call_no_bucket,
@@ -1870,6 +4073,38 @@ int main(int argc, char **argv) {
         runBench();
     }
 
+    if (getenv("CLIENTS_BENCH") != NULL) {
+        runClientsBench();
+    }
+
+    if (getenv("FALSE_SHARING_BENCH") != NULL) {
+        runFalseSharingBench();
+    }
+
+    if (getenv("HASH_BENCH") != NULL) {
+        runHashBench();
+    }
+
+    if (getenv("GENHASH_BENCH") != NULL) {
+        runGenhashBench(getenv("GENHASH_BENCH"));
+    }
+
+    if (getenv("CREATE_BENCH") != NULL) {
+        runCreateBench();
+    }
+
+    if (getenv("CONNECT_BENCH") != NULL) {
+        runConnectBench();
+    }
+
+    if (getenv("LIMIT_BENCH") != NULL) {
+        runLimitBench();
+    }
+
+    if (getenv("TIMING_BENCH") != NULL) {
+        runTimingBench();
+    }
+
     return rc;
 }
 
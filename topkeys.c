@@ -47,7 +47,7 @@ topkeys_t *topkeys_init(int max_keys) {
     tk->list.prev = &tk->list;
 
     static struct hash_ops my_hash_ops = {
-        .hashfunc = genhash_string_hash,
+        .hashfunc = genhash_seeded_hash,
         .hasheq = my_hash_eq,
         .dupKey = NULL,
         .dupValue = NULL,
@@ -55,7 +55,12 @@ topkeys_t *topkeys_init(int max_keys) {
         .freeValue = NULL,
     };
 
-    tk->hash = genhash_init(max_keys, my_hash_ops);
+    /* Evictions leave tombstones behind, so the flat table still
+     * rehashes now and then. Sizing it for twice max_keys keeps the
+     * live entries under half the growth limit, which makes those
+     * rehashes sweep the tombstones in place rather than doubling the
+     * table under the shard mutex. */
+    tk->hash = genhash_init_impl(2 * max_keys, my_hash_ops, GENHASH_FLAT);
     if (tk->hash == NULL) {
         return NULL;
     }
@@ -104,16 +109,21 @@ static inline void topkeys_item_delete(topkeys_t *tk, topkey_item_t *it) {
     free(it);
 }
 
-topkey_item_t *topkeys_item_get_or_create(topkeys_t *tk, const void *key, size_t nkey, const rel_time_t ct) {
-    topkey_item_t *it = genhash_find(tk->hash, key, nkey);
+/* khash is genhash_hash64() of the key. Its low bits are what
+ * genhash_seeded_hash() returns, so we can pass them on to the table */
+topkey_item_t *topkeys_item_get_or_create(topkeys_t *tk, const void *key, size_t nkey,
+                                          uint64_t khash, const rel_time_t ct) {
+    int hv = (int)(uint32_t)khash;
+    topkey_item_t *it = genhash_find_hashed(tk->hash, hv, key, nkey);
     if (it == NULL) {
         it = topkey_item_init(key, nkey, ct);
         if (it != NULL) {
             if (++tk->nkeys > tk->max_keys) {
                 topkeys_item_delete(tk, topkeys_tail(tk));
             }
-            genhash_update(tk->hash, it->ti_key, it->ti_nkey,
-                           it, topkey_item_size(it));
+            /* We just looked, so there's no entry to update */
+            genhash_store_hashed(tk->hash, hv, it->ti_key, it->ti_nkey,
+                                 it, topkey_item_size(it));
         } else {
             return NULL;
         }
@@ -161,9 +171,6 @@ ENGINE_ERROR_CODE topkeys_stats(topkeys_t **tks, size_t shards,
     return ENGINE_SUCCESS;
 }
 
-topkeys_t *tk_get_shard(topkeys_t **tks, const void *key, size_t nkey) {
-    // This is special-cased for 8
-    assert(TK_SHARDS == 8);
-    int khash = genhash_string_hash(key, nkey);
-    return tks[khash & 0x07];
+topkeys_t *tk_get_shard(topkeys_t **tks, uint64_t khash) {
+    return tks[tk_shard(khash)];
 }
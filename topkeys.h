@@ -18,18 +18,23 @@ void must_unlock(pthread_mutex_t *mutex);
 
 #define TK_MAX_VAL_LEN 500
 
+/* Must be a power of two */
 #define TK_SHARDS 8
 
-/* Update the correct stat for a given operation */
+/* Update the correct stat for a given operation. The key is hashed
+ * once: the high bits pick the shard and the low bits are used for
+ * the lookup within it */
 #define TK(tks, op, key, nkey, ctime) \
 { \
     if (tks) { \
         assert(key); \
         assert(nkey > 0); \
-        topkeys_t *tk = tk_get_shard((tks), (key), (nkey)); \
+        uint64_t tk_khash = genhash_hash64((key), (nkey)); \
+        topkeys_t *tk = tk_get_shard((tks), tk_khash); \
         must_lock(&tk->mutex); \
         topkey_item_t *tmp = topkeys_item_get_or_create((tk), (key), \
-                                                        (nkey), (ctime)); \
+                                                        (nkey), tk_khash, \
+                                                        (ctime)); \
         if (tmp != NULL) { \
             tmp->op++; \
         } \
@@ -62,10 +67,17 @@ typedef struct topkeys {
 
 topkeys_t *topkeys_init(int max_keys);
 void topkeys_free(topkeys_t *topkeys);
-topkeys_t *tk_get_shard(topkeys_t **tk, const void *key, size_t nkey);
+/* The shard for a key hashed with genhash_hash64(). Uses the bits the
+ * in-shard lookup doesn't */
+static inline int tk_shard(uint64_t khash) {
+    return (int)((khash >> 32) & (TK_SHARDS - 1));
+}
+
+topkeys_t *tk_get_shard(topkeys_t **tk, uint64_t khash);
 topkey_item_t *topkeys_item_get_or_create(topkeys_t *tk,
                                           const void *key,
                                           size_t nkey,
+                                          uint64_t khash,
                                           const rel_time_t ctime);
 
 ENGINE_ERROR_CODE topkeys_stats(topkeys_t **tk, size_t n,